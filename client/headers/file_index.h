@@ -0,0 +1,79 @@
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+#include "sha256.h"
+#include "merkle.h"
+
+// What the client knew about a file the last time it was in sync with the
+// server
+struct IndexEntry {
+    uint64_t inode = 0;
+    uint64_t size = 0;
+    int64_t mtimeNs = 0;
+    uint8_t hash[SHA256_DIGEST_SIZE] = {};  // SHA-256 of the content
+    uint64_t serverVersion = 0;             // version the server reported for it
+};
+
+// Persistent index of the sync directory, kept in sync_dir_<user>.index and
+// mapped into memory. Each update writes one fixed-size record in place, so
+// a restart knows which files changed while the client was down without
+// rereading the others. It is only a cache: it is never fsync'd, and a lost
+// or damaged index just means the files get compared again.
+class FileIndex {
+public:
+    ~FileIndex();
+
+    // Map the index at path, creating it if needed
+    bool open(const std::string& path);
+
+    bool lookup(const std::string& name, IndexEntry& entry);
+    void update(const std::string& name, const IndexEntry& entry);
+    void remove(const std::string& name);
+
+    std::vector<std::string> names();
+
+    // Random id this sync directory identifies itself with to the server
+    uint64_t deviceId();
+
+    // Position in the server's change journal reached by the last sync;
+    // false if there is none yet
+    bool cursor(uint64_t& journal, uint64_t& seq);
+    void setCursor(uint64_t journal, uint64_t seq);
+
+    // Merkle tree of the indexed files and their server versions, to compare
+    // with the server's (see merkle.h)
+    void merkleChildren(const MerklePrefix& prefix, MerkleNode children[MERKLE_FANOUT]);
+
+private:
+    struct Header;
+    struct Record;
+
+    Record* record(size_t slot);
+    bool resize(size_t capacity);
+
+    std::mutex mutex;
+    int fd = -1;
+    void* map = nullptr;
+    size_t mapSize = 0;
+    size_t capacity = 0;
+    std::unordered_map<std::string, size_t> slots;
+    std::vector<size_t> freeSlots;
+    MerkleTree tree;
+};
+
+// Fills the metadata part of entry from st
+void index_set_stat(IndexEntry& entry, const struct stat& st);
+
+// True when st still describes the file the entry was recorded for
+bool index_stat_matches(const IndexEntry& entry, const struct stat& st);
+
+// SHA-256 of a whole file
+bool hash_file(const std::string& path, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef STRIPING_H
+#define STRIPING_H
+
+#include <cstdint>
+#include <string>
+
+// Striped transfers: besides the main connection a device may open data
+// connections attached to its login (CMD_ATTACH). A large file is then
+// split into ranges that move over all of them at once, each written at
+// its offset, so a single transfer is not held to what one TCP connection
+// gets out of a long, fast path.
+
+// Most data connections a client may open
+#define MAX_STRIPES 16
+
+// Files smaller than this go over the main connection alone. Downloads of
+// larger ones still take their first STRIPE_MIN_SIZE bytes from it.
+#define STRIPE_MIN_SIZE (16 * 1024 * 1024)
+
+// Bytes per download range, and download ranges each data connection
+// keeps requested ahead
+#define STRIPE_RANGE_SIZE (8 * 1024 * 1024)
+#define STRIPE_PIPELINE 2
+
+// Open count data connections for the device that logged in with token.
+// Returns how many could be opened.
+int stripes_open(const std::string& ip, int port, uint64_t token, int count);
+void stripes_close();
+
+// Whether any data connection is open
+bool stripes_active();
+
+// Download [offset, size) of the given version of filename, writing each
+// range at its offset of fd. False if any range failed, including because
+// the file changed on the server meanwhile.
+bool stripes_download(const std::string& filename, uint64_t version, uint64_t offset,
+                      uint64_t size, int fd);
+
+// Send the first size bytes of fd as the ranges of striped upload id
+// (CMD_STRIPED_BEGIN); false unless the server took every one
+bool stripes_upload(uint64_t id, int fd, uint64_t size);
+
+#endif
@@ -5,15 +5,38 @@
 #include <mutex>
 #include <map>
 #include <condition_variable>
+#include <future>
 #include "packet.h"
 #include <sys/socket.h>  // For socket constants like SOL_SOCKET
 
 // Forward declarations for socket operations
-uint16_t get_next_seq();
+uint32_t get_next_seq();
 bool check_socket_status();
+
+// One exchange with the server: a fresh seqn whose incoming frames are kept
+// for this exchange until the Stream goes out of scope (see packet.h)
+class Stream {
+public:
+    Stream();
+    ~Stream();
+    Stream(const Stream&) = delete;
+    Stream& operator=(const Stream&) = delete;
+
+    // Waits for the reply, the stream's first frame; false if the
+    // connection was lost first
+    bool reply(packet& pkt);
+
+    const uint32_t seqn;
+
+private:
+    std::future<packet> future;
+};
+
+// Send a command on a stream of its own and wait for its reply
 packet send_command_and_wait(const packet& cmd);
 
-bool sync_start(const char* username, const char* server_ip, int port);
+// stripes: data connections to open for large transfers (see striping.h)
+bool sync_start(const char* username, const char* server_ip, int port, int stripes = 0);
 bool sync_dir_exists();
 void create_sync_dir();
 void watch_sync_dir();
@@ -23,7 +46,7 @@ void handle_server_notification(packet& pkt);
 bool upload_file(const std::string& filepath);
 bool download_file(const std::string& filename);
 bool delete_file(const std::string& filename);
-void list_server_files();
+void list_server_files(int sort);  // a ListSort (listing.h)
 void list_client_files();
 void get_sync_dir();
 
@@ -32,10 +55,8 @@ extern int server_socket;
 extern std::string sync_dir_path;
 extern std::string current_username;
 extern std::mutex socket_mutex;
-extern std::map<uint16_t, packet> responses;
 extern std::mutex responses_mutex;
-extern std::condition_variable responses_cv;
-extern uint16_t next_seq_number;
+extern uint32_t next_seq_number;
 
 // Monitor thread coordination
 extern std::mutex monitor_ready_mutex;
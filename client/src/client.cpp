@@ -1,5 +1,6 @@
 #include "sync.h"
 #include "commands.h"
+#include "striping.h"
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
@@ -115,13 +116,27 @@ int main(int argc, char* argv[]) {
     }
     if (port == 0) ask_port();
 
+    // Optional: data connections for striping large transfers
+    int stripes = 0;
+    if (argc >= 5) {
+        try {
+            stripes = std::stoi(argv[4]);
+        } catch (...) {
+            stripes = -1;
+        }
+        if (stripes < 0 || stripes > MAX_STRIPES) {
+            std::cout << "Número de conexões de dados inválido (0-" << MAX_STRIPES << "); usando 0.\n";
+            stripes = 0;
+        }
+    }
+
     const char* username_c = username.c_str();
     const char* server_ip_c = server_ip.c_str();
 
     std::cout << "Conectando como '" << username << "' em " << server_ip << ":" << port << "..." << std::endl;
 
     // Start synchronization in background; if it fails, exit.
-    if (!sync_start(username_c, server_ip_c, port)) {
+    if (!sync_start(username_c, server_ip_c, port, stripes)) {
         std::cerr << "Não foi possível iniciar a sincronização. Verifique se o servidor está online e tente novamente." << std::endl;
         return 1;
     }
@@ -1,5 +1,6 @@
 #include "sync.h"
 #include "commands.h"
+#include "listing.h"
 #include <iostream>
 #include <string>
 #include <vector>
@@ -26,7 +27,7 @@ void print_help() {
     std::cout << "  " << CMD_UPLOAD << " <path/filename.ext> - Envia um arquivo para o servidor" << std::endl;
     std::cout << "  " << CMD_DOWNLOAD << " <filename.ext> - Baixa um arquivo do servidor para o diretório local" << std::endl;
     std::cout << "  " << CMD_DELETE << " <filename.ext> - Remove um arquivo do diretório de sincronização" << std::endl;
-    std::cout << "  " << CMD_LIST_SERVER << " - Lista os arquivos no servidor" << std::endl;
+    std::cout << "  " << CMD_LIST_SERVER << " [nome|data|tamanho] - Lista os arquivos no servidor" << std::endl;
     std::cout << "  " << CMD_LIST_CLIENT << " - Lista os arquivos no diretório de sincronização local" << std::endl;
     std::cout << "  " << CMD_GET_SYNC_DIR << " - Inicializa o diretório de sincronização" << std::endl;
     std::cout << "  " << CMD_EXIT << " - Encerra a sessão com o servidor" << std::endl;
@@ -51,10 +52,8 @@ bool process_command(const std::string& command) {
         packet exit_pkt;
         exit_pkt.type = 10; // CMD_EXIT
         exit_pkt.seqn = 0;
-        exit_pkt.total_size = 0;
-        exit_pkt.length = 0;
 
-        send(server_socket, &exit_pkt, sizeof(packet), 0);
+        send_packet(server_socket, exit_pkt);
         return false; // Exit command loop
     }
     else if (cmd == CMD_UPLOAD) {
@@ -82,7 +81,18 @@ bool process_command(const std::string& command) {
         delete_file(tokens[1]);
     }
     else if (cmd == CMD_LIST_SERVER) {
-        list_server_files();
+        int sort = LIST_BY_NAME;
+        if (tokens.size() >= 2) {
+            if (tokens[1] == "data") {
+                sort = LIST_BY_MTIME;
+            } else if (tokens[1] == "tamanho") {
+                sort = LIST_BY_SIZE;
+            } else if (tokens[1] != "nome") {
+                std::cout << "Uso: " << CMD_LIST_SERVER << " [nome|data|tamanho]" << std::endl;
+                return true;
+            }
+        }
+        list_server_files(sort);
     }
     else if (cmd == CMD_LIST_CLIENT) {
         list_client_files();
@@ -0,0 +1,260 @@
+#include "file_index.h"
+#include "common.h"
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <random>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC "SYNCIDX2"
+#define INDEX_INITIAL_CAPACITY 64
+
+// On-disk layout: a header, then capacity fixed-size records in host byte
+// order (the index never leaves this machine)
+struct FileIndex::Header {
+    char magic[8];
+    uint32_t recordSize;
+    uint32_t capacity;
+    uint64_t deviceId;
+    uint64_t journalId;     // journal cursor; journalId 0 = none yet
+    uint64_t journalSeq;
+};
+
+struct FileIndex::Record {
+    char name[256];     // NUL-terminated; NAME_MAX is 255
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtimeNs;
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    uint64_t serverVersion;
+    uint32_t inUse;
+    uint32_t reserved;
+};
+
+FileIndex::~FileIndex() {
+    if (map != nullptr) {
+        munmap(map, mapSize);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+FileIndex::Record* FileIndex::record(size_t slot) {
+    return (Record*)((char*)map + sizeof(Header)) + slot;
+}
+
+bool FileIndex::resize(size_t newCapacity) {
+    size_t newSize = sizeof(Header) + newCapacity * sizeof(Record);
+    if (ftruncate(fd, newSize) != 0) {
+        DEBUG_PRINTF("ERROR: Failed to grow file index: %s\n", strerror(errno));
+        return false;
+    }
+    void* newMap = mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (newMap == MAP_FAILED) {
+        DEBUG_PRINTF("ERROR: Failed to map file index: %s\n", strerror(errno));
+        return false;
+    }
+    if (map != nullptr) {
+        munmap(map, mapSize);
+    }
+    map = newMap;
+    mapSize = newSize;
+
+    Header* header = (Header*)map;
+    memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+    header->recordSize = sizeof(Record);
+    header->capacity = newCapacity;
+
+    // The new records are zero (not in use); hand out the lowest ones first
+    for (size_t slot = newCapacity; slot > capacity; slot--) {
+        freeSlots.push_back(slot - 1);
+    }
+    capacity = newCapacity;
+    return true;
+}
+
+bool FileIndex::open(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        DEBUG_PRINTF("ERROR: Failed to open file index %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    Header header;
+    bool valid = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header) &&
+                 pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                 memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.recordSize == sizeof(Record) &&
+                 (size_t)st.st_size == sizeof(Header) + (size_t)header.capacity * sizeof(Record);
+    if (!valid) {
+        // New, from another build, or damaged: start over
+        DEBUG_PRINTF("DEBUG: Creating file index %s\n", path.c_str());
+        if (ftruncate(fd, 0) != 0 || !resize(INDEX_INITIAL_CAPACITY)) {
+            return false;
+        }
+        std::random_device random;
+        ((Header*)map)->deviceId = ((uint64_t)random() << 32) | random();
+        return true;
+    }
+
+    map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        DEBUG_PRINTF("ERROR: Failed to map file index: %s\n", strerror(errno));
+        map = nullptr;
+        return false;
+    }
+    mapSize = st.st_size;
+    capacity = header.capacity;
+
+    for (size_t slot = capacity; slot > 0; slot--) {
+        Record* r = record(slot - 1);
+        if (r->inUse && memchr(r->name, '\0', sizeof(r->name)) != nullptr &&
+            slots.emplace(r->name, slot - 1).second) {
+            tree.set(r->name, r->serverVersion);
+            continue;
+        }
+        r->inUse = 0;
+        freeSlots.push_back(slot - 1);
+    }
+    DEBUG_PRINTF("DEBUG: Loaded file index %s with %zu files\n", path.c_str(), slots.size());
+    return true;
+}
+
+bool FileIndex::lookup(const std::string& name, IndexEntry& entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = slots.find(name);
+    if (it == slots.end()) {
+        return false;
+    }
+    const Record* r = record(it->second);
+    entry.inode = r->inode;
+    entry.size = r->size;
+    entry.mtimeNs = r->mtimeNs;
+    memcpy(entry.hash, r->hash, sizeof(entry.hash));
+    entry.serverVersion = r->serverVersion;
+    return true;
+}
+
+void FileIndex::update(const std::string& name, const IndexEntry& entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (map == nullptr || name.size() >= sizeof(Record::name)) {
+        return;
+    }
+
+    auto it = slots.find(name);
+    size_t slot;
+    if (it != slots.end()) {
+        slot = it->second;
+    } else {
+        if (freeSlots.empty() && !resize(capacity * 2)) {
+            return;
+        }
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+        slots[name] = slot;
+    }
+
+    Record* r = record(slot);
+    memset(r->name, 0, sizeof(r->name));
+    memcpy(r->name, name.data(), name.size());
+    r->inode = entry.inode;
+    r->size = entry.size;
+    r->mtimeNs = entry.mtimeNs;
+    memcpy(r->hash, entry.hash, sizeof(r->hash));
+    r->serverVersion = entry.serverVersion;
+    r->inUse = 1;
+    tree.set(name, entry.serverVersion);
+}
+
+void FileIndex::remove(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = slots.find(name);
+    if (it == slots.end()) {
+        return;
+    }
+    record(it->second)->inUse = 0;
+    freeSlots.push_back(it->second);
+    slots.erase(it);
+    tree.remove(name);
+}
+
+std::vector<std::string> FileIndex::names() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::string> result;
+    result.reserve(slots.size());
+    for (const auto& slot : slots) {
+        result.push_back(slot.first);
+    }
+    return result;
+}
+
+uint64_t FileIndex::deviceId() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return map != nullptr ? ((Header*)map)->deviceId : 0;
+}
+
+bool FileIndex::cursor(uint64_t& journal, uint64_t& seq) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (map == nullptr || ((Header*)map)->journalId == 0) {
+        return false;
+    }
+    journal = ((Header*)map)->journalId;
+    seq = ((Header*)map)->journalSeq;
+    return true;
+}
+
+void FileIndex::setCursor(uint64_t journal, uint64_t seq) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (map != nullptr) {
+        ((Header*)map)->journalId = journal;
+        ((Header*)map)->journalSeq = seq;
+    }
+}
+
+void FileIndex::merkleChildren(const MerklePrefix& prefix, MerkleNode children[MERKLE_FANOUT]) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i = 0; i < MERKLE_FANOUT; i++) {
+        children[i] = tree.node(prefix.child(i));
+    }
+}
+
+void index_set_stat(IndexEntry& entry, const struct stat& st) {
+    entry.inode = st.st_ino;
+    entry.size = st.st_size;
+    entry.mtimeNs = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+bool index_stat_matches(const IndexEntry& entry, const struct stat& st) {
+    IndexEntry current;
+    index_set_stat(current, st);
+    return current.inode == entry.inode && current.size == entry.size &&
+           current.mtimeNs == entry.mtimeNs;
+}
+
+bool hash_file(const std::string& path, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    Sha256 ctx;
+    char buffer[64 * 1024];
+    while (true) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            close(fd);
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        ctx.update(buffer, n);
+    }
+    close(fd);
+    ctx.final(digest);
+    return true;
+}
@@ -0,0 +1,335 @@
+#include "striping.h"
+#include "socket_utils.h"
+#include "common.h"
+#include "packet.h"
+#include "packet_types.h"
+#include "wire.h"
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+// One data connection. Used by one thread at a time, with blocking I/O;
+// seqn numbers its own streams.
+struct DataConnection {
+    int sock = -1;
+    uint32_t seqn = 0;
+};
+
+// Held for a whole transfer: striped transfers take every data connection
+// and run one after the other
+static std::mutex stripes_mutex;
+static std::vector<DataConnection> connections;
+
+// Hands out the ranges of one transfer to the connection threads
+class RangeQueue {
+public:
+    RangeQueue(uint64_t offset, uint64_t end, uint64_t step) : next(offset), end(end), step(step) {}
+
+    bool take(uint64_t& offset, uint64_t& length) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (failed || next >= end) {
+            return false;
+        }
+        offset = next;
+        length = std::min(step, end - next);
+        next += length;
+        return true;
+    }
+
+    // Stops handing out ranges; the transfer failed
+    void fail() {
+        std::lock_guard<std::mutex> lock(mutex);
+        failed = true;
+    }
+
+    bool ok() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return !failed;
+    }
+
+private:
+    std::mutex mutex;
+    uint64_t next;
+    uint64_t end;
+    uint64_t step;
+    bool failed = false;
+};
+
+static void close_connection(DataConnection& conn) {
+    if (conn.sock >= 0) {
+        close(conn.sock);
+        conn.sock = -1;
+    }
+}
+
+// Connections that broke during a transfer are gone for good; the rest
+// carry on (stripes_mutex held)
+static void drop_broken() {
+    std::vector<DataConnection> alive;
+    for (const auto& conn : connections) {
+        if (conn.sock >= 0) {
+            alive.push_back(conn);
+        }
+    }
+    connections.swap(alive);
+}
+
+static bool open_connection(DataConnection& conn, const std::string& ip, int port, uint64_t token) {
+    conn.sock = create_bulk_socket();
+    if (conn.sock < 0) {
+        return false;
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = 30;
+    timeout.tv_usec = 0;
+    setsockopt(conn.sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn.sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (connect_socket(conn.sock, ip.c_str(), port) < 0) {
+        DEBUG_PRINTF("ERROR: Failed to open data connection to %s:%d: %s\n", ip.c_str(), port, strerror(errno));
+        close_connection(conn);
+        return false;
+    }
+
+    packet attach;
+    attach.type = CMD_ATTACH;
+    attach.seqn = ++conn.seqn;
+    append_u64(attach.payload, token);
+
+    packet response;
+    if (!send_packet(conn.sock, attach) || !recv_packet(conn.sock, response) ||
+        response.type != CMD_ATTACH || response.payload != "OK") {
+        DEBUG_PRINTF("ERROR: Server refused data connection\n");
+        close_connection(conn);
+        return false;
+    }
+    return true;
+}
+
+int stripes_open(const std::string& ip, int port, uint64_t token, int count) {
+    std::lock_guard<std::mutex> lock(stripes_mutex);
+    for (auto& conn : connections) {
+        close_connection(conn);
+    }
+    connections.clear();
+
+    for (int i = 0; i < count; i++) {
+        DataConnection conn;
+        if (!open_connection(conn, ip, port, token)) {
+            break;
+        }
+        connections.push_back(conn);
+    }
+    DEBUG_PRINTF("DEBUG: %zu of %d data connections open\n", connections.size(), count);
+    return connections.size();
+}
+
+void stripes_close() {
+    std::lock_guard<std::mutex> lock(stripes_mutex);
+    for (auto& conn : connections) {
+        close_connection(conn);
+    }
+    connections.clear();
+}
+
+bool stripes_active() {
+    std::lock_guard<std::mutex> lock(stripes_mutex);
+    return !connections.empty();
+}
+
+// A range being downloaded on one connection
+struct OpenRange {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t received = 0;
+    bool replied = false;
+};
+
+// Runs on its own thread per connection. Up to STRIPE_PIPELINE ranges are
+// requested at once, each granted its full length of credit up front: the
+// connection carries nothing else, so TCP's own flow control suffices.
+// After a failure the ranges already requested are still drained so the
+// connection stays usable; only a broken connection is closed.
+static void download_ranges(DataConnection& conn, const std::string& filename, uint64_t version,
+                            int fd, RangeQueue& queue) {
+    std::map<uint32_t, OpenRange> open;
+
+    while (true) {
+        OpenRange range;
+        while (open.size() < STRIPE_PIPELINE && queue.take(range.offset, range.length)) {
+            packet request;
+            request.type = CMD_DOWNLOAD_RANGE;
+            request.seqn = ++conn.seqn;
+            append_u64(request.payload, range.offset);
+            append_u64(request.payload, range.length);
+            append_u64(request.payload, version);
+            request.payload += filename;
+
+            packet window;
+            window.type = STREAM_WINDOW;
+            window.seqn = request.seqn;
+            append_u32(window.payload, range.length);
+
+            if (!send_packet(conn.sock, request) || !send_packet(conn.sock, window)) {
+                queue.fail();
+                close_connection(conn);
+                return;
+            }
+            open[request.seqn] = range;
+        }
+        if (open.empty()) {
+            return;
+        }
+
+        packet pkt;
+        if (!recv_packet(conn.sock, pkt)) {
+            DEBUG_PRINTF("ERROR: Data connection lost during download of %s\n", filename.c_str());
+            queue.fail();
+            close_connection(conn);
+            return;
+        }
+        auto it = open.find(pkt.seqn);
+        if (it == open.end()) {
+            queue.fail();
+            close_connection(conn);
+            return;
+        }
+        OpenRange& current = it->second;
+
+        if (!current.replied) {
+            // "OK" + version; anything else (e.g. "CHANGED") sends no data
+            if (pkt.type != CMD_DOWNLOAD_RANGE || pkt.payload.size() != 2 + sizeof(uint64_t) ||
+                pkt.payload.compare(0, 2, "OK") != 0 ||
+                get_u64((const uint8_t*)pkt.payload.data() + 2) != version) {
+                DEBUG_PRINTF("ERROR: Range of %s refused: %s\n", filename.c_str(), pkt.payload.c_str());
+                queue.fail();
+                open.erase(it);
+                continue;
+            }
+            current.replied = true;
+        } else {
+            size_t n = pkt.payload.size();
+            if (pkt.type != DATA_PACKET || n > current.length - current.received) {
+                queue.fail();
+                close_connection(conn);
+                return;
+            }
+            if (pwrite(fd, pkt.payload.data(), n, current.offset + current.received) != (ssize_t)n) {
+                DEBUG_PRINTF("ERROR: Failed to write range of %s: %s\n", filename.c_str(), strerror(errno));
+                queue.fail();
+            }
+            current.received += n;
+        }
+
+        // Clamped by the server only if the file is shorter, which a
+        // matching version rules out
+        if (current.received == current.length) {
+            open.erase(it);
+        }
+    }
+}
+
+bool stripes_download(const std::string& filename, uint64_t version, uint64_t offset,
+                      uint64_t size, int fd) {
+    std::lock_guard<std::mutex> lock(stripes_mutex);
+    if (connections.empty()) {
+        return false;
+    }
+
+    RangeQueue queue(offset, size, STRIPE_RANGE_SIZE);
+    std::vector<std::thread> threads;
+    for (auto& conn : connections) {
+        threads.emplace_back(download_ranges, std::ref(conn), std::cref(filename), version, fd, std::ref(queue));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    drop_broken();
+    return queue.ok();
+}
+
+// Runs on its own thread per connection: sends FILE_CHUNK_SIZE pieces as
+// CMD_UPLOAD_RANGE frames without waiting, then collects one reply per
+// piece. The replies are tiny, so the server never blocks on them.
+static void upload_ranges(DataConnection& conn, uint64_t id, int fd, RangeQueue& queue) {
+    size_t sent = 0;
+    uint64_t offset, length;
+    std::string payload;
+
+    while (queue.take(offset, length)) {
+        payload.clear();
+        append_u64(payload, id);
+        append_u64(payload, offset);
+        size_t header = payload.size();
+        payload.resize(header + length);
+
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = pread(fd, &payload[header + done], length - done, offset + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                DEBUG_PRINTF("ERROR: Failed to read range for striped upload: %s\n", strerror(errno));
+                queue.fail();
+                break;
+            }
+            done += n;
+        }
+        if (done < length) {
+            break;
+        }
+
+        packet pkt;
+        pkt.type = CMD_UPLOAD_RANGE;
+        pkt.seqn = ++conn.seqn;
+        pkt.payload.swap(payload);
+        bool ok = send_packet(conn.sock, pkt);
+        payload.swap(pkt.payload);
+        if (!ok) {
+            queue.fail();
+            close_connection(conn);
+            return;
+        }
+        sent++;
+    }
+
+    for (size_t i = 0; i < sent; i++) {
+        packet response;
+        if (!recv_packet(conn.sock, response)) {
+            queue.fail();
+            close_connection(conn);
+            return;
+        }
+        if (response.type != CMD_UPLOAD_RANGE || response.payload != "OK") {
+            queue.fail();
+        }
+    }
+}
+
+bool stripes_upload(uint64_t id, int fd, uint64_t size) {
+    std::lock_guard<std::mutex> lock(stripes_mutex);
+    if (connections.empty()) {
+        return false;
+    }
+
+    RangeQueue queue(0, size, FILE_CHUNK_SIZE);
+    std::vector<std::thread> threads;
+    for (auto& conn : connections) {
+        threads.emplace_back(upload_ranges, std::ref(conn), id, fd, std::ref(queue));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    drop_broken();
+    return queue.ok();
+}
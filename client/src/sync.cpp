@@ -1,7 +1,17 @@
 #include "sync.h"
+#include "file_index.h"
+#include "striping.h"
 #include "socket_utils.h"
 #include "common.h"
 #include "packet.h"  // Explicit include to guarantee visibility of struct packet
+#include "packet_types.h"
+#include "delta.h"
+#include "bundle.h"
+#include "chunker.h"
+#include "sha256.h"
+#include "merkle.h"
+#include "listing.h"
+#include "wire.h"
 #include <cstdio>
 #include <cstring>
 #include <iostream>
@@ -10,9 +20,12 @@
 #include <thread>
 #include <vector>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/ioctl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>      // For fcntl
@@ -26,7 +39,11 @@
 #include <condition_variable>
 #include <errno.h>
 #include <atomic>
+#include <memory>
+#include <future>
+#include <stdexcept>
 #include <set>
+#include <deque>
 
 namespace fs = std::filesystem;
 
@@ -42,54 +59,221 @@ std::string current_username;
 static std::string g_server_ip;
 static int g_server_port = 0;
 
+// Data connections asked for on the command line (0: striping off)
+static int g_stripes = 0;
+
 // Flag that tells every thread whether the TCP connection is still alive
 static std::atomic<bool> connection_alive{true};
 
+// Set when the server dropped notifications for us ("R:" marker); the file
+// watcher thread then catches up with the server's journal
+static std::atomic<bool> resync_requested{false};
+
+// Notifications from the reader thread, for the monitor thread. The
+// condition variable is never destroyed: the monitor still waits on it at
+// exit, and destroying a condition variable with waiters blocks.
+static std::mutex notification_mutex;
+static std::condition_variable& notification_cv = *new std::condition_variable();
+static std::deque<packet> notifications;
+
+static void queue_notification(packet& pkt) {
+    std::lock_guard<std::mutex> lock(notification_mutex);
+    notifications.push_back(std::move(pkt));
+    notification_cv.notify_one();
+}
+
+static packet wait_notification() {
+    std::unique_lock<std::mutex> lock(notification_mutex);
+    notification_cv.wait(lock, [] { return !notifications.empty(); });
+    packet pkt = std::move(notifications.front());
+    notifications.pop_front();
+    return pkt;
+}
+
+// Wakes the file watcher thread out of poll(); -1 while it is not running
+static std::atomic<int> watcher_wake_fd{-1};
+
+static void request_resync() {
+    resync_requested = true;
+    int fd = watcher_wake_fd;
+    if (fd >= 0) {
+        uint64_t one = 1;
+        ssize_t n = write(fd, &one, sizeof(one));
+        (void)n;
+    }
+}
+
 // Mutex for file operations
 std::mutex file_mutex;
 
-// Mutex for socket communication
+// Serializes writes to the socket, one whole frame at a time (only the
+// reader thread reads from it)
 std::mutex socket_mutex;
 
+// Held to keep the monitor thread from applying notifications, e.g. while
+// an exchange reconciles the sync directory with a listing
 std::mutex download_mutex;
 
-// Map to store responses
-std::map<uint16_t, packet> responses;
+// Hands out sequence numbers
 std::mutex responses_mutex;
-std::condition_variable responses_cv;
-uint16_t next_seq_number = 1;
+uint32_t next_seq_number = 1;
+
+// Open streams (see packet.h) by seqn. The reader thread completes a
+// stream's reply future with its first frame and queues the ones after it
+// (file data, listing entries) for the thread that owns the exchange.
+struct PendingStream {
+    std::promise<packet> reply;
+    bool replied = false;
+    bool body = false;      // the server opened a download stream not yet received whole
+    std::deque<packet> frames;
+};
+static std::mutex stream_mutex;
+static std::condition_variable stream_cv;
+static std::unordered_map<uint32_t, PendingStream> streams;
+static bool reader_running = false;
 
 // Monitor thread coordination
 std::mutex monitor_ready_mutex;
 std::condition_variable monitor_ready_cv;
 bool monitor_thread_ready = false;
 
-// File modification times to track changes
-std::unordered_map<std::string, time_t> file_mtimes;
-
-// Enum for packet types (same as server)
-enum PacketType {
-    CMD_LOGIN = 1,
-    CMD_UPLOAD = 2,
-    CMD_DOWNLOAD = 3,
-    CMD_DELETE = 4,
-    CMD_LIST_SERVER = 5,
-    CMD_LIST_CLIENT = 6,
-    CMD_GET_SYNC_DIR = 7,
-    DATA_PACKET = 8,
-    SYNC_NOTIFICATION = 9,
-    CMD_EXIT = 10
-};
+// What each file looked like when it was last in sync with the server
+static FileIndex file_index;
+
+// Downloads land in hidden temp files with this prefix until they are complete
+#define TEMP_FILE_PREFIX ".sync_tmp."
+
+// inotify events that mean a file in the sync directory changed
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)
+
+// Quiet time that ends a batch of events, so a burst (an editor saving, a
+// cp of many files) is handled once per file
+#define WATCH_SETTLE_MS 20
+
+// Uploads of files at least this big first try to send only what changed
+#define DELTA_MIN_FILE_SIZE (64 * 1024)
+
+// Longest range a single DELTA_COPY frame describes (its length is a u32)
+#define DELTA_MAX_COPY (1024 * 1024 * 1024)
+
+// Download requests kept in flight while syncing many files
+#define DOWNLOAD_PIPELINE 8
+
+// Threads that make downloaded files durable and move them into place, and
+// how many received files may wait for them
+#define DOWNLOAD_WRITERS 4
+#define DOWNLOAD_WRITE_QUEUE 32
+
+// Bytes of file data per upload bundle (bundles are built in memory), and
+// upload bundles sent ahead of their replies
+#define BUNDLE_UPLOAD_SIZE (4 * 1024 * 1024)
+#define BUNDLE_UPLOAD_PIPELINE 4
+
+// Merkle subtrees with at most this many server files are listed rather
+// than descended into
+#define MERKLE_LIST_THRESHOLD 32
 
 // Forward declarations
-void initialize_sync();
 void monitor_server_notifications();
 void check_for_file_changes();
+void scan_for_file_changes();
 void process_file_change(const std::string& filename, bool is_deleted);
-void update_file_mtimes();
+static void upload_files(const std::vector<std::string>& filenames);
+void catch_up();
+void merkle_sync();
 bool reset_socket_connection();
+bool receive_file(uint32_t seqn, const std::string& filename, const std::string& destPath,
+                  const packet& response, uint8_t* digest = nullptr);
+static void start_reader();
+static bool send_frame(const packet& pkt);
+
+static bool is_temp_file(const std::string& filename) {
+    return filename.compare(0, strlen(TEMP_FILE_PREFIX), TEMP_FILE_PREFIX) == 0;
+}
+
+// Changes the client makes to the sync directory itself (downloads, deletes
+// ordered by the server) must not be sent back as local edits. Register them
+// before touching the file; the watcher drops the next change it sees for it.
+static void ignore_next_change(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(arquivos_sincronizados_mutex);
+    arquivos_sincronizados.insert(filename);
+}
+
+static void unignore_change(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(arquivos_sincronizados_mutex);
+    arquivos_sincronizados.erase(filename);
+}
+
+static bool take_ignored_change(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(arquivos_sincronizados_mutex);
+    return arquivos_sincronizados.erase(filename) > 0;
+}
+
+// Records that the local file now matches the given server version
+static void record_synced(const std::string& filename, const struct stat& st,
+                          const uint8_t hash[SHA256_DIGEST_SIZE], uint64_t version) {
+    IndexEntry entry;
+    index_set_stat(entry, st);
+    memcpy(entry.hash, hash, SHA256_DIGEST_SIZE);
+    entry.serverVersion = version;
+    file_index.update(filename, entry);
+}
+
+// Whether a local file differs from what was last synced. Metadata decides
+// in the common case; a file whose mtime moved but whose size did not is
+// hashed, so touching it or rewriting the same content sends nothing.
+static bool local_file_changed(const std::string& filename, const struct stat& st) {
+    IndexEntry entry;
+    if (!file_index.lookup(filename, entry)) {
+        return true;
+    }
+    if (index_stat_matches(entry, st)) {
+        return false;
+    }
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    if (entry.size != (uint64_t)st.st_size ||
+        !hash_file(sync_dir_path + "/" + filename, digest) ||
+        memcmp(digest, entry.hash, SHA256_DIGEST_SIZE) != 0) {
+        return true;
+    }
+
+    // Same content; remember the new metadata so it is not hashed again
+    index_set_stat(entry, st);
+    file_index.update(filename, entry);
+    return false;
+}
+
+// The login reply carries the token data connections attach with
+static void open_stripes(const packet& login_response) {
+    if (g_stripes <= 0) {
+        return;
+    }
+    if (login_response.payload.size() < sizeof(uint64_t)) {
+        printf("Servidor não aceita conexões de dados; usando apenas a conexão principal.\n");
+        return;
+    }
+    uint64_t token = get_u64((const uint8_t*)login_response.payload.data());
+    int opened = stripes_open(g_server_ip, g_server_port, token, g_stripes);
+    if (opened < g_stripes) {
+        printf("Apenas %d de %d conexões de dados abertas.\n", opened, g_stripes);
+    }
+}
+
+// Asks the server to push small files along with their notifications. A
+// server that does not know CMD_PUSH keeps sending plain ones.
+static void subscribe_push() {
+    Stream stream;
+    packet request;
+    request.type = CMD_PUSH;
+    request.seqn = stream.seqn;
+    packet response;
+    if (!send_frame(request) || !stream.reply(response) || response.payload.compare(0, 2, "OK") != 0) {
+        DEBUG_PRINTF("DEBUG: Server does not push files; downloading on notification\n");
+    }
+}
 
-bool sync_start(const char* username, const char* server_ip, int port) {
+bool sync_start(const char* username, const char* server_ip, int port, int stripes) {
     printf("Iniciando sessão para o usuário %s...\n", username);
 
     // Save username
@@ -132,6 +316,7 @@ bool sync_start(const char* username, const char* server_ip, int port) {
 
     g_server_ip = server_ip;
     g_server_port = port;
+    g_stripes = stripes;
 
     int err = connect_socket(server_socket, server_ip, port);
     if (err < 0) {
@@ -144,10 +329,10 @@ bool sync_start(const char* username, const char* server_ip, int port) {
 
     // Make sure sync directory exists before we start
     watch_sync_dir();
+    file_index.open(sync_dir_path + ".index");
 
     // Start threads for monitoring BEFORE sending any commands
     std::thread server_thread(monitor_server_notifications);
-    std::thread file_thread(check_for_file_changes);
 
     // Wait for monitor thread to be ready
     {
@@ -158,55 +343,54 @@ bool sync_start(const char* username, const char* server_ip, int port) {
 
     // Now send login packet
     packet login_pkt;
-    memset(&login_pkt, 0, sizeof(packet)); // Clear the entire structure
     login_pkt.type = CMD_LOGIN;
     login_pkt.seqn = get_next_seq(); // Use proper sequence number
-    login_pkt.total_size = 0;
-    strcpy(login_pkt.payload, username);
-    login_pkt.length = strlen(username);
+    login_pkt.payload = username;
 
-    DEBUG_PRINTF("DEBUG: Sending login packet with seq: %d, type: %d, length: %d\n",
-           login_pkt.seqn, login_pkt.type, login_pkt.length);
-    DEBUG_PRINTF("DEBUG: Packet size: %zu bytes\n", sizeof(packet));
+    DEBUG_PRINTF("DEBUG: Sending login packet with seq: %u, type: %d, length: %zu\n",
+           login_pkt.seqn, login_pkt.type, login_pkt.payload.size());
 
     // Use direct socket send for login packet
     {
         std::lock_guard<std::mutex> lock(socket_mutex);
-        ssize_t bytes_sent = send(server_socket, &login_pkt, sizeof(packet), 0);
-        if (bytes_sent <= 0) {
+        if (!send_packet(server_socket, login_pkt)) {
             DEBUG_PRINTF("ERROR: Failed to send login packet: %s\n", strerror(errno));
             close(server_socket);
             return false;
         }
-        DEBUG_PRINTF("DEBUG: Sent %zd bytes directly via socket\n", bytes_sent);
     }
 
     // Wait for server response using direct socket operations
     packet response;
-    memset(&response, 0, sizeof(packet));
 
     {
         std::lock_guard<std::mutex> lock(socket_mutex);
         DEBUG_PRINTF("DEBUG: Waiting for login response...\n");
-        ssize_t bytes_received = recv(server_socket, &response, sizeof(packet), MSG_WAITALL);
-        if (bytes_received <= 0) {
+        if (!recv_packet(server_socket, response)) {
             DEBUG_PRINTF("ERROR: Failed to receive login response: %s\n", strerror(errno));
             close(server_socket);
             return false;
         }
-        DEBUG_PRINTF("DEBUG: Received %zd bytes login response\n", bytes_received);
     }
 
-    DEBUG_PRINTF("DEBUG: Received login response with seq: %d, type: %d\n", response.seqn, response.type);
+    DEBUG_PRINTF("DEBUG: Received login response with seq: %u, type: %d\n", response.seqn, response.type);
 
     if (response.type == CMD_LOGIN) {
         printf("Login bem-sucedido.\n");
 
+        // From here on every frame is read by the reader thread
+        start_reader();
+        open_stripes(response);
+        subscribe_push();
+
         // Initialize sync (Initial sync handshake)
         DEBUG_PRINTF("Realizando sincronização inicial...\n");
-        get_sync_dir();
+        catch_up();
         printf("Sincronização inicial concluída.\n");
 
+        // Local changes are picked up from here on
+        std::thread file_thread(check_for_file_changes);
+
         // Detach threads to run in background
         server_thread.detach();
         file_thread.detach();
@@ -239,105 +423,217 @@ void watch_sync_dir() {
     }
 }
 
-void initialize_sync() {
-    // Make sure the sync directory exists
-    watch_sync_dir();
+// Polling fallback for when inotify is not available
+static void poll_for_file_changes() {
+    while (true) {
+        // Sleep for a short time to reduce CPU usage
+        std::this_thread::sleep_for(std::chrono::seconds(1));
 
-    // Get file list from server
-    get_sync_dir();
+        if (resync_requested.exchange(false)) {
+            catch_up();
+        }
 
-    // Initialize file mtimes for monitoring changes
-    update_file_mtimes();
+        scan_for_file_changes();
+    }
 }
 
-void update_file_mtimes() {
-    std::lock_guard<std::mutex> lock(file_mutex);
-    file_mtimes.clear();
+// Drains the inotify queue into changes (filename -> deleted; the last
+// event for a file wins). Returns false once the directory watch is gone.
+static bool read_watch_events(int inotify_fd, std::map<std::string, bool>& changes, bool& overflow) {
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    bool watching = true;
 
-    DIR* dir = opendir(sync_dir_path.c_str());
-    if (dir == nullptr) {
-        return;
-    }
+    while (true) {
+        ssize_t n = read(inotify_fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            break; // EAGAIN: drained
+        }
 
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != nullptr) {
-        if (entry->d_type == DT_REG) {  // Regular file
-            std::string filename = entry->d_name;
-            std::string filepath = sync_dir_path + "/" + filename;
+        for (char* p = buffer; p < buffer + n;) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
 
-            struct stat st;
-            if (stat(filepath.c_str(), &st) == 0) {
-                file_mtimes[filename] = st.st_mtime;
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflow = true;
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                watching = false;   // directory removed or unmounted
+                continue;
+            }
+            if (event->len == 0 || (event->mask & IN_ISDIR)) {
+                continue;
+            }
+
+            std::string filename = event->name;
+            if (is_temp_file(filename)) {
+                continue; // Download in progress
             }
+            changes[filename] = (event->mask & (IN_DELETE | IN_MOVED_FROM)) != 0;
         }
     }
+    return watching;
+}
 
-    closedir(dir);
+// Deletions go to the server right away; files to upload are added to
+// uploads, to be sent together
+static void handle_watch_change(const std::string& filename, bool deleted, std::vector<std::string>& uploads) {
+    if (take_ignored_change(filename)) {
+        DEBUG_PRINTF("DEBUG: Ignoring own change to %s\n", filename.c_str());
+        return;
+    }
+
+    std::string filepath = sync_dir_path + "/" + filename;
+    struct stat st;
+    if (deleted) {
+        // Only files the server has; a download may also have put it back already
+        IndexEntry entry;
+        if (file_index.lookup(filename, entry) && stat(filepath.c_str(), &st) != 0) {
+            process_file_change(filename, true);
+        }
+        return;
+    }
+
+    // Gone again already (or not a regular file): nothing to upload
+    if (stat(filepath.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    if (!local_file_changed(filename, st)) {
+        DEBUG_PRINTF("DEBUG: %s unchanged since last sync\n", filename.c_str());
+        return;
+    }
+    uploads.push_back(filename);
 }
 
+// Waits for inotify events on the sync directory and pushes each change to
+// the server as it happens. Idle clients sleep in poll(); a full directory
+// scan only runs when the kernel's event queue overflowed.
 void check_for_file_changes() {
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    watch_sync_dir();
+    if (inotify_fd < 0 || wake_fd < 0 ||
+        inotify_add_watch(inotify_fd, sync_dir_path.c_str(), WATCH_EVENTS) < 0) {
+        DEBUG_PRINTF("WARN: inotify unavailable (%s), polling the sync directory\n", strerror(errno));
+        if (inotify_fd >= 0) close(inotify_fd);
+        if (wake_fd >= 0) close(wake_fd);
+        poll_for_file_changes();
+        return;
+    }
+    watcher_wake_fd = wake_fd;
+
+    // Changes made before the watch existed (the initial sync) raise no
+    // events, so their ignore marks would swallow the next real edit. The
+    // index already tells those files apart.
+    {
+        std::lock_guard<std::mutex> lock(arquivos_sincronizados_mutex);
+        arquivos_sincronizados.clear();
+    }
+
     while (true) {
-        // Sleep for a short time to reduce CPU usage
-        std::this_thread::sleep_for(std::chrono::seconds(1));
+        struct pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            DEBUG_PRINTF("ERROR: poll on file watcher failed: %s\n", strerror(errno));
+            break;
+        }
 
-        if (!sync_dir_exists()) {
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            ssize_t n = read(wake_fd, &count, sizeof(count));
+            (void)n;
+        }
+        if (resync_requested.exchange(false)) {
+            catch_up();
+        }
+        if (!(fds[0].revents & POLLIN)) {
             continue;
         }
 
-        std::unordered_map<std::string, time_t> current_mtimes;
-        std::vector<std::string> current_files;
+        std::map<std::string, bool> changes;
+        bool overflow = false;
+        bool watching = read_watch_events(inotify_fd, changes, overflow);
+        struct pollfd settle = {inotify_fd, POLLIN, 0};
+        while (watching && poll(&settle, 1, WATCH_SETTLE_MS) > 0) {
+            watching = read_watch_events(inotify_fd, changes, overflow);
+        }
 
-        // Get current files and mtimes
-        DIR* dir = opendir(sync_dir_path.c_str());
-        if (dir == nullptr) {
-            continue;
+        if (!watching) {
+            // The sync directory itself went away; recreate it and watch again
+            watch_sync_dir();
+            if (inotify_add_watch(inotify_fd, sync_dir_path.c_str(), WATCH_EVENTS) < 0) {
+                DEBUG_PRINTF("ERROR: Cannot watch %s again: %s\n", sync_dir_path.c_str(), strerror(errno));
+                break;
+            }
+            overflow = true;
         }
 
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != nullptr) {
-            if (entry->d_type == DT_REG) {  // Regular file
-                std::string filename = entry->d_name;
-                std::string filepath = sync_dir_path + "/" + filename;
-                current_files.push_back(filename);
+        if (overflow) {
+            // Events were lost; compare against what we knew instead
+            DEBUG_PRINTF("WARN: File watcher queue overflowed, rescanning %s\n", sync_dir_path.c_str());
+            scan_for_file_changes();
+            continue;
+        }
 
-                struct stat st;
-                if (stat(filepath.c_str(), &st) == 0) {
-                    current_mtimes[filename] = st.st_mtime;
-                }
-            }
+        std::vector<std::string> uploads;
+        for (const auto& change : changes) {
+            handle_watch_change(change.first, change.second, uploads);
         }
+        upload_files(uploads);
+    }
 
-        closedir(dir);
+    watcher_wake_fd = -1;
+    close(wake_fd);
+    close(inotify_fd);
+    poll_for_file_changes();
+}
 
-        for (const auto& file : current_files) {
-            // IGNORE arquivos sincronizados recentemente
-            {
-                std::lock_guard<std::mutex> lock(arquivos_sincronizados_mutex);
-                if (arquivos_sincronizados.count(file)) {
-                    arquivos_sincronizados.erase(file);
-                    continue; // Não faz upload desse arquivo
-                }
-            }
-            auto it = file_mtimes.find(file);
-            if (it == file_mtimes.end() || it->second != current_mtimes[file]) {
-                // File is new or modified
-                process_file_change(file, false);
-            }
+// Full comparison of the sync directory against the index
+void scan_for_file_changes() {
+    if (!sync_dir_exists()) {
+        return;
+    }
+
+    std::set<std::string> current_files;
+    DIR* dir = opendir(sync_dir_path.c_str());
+    if (dir == nullptr) {
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_type == DT_REG) {  // Regular file
+            std::string filename = entry->d_name;
+            if (is_temp_file(filename)) continue; // Download in progress
+            current_files.insert(filename);
         }
+    }
 
-        // Check for deleted files
-        for (const auto& entry : file_mtimes) {
-            if (current_mtimes.find(entry.first) == current_mtimes.end()) {
-                // TODO: bug here.
-                // File was deleted
-                // process_file_change(entry.first, true);
-            }
+    closedir(dir);
+
+    std::vector<std::string> uploads;
+    for (const auto& file : current_files) {
+        // IGNORE arquivos sincronizados recentemente
+        if (take_ignored_change(file)) {
+            continue; // Não faz upload desse arquivo
+        }
+        struct stat st;
+        if (stat((sync_dir_path + "/" + file).c_str(), &st) == 0 && local_file_changed(file, st)) {
+            // File is new or modified
+            uploads.push_back(file);
         }
+    }
+    upload_files(uploads);
 
-        // Update mtimes
-        file_mutex.lock();
-        file_mtimes = current_mtimes;
-        file_mutex.unlock();
+    // Files the index knows that are gone were deleted here. Checked again
+    // right before: a download may have landed since the directory was read.
+    for (const auto& file : file_index.names()) {
+        struct stat st;
+        if (current_files.count(file) == 0 && !take_ignored_change(file) &&
+            stat((sync_dir_path + "/" + file).c_str(), &st) != 0 && errno == ENOENT) {
+            process_file_change(file, true);
+        }
     }
 }
 
@@ -352,41 +648,173 @@ void process_file_change(const std::string& filename, bool is_deleted) {
     }
 }
 
-// Function to send a command and get a response
-packet send_command_and_wait(const packet& cmd) {
-    uint16_t seq = cmd.seqn;
+// Get next sequence number
+uint32_t get_next_seq() {
+    std::lock_guard<std::mutex> lock(responses_mutex);
+    return next_seq_number++;
+}
+
+Stream::Stream() : seqn(get_next_seq()) {
+    std::lock_guard<std::mutex> lock(stream_mutex);
+    PendingStream& stream = streams[seqn];
+    future = stream.reply.get_future();
+    if (!connection_alive.load()) {
+        stream.reply.set_exception(std::make_exception_ptr(std::runtime_error("connection lost")));
+        stream.replied = true;
+    }
+}
 
-    // Send the command with the socket mutex locked
+Stream::~Stream() {
+    // Whatever still arrives for it is dropped
+    bool abandoned;
     {
-        std::lock_guard<std::mutex> lock(socket_mutex);
-        write(server_socket, &cmd, sizeof(packet));
+        std::lock_guard<std::mutex> lock(stream_mutex);
+        auto it = streams.find(seqn);
+        abandoned = it != streams.end() && it->second.body;
+        streams.erase(seqn);
     }
 
-    // Wait for response with the sequence number
-    std::unique_lock<std::mutex> lock(responses_mutex);
-    while (responses.find(seq) == responses.end()) {
-        responses_cv.wait(lock);
+    // A download left midway would hold one of the server's stream slots
+    // for as long as the connection lasts
+    if (abandoned && connection_alive.load()) {
+        DEBUG_PRINTF("DEBUG: Cancelling download stream %u\n", seqn);
+        packet cancel;
+        cancel.type = STREAM_CANCEL;
+        cancel.seqn = seqn;
+        send_frame(cancel);
     }
+}
 
-    // Get the response and remove it from the map
-    packet response = responses[seq];
-    responses.erase(seq);
+bool Stream::reply(packet& pkt) {
+    try {
+        pkt = future.get();
+        return true;
+    } catch (const std::exception& e) {
+        DEBUG_PRINTF("ERROR: No reply on stream %u: %s\n", seqn, e.what());
+        return false;
+    }
+}
 
-    return response;
+// Hands a frame to whoever waits for it. Caller holds stream_mutex.
+static void dispatch_frame(packet& frame) {
+    auto it = frame.seqn != 0 ? streams.find(frame.seqn) : streams.end();
+    if (it != streams.end()) {
+        PendingStream& stream = it->second;
+        if (!stream.replied) {
+            stream.replied = true;
+            stream.body = (frame.type == CMD_DOWNLOAD || frame.type == CMD_DOWNLOAD_RANGE ||
+                           frame.type == CMD_DOWNLOAD_BUNDLE) && frame.payload.compare(0, 2, "OK") == 0;
+            stream.reply.set_value(std::move(frame));
+        } else {
+            stream.frames.push_back(std::move(frame));
+            stream_cv.notify_all();
+        }
+    } else if (frame.type == SYNC_NOTIFICATION || frame.type == SYNC_PUSH) {
+        queue_notification(frame);
+    } else {
+        DEBUG_PRINTF("DEBUG: Dropping type %d frame of closed stream %u\n", frame.type, frame.seqn);
+    }
 }
 
-// Get next sequence number
-uint16_t get_next_seq() {
-    std::lock_guard<std::mutex> lock(responses_mutex);
-    return next_seq_number++;
+// The only thread that reads from the socket. It sleeps in poll() until a
+// frame starts to arrive (the receive timeout then only catches a frame
+// stalled midway) and runs until the connection breaks, failing every
+// exchange still waiting.
+static void read_frames(int sock) {
+    DEBUG_PRINTF("DEBUG Reader: Thread starting\n");
+    while (true) {
+        struct pollfd pfd = {sock, POLLIN, 0};
+        int ready = poll(&pfd, 1, -1);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        packet frame;
+        if (ready < 0 || !recv_packet(sock, frame)) {
+            DEBUG_PRINTF("ERROR: Lost connection to server (incomplete frame).\n");
+            break;
+        }
+        std::lock_guard<std::mutex> lock(stream_mutex);
+        dispatch_frame(frame);
+    }
+
+    std::lock_guard<std::mutex> lock(stream_mutex);
+    connection_alive.store(false);
+    for (auto& entry : streams) {
+        if (!entry.second.replied) {
+            entry.second.replied = true;
+            entry.second.reply.set_exception(std::make_exception_ptr(std::runtime_error("connection lost")));
+        }
+    }
+    reader_running = false;
+    stream_cv.notify_all();
+}
+
+static void start_reader() {
+    std::lock_guard<std::mutex> lock(stream_mutex);
+    reader_running = true;
+    std::thread(read_frames, server_socket).detach();
+}
+
+// Stops the reader of a socket about to be replaced
+static void stop_reader() {
+    std::unique_lock<std::mutex> lock(stream_mutex);
+    if (reader_running) {
+        shutdown(server_socket, SHUT_RDWR);
+        stream_cv.wait(lock, [] { return !reader_running; });
+    }
+    streams.clear();
+}
+
+// Next frame of stream seqn after its reply. False once the connection is
+// gone.
+static bool recv_frame(uint32_t seqn, packet& pkt) {
+    std::unique_lock<std::mutex> lock(stream_mutex);
+    while (true) {
+        auto it = streams.find(seqn);
+        if (it == streams.end()) {
+            return false;   // dropped by a reconnect
+        }
+        if (!it->second.frames.empty()) {
+            pkt = std::move(it->second.frames.front());
+            it->second.frames.pop_front();
+            return true;
+        }
+        if (!connection_alive.load()) {
+            return false;
+        }
+        stream_cv.wait(lock);
+    }
+}
+
+// The download on stream seqn has been received whole
+static void end_stream_body(uint32_t seqn) {
+    std::lock_guard<std::mutex> lock(stream_mutex);
+    auto it = streams.find(seqn);
+    if (it != streams.end()) {
+        it->second.body = false;
+    }
+}
+
+// Sends a frame of stream seqn as a whole
+static bool send_frame(const packet& pkt) {
+    std::lock_guard<std::mutex> lock(socket_mutex);
+    return send_packet(server_socket, pkt);
+}
+
+// Function to send a command and get a response
+packet send_command_and_wait(const packet& cmd) {
+    Stream stream;
+    packet request = cmd;
+    request.seqn = stream.seqn;
+    packet response;
+    if (!send_frame(request) || !stream.reply(response)) {
+        response.payload = "ERROR";
+    }
+    return response;
 }
 
 // Function to monitor notifications from the server
 void monitor_server_notifications() {
-    bool command_completed = false;
-    uint16_t expected_seqn = 0;
-    size_t files_remaining = 0;
-
     DEBUG_PRINTF("DEBUG Monitor: Thread starting\n");
 
     // Signal that the monitor thread is ready
@@ -400,212 +828,363 @@ void monitor_server_notifications() {
 
     while (true) {
         // Wait for notifications from the server
+        packet pkt = wait_notification();
         std::lock_guard<std::mutex> pause_monitor(download_mutex);
+        DEBUG_PRINTF("DEBUG Monitor: Processing notification: %s\n", pkt.payload.c_str());
+        handle_server_notification(pkt);
+    }
+}
 
-        packet pkt;
-        memset(&pkt, 0, sizeof(packet)); // Clear the packet before reading
+// A download received into a temp file next to its destination, not yet
+// made durable or moved into place
+struct ReceivedFile {
+    int fd = -1;                // -1: the local write failed (data was drained)
+    std::string tempPath;
+    std::string destPath;
+    uint8_t digest[SHA256_DIGEST_SIZE] = {};
+};
 
-        {
-            std::lock_guard<std::mutex> lock(socket_mutex);
+// Creates the temp file a download of destPath is received into, next to
+// it so the final rename never crosses a filesystem. -1 on failure.
+static int create_temp_file(const std::string& destPath, std::string& tempPath) {
+    fs::path dest(destPath);
+    std::string tmpl = (dest.parent_path() / (TEMP_FILE_PREFIX + dest.filename().string() + ".XXXXXX")).string();
+    std::vector<char> path(tmpl.begin(), tmpl.end());
+    path.push_back('\0');
+
+    int fd = mkstemp(path.data());
+    if (fd < 0) {
+        DEBUG_PRINTF("ERROR: Failed to create temp file for %s: %s\n", destPath.c_str(), strerror(errno));
+    } else {
+        fchmod(fd, 0644); // mkstemp creates 0600; match what ofstream used to give us
+    }
+    tempPath = path.data();
+    return fd;
+}
 
-            // Check if there's any bytes available to read
-            int bytes_available = 0;
-            int err = ioctl(server_socket, FIONREAD, &bytes_available);
-            if (err < 0) {
-                DEBUG_PRINTF("ERR: %d\n", err);
-            }
+// Receive the DATA_PACKETs of download stream seqn and stream them into a
+// temp file of fileSize bytes next to destPath, one chunk in memory at a
+// time. The stream carries the first length bytes (file.digest is only
+// set if that is all of them). Each chunk written is credited back to the
+// server, which only sends a stream as far as its credit goes. If the
+// local write fails the rest of the data is still drained (file.fd is then
+// -1). Returns false only when the stream itself broke.
+static bool receive_data(uint32_t seqn, const std::string& destPath, uint64_t fileSize, uint64_t length,
+                         ReceivedFile& file) {
+    std::string tempPath;
+    int fd = create_temp_file(destPath, tempPath);
+
+    if (fd >= 0 && fileSize > 0) {
+        // Reserve the space up front; a full disk fails here instead of midway
+        int err = posix_fallocate(fd, 0, fileSize);
+        if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+            DEBUG_PRINTF("ERROR: Failed to preallocate %llu bytes for %s: %s\n",
+                   (unsigned long long)fileSize, destPath.c_str(), strerror(err));
+            close(fd);
+            unlink(tempPath.c_str());
+            fd = -1;
+        }
+    }
 
-            if (bytes_available > 0) {
+    uint64_t bytesRead = 0;
+    bool streamOk = true;
+    Sha256 hash;
 
-                size_t bytes_read = read_all(server_socket, &pkt, sizeof(packet));
-                if (bytes_read > 0 && bytes_read != sizeof(packet)) {
-                    DEBUG_PRINTF("ERROR: Lost connection to server (read %zu of %zu).\n",
-                        bytes_read, sizeof(packet));
-                    connection_alive.store(false);
-                    break; // Exit monitor thread; other threads will notice connection loss
-                }
-            }
+    while (streamOk && bytesRead < length) {
+        packet data;
+        if (!recv_frame(seqn, data)) {
+            DEBUG_PRINTF("ERROR: Failed to receive file data packet: %s\n", strerror(errno));
+            streamOk = false;
+            break;
         }
 
-        if (pkt.length != 0) {
-            DEBUG_PRINTF("DEBUG Monitor: Received packet type: %d, seq: %d, length: %d, payload: %.10s...\n",
-                   pkt.type, pkt.seqn, pkt.length, pkt.payload);
+        if (data.type != DATA_PACKET || data.payload.size() > length - bytesRead) {
+            DEBUG_PRINTF("ERROR: Unexpected packet type %d (expected DATA_PACKET)\n", data.type);
+            streamOk = false;
+            break;
         }
 
-        // Handle the packet based on its type
-        if (pkt.type == SYNC_NOTIFICATION) {
-            DEBUG_PRINTF("DEBUG Monitor: Processing sync notification\n");
-
-            // Check if this is part of a get_sync_dir response
-            if (command_completed && files_remaining > 0) {
-                files_remaining--;
-                DEBUG_PRINTF("DEBUG Monitor: Processing sync dir file (%zu remaining)\n", files_remaining);
-
-                if (files_remaining == 0) {
-                    // Signal that the get_sync_dir command is fully complete
-                    command_completed = false;
-                    DEBUG_PRINTF("DEBUG Monitor: All sync dir files processed\n");
-                }
-                // Process the file notification regardless
-                handle_server_notification(pkt);
-            } else {
-                // It's a standalone sync notification from another device
-                DEBUG_PRINTF("DEBUG Monitor: Processing notification from another device\n");
-                handle_server_notification(pkt);
-            }
+        size_t n = data.payload.size();
+        if (fd >= 0 && pwrite(fd, data.payload.data(), n, bytesRead) != (ssize_t)n) {
+            DEBUG_PRINTF("ERROR: Failed to write %s: %s\n", tempPath.c_str(), strerror(errno));
+            close(fd);
+            unlink(tempPath.c_str());
+            fd = -1;
         }
-        else { // It's a response to a command
-            // DEBUG_PRINTF("DEBUG Monitor: Received command response, adding to responses map\n");
-
-            // Special handling for get_sync_dir
-            if (pkt.type == CMD_GET_SYNC_DIR) {
-                // Mark that we're expecting file notifications
-                if (strcmp(pkt.payload, "OK") == 0) {
-                    command_completed = true;
-                    files_remaining = pkt.total_size;
-                    expected_seqn = pkt.seqn;
-                    DEBUG_PRINTF("DEBUG Monitor: get_sync_dir response OK, expecting %zu files\n", files_remaining);
-
-                    // If no files to sync, mark command as done immediately
-                    if (files_remaining == 0) {
-                        command_completed = false;
-                        DEBUG_PRINTF("DEBUG Monitor: No files to sync, command completed\n");
-                    }
-                }
-            }
-
-            // Store the response in the map
-            {
-                std::lock_guard<std::mutex> lock(responses_mutex);
-                responses[pkt.seqn] = pkt;
-                // DEBUG_PRINTF("DEBUG Monitor: Added response for seq %d to map (map size: %zu)\n",
-                //       pkt.seqn, responses.size());
-                responses_cv.notify_all();
-            }
+        hash.update(data.payload.data(), n);
+        bytesRead += n;
+
+        if (bytesRead < length) {
+            packet window;
+            window.type = STREAM_WINDOW;
+            window.seqn = seqn;
+            window.payload.resize(sizeof(uint32_t));
+            put_u32((uint8_t*)&window.payload[0], n);
+            send_frame(window);
         }
+
+        DEBUG_PRINTF("DEBUG: Download progress: %llu/%llu bytes (%d%%)\n",
+               (unsigned long long)bytesRead, (unsigned long long)length,
+               (int)(bytesRead * 100 / length));
+    }
+
+    if (streamOk) {
+        end_stream_body(seqn);
+    } else if (fd >= 0) {
+        close(fd);
+        unlink(tempPath.c_str());
+        fd = -1;
     }
+    file.fd = fd;
+    file.tempPath = tempPath;
+    file.destPath = destPath;
+    hash.final(file.digest);
+    return streamOk;
 }
 
-void handle_server_notification(packet& pkt) {
-    DEBUG_PRINTF("DEBUG: Handling server notification type %d\n", pkt.type);
+// Makes a received file durable and atomically replaces its destination
+// with it: readers only ever see the old file or the complete new one.
+// Touches only the disk, so it can run off the receiving thread.
+static bool install_file(ReceivedFile& file) {
+    if (file.fd < 0) {
+        return false;
+    }
+    bool ok = fsync(file.fd) == 0;
+    close(file.fd);
+    file.fd = -1;
+    if (ok && rename(file.tempPath.c_str(), file.destPath.c_str()) != 0) {
+        DEBUG_PRINTF("ERROR: Failed to move %s into place: %s\n", file.destPath.c_str(), strerror(errno));
+        ok = false;
+    }
+    if (!ok) {
+        unlink(file.tempPath.c_str());
+    }
+    return ok;
+}
 
-    // Lock file operations during handling
-    std::lock_guard<std::mutex> lock(file_mutex);
+// Request for the download of filename on stream seqn. With data
+// connections open, only the first STRIPE_MIN_SIZE bytes are asked for
+// here; receive_download fetches the rest of a larger file in ranges over
+// the data connections.
+static packet download_request(uint32_t seqn, const std::string& filename) {
+    packet request;
+    request.seqn = seqn;
+    if (stripes_active()) {
+        request.type = CMD_DOWNLOAD_RANGE;
+        append_u64(request.payload, 0);
+        append_u64(request.payload, STRIPE_MIN_SIZE);
+        append_u64(request.payload, 0); // whatever version is current
+    } else {
+        request.type = CMD_DOWNLOAD;
+    }
+    request.payload += filename;
+    return request;
+}
 
-    if (pkt.type == SYNC_NOTIFICATION) {
-        // Payload format: <action>:<filename>
-        // action: 'U' for upload/update, 'D' for delete
-        std::string payload_str(pkt.payload, pkt.length);
-        size_t delimiter_pos = payload_str.find(':');
+// Receive the download of filename answered by response (on stream seqn)
+// into a temp file next to destPath; see receive_data. The ranges fetched
+// over the data connections must be of the version the reply named.
+static bool receive_download(uint32_t seqn, const std::string& filename, const std::string& destPath,
+                             const packet& response, ReceivedFile& file) {
+    uint64_t fileSize = response.total_size;
+    uint64_t length = fileSize;
+    if (response.type == CMD_DOWNLOAD_RANGE) {
+        length = std::min<uint64_t>(fileSize, STRIPE_MIN_SIZE);
+    }
+    if (!receive_data(seqn, destPath, fileSize, length, file)) {
+        return false;
+    }
+    if (length == fileSize || file.fd < 0) {
+        return true;
+    }
 
-        if (delimiter_pos != std::string::npos) {
-            char action = payload_str[0];
-            std::string filename = payload_str.substr(delimiter_pos + 1);
-            std::string full_path = sync_dir_path + "/" + filename;
+    auto start = std::chrono::steady_clock::now();
+    if (response.payload.size() < 2 + sizeof(uint64_t) ||
+        !stripes_download(filename, get_u64((const uint8_t*)response.payload.data() + 2),
+                          length, fileSize, file.fd) ||
+        !hash_file(file.tempPath, file.digest)) {
+        DEBUG_PRINTF("ERROR: Striped download of %s failed\n", filename.c_str());
+        close(file.fd);
+        unlink(file.tempPath.c_str());
+        file.fd = -1;
+        return true;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    DEBUG_PRINTF("DEBUG: Striped download of %s: %.1f MB in %.2f s\n", filename.c_str(),
+                 (fileSize - length) / 1048576.0, seconds);
+    return true;
+}
 
-            DEBUG_PRINTF("DEBUG: Received notification - Action: %c, File: %s\n", action, filename.c_str());
+// Receive a download straight into destPath. If digest is given it
+// receives the SHA-256 of the content.
+bool receive_file(uint32_t seqn, const std::string& filename, const std::string& destPath,
+                  const packet& response, uint8_t* digest) {
+    ReceivedFile file;
+    bool streamOk = receive_download(seqn, filename, destPath, response, file);
+    if (!streamOk || !install_file(file)) {
+        return false;
+    }
+    if (digest != nullptr) {
+        memcpy(digest, file.digest, sizeof(file.digest));
+    }
+    return true;
+}
+
+// Whether the local file is the given server version, untouched since
+static bool have_version(const std::string& filename, uint64_t version) {
+    IndexEntry entry;
+    struct stat st;
+    return version != 0 && file_index.lookup(filename, entry) && entry.serverVersion == version &&
+           stat((sync_dir_path + "/" + filename).c_str(), &st) == 0 && index_stat_matches(entry, st);
+}
+
+// SYNC_PUSH: writes the file it carries into the sync directory. False
+// if that failed; filename is then set when the push named one, which is
+// fetched the usual way instead. Caller holds file_mutex.
+static bool apply_push(const packet& pkt, std::string& filename) {
+    std::vector<BundleEntry> entries;
+    if (!parse_bundle_frame(pkt.payload.data(), pkt.payload.size(), entries) || entries.size() != 1) {
+        DEBUG_PRINTF("ERROR: Malformed pushed file\n");
+        return false;
+    }
+    const BundleEntry& entry = entries[0];
+    filename = entry.name;
+    if (have_version(filename, entry.version)) {
+        DEBUG_PRINTF("DEBUG: %s is already up to date\n", filename.c_str());
+        return true;
+    }
+    if (!entry.intact) {
+        DEBUG_PRINTF("ERROR: Pushed file %s is damaged\n", filename.c_str());
+        return false;
+    }
+
+    ReceivedFile file;
+    file.destPath = sync_dir_path + "/" + filename;
+    file.fd = create_temp_file(file.destPath, file.tempPath);
+    if (file.fd >= 0 && write_all(file.fd, entry.data, entry.size) != entry.size) {
+        close(file.fd);
+        unlink(file.tempPath.c_str());
+        file.fd = -1;
+    }
+
+    // Before the rename lands, or the watcher would upload it right back
+    ignore_next_change(filename);
+    struct stat st;
+    if (!install_file(file) || stat(file.destPath.c_str(), &st) != 0) {
+        unignore_change(filename);
+        return false;
+    }
+    record_synced(filename, st, entry.digest, entry.version);
+    printf("Arquivo %s recebido via notificação.\n", filename.c_str());
+    return true;
+}
+
+void handle_server_notification(packet& pkt) {
+    DEBUG_PRINTF("DEBUG: Handling server notification type %d\n", pkt.type);
+
+    // Lock file operations during handling
+    std::lock_guard<std::mutex> lock(file_mutex);
+
+    if (pkt.type == SYNC_PUSH) {
+        std::string filename;
+        if (apply_push(pkt, filename) || filename.empty()) {
+            return;
+        }
+        // Fetch it as if only notified
+        pkt.type = SYNC_NOTIFICATION;
+        pkt.payload = "U:" + filename;
+    }
+
+    if (pkt.type == SYNC_NOTIFICATION) {
+        // Payload format: <action>:<filename>
+        // action: 'U' for upload/update, 'D' for delete
+        const std::string& payload_str = pkt.payload;
+        size_t delimiter_pos = payload_str.find(':');
+
+        if (delimiter_pos != std::string::npos) {
+            char action = payload_str[0];
+            std::string filename = payload_str.substr(delimiter_pos + 1);
+            std::string full_path = sync_dir_path + "/" + filename;
+
+            DEBUG_PRINTF("DEBUG: Received notification - Action: %c, File: %s\n", action, filename.c_str());
 
             if (action == 'U') {
+                // Already have that version (total_size carries it)
+                struct stat st;
+                if (have_version(filename, pkt.total_size)) {
+                    DEBUG_PRINTF("DEBUG: %s is already up to date\n", filename.c_str());
+                    return;
+                }
+
                 // Request download from server
                 DEBUG_PRINTF("Atualização detectada no servidor para %s. Baixando...\n", filename.c_str());
 
                 // Create download request
-                packet download_req;
-                memset(&download_req, 0, sizeof(packet));
-                download_req.type = CMD_DOWNLOAD;
-                download_req.seqn = get_next_seq();
-                strncpy(download_req.payload, filename.c_str(), sizeof(download_req.payload) - 1);
-                download_req.length = strlen(download_req.payload);
+                Stream stream;
+                packet download_req = download_request(stream.seqn, filename);
 
                 // Send download request
-                {
-                    std::lock_guard<std::mutex> sock_lock(socket_mutex);
-                    if (write_all(server_socket, &download_req, sizeof(packet)) != sizeof(packet)) {
-                         DEBUG_PRINTF("ERROR: Failed to send download request for notification %s\n", filename.c_str());
-                         return;
-                    }
-
-                    // Wait for server response
-                    packet response;
-                    memset(&response, 0, sizeof(packet));
-                    if (read_all(server_socket, &response, sizeof(packet)) != sizeof(packet)) {
-                        DEBUG_PRINTF("ERROR: Failed to receive download response\n");
-                        return;
-                    }
-
-                    if (strcmp(response.payload, "OK") != 0) {
-                        DEBUG_PRINTF("ERROR: Server returned error for download: %s\n", response.payload);
-                        return;
-                    }
-
-                    // Prepare to receive file data
-                    size_t fileSize = response.total_size;
-                    DEBUG_PRINTF("DEBUG: Receiving file %s (%zu bytes) via notification handler\n", filename.c_str(), fileSize);
-
-                    // Allocate buffer for file data
-                    char* fileData = new char[fileSize];
-                    size_t bytesRead = 0;
-
-                    // Receive file data packets
-                    while (bytesRead < fileSize) {
-                        packet dataPkt;
-                        memset(&dataPkt, 0, sizeof(packet));
-
-                        if (read_all(server_socket, &dataPkt, sizeof(packet)) != sizeof(packet)) {
-                            DEBUG_PRINTF("ERROR: Failed to receive file data packet\n");
-                            delete[] fileData;
-                            return;
-                        }
-
-                        if (dataPkt.type != DATA_PACKET) {
-                            DEBUG_PRINTF("ERROR: Expected DATA_PACKET but got type %d\n", dataPkt.type);
-                            delete[] fileData;
-                            return;
-                        }
-
-                        memcpy(fileData + bytesRead, dataPkt.payload, dataPkt.length);
-                        bytesRead += dataPkt.length;
-                        DEBUG_PRINTF("DEBUG: Download progress: %zu/%zu bytes (%d%%)\n",
-                               bytesRead, fileSize, (int)(bytesRead * 100 / fileSize));
-                    }
+                if (!send_frame(download_req)) {
+                     DEBUG_PRINTF("ERROR: Failed to send download request for notification %s\n", filename.c_str());
+                     return;
+                }
 
-                    // Write file to sync directory
-                    std::ofstream file(full_path, std::ios::binary);
-                    if (!file) {
-                        DEBUG_PRINTF("ERROR: Failed to create file %s\n", full_path.c_str());
-                        delete[] fileData;
-                        return;
-                    }
+                // Wait for server response
+                packet response;
+                if (!stream.reply(response)) {
+                    DEBUG_PRINTF("ERROR: Failed to receive download response\n");
+                    return;
+                }
 
-                    file.write(fileData, fileSize);
-                    file.close();
-                    delete[] fileData;
+                // Payload: "OK" followed by the version being sent
+                if (response.payload.compare(0, 2, "OK") != 0) {
+                    DEBUG_PRINTF("ERROR: Server returned error for download: %s\n", response.payload.c_str());
+                    return;
+                }
+                uint64_t version = 0;
+                if (response.payload.size() >= 2 + sizeof(uint64_t)) {
+                    version = get_u64((const uint8_t*)response.payload.data() + 2);
+                }
 
-                    {
-                        std::lock_guard<std::mutex> lock(arquivos_sincronizados_mutex);
-                        arquivos_sincronizados.insert(filename);
-                    }
+                // Stream file data into the sync directory
+                uint64_t fileSize = response.total_size;
+                DEBUG_PRINTF("DEBUG: Receiving file %s (%llu bytes) via notification handler\n",
+                       filename.c_str(), (unsigned long long)fileSize);
+
+                // Before the rename lands, or the watcher would upload it right back
+                ignore_next_change(filename);
+                uint8_t digest[SHA256_DIGEST_SIZE];
+                if (!receive_file(stream.seqn, filename, full_path, response, digest)) {
+                    DEBUG_PRINTF("ERROR: Failed to receive file %s\n", filename.c_str());
+                    unignore_change(filename);
+                    return;
+                }
 
-                    // Update file times map
-                    struct stat st;
-                    if (stat(full_path.c_str(), &st) == 0) {
-                        file_mtimes[filename] = st.st_mtime;
-                    }
+                if (stat(full_path.c_str(), &st) == 0) {
+                    record_synced(filename, st, digest, version);
+                }
 
-                    printf("Arquivo %s baixado com sucesso via notificação.\n", filename.c_str());
-                } // Release socket lock
+                printf("Arquivo %s baixado com sucesso via notificação.\n", filename.c_str());
 
+            } else if (action == 'R') {
+                // We fell behind and the server dropped our notifications.
+                // Can't resync from here: the monitor thread has to keep reading.
+                printf("Notificações perdidas; ressincronizando com o servidor...\n");
+                request_resync();
             } else if (action == 'D') {
                 // Delete the file locally
                 printf("Arquivo %s removido no servidor. Removendo localmente...\n", filename.c_str());
+                ignore_next_change(filename);
                 if (remove(full_path.c_str()) == 0) {
                     printf("Arquivo %s removido localmente.\n", filename.c_str());
-                    // Update local mtimes map
-                    file_mtimes.erase(filename);
+                    file_index.remove(filename);
                 } else {
                     // Check if file didn't exist locally already (not an error)
+                    unignore_change(filename);
                     if (errno != ENOENT) {
                         perror("Erro ao remover arquivo localmente");
+                    } else {
+                        file_index.remove(filename);
                     }
                 }
             }
@@ -618,7 +1197,501 @@ void handle_server_notification(packet& pkt) {
     // Mutex automatically released when lock goes out of scope
 }
 
+// Writer threads of one download_files() call. Each received file is
+// fsync'd and renamed into place off the receiving thread, so the disk
+// latency of one file overlaps with receiving the next ones.
+class DownloadWriters {
+public:
+    DownloadWriters() {
+        for (int i = 0; i < DOWNLOAD_WRITERS; i++) {
+            threads.emplace_back(&DownloadWriters::run, this);
+        }
+    }
+
+    ~DownloadWriters() { finish(); }
+
+    // Blocks while DOWNLOAD_WRITE_QUEUE files are already waiting
+    void add(const std::string& filename, uint64_t version, const ReceivedFile& file) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return queue.size() < DOWNLOAD_WRITE_QUEUE; });
+        queue.push_back({filename, version, file});
+        cv.notify_all();
+    }
+
+    // Waits until everything queued is written; returns how many files
+    // made it into place
+    size_t finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        cv.notify_all();
+        for (auto& thread : threads) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+        return installed;
+    }
+
+private:
+    struct Job {
+        std::string filename;
+        uint64_t version;
+        ReceivedFile file;
+    };
+
+    void run() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return closing || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                job = std::move(queue.front());
+                queue.pop_front();
+                cv.notify_all();
+            }
+
+            struct stat st;
+            if (install_file(job.file) && stat(job.file.destPath.c_str(), &st) == 0) {
+                record_synced(job.filename, st, job.file.digest, job.version);
+                installed++;
+                DEBUG_PRINTF("DEBUG: Downloaded %s\n", job.filename.c_str());
+            } else {
+                unignore_change(job.filename);
+                printf("Erro ao gravar o arquivo %s.\n", job.filename.c_str());
+            }
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Job> queue;
+    bool closing = false;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> installed{0};
+};
+
+// Receives bundle stream seqn (bundleSize bytes, see bundle.h) and hands
+// each file in it to writers. A damaged entry is skipped. Returns false
+// only when the stream itself broke.
+static bool receive_bundle(uint32_t seqn, uint64_t bundleSize, DownloadWriters& writers, size_t& files) {
+    uint64_t received = 0;
+    while (received < bundleSize) {
+        packet data;
+        std::vector<BundleEntry> entries;
+        if (!recv_frame(seqn, data) || data.type != DATA_PACKET ||
+            data.payload.size() > bundleSize - received ||
+            !parse_bundle_frame(data.payload.data(), data.payload.size(), entries)) {
+            DEBUG_PRINTF("ERROR: Bundle stream %u broken after %llu bytes\n", seqn, (unsigned long long)received);
+            return false;
+        }
+        received += data.payload.size();
+        if (received < bundleSize) {
+            packet window;
+            window.type = STREAM_WINDOW;
+            window.seqn = seqn;
+            append_u32(window.payload, data.payload.size());
+            send_frame(window);
+        }
+
+        for (const auto& entry : entries) {
+            files++;
+            ReceivedFile file;
+            file.destPath = sync_dir_path + "/" + entry.name;
+            file.fd = entry.intact ? create_temp_file(file.destPath, file.tempPath) : -1;
+            if (file.fd >= 0 && write_all(file.fd, entry.data, entry.size) != entry.size) {
+                close(file.fd);
+                unlink(file.tempPath.c_str());
+                file.fd = -1;
+            }
+            if (file.fd < 0) {
+                printf("Erro ao gravar o arquivo %s.\n", entry.name.c_str());
+                continue;
+            }
+            memcpy(file.digest, entry.digest, sizeof(file.digest));
+
+            // Before the rename lands, or the watcher would upload it right back
+            ignore_next_change(entry.name);
+            writers.add(entry.name, entry.version, file);
+        }
+    }
+    end_stream_body(seqn);
+    return true;
+}
+
+// Downloads the given files (name, server version). Instead of one round
+// trip per file, they are asked for BUNDLE_MAX_FILES at a time as bundles,
+// which carry the small ones in a single stream; those the server finds
+// too large for a bundle follow on a stream each. Up to DOWNLOAD_PIPELINE
+// requests are kept in flight so the link never idles between them. Their
+// data is read in request order; the server's per-stream credit keeps the
+// ones further back from running ahead. Caller paused the monitor.
+static void download_files(const std::vector<std::pair<std::string, uint64_t>>& files) {
+    if (files.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(file_mutex);
+    DownloadWriters writers;
+
+    // A request covers files [first, first + count) of names; only bundles
+    // have more than one
+    struct Request {
+        size_t first;
+        size_t count;
+        bool bundle;
+    };
+    std::vector<std::string> names;
+    std::vector<Request> requests;
+    for (const auto& file : files) {
+        names.push_back(file.first);
+    }
+    for (size_t first = 0; first < names.size(); first += BUNDLE_MAX_FILES) {
+        requests.push_back({first, std::min<size_t>(BUNDLE_MAX_FILES, names.size() - first), true});
+    }
+
+    std::deque<std::unique_ptr<Stream>> inFlight;
+    size_t sent = 0;
+    size_t done = 0;
+    uint64_t bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto lastReport = start;
+
+    for (size_t received = 0; received < requests.size(); received++) {
+        while (sent < requests.size() && inFlight.size() < DOWNLOAD_PIPELINE) {
+            const Request& next = requests[sent];
+            std::unique_ptr<Stream> stream(new Stream());
+            packet request;
+            if (next.bundle) {
+                request.type = CMD_DOWNLOAD_BUNDLE;
+                request.seqn = stream->seqn;
+                for (size_t i = next.first; i < next.first + next.count; i++) {
+                    append_u16(request.payload, names[i].size());
+                    request.payload += names[i];
+                }
+            } else {
+                request = download_request(stream->seqn, names[next.first]);
+            }
+            if (!send_frame(request)) {
+                DEBUG_PRINTF("ERROR: Failed to send download request\n");
+                return;
+            }
+            inFlight.push_back(std::move(stream));
+            sent++;
+        }
+
+        const Request current = requests[received];
+        std::unique_ptr<Stream> stream = std::move(inFlight.front());
+        inFlight.pop_front();
+        packet response;
+        if (!stream->reply(response)) {
+            DEBUG_PRINTF("ERROR: Failed to receive download response\n");
+            return;
+        }
+
+        if (current.bundle) {
+            // Payload: "OK" + one status per name asked for
+            if (response.payload.compare(0, 2, "OK") != 0 || response.payload.size() != 2 + current.count) {
+                DEBUG_PRINTF("ERROR: Server returned error for bundle: %s\n", response.payload.c_str());
+                continue;
+            }
+            for (size_t i = 0; i < current.count; i++) {
+                if (response.payload[2 + i] == BUNDLE_TOO_LARGE) {
+                    requests.push_back({current.first + i, 1, false});
+                } else if (response.payload[2 + i] == BUNDLE_MISSING) {
+                    done++; // deleted since it was listed
+                }
+            }
+            if (!receive_bundle(stream->seqn, response.total_size, writers, done)) {
+                return;
+            }
+            bytes += response.total_size;
+        } else {
+            const std::string& filename = names[current.first];
+            done++;
+
+            // Payload: "OK" followed by the version being sent; no data otherwise
+            if (response.payload.compare(0, 2, "OK") != 0 || response.payload.size() < 2 + sizeof(uint64_t)) {
+                DEBUG_PRINTF("ERROR: Server returned error for download of %s: %s\n",
+                             filename.c_str(), response.payload.c_str());
+                continue;
+            }
+            uint64_t version = get_u64((const uint8_t*)response.payload.data() + 2);
+
+            // Before the rename lands, or the watcher would upload it right back
+            ignore_next_change(filename);
+            ReceivedFile file;
+            if (!receive_download(stream->seqn, filename, sync_dir_path + "/" + filename, response, file)) {
+                DEBUG_PRINTF("ERROR: Download of %s cut short\n", filename.c_str());
+                unignore_change(filename);
+                return;
+            }
+            if (file.fd < 0) {
+                unignore_change(filename);
+                printf("Erro ao gravar o arquivo %s.\n", filename.c_str());
+                continue;
+            }
+            bytes += response.total_size;
+            writers.add(filename, version, file);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastReport >= std::chrono::seconds(1)) {
+            lastReport = now;
+            printf("Baixando: %zu de %zu arquivos (%.1f MB)...\n", done, files.size(), bytes / 1048576.0);
+        }
+    }
+
+    size_t installed = writers.finish();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%zu de %zu arquivos baixados (%.1f MB em %.1f s).\n", installed, files.size(),
+           bytes / 1048576.0, seconds);
+}
+
+// Streams a delta upload: literal runs as DATA_PACKETs, ranges of the
+// server's copy as DELTA_COPY frames, all on the upload's stream
+class UploadDeltaSink : public DeltaSink {
+public:
+    UploadDeltaSink(uint32_t seqn, uint64_t totalSize) : seqn(seqn), totalSize(totalSize) {}
+
+    uint64_t literalBytes = 0;
+
+    bool literal(const uint8_t* data, size_t length) override {
+        std::lock_guard<std::mutex> lock(socket_mutex);
+        literalBytes += length;
+        return send_packet_data(server_socket, DATA_PACKET, seqn, totalSize, data, length);
+    }
+
+    bool copy(uint64_t offset, uint64_t length) override {
+        while (length > 0) {
+            uint32_t n = (uint32_t)std::min<uint64_t>(length, DELTA_MAX_COPY);
+            std::string payload;
+            append_u64(payload, offset);
+            append_u32(payload, n);
+
+            std::lock_guard<std::mutex> lock(socket_mutex);
+            if (!send_packet_data(server_socket, DELTA_COPY, seqn, totalSize,
+                                  payload.data(), payload.size())) {
+                return false;
+            }
+            offset += n;
+            length -= n;
+        }
+        return true;
+    }
+
+private:
+    uint32_t seqn;
+    uint64_t totalSize;
+};
+
+// Sends only the parts of filepath the server's copy lacks; response is the
+// upload reply. Returns false when the server has no usable copy or rejected
+// the delta, in which case the caller falls back to a full upload.
+static bool upload_delta(const std::string& filepath, const std::string& filename, uint64_t fileSize,
+                         packet& response) {
+    Stream signature;
+    packet cmd;
+    cmd.type = CMD_SIGNATURE;
+    cmd.seqn = signature.seqn;
+    cmd.payload = filename;
+    if (!send_frame(cmd)) {
+        return false;
+    }
+
+    if (!signature.reply(response)) {
+        DEBUG_PRINTF("ERROR: Failed to receive signature: %s\n", strerror(errno));
+        return false;
+    }
+    FileSignature sig;
+    if (response.payload.compare(0, 2, "OK") != 0 ||
+        !decode_signature(response.payload.data() + 2, response.payload.size() - 2, sig)) {
+        DEBUG_PRINTF("DEBUG: No signature for %s (%s), sending it whole\n",
+                     filename.c_str(), response.payload.substr(0, 16).c_str());
+        return false;
+    }
+
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    void* data = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        DEBUG_PRINTF("ERROR: Failed to map %s: %s\n", filepath.c_str(), strerror(errno));
+        return false;
+    }
+    madvise(data, fileSize, MADV_SEQUENTIAL);
+
+    // Payload: the version the signature describes, then the filename
+    Stream upload;
+    cmd.type = CMD_UPLOAD_DELTA;
+    cmd.seqn = upload.seqn;
+    cmd.total_size = fileSize;
+    cmd.payload.clear();
+    append_u64(cmd.payload, sig.baseVersion);
+    cmd.payload += filename;
+
+    UploadDeltaSink sink(upload.seqn, fileSize);
+    bool sent = send_frame(cmd) && compute_delta((const uint8_t*)data, fileSize, sig, FILE_CHUNK_SIZE, sink);
+    munmap(data, fileSize);
+    if (!sent) {
+        DEBUG_PRINTF("ERROR: Failed to send delta: %s\n", strerror(errno));
+        return false;
+    }
+
+    if (!upload.reply(response)) {
+        DEBUG_PRINTF("ERROR: Failed to receive delta upload response: %s\n", strerror(errno));
+        return false;
+    }
+    DEBUG_PRINTF("DEBUG: Delta upload of %s: %llu of %llu bytes sent as literals, response %s\n",
+                 filename.c_str(), (unsigned long long)sink.literalBytes,
+                 (unsigned long long)fileSize, response.payload.c_str());
+    return response.payload == "OK";
+}
+
+// Uploads a file the server has no copy of under this name, referencing the
+// chunks it already stores (other files, other users) instead of sending
+// them. Returns false when nothing can be saved this way or the server
+// rejected it; the caller then does a full upload.
+static bool upload_dedup(const std::string& filepath, const std::string& filename, uint64_t fileSize,
+                         packet& response) {
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    void* mapped = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        DEBUG_PRINTF("ERROR: Failed to map %s: %s\n", filepath.c_str(), strerror(errno));
+        return false;
+    }
+    madvise(mapped, fileSize, MADV_SEQUENTIAL);
+    const uint8_t* data = (const uint8_t*)mapped;
+
+    // Same cut points as the server's store
+    struct Chunk {
+        uint64_t offset;
+        uint32_t length;
+    };
+    std::vector<Chunk> chunks;
+    std::string hashes;
+    CdcChunker chunker;
+    uint64_t start = 0;
+    for (uint64_t offset = 0; offset < fileSize;) {
+        bool cut;
+        offset += chunker.scan(data + offset, fileSize - offset, cut);
+        if (cut || offset == fileSize) {
+            uint8_t digest[SHA256_DIGEST_SIZE];
+            sha256(data + start, offset - start, digest);
+            hashes.append((const char*)digest, SHA256_DIGEST_SIZE);
+            chunks.push_back({start, (uint32_t)(offset - start)});
+            start = offset;
+        }
+    }
+
+    Stream query;
+    packet cmd;
+    cmd.type = CMD_QUERY_CHUNKS;
+    cmd.seqn = query.seqn;
+    cmd.payload = hashes;
+    bool ok = hashes.size() <= PACKET_MAX_PAYLOAD && send_frame(cmd) &&
+         query.reply(response) && response.payload.compare(0, 2, "OK") == 0 &&
+         response.payload.size() == 2 + chunks.size();
+
+    uint64_t known = 0;
+    for (size_t i = 0; ok && i < chunks.size(); i++) {
+        if (response.payload[2 + i]) {
+            known += chunks[i].length;
+        }
+    }
+    if (!ok || known == 0) {
+        munmap(mapped, fileSize);
+        return false;
+    }
+
+    // A normal upload in which stored chunks go as CHUNK_REFs
+    Stream upload;
+    cmd.type = CMD_UPLOAD;
+    cmd.seqn = upload.seqn;
+    cmd.total_size = fileSize;
+    cmd.payload = filename;
+    const std::string stored = response.payload.substr(2);
+    ok = send_frame(cmd);
+    for (size_t i = 0; ok && i < chunks.size(); i++) {
+        std::lock_guard<std::mutex> lock(socket_mutex);
+        if (stored[i]) {
+            std::string ref = hashes.substr(i * SHA256_DIGEST_SIZE, SHA256_DIGEST_SIZE);
+            append_u32(ref, chunks[i].length);
+            ok = send_packet_data(server_socket, CHUNK_REF, upload.seqn, fileSize, ref.data(), ref.size());
+        } else {
+            ok = send_packet_data(server_socket, DATA_PACKET, upload.seqn, fileSize,
+                                  data + chunks[i].offset, chunks[i].length);
+        }
+    }
+    munmap(mapped, fileSize);
+    if (!ok || !upload.reply(response)) {
+        DEBUG_PRINTF("ERROR: Deduplicated upload of %s failed: %s\n", filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    DEBUG_PRINTF("DEBUG: Deduplicated upload of %s: %llu of %llu bytes already on the server, response %s\n",
+                 filename.c_str(), (unsigned long long)known, (unsigned long long)fileSize,
+                 response.payload.c_str());
+    return response.payload == "OK";
+}
+
+// Sends filepath in ranges over the data connections (see striping.h);
+// response is the commit reply. Returns false if the transfer failed, in
+// which case the caller sends the file over the main connection.
+static bool upload_striped(const std::string& filepath, const std::string& filename, uint64_t fileSize,
+                           packet& response) {
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    // Reply: "OK" + the upload id the ranges name
+    Stream begin;
+    packet cmd;
+    cmd.type = CMD_STRIPED_BEGIN;
+    cmd.seqn = begin.seqn;
+    cmd.total_size = fileSize;
+    cmd.payload = filename;
+    packet reply;
+    if (!send_frame(cmd) || !begin.reply(reply) ||
+        reply.payload.size() != 2 + sizeof(uint64_t) || reply.payload.compare(0, 2, "OK") != 0) {
+        close(fd);
+        return false;
+    }
+    uint64_t id = get_u64((const uint8_t*)reply.payload.data() + 2);
+
+    auto start = std::chrono::steady_clock::now();
+    bool sent = stripes_upload(id, fd, fileSize);
+    close(fd);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    DEBUG_PRINTF("DEBUG: Striped upload of %s: %.1f MB in %.2f s%s\n", filename.c_str(),
+                 fileSize / 1048576.0, seconds, sent ? "" : " (failed)");
+
+    // Committed even after a failure: the server then drops what it got
+    Stream commit;
+    cmd.type = CMD_STRIPED_COMMIT;
+    cmd.seqn = commit.seqn;
+    cmd.total_size = 0;
+    cmd.payload.clear();
+    append_u64(cmd.payload, id);
+    if (!send_frame(cmd) || !commit.reply(response)) {
+        return false;
+    }
+    return sent && response.payload == "OK";
+}
+
 bool upload_file(const std::string& filepath) {
+    std::lock_guard<std::mutex> pause_monitor(download_mutex);
+
     // Check socket status first
     if (!check_socket_status()) {
         DEBUG_PRINTF("ERROR: Socket is in invalid state. Cannot send upload command.\n");
@@ -651,239 +1724,328 @@ bool upload_file(const std::string& filepath) {
 
     DEBUG_PRINTF("DEBUG: File size: %zu bytes\n", fileSize);
 
-    // Read file content
-    char* fileData = new char[fileSize];
-    file.read(fileData, fileSize);
-    file.close();
+    // What is about to be sent, for the index. A write racing the upload
+    // changes the mtime, so the file is just seen as modified again.
+    struct stat sent;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    bool hashed = stat(filepath.c_str(), &sent) == 0 && hash_file(filepath, digest);
 
-    DEBUG_PRINTF("DEBUG: File read into memory\n");
-
-    // Send upload command
-    packet cmd;
-    memset(&cmd, 0, sizeof(packet)); // Clear packet
-    cmd.type = CMD_UPLOAD;
-    cmd.seqn = get_next_seq();
-    cmd.total_size = fileSize;
-    strcpy(cmd.payload, filename.c_str());
-    cmd.length = filename.length();
-
-    DEBUG_PRINTF("DEBUG: Sending upload command packet for file: %s, size: %zu\n",
-           filename.c_str(), fileSize);
-
-    // Send the command
-    {
-        std::lock_guard<std::mutex> lock(socket_mutex);
-        ssize_t bytes_sent = send(server_socket, &cmd, sizeof(packet), 0);
-        if (bytes_sent <= 0) {
+    // Most edits touch a small part of a file; try sending just those. A
+    // file new to the server may still share content with stored ones.
+    packet response;
+    bool sentDelta = fileSize >= DELTA_MIN_FILE_SIZE &&
+                     (upload_delta(filepath, filename, fileSize, response) ||
+                      upload_dedup(filepath, filename, fileSize, response));
+    // Otherwise a large file goes over the data connections, if open
+    if (!sentDelta && fileSize >= STRIPE_MIN_SIZE && stripes_active()) {
+        sentDelta = upload_striped(filepath, filename, fileSize, response);
+    }
+    if (!sentDelta) {
+        // Send upload command; the data frames go on its stream
+        Stream upload;
+        packet cmd;
+        cmd.type = CMD_UPLOAD;
+        cmd.seqn = upload.seqn;
+        cmd.total_size = fileSize;
+        cmd.payload = filename;
+
+        DEBUG_PRINTF("DEBUG: Sending upload command packet for file: %s, size: %zu\n",
+               filename.c_str(), fileSize);
+
+        // Send the command
+        if (!send_frame(cmd)) {
             DEBUG_PRINTF("ERROR: Failed to send upload command: %s\n", strerror(errno));
-            delete[] fileData;
             return false;
         }
-        DEBUG_PRINTF("DEBUG: Sent %zd bytes (upload command)\n", bytes_sent);
-    }
-
-    DEBUG_PRINTF("DEBUG: Upload command sent, sending file data...\n");
-
-    // Send file data in chunks
-    size_t bytesSent = 0;
-    while (bytesSent < fileSize) {
-        packet dataPkt;
-        memset(&dataPkt, 0, sizeof(packet)); // Clear packet
-        dataPkt.type = DATA_PACKET;
-        dataPkt.seqn = bytesSent / sizeof(dataPkt.payload) + 1;
-
-        size_t bytesToSend = std::min(sizeof(dataPkt.payload), fileSize - bytesSent);
-        memcpy(dataPkt.payload, fileData + bytesSent, bytesToSend);
-        dataPkt.length = bytesToSend;
 
-        DEBUG_PRINTF("DEBUG: Sending data packet %d, bytes: %zu\n", dataPkt.seqn, bytesToSend);
+        DEBUG_PRINTF("DEBUG: Upload command sent, sending file data...\n");
 
-        {
-            std::lock_guard<std::mutex> lock(socket_mutex);
-            ssize_t bytes_sent = send(server_socket, &dataPkt, sizeof(packet), 0);
-            if (bytes_sent <= 0) {
-                DEBUG_PRINTF("ERROR: Failed to send file data: %s\n", strerror(errno));
-                delete[] fileData;
+        // Send file data in chunks, reading each one from disk as we go
+        std::vector<char> chunk(std::min((size_t)FILE_CHUNK_SIZE, fileSize));
+        size_t bytesSent = 0;
+        while (bytesSent < fileSize) {
+            size_t bytesToSend = std::min(chunk.size(), fileSize - bytesSent);
+            if (!file.read(chunk.data(), bytesToSend)) {
+                DEBUG_PRINTF("ERROR: Failed to read file data from %s\n", filepath.c_str());
                 return false;
             }
-            DEBUG_PRINTF("DEBUG: Sent %zd bytes (data packet)\n", bytes_sent);
-        }
 
-        bytesSent += bytesToSend;
-        DEBUG_PRINTF("DEBUG: Progress: %zu/%zu bytes sent (%d%%)\n",
-               bytesSent, fileSize, (int)(bytesSent * 100 / fileSize));
-    }
+            DEBUG_PRINTF("DEBUG: Sending data packet, bytes: %zu\n", bytesToSend);
 
-    delete[] fileData;
+            {
+                std::lock_guard<std::mutex> lock(socket_mutex);
+                if (!send_packet_data(server_socket, DATA_PACKET, upload.seqn, fileSize,
+                                      chunk.data(), bytesToSend)) {
+                    DEBUG_PRINTF("ERROR: Failed to send file data: %s\n", strerror(errno));
+                    return false;
+                }
+            }
 
-    DEBUG_PRINTF("DEBUG: All file data sent, waiting for server response...\n");
+            bytesSent += bytesToSend;
+            DEBUG_PRINTF("DEBUG: Progress: %zu/%zu bytes sent (%d%%)\n",
+                   bytesSent, fileSize, (int)(bytesSent * 100 / fileSize));
+        }
+        file.close();
 
-    // Receive server response directly
-    packet response;
-    memset(&response, 0, sizeof(packet)); // Clear response packet
+        DEBUG_PRINTF("DEBUG: All file data sent, waiting for server response...\n");
 
-    {
-        std::lock_guard<std::mutex> lock(socket_mutex);
+        // Receive server response
         DEBUG_PRINTF("DEBUG: Waiting for upload response...\n");
-        ssize_t recv_bytes = recv(server_socket, &response, sizeof(packet), MSG_WAITALL);
-        if (recv_bytes <= 0) {
+        if (!upload.reply(response)) {
             DEBUG_PRINTF("ERROR: Failed to receive upload response: %s\n", strerror(errno));
             return false;
         }
-        DEBUG_PRINTF("DEBUG: Received %zd bytes upload response\n", recv_bytes);
     }
 
-    DEBUG_PRINTF("DEBUG: Received upload response: %s\n", response.payload);
+    DEBUG_PRINTF("DEBUG: Received upload response: %s\n", response.payload.c_str());
 
-    if (strcmp(response.payload, "OK") == 0) {
+    if (response.payload == "OK") {
         printf("Arquivo '%s' enviado com sucesso.\n", filename.c_str());
 
         // Check if file was copied to sync directory
         std::string syncPath = sync_dir_path + "/" + filename;
         DEBUG_PRINTF("DEBUG: Checking if file was copied to sync directory: %s\n", syncPath.c_str());
 
+        struct stat st;
         if (fs::exists(syncPath)) {
             DEBUG_PRINTF("DEBUG: File exists in sync directory\n");
+
+            // The server now has this version (total_size carries it)
+            if (hashed && stat(syncPath.c_str(), &st) == 0 &&
+                st.st_dev == sent.st_dev && st.st_ino == sent.st_ino) {
+                record_synced(filename, sent, digest, response.total_size);
+            }
         } else {
             DEBUG_PRINTF("DEBUG: File does NOT exist in sync directory\n");
 
             // Try to copy the file to sync directory if it's not there
+            // (the server already has it; don't upload it again)
+            ignore_next_change(filename);
             try {
                 fs::copy_file(filepath, syncPath, fs::copy_options::overwrite_existing);
                 DEBUG_PRINTF("DEBUG: Manually copied file to sync directory\n");
+                if (hashed && stat(syncPath.c_str(), &st) == 0) {
+                    record_synced(filename, st, digest, response.total_size);
+                }
             } catch (const std::exception& e) {
+                unignore_change(filename);
                 DEBUG_PRINTF("DEBUG: Error copying file to sync directory: %s\n", e.what());
             }
         }
 
         return true;
-    } else if (response.type == SYNC_NOTIFICATION || strncmp(response.payload, "U:", 2) == 0) {
+    } else if (response.type == SYNC_NOTIFICATION || response.payload.compare(0, 2, "U:") == 0) {
         // This is a notification, not an error
         printf("Arquivo '%s' enviado com sucesso. (Notificação recebida)\n", filename.c_str());
 
         // Make sure the file is in the sync directory
         std::string syncPath = sync_dir_path + "/" + filename;
         if (!fs::exists(syncPath)) {
+            ignore_next_change(filename);
             try {
                 fs::copy_file(filepath, syncPath, fs::copy_options::overwrite_existing);
                 DEBUG_PRINTF("DEBUG: Copied file to sync directory after notification\n");
             } catch (const std::exception& e) {
+                unignore_change(filename);
                 DEBUG_PRINTF("DEBUG: Error copying file to sync directory: %s\n", e.what());
             }
         }
 
         return true;
     } else {
-        printf("Erro ao enviar arquivo: %s\n", response.payload);
+        printf("Erro ao enviar arquivo: %s\n", response.payload.c_str());
         return false;
     }
 }
 
-bool download_file(const std::string& filename) {
-    std::lock_guard<std::mutex> pause_monitor(download_mutex);
+// A file of the sync directory sent in an upload bundle
+struct BundledFile {
+    std::string filename;
+    struct stat st;                     // when it was read
+    uint8_t digest[SHA256_DIGEST_SIZE];
+};
 
-    // Check socket status first
-    if (!check_socket_status()) {
-        DEBUG_PRINTF("ERROR: Socket is in invalid state. Cannot send download command.\n");
+// Sends one upload bundle on stream: frames holds its entries
+static bool send_bundle(const Stream& stream, const std::vector<std::string>& frames) {
+    packet cmd;
+    cmd.type = CMD_UPLOAD_BUNDLE;
+    cmd.seqn = stream.seqn;
+    for (const auto& frame : frames) {
+        cmd.total_size += frame.size();
+    }
+    if (!send_frame(cmd)) {
         return false;
     }
-
-    // Prepare destination path
-    std::string destPath = fs::current_path().string() + "/" + filename;  // Download to project root directory
-
-    // Send download command
-    packet cmd;
-    memset(&cmd, 0, sizeof(packet)); // Clear the packet
-    cmd.type = CMD_DOWNLOAD;
-    cmd.seqn = get_next_seq();
-    cmd.total_size = 0;
-    strcpy(cmd.payload, filename.c_str());
-    cmd.length = filename.length();
-
-    DEBUG_PRINTF("DEBUG: Sending download command for file: %s with seq: %d\n", filename.c_str(), cmd.seqn);
-
-    {
+    for (const auto& frame : frames) {
         std::lock_guard<std::mutex> lock(socket_mutex);
-        ssize_t bytes_sent = send(server_socket, &cmd, sizeof(packet), 0);
-        if (bytes_sent <= 0) {
-            DEBUG_PRINTF("ERROR: Failed to send download command: %s\n", strerror(errno));
+        if (!send_packet_data(server_socket, DATA_PACKET, stream.seqn, cmd.total_size,
+                              frame.data(), frame.size())) {
             return false;
         }
-        DEBUG_PRINTF("DEBUG: Sent %zd bytes (download command)\n", bytes_sent);
     }
+    return true;
+}
 
-    // Receive server response directly
+// Reads the reply to an upload bundle ("OK" + status u8 and version u64 per
+// file) and records the files the server stored. The others are added to
+// retry. Returns how many were stored.
+static size_t finish_bundle(Stream& stream, const std::vector<BundledFile>& files,
+                            std::vector<std::string>& retry) {
     packet response;
-    memset(&response, 0, sizeof(packet)); // Clear response packet
+    bool ok = stream.reply(response) && response.payload.compare(0, 2, "OK") == 0 &&
+              response.payload.size() == 2 + files.size() * 9;
+    size_t stored = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        const uint8_t* result = (const uint8_t*)response.payload.data() + 2 + i * 9;
+        if (!ok || result[0] != BUNDLE_STORED) {
+            retry.push_back(files[i].filename);
+            continue;
+        }
+        // Recorded as what was read; a write since shows up as a change
+        struct stat st;
+        std::string path = sync_dir_path + "/" + files[i].filename;
+        if (stat(path.c_str(), &st) == 0 && st.st_dev == files[i].st.st_dev && st.st_ino == files[i].st.st_ino) {
+            record_synced(files[i].filename, files[i].st, files[i].digest, get_u64(result + 1));
+        }
+        stored++;
+    }
+    return stored;
+}
 
+// Uploads the given files of the sync directory. Small ones (those too
+// small for delta uploads to pay off) travel in bundles, several in flight,
+// so many small files cost a few round trips instead of one each. Larger
+// files, and any the server did not take from a bundle, go through
+// upload_file one at a time.
+static void upload_files(const std::vector<std::string>& filenames) {
+    std::vector<std::string> single;
+    size_t stored = 0;
     {
-        std::lock_guard<std::mutex> lock(socket_mutex);
-        DEBUG_PRINTF("DEBUG: Waiting for download response...\n");
-        ssize_t recv_bytes = recv(server_socket, &response, sizeof(packet), MSG_WAITALL);
-        if (recv_bytes <= 0) {
-            DEBUG_PRINTF("ERROR: Failed to receive download response: %s\n", strerror(errno));
-            return false;
+        std::lock_guard<std::mutex> pause_monitor(download_mutex);
+        struct Bundle {
+            std::unique_ptr<Stream> stream;
+            std::vector<BundledFile> files;
+        };
+        std::deque<Bundle> inFlight;
+        std::vector<BundledFile> files;
+        std::vector<std::string> frames;
+        size_t bytes = 0;
+        bool broken = false;
+
+        auto flush = [&]() {
+            if (files.empty()) {
+                return;
+            }
+            Bundle bundle;
+            bundle.stream.reset(new Stream());
+            if (broken || !send_bundle(*bundle.stream, frames)) {
+                broken = true; // the stream is out of step; leave it to upload_file
+                for (const auto& file : files) {
+                    single.push_back(file.filename);
+                }
+            } else {
+                bundle.files.swap(files);
+                inFlight.push_back(std::move(bundle));
+            }
+            files.clear();
+            frames.clear();
+            bytes = 0;
+            if (inFlight.size() >= BUNDLE_UPLOAD_PIPELINE) {
+                stored += finish_bundle(*inFlight.front().stream, inFlight.front().files, single);
+                inFlight.pop_front();
+            }
+        };
+
+        std::string data;
+        for (const auto& filename : filenames) {
+            std::string path = sync_dir_path + "/" + filename;
+            BundledFile file;
+            file.filename = filename;
+            if (stat(path.c_str(), &file.st) != 0 || !S_ISREG(file.st.st_mode) ||
+                file.st.st_size >= DELTA_MIN_FILE_SIZE) {
+                single.push_back(filename);
+                continue;
+            }
+            std::ifstream in(path, std::ios::binary);
+            data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            if (!in.good() && !in.eof()) {
+                single.push_back(filename);
+                continue;
+            }
+
+            sha256(data.data(), data.size(), file.digest);
+            if (frames.empty() || frames.back().size() >= BUNDLE_FRAME_SIZE) {
+                frames.emplace_back();
+            }
+            append_bundle_entry(frames.back(), filename, 0, data.data(), data.size(), file.digest);
+            files.push_back(file);
+            bytes += data.size();
+            if (files.size() >= BUNDLE_MAX_FILES || bytes >= BUNDLE_UPLOAD_SIZE) {
+                flush();
+            }
+        }
+        flush();
+        while (!inFlight.empty()) {
+            stored += finish_bundle(*inFlight.front().stream, inFlight.front().files, single);
+            inFlight.pop_front();
         }
-        DEBUG_PRINTF("DEBUG: Received %zd bytes download response\n", recv_bytes);
     }
 
-    DEBUG_PRINTF("DEBUG: Received download response: %s with seq: %d\n", response.payload, response.seqn);
+    if (stored > 0) {
+        printf("%zu arquivos enviados em pacotes.\n", stored);
+    }
+    for (const auto& filename : single) {
+        upload_file(sync_dir_path + "/" + filename);
+    }
+}
 
-    if (strcmp(response.payload, "OK") != 0) {
-        printf("Erro ao baixar arquivo: %s\n", response.payload);
+bool download_file(const std::string& filename) {
+    // Check socket status first
+    if (!check_socket_status()) {
+        DEBUG_PRINTF("ERROR: Socket is in invalid state. Cannot send download command.\n");
         return false;
     }
 
-    // Allocate buffer for file
-    size_t fileSize = response.total_size;
-    char* fileData = new char[fileSize];
-    size_t bytesRead = 0;
+    // Prepare destination path
+    std::string destPath = fs::current_path().string() + "/" + filename;  // Download to project root directory
 
-    DEBUG_PRINTF("DEBUG: Expecting file of size: %zu bytes\n", fileSize);
+    // Send download command
+    Stream stream;
+    packet cmd = download_request(stream.seqn, filename);
 
-    // Receive file data packets directly
-    while (bytesRead < fileSize) {
-        packet dataPkt;
-        memset(&dataPkt, 0, sizeof(packet));
+    DEBUG_PRINTF("DEBUG: Sending download command for file: %s with seq: %u\n", filename.c_str(), cmd.seqn);
 
-        {
-            std::lock_guard<std::mutex> lock(socket_mutex);
-            ssize_t recv_bytes = read_all(server_socket, &dataPkt, sizeof(packet));
-            if (recv_bytes <= 0) {
-                DEBUG_PRINTF("ERROR: Failed to receive file data: %s\n", strerror(errno));
-                delete[] fileData;
-                return false;
-            }
-            DEBUG_PRINTF("DEBUG: Received data packet with %zd bytes\n", recv_bytes);
-        }
+    if (!send_frame(cmd)) {
+        DEBUG_PRINTF("ERROR: Failed to send download command: %s\n", strerror(errno));
+        return false;
+    }
 
-        if (dataPkt.type != DATA_PACKET) {
-            DEBUG_PRINTF("ERROR: Unexpected packet type %d (expected DATA_PACKET)\n", dataPkt.type);
-            delete[] fileData;
-            return false;
-        }
+    // Receive server response
+    packet response;
+    DEBUG_PRINTF("DEBUG: Waiting for download response...\n");
+    if (!stream.reply(response)) {
+        DEBUG_PRINTF("ERROR: Failed to receive download response: %s\n", strerror(errno));
+        return false;
+    }
 
-        memcpy(fileData + bytesRead, dataPkt.payload, dataPkt.length);
-        bytesRead += dataPkt.length;
+    DEBUG_PRINTF("DEBUG: Received download response: %s with seq: %u\n", response.payload.c_str(), response.seqn);
 
-        DEBUG_PRINTF("DEBUG: Download progress: %zu/%zu bytes (%d%%)\n",
-               bytesRead, fileSize, (int)(bytesRead * 100 / fileSize));
+    // Payload: "OK" followed by the version being sent
+    if (response.payload.compare(0, 2, "OK") != 0) {
+        printf("Erro ao baixar arquivo: %s\n", response.payload.c_str());
+        return false;
     }
 
-    DEBUG_PRINTF("DEBUG: All file data received, saving to: %s\n", destPath.c_str());
+    uint64_t fileSize = response.total_size;
+    DEBUG_PRINTF("DEBUG: Expecting file of size: %llu bytes, saving to: %s\n",
+           (unsigned long long)fileSize, destPath.c_str());
 
-    // Save file
-    std::ofstream file(destPath, std::ios::binary);
-    if (!file) {
-        printf("Erro ao criar arquivo local '%s'.\n", destPath.c_str());
-        delete[] fileData;
+    // Receive file data packets directly into the destination
+    if (!receive_file(stream.seqn, filename, destPath, response)) {
+        printf("Erro ao salvar arquivo local '%s'.\n", destPath.c_str());
         return false;
     }
 
-    file.write(fileData, fileSize);
-    file.close();
-    delete[] fileData;
-
     printf("Arquivo '%s' baixado com sucesso.\n", filename.c_str());
     return true;
 }
@@ -898,127 +2060,63 @@ bool delete_file(const std::string& filename) {
         }
     }
 
-    // Track our operation with unique sequence number
-    uint16_t delete_seq = get_next_seq();
-
     // Build delete command packet
+    Stream stream;
     packet cmd;
-    memset(&cmd, 0, sizeof(packet));
     cmd.type = CMD_DELETE;
-    cmd.seqn = delete_seq;
-    cmd.total_size = 0;
-    strcpy(cmd.payload, filename.c_str());
-    cmd.length = strlen(filename.c_str());
-
-    DEBUG_PRINTF("DEBUG: [DELETE] Sending command for file: %s with seq: %d\n", filename.c_str(), delete_seq);
-
-    // First check if we need to clear socket buffer
-    int bytes_available = 0;
-    if (ioctl(server_socket, FIONREAD, &bytes_available) == 0) {
-        if (bytes_available > 0) {
-            DEBUG_PRINTF("WARNING: [DELETE] Socket has %d bytes of pending data, protocol desync detected\n",
-                   bytes_available);
-            DEBUG_PRINTF("WARNING: [DELETE] Resetting connection to ensure clean state\n");
-            if (!reset_socket_connection()) {
-                DEBUG_PRINTF("ERROR: [DELETE] Failed to reset connection. Cannot delete file.\n");
-                return false;
-            }
-        }
-    }
+    cmd.seqn = stream.seqn;
+    cmd.payload = filename;
 
-    // Send command with exclusive lock
-    {
-        std::lock_guard<std::mutex> lock(socket_mutex);
-        ssize_t bytes_sent = send(server_socket, &cmd, sizeof(packet), 0);
-        if (bytes_sent <= 0) {
-            DEBUG_PRINTF("ERROR: [DELETE] Failed to send command: %s\n", strerror(errno));
-            return false;
-        }
-        DEBUG_PRINTF("DEBUG: [DELETE] Sent %zd bytes (delete command)\n", bytes_sent);
+    DEBUG_PRINTF("DEBUG: [DELETE] Sending command for file: %s with seq: %u\n", filename.c_str(), cmd.seqn);
+
+    if (!send_frame(cmd)) {
+        DEBUG_PRINTF("ERROR: [DELETE] Failed to send command: %s\n", strerror(errno));
+        return false;
     }
 
-    // Receive response with shorter timeout
+    // The reply comes on our stream, whatever else is in flight
     packet response;
-    memset(&response, 0, sizeof(packet));
-
-    {
-        std::lock_guard<std::mutex> lock(socket_mutex);
-        DEBUG_PRINTF("DEBUG: [DELETE] Waiting for response...\n");
-
-        // Set a shorter timeout for this operation
-        struct timeval short_timeout;
-        short_timeout.tv_sec = 5;
-        short_timeout.tv_usec = 0;
-        setsockopt(server_socket, SOL_SOCKET, SO_RCVTIMEO, &short_timeout, sizeof(short_timeout));
-
-        // Receive with timeout
-        ssize_t recv_bytes = recv(server_socket, &response, sizeof(packet), MSG_WAITALL);
-
-        // Reset timeout to default
-        struct timeval default_timeout;
-        default_timeout.tv_sec = 10;
-        default_timeout.tv_usec = 0;
-        setsockopt(server_socket, SOL_SOCKET, SO_RCVTIMEO, &default_timeout, sizeof(default_timeout));
-
-        if (recv_bytes <= 0) {
-            DEBUG_PRINTF("ERROR: [DELETE] Failed to receive response: %s\n", strerror(errno));
-            // Try to reset connection on timeout
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                DEBUG_PRINTF("WARNING: [DELETE] Response timeout, attempting to reset connection\n");
-                reset_socket_connection();
-            }
-            return false;
-        }
-        DEBUG_PRINTF("DEBUG: [DELETE] Received %zd bytes response\n", recv_bytes);
+    DEBUG_PRINTF("DEBUG: [DELETE] Waiting for response...\n");
+    if (!stream.reply(response)) {
+        DEBUG_PRINTF("ERROR: [DELETE] Failed to receive response: %s\n", strerror(errno));
+        return false;
     }
 
     // Validate response packet
-    DEBUG_PRINTF("DEBUG: [DELETE] Response: type=%d, seq=%d, length=%d, payload='%s'\n",
-           response.type, response.seqn, response.length, response.payload);
+    DEBUG_PRINTF("DEBUG: [DELETE] Response: type=%d, seq=%u, length=%zu, payload='%s'\n",
+           response.type, response.seqn, response.payload.size(), response.payload.c_str());
 
-    // Strict validation of response
     if (response.type != CMD_DELETE) {
         DEBUG_PRINTF("ERROR: [DELETE] Invalid response type: %d (expected %d)\n",
                response.type, CMD_DELETE);
-        DEBUG_PRINTF("WARNING: [DELETE] Protocol desync detected, resetting connection\n");
-        reset_socket_connection();
-        return false;
-    }
-
-    if (response.seqn != delete_seq) {
-        DEBUG_PRINTF("ERROR: [DELETE] Sequence number mismatch: %d (expected %d)\n",
-               response.seqn, delete_seq);
-        DEBUG_PRINTF("WARNING: [DELETE] Protocol desync detected, resetting connection\n");
-        reset_socket_connection();
         return false;
     }
 
     // Process response based on payload
-    if (strcmp(response.payload, "OK") == 0) {
+    if (response.payload == "OK") {
         printf("Arquivo '%s' deletado com sucesso.\n", filename.c_str());
+        file_index.remove(filename);
 
         // Also remove from local sync directory if it exists
         std::string localPath = sync_dir_path + "/" + filename;
         if (fs::exists(localPath)) {
+            ignore_next_change(filename);
             try {
                 fs::remove(localPath);
                 DEBUG_PRINTF("DEBUG: [DELETE] Removed local file: %s\n", localPath.c_str());
-
-                // Update mtimes
-                file_mutex.lock();
-                file_mtimes.erase(filename);
-                file_mutex.unlock();
             } catch (const std::exception& e) {
+                unignore_change(filename);
                 DEBUG_PRINTF("DEBUG: [DELETE] Error removing local file: %s\n", e.what());
             }
         }
 
         return true;
-    } else if (strcmp(response.payload, "NOT_FOUND") == 0) {
+    } else if (response.payload == "NOT_FOUND") {
         printf("Arquivo '%s' não encontrado no servidor.\n", filename.c_str());
+        file_index.remove(filename);
         return false;
     } else {
-        printf("Erro ao deletar arquivo: %s\n", response.payload);
+        printf("Erro ao deletar arquivo: %s\n", response.payload.c_str());
         return false;
     }
 }
@@ -1047,7 +2145,12 @@ bool check_socket_status() {
     return true;
 }
 
-void list_server_files() {
+static void print_list_time(char* out, size_t size, uint64_t ns) {
+    time_t t = ns / 1000000000ull;
+    strftime(out, size, "%Y-%m-%d %H:%M:%S", localtime(&t));
+}
+
+void list_server_files(int sort) {
     // Check socket status
     if (!check_socket_status()) {
         DEBUG_PRINTF("ERROR: Socket is in invalid state before sending list_server command. Attempting reset...\n");
@@ -1057,190 +2160,75 @@ void list_server_files() {
         }
     }
 
-    // Check for pending data that would indicate protocol desync
-    int bytes_available = 0;
-    if (ioctl(server_socket, FIONREAD, &bytes_available) == 0 && bytes_available > 0) {
-        DEBUG_PRINTF("WARNING: [LIST] Socket has %d bytes of pending data, protocol desync detected\n",
-               bytes_available);
-        DEBUG_PRINTF("WARNING: [LIST] Resetting connection to ensure clean state\n");
-        if (!reset_socket_connection()) {
-            DEBUG_PRINTF("ERROR: [LIST] Failed to reset connection. Cannot list server files.\n");
-            return;
-        }
-    }
-
-    // Send list_server command
-    packet cmd;
-    memset(&cmd, 0, sizeof(packet));
-    cmd.type = CMD_LIST_SERVER;
-    cmd.seqn = get_next_seq();
-    cmd.total_size = 0;
-    cmd.length = 0;
-
-    DEBUG_PRINTF("DEBUG: [LIST] Sending list_server command with seq: %d\n", cmd.seqn);
-    uint16_t expected_seq = cmd.seqn; // Store for validation
+    // Newest and largest files first; names in alphabetical order
+    ListQuery query;
+    query.sort = sort;
+    query.descending = sort != LIST_BY_NAME;
 
-    // Send with exclusive lock
-    ssize_t bytes_sent;
-    {
-        std::lock_guard<std::mutex> lock(socket_mutex);
-        bytes_sent = write_all(server_socket, &cmd, sizeof(packet));
-        if (bytes_sent <= 0) {
+    // One page at a time, each asked for after the last entry of the one
+    // before and printed as it arrives
+    int file_count = 0;
+    while (true) {
+        Stream listing;
+        packet cmd;
+        cmd.type = CMD_LIST_SERVER;
+        cmd.seqn = listing.seqn;
+        encode_list_query(cmd.payload, query);
+
+        DEBUG_PRINTF("DEBUG: [LIST] Requesting page after %d files with seq: %u\n", file_count, cmd.seqn);
+        if (!send_frame(cmd)) {
             DEBUG_PRINTF("ERROR: [LIST] Failed to send command: %s\n", strerror(errno));
             return;
         }
-        DEBUG_PRINTF("DEBUG: [LIST] Sent %zd bytes (list_server command)\n", bytes_sent);
-    }
-
-    // Set a shorter timeout just for this operation
-    struct timeval short_timeout;
-    short_timeout.tv_sec = 5;
-    short_timeout.tv_usec = 0;
-
-    {
-        std::lock_guard<std::mutex> lock(socket_mutex);
-        setsockopt(server_socket, SOL_SOCKET, SO_RCVTIMEO, &short_timeout, sizeof(short_timeout));
-    }
 
-    // Receive server response
-    packet response;
-    memset(&response, 0, sizeof(packet));
-
-    {
-        std::lock_guard<std::mutex> lock(socket_mutex);
-        DEBUG_PRINTF("DEBUG: [LIST] Waiting for response...\n");
-        ssize_t recv_bytes = read_all(server_socket, &response, sizeof(packet));
-
-        // Reset timeout to default
-        struct timeval default_timeout;
-        default_timeout.tv_sec = 10;
-        default_timeout.tv_usec = 0;
-        setsockopt(server_socket, SOL_SOCKET, SO_RCVTIMEO, &default_timeout, sizeof(default_timeout));
-
-        if (recv_bytes <= 0) {
+        // Receive server response; it does not wait behind transfers in flight
+        packet response;
+        if (!listing.reply(response)) {
             DEBUG_PRINTF("ERROR: [LIST] Failed to receive response: %s\n", strerror(errno));
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                DEBUG_PRINTF("WARNING: [LIST] Response timeout, resetting connection\n");
-                reset_socket_connection();
-            }
             return;
         }
-        DEBUG_PRINTF("DEBUG: [LIST] Received %zd bytes response\n", recv_bytes);
-    }
-
-    // Validate response packet
-    DEBUG_PRINTF("DEBUG: [LIST] Response: type=%d, seq=%d, length=%d, total_size=%u\n",
-           response.type, response.seqn, response.length, response.total_size);
-
-    // Strict validation
-    if (response.type != CMD_LIST_SERVER) {
-        DEBUG_PRINTF("ERROR: [LIST] Invalid response type: %d (expected %d)\n",
-               response.type, CMD_LIST_SERVER);
-        DEBUG_PRINTF("WARNING: [LIST] Protocol desync detected, resetting connection\n");
-        reset_socket_connection();
-        return;
-    }
-
-    if (response.seqn != expected_seq) {
-        DEBUG_PRINTF("ERROR: [LIST] Sequence number mismatch: %d (expected %d)\n",
-               response.seqn, expected_seq);
-        DEBUG_PRINTF("WARNING: [LIST] Protocol desync detected, resetting connection\n");
-        reset_socket_connection();
-        return;
-    }
 
-    // Start with the response payload
-    std::string fileList(response.payload, response.length);
-    size_t expectedSize = response.total_size;
-
-    DEBUG_PRINTF("DEBUG: [LIST] Initial response has %zu bytes of data, expecting %zu total bytes\n",
-           fileList.length(), expectedSize);
-
-    // If we expect more data (data packets)
-    if (expectedSize > 0 && fileList.length() < expectedSize) {
-        // Receive additional data packets directly
-        while (fileList.length() < expectedSize) {
-            packet dataPkt;
-            memset(&dataPkt, 0, sizeof(packet));
-
-            {
-                std::lock_guard<std::mutex> lock(socket_mutex);
-                ssize_t recv_bytes = read_all(server_socket, &dataPkt, sizeof(packet));
-                if (recv_bytes <= 0) {
-                    DEBUG_PRINTF("ERROR: [LIST] Failed to receive additional data: %s\n", strerror(errno));
-                    break;
-                }
-                DEBUG_PRINTF("DEBUG: [LIST] Received additional data packet with %zd bytes\n", recv_bytes);
-            }
-
-            if (dataPkt.type != DATA_PACKET) {
-                DEBUG_PRINTF("ERROR: [LIST] Unexpected packet type %d (expected DATA_PACKET)\n", dataPkt.type);
-                DEBUG_PRINTF("WARNING: [LIST] Protocol desync detected, resetting connection\n");
-                reset_socket_connection();
-                return;
-            }
-
-            fileList.append(dataPkt.payload, dataPkt.length);
-            DEBUG_PRINTF("DEBUG: [LIST] Received additional data, now have %zu/%zu bytes\n",
-                   fileList.length(), expectedSize);
+        std::vector<ListEntry> entries;
+        if (response.type != CMD_LIST_SERVER || response.payload.size() < 3 ||
+            response.payload.compare(0, 2, "OK") != 0 ||
+            !parse_list_page(response.payload.data() + 3, response.payload.size() - 3, entries)) {
+            DEBUG_PRINTF("ERROR: [LIST] Invalid response: type=%d, length=%zu\n",
+                   response.type, response.payload.size());
+            return;
         }
-    }
-
-    // Print file list
-    if (fileList.empty()) {
-        printf("Nenhum arquivo no servidor.\n");
-        return;
-    }
-
-    printf("Arquivos no servidor:\n");
-    printf("%-30s %-10s %-20s %-20s %-20s\n", "Nome", "Tamanho", "Modificado", "Acessado", "Criado");
-
-    std::istringstream stream(fileList);
-    std::string line;
-    int file_count = 0;
-
-    while (std::getline(stream, line)) {
-        std::istringstream lineStream(line);
-        std::string filename, sizeStr, mtimeStr, atimeStr, ctimeStr;
-
-        std::getline(lineStream, filename, ',');
-        std::getline(lineStream, sizeStr, ',');
-        std::getline(lineStream, mtimeStr, ',');
-        std::getline(lineStream, atimeStr, ',');
-        std::getline(lineStream, ctimeStr, ',');
-
-        if (!filename.empty() && !sizeStr.empty()) {
-            // Validate time strings before conversion to avoid exceptions
-            if (mtimeStr.empty() || atimeStr.empty() || ctimeStr.empty()) {
-                DEBUG_PRINTF("WARNING: [LIST] Skipping malformed line: %s\n", line.c_str());
-                continue;
-            }
-
-            time_t mtime = 0, atime = 0, ctime = 0;
-            try {
-                mtime = std::stol(mtimeStr);
-                atime = std::stol(atimeStr);
-                ctime = std::stol(ctimeStr);
-            } catch (const std::exception& e) {
-                DEBUG_PRINTF("WARNING: [LIST] Invalid time values in line: %s (%s)\n", line.c_str(), e.what());
-                continue;
-            }
+        bool more = response.payload[2] != 0;
 
+        if (file_count == 0 && !entries.empty()) {
+            printf("Arquivos no servidor:\n");
+            printf("%-30s %-10s %-20s %-20s %-20s\n", "Nome", "Tamanho", "Modificado", "Acessado", "Criado");
+        }
+        for (const auto& entry : entries) {
             char mtimeStr[64], atimeStr[64], ctimeStr[64];
-            strftime(mtimeStr, sizeof(mtimeStr), "%Y-%m-%d %H:%M:%S", localtime(&mtime));
-            strftime(atimeStr, sizeof(atimeStr), "%Y-%m-%d %H:%M:%S", localtime(&atime));
-            strftime(ctimeStr, sizeof(ctimeStr), "%Y-%m-%d %H:%M:%S", localtime(&ctime));
+            print_list_time(mtimeStr, sizeof(mtimeStr), entry.mtime);
+            print_list_time(atimeStr, sizeof(atimeStr), entry.atime);
+            print_list_time(ctimeStr, sizeof(ctimeStr), entry.ctime);
 
-            printf("%-30s %-10s %-20s %-20s %-20s\n",
-                   filename.c_str(),
-                   sizeStr.c_str(),
+            printf("%-30s %-10llu %-20s %-20s %-20s\n",
+                   entry.name.c_str(),
+                   (unsigned long long)entry.size,
                    mtimeStr,
                    atimeStr,
                    ctimeStr);
             file_count++;
         }
+
+        if (!more || entries.empty()) {
+            break;
+        }
+        const ListEntry& last = entries.back();
+        query.resume = true;
+        query.afterName = last.name;
+        query.afterKey = list_sort_key(query, last.size, last.mtime);
     }
 
+    if (file_count == 0) {
+        printf("Nenhum arquivo no servidor.\n");
+    }
     DEBUG_PRINTF("DEBUG: [LIST] Successfully displayed %d files from server\n", file_count);
 }
 
@@ -1270,7 +2258,161 @@ void list_client_files() {
     }
 }
 
+// Reads the notifications that follow a listing reply on stream seqn.
+// Caller paused the monitor.
+static bool recv_listing(uint32_t seqn, size_t count, std::vector<packet>& listing) {
+    listing.reserve(listing.size() + count);
+    for (size_t i = 0; i < count; i++) {
+        packet filePkt;
+        if (!recv_frame(seqn, filePkt)) {
+            DEBUG_PRINTF("Erro ao receber notificação de arquivo: %s\n", strerror(errno));
+            return false;
+        }
+        DEBUG_PRINTF("DEBUG: Received file notification %zu/%zu: %s\n",
+               i+1, count, filePkt.payload.c_str());
+
+        if (filePkt.type != SYNC_NOTIFICATION) {
+            DEBUG_PRINTF("ERRO: Esperava notificação de arquivo, recebeu pacote tipo %d\n", filePkt.type);
+            continue;
+        }
+        listing.push_back(std::move(filePkt));
+    }
+    return true;
+}
+
+// A file the server no longer has: delete it here too, unless it changed
+// here since the last sync (then it goes back up)
+static void reconcile_server_delete(const std::string& filename, std::vector<std::string>& uploads) {
+    struct stat st;
+    if (stat((sync_dir_path + "/" + filename).c_str(), &st) != 0) {
+        file_index.remove(filename);        // gone on both sides
+    } else if (local_file_changed(filename, st)) {
+        uploads.push_back(filename);
+    } else {
+        packet deleted;
+        deleted.type = SYNC_NOTIFICATION;
+        deleted.payload = "D:" + filename;
+        handle_server_notification(deleted);
+    }
+}
+
+// Brings the sync directory in line with what changed on the server
+// ("U:"/"D:" notifications) and collects what changed here while we were
+// away. Only what changed on either side is transferred. When listed is
+// given, the notifications name every server file under those Merkle
+// prefixes, so indexed files under them that are missing were deleted
+// there. Returns false if a server change could not be applied.
+static bool reconcile(std::vector<packet>& changes, const std::vector<MerklePrefix>* listed,
+                      std::vector<std::string>& uploads, std::vector<std::string>& deletes) {
+    std::set<std::string> seen;
+    std::vector<std::pair<std::string, uint64_t>> downloads;
+    for (auto& filePkt : changes) {
+        if (filePkt.payload.size() < 2 || filePkt.payload[1] != ':') {
+            continue;
+        }
+        char action = filePkt.payload[0];
+        std::string filename = filePkt.payload.substr(2);
+        std::string filepath = sync_dir_path + "/" + filename;
+        seen.insert(filename);
+
+        if (action == 'D') {
+            reconcile_server_delete(filename, uploads);
+            continue;
+        }
+
+        IndexEntry entry;
+        struct stat st;
+        bool known = file_index.lookup(filename, entry);
+        bool present = stat(filepath.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+        if (known && entry.serverVersion == filePkt.total_size) {
+            // The server still has what we last synced
+            if (!present) {
+                deletes.push_back(filename);    // deleted here while offline
+            } else if (local_file_changed(filename, st)) {
+                uploads.push_back(filename);    // edited here while offline
+            }
+            continue;
+        }
+
+        if (known && present && local_file_changed(filename, st)) {
+            printf("Conflito em %s: alterado aqui e no servidor; mantendo a versão do servidor.\n",
+                   filename.c_str());
+        }
+        if (!have_version(filename, filePkt.total_size)) {
+            downloads.emplace_back(filename, filePkt.total_size);
+        }
+    }
+
+    download_files(downloads);
+    bool applied = true;
+    for (const auto& download : downloads) {
+        IndexEntry entry;
+        applied = applied && file_index.lookup(download.first, entry) &&
+                  entry.serverVersion == download.second;
+    }
+
+    if (listed != nullptr) {
+        for (const auto& filename : file_index.names()) {
+            if (seen.count(filename) != 0) {
+                continue;
+            }
+            for (const auto& prefix : *listed) {
+                if (prefix.contains(filename)) {
+                    seen.insert(filename);
+                    reconcile_server_delete(filename, uploads);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Files created or edited here while offline
+    DIR* dir = opendir(sync_dir_path.c_str());
+    if (dir != nullptr) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            std::string filename = entry->d_name;
+            struct stat st;
+            if (entry->d_type == DT_REG && !is_temp_file(filename) && seen.count(filename) == 0 &&
+                stat((sync_dir_path + "/" + filename).c_str(), &st) == 0 &&
+                local_file_changed(filename, st)) {
+                uploads.push_back(filename);
+            }
+        }
+        closedir(dir);
+    }
+
+    // and files deleted here that the server did not touch
+    for (const auto& filename : file_index.names()) {
+        struct stat st;
+        if (seen.count(filename) == 0 && stat((sync_dir_path + "/" + filename).c_str(), &st) != 0) {
+            deletes.push_back(filename);
+        }
+    }
+    return applied;
+}
+
+// Sends the local changes reconcile() found; the monitor pause is released
+// by then, each transfer takes it itself
+static void send_local_changes(const std::vector<std::string>& uploads, const std::vector<std::string>& deletes) {
+    upload_files(uploads);
+    for (const auto& filename : deletes) {
+        process_file_change(filename, true);
+    }
+}
+
+// Records the journal cursor at the end of a listing reply ("OK" + journal
+// id + head), once everything up to it has been applied
+static void save_cursor(const packet& response, bool applied) {
+    if (applied && response.payload.size() >= 2 + 2 * sizeof(uint64_t)) {
+        const uint8_t* p = (const uint8_t*)response.payload.data() + 2;
+        file_index.setCursor(get_u64(p), get_u64(p + sizeof(uint64_t)));
+    }
+}
+
 void get_sync_dir() {
+    std::unique_lock<std::mutex> pause_monitor(download_mutex);
+
     // Check socket status first
     if (!check_socket_status()) {
         DEBUG_PRINTF("ERROR: Socket is in invalid state. Cannot send get_sync_dir command.\n");
@@ -1281,49 +2423,34 @@ void get_sync_dir() {
     watch_sync_dir();
 
     // Send get_sync_dir command
+    Stream stream;
     packet cmd;
-    memset(&cmd, 0, sizeof(packet)); // Clear packet
     cmd.type = CMD_GET_SYNC_DIR;
-    cmd.seqn = get_next_seq();
-    cmd.total_size = 0;
-    cmd.length = 0;
+    cmd.seqn = stream.seqn;
+    append_u64(cmd.payload, file_index.deviceId());
 
-    DEBUG_PRINTF("DEBUG: Sending get_sync_dir command with seq: %d\n", cmd.seqn);
+    DEBUG_PRINTF("DEBUG: Sending get_sync_dir command with seq: %u\n", cmd.seqn);
 
-    {
-        std::lock_guard<std::mutex> lock(socket_mutex);
-        ssize_t bytes_sent = send(server_socket, &cmd, sizeof(packet), 0);
-        if (bytes_sent <= 0) {
-            DEBUG_PRINTF("Erro ao enviar comando get_sync_dir: %s\n", strerror(errno));
-            return;
-        }
-        DEBUG_PRINTF("DEBUG: Sent %zd bytes (get_sync_dir command)\n", bytes_sent);
+    if (!send_frame(cmd)) {
+        DEBUG_PRINTF("Erro ao enviar comando get_sync_dir: %s\n", strerror(errno));
+        return;
     }
 
-    // Wait for server response using direct receive
+    // Wait for server response
     DEBUG_PRINTF("DEBUG: Waiting for get_sync_dir response...\n");
     packet response;
-    memset(&response, 0, sizeof(packet)); // Clear response packet
 
-    {
-        std::lock_guard<std::mutex> lock(socket_mutex);
-        ssize_t recv_bytes = recv(server_socket, &response, sizeof(packet), MSG_WAITALL);
-        if (recv_bytes <= 0) {
-            DEBUG_PRINTF("Erro ao receber resposta do servidor: %s\n", strerror(errno));
-            return;
-        }
-        DEBUG_PRINTF("DEBUG: Received %zd bytes for get_sync_dir response\n", recv_bytes);
+    if (!stream.reply(response)) {
+        DEBUG_PRINTF("Erro ao receber resposta do servidor: %s\n", strerror(errno));
+        return;
     }
 
-    DEBUG_PRINTF("DEBUG: Received get_sync_dir response: %s with seq: %d, total_size: %u\n",
-           response.payload, response.seqn, response.total_size);
-
-    if (response.seqn != cmd.seqn) {
-        DEBUG_PRINTF("WARNING: Sequence number mismatch: got %d, expected %d\n", response.seqn, cmd.seqn);
-    }
+    DEBUG_PRINTF("DEBUG: Received get_sync_dir response with seq: %u, total_size: %llu\n",
+           response.seqn, (unsigned long long)response.total_size);
 
-    if (strcmp(response.payload, "OK") != 0) {
-        printf("Erro ao inicializar diretório de sincronização: %s\n", response.payload);
+    // Payload: "OK" + journal id + cursor the listing is current to
+    if (response.payload.compare(0, 2, "OK") != 0) {
+        printf("Erro ao inicializar diretório de sincronização: %s\n", response.payload.c_str());
         return;
     }
 
@@ -1331,44 +2458,204 @@ void get_sync_dir() {
     size_t numFiles = response.total_size;
     printf("Inicializando diretório de sincronização com %zu arquivos...\n", numFiles);
 
-    if (numFiles == 0) {
-        printf("Diretório de sincronização inicializado (vazio).\n");
-        update_file_mtimes();
+    // Read the whole listing before downloading anything: reconciling
+    // needs all of it
+    std::vector<packet> listing;
+    if (!recv_listing(stream.seqn, numFiles, listing)) {
         return;
     }
 
-    // For each file notification, receive it directly
-    for (size_t i = 0; i < numFiles; i++) {
-        packet filePkt;
-        memset(&filePkt, 0, sizeof(packet));
+    std::vector<std::string> uploads;
+    std::vector<std::string> deletes;
+    std::vector<MerklePrefix> everything(1);    // the root
+    save_cursor(response, reconcile(listing, &everything, uploads, deletes));
 
-        {
-            std::lock_guard<std::mutex> lock(socket_mutex);
-            ssize_t recv_bytes = recv(server_socket, &filePkt, sizeof(packet), MSG_WAITALL);
-            if (recv_bytes <= 0) {
-                DEBUG_PRINTF("Erro ao receber notificação de arquivo: %s\n", strerror(errno));
+    DEBUG_PRINTF("Diretório de sincronização inicializado com %zu arquivos.\n", numFiles);
+
+    pause_monitor.unlock();
+    send_local_changes(uploads, deletes);
+}
+
+// Sends one CMD_MERKLE request on stream and checks the reply header (and,
+// for 'N', that all the child nodes are there)
+static bool merkle_request(Stream& stream, char op, const MerklePrefix* prefixes, size_t count,
+                           packet& response) {
+    packet cmd;
+    cmd.type = CMD_MERKLE;
+    cmd.seqn = stream.seqn;
+    cmd.payload = std::string(1, op);
+    for (size_t i = 0; i < count; i++) {
+        encode_merkle_prefix(cmd.payload, prefixes[i]);
+    }
+    if (!send_frame(cmd)) {
+        DEBUG_PRINTF("ERROR: Failed to send merkle command: %s\n", strerror(errno));
+        return false;
+    }
+
+    if (!stream.reply(response)) {
+        DEBUG_PRINTF("ERROR: Failed to receive merkle response: %s\n", strerror(errno));
+        return false;
+    }
+    size_t expected = 2 + 2 * sizeof(uint64_t) +
+                      (op == 'N' ? count * MERKLE_FANOUT * MERKLE_NODE_SIZE : 0);
+    if (response.payload.compare(0, 2, "OK") != 0 || response.payload.size() != expected) {
+        DEBUG_PRINTF("ERROR: Bad merkle response (%zu bytes)\n", response.payload.size());
+        return false;
+    }
+    return true;
+}
+
+// Full reconciliation without a journal cursor: compares the index's Merkle
+// tree with the server's level by level, descending only into subtrees that
+// differ, and then lists just the files under those. Two directories that
+// mostly agree are reconciled in a few round trips and a few notifications,
+// however many files they hold.
+void merkle_sync() {
+    std::unique_lock<std::mutex> pause_monitor(download_mutex);
+    if (!check_socket_status()) {
+        DEBUG_PRINTF("ERROR: Socket is in invalid state. Cannot compare with the server.\n");
+        return;
+    }
+    watch_sync_dir();
+
+    packet first;       // its journal position predates every node we read
+    std::vector<MerklePrefix> level(1);     // the root
+    std::vector<MerklePrefix> listed;
+    size_t requests = 0;
+    while (!level.empty()) {
+        std::vector<MerklePrefix> next;
+        for (size_t start = 0; start < level.size(); start += MERKLE_MAX_PREFIXES) {
+            size_t count = std::min(level.size() - start, (size_t)MERKLE_MAX_PREFIXES);
+            Stream stream;
+            packet response;
+            if (!merkle_request(stream, 'N', &level[start], count, response)) {
                 return;
             }
-            DEBUG_PRINTF("DEBUG: Received file notification %zu/%zu: %s (%zd bytes)\n",
-                   i+1, numFiles, filePkt.payload, recv_bytes);
+            requests++;
+            if (first.payload.empty()) {
+                first = response;
+            }
+
+            const uint8_t* p = (const uint8_t*)response.payload.data() + 2 + 2 * sizeof(uint64_t);
+            for (size_t i = 0; i < count; i++) {
+                MerkleNode local[MERKLE_FANOUT];
+                file_index.merkleChildren(level[start + i], local);
+                for (int c = 0; c < MERKLE_FANOUT; c++, p += MERKLE_NODE_SIZE) {
+                    MerkleNode remote;
+                    decode_merkle_node(p, remote);
+                    if (remote == local[c]) {
+                        continue;
+                    }
+                    // Small subtrees are cheaper to list than to descend into
+                    MerklePrefix child = level[start + i].child(c);
+                    if (remote.count <= MERKLE_LIST_THRESHOLD || child.depth == MERKLE_DEPTH) {
+                        listed.push_back(child);
+                    } else {
+                        next.push_back(child);
+                    }
+                }
+            }
         }
+        level.swap(next);
+    }
 
-        if (filePkt.type != SYNC_NOTIFICATION) {
-            DEBUG_PRINTF("ERRO: Esperava notificação de arquivo, recebeu pacote tipo %d\n", filePkt.type);
-            continue;
+    std::vector<packet> listing;
+    for (size_t start = 0; start < listed.size(); start += MERKLE_MAX_PREFIXES) {
+        size_t count = std::min(listed.size() - start, (size_t)MERKLE_MAX_PREFIXES);
+        Stream stream;
+        packet response;
+        if (!merkle_request(stream, 'F', &listed[start], count, response) ||
+            !recv_listing(stream.seqn, response.total_size, listing)) {
+            return;
         }
+        requests++;
+    }
+    DEBUG_PRINTF("DEBUG: Merkle comparison took %zu requests; %zu subtrees differ, %zu server files in them\n",
+                 requests, listed.size(), listing.size());
+    printf("Sincronizando %zu arquivos que diferem do servidor...\n", listing.size());
+
+    std::vector<std::string> uploads;
+    std::vector<std::string> deletes;
+    save_cursor(first, reconcile(listing, &listed, uploads, deletes));
+
+    pause_monitor.unlock();
+    send_local_changes(uploads, deletes);
+}
+
+// Reconciles everything when there is no usable journal cursor: by Merkle
+// comparison when there is an index to compare, by a full listing otherwise
+static void resync_all() {
+    if (file_index.names().empty()) {
+        get_sync_dir();
+    } else {
+        merkle_sync();
+    }
+}
 
-        // Process this file notification
-        handle_server_notification(filePkt);
+// Brings the sync directory up to date after (re)connecting: asks the
+// server only for what changed since the cursor of the last sync. Falls
+// back to a full reconciliation when there is no cursor yet or the server
+// can no longer serve it.
+void catch_up() {
+    uint64_t journalId, seq;
+    if (!file_index.cursor(journalId, seq)) {
+        resync_all();
+        return;
     }
 
-    DEBUG_PRINTF("Diretório de sincronização inicializado com %zu arquivos.\n", numFiles);
-    update_file_mtimes();
+    std::unique_lock<std::mutex> pause_monitor(download_mutex);
+    if (!check_socket_status()) {
+        DEBUG_PRINTF("ERROR: Socket is in invalid state. Cannot catch up with the server.\n");
+        return;
+    }
+    watch_sync_dir();
+
+    Stream stream;
+    packet cmd;
+    cmd.type = CMD_GET_CHANGES;
+    cmd.seqn = stream.seqn;
+    append_u64(cmd.payload, file_index.deviceId());
+    append_u64(cmd.payload, journalId);
+    append_u64(cmd.payload, seq);
+    if (!send_frame(cmd)) {
+        DEBUG_PRINTF("ERROR: Failed to send get_changes command: %s\n", strerror(errno));
+        return;
+    }
+
+    packet response;
+    if (!stream.reply(response)) {
+        DEBUG_PRINTF("ERROR: Failed to receive get_changes response: %s\n", strerror(errno));
+        return;
+    }
+    if (response.payload.compare(0, 2, "OK") != 0) {
+        DEBUG_PRINTF("DEBUG: Server cannot serve cursor %llu (%s), listing everything\n",
+                     (unsigned long long)seq, response.payload.c_str());
+        pause_monitor.unlock();
+        resync_all();
+        return;
+    }
+
+    size_t numChanges = response.total_size;
+    printf("Sincronizando %zu alterações desde a última conexão...\n", numChanges);
+
+    std::vector<packet> changes;
+    if (!recv_listing(stream.seqn, numChanges, changes)) {
+        return;
+    }
+
+    std::vector<std::string> uploads;
+    std::vector<std::string> deletes;
+    save_cursor(response, reconcile(changes, nullptr, uploads, deletes));
+
+    pause_monitor.unlock();
+    send_local_changes(uploads, deletes);
 }
 
 // Add this function to reset the socket connection
 bool reset_socket_connection() {
-    // Close existing socket
+    // Close existing socket; data connections belong to the old login
+    stop_reader();
+    stripes_close();
     if (server_socket != -1) {
         close(server_socket);
         DEBUG_PRINTF("DEBUG: Socket connection reset - closed old socket\n");
@@ -1416,15 +2703,11 @@ bool reset_socket_connection() {
 
     // Re-login user
     packet login_pkt;
-    memset(&login_pkt, 0, sizeof(packet));
     login_pkt.type = CMD_LOGIN;
     login_pkt.seqn = get_next_seq();
-    login_pkt.total_size = 0;
-    strcpy(login_pkt.payload, current_username.c_str());
-    login_pkt.length = strlen(current_username.c_str());
+    login_pkt.payload = current_username;
 
-    ssize_t bytes_sent = send(server_socket, &login_pkt, sizeof(packet), 0);
-    if (bytes_sent <= 0) {
+    if (!send_packet(server_socket, login_pkt)) {
         DEBUG_PRINTF("ERROR: Failed to send login packet after reconnection\n");
         close(server_socket);
         server_socket = -1;
@@ -1433,9 +2716,7 @@ bool reset_socket_connection() {
 
     // Receive login response
     packet response;
-    memset(&response, 0, sizeof(packet));
-    ssize_t bytes_received = recv(server_socket, &response, sizeof(packet), MSG_WAITALL);
-    if (bytes_received <= 0 || response.type != CMD_LOGIN) {
+    if (!recv_packet(server_socket, response) || response.type != CMD_LOGIN) {
         DEBUG_PRINTF("ERROR: Failed to receive valid login response after reconnection\n");
         close(server_socket);
         server_socket = -1;
@@ -1444,5 +2725,8 @@ bool reset_socket_connection() {
 
     DEBUG_PRINTF("DEBUG: Successfully re-authenticated to server\n");
     connection_alive.store(true);
+    start_reader();
+    open_stripes(response);
+    subscribe_push();
     return true;
 }
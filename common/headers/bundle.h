@@ -0,0 +1,53 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include "sha256.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Bundles move many small files as one stream (CMD_UPLOAD_BUNDLE,
+// CMD_DOWNLOAD_BUNDLE) instead of a command and a reply per file. Each
+// DATA_PACKET of a bundle holds whole entries:
+//   name length u16, name, size u64, version u64, data, SHA-256 of data
+// The version is the server's; uploads leave it 0.
+
+// Larger files are never bundled, so an entry always fits in a frame
+#define BUNDLE_MAX_FILE_SIZE (1024 * 1024)
+
+// Devices that asked for it (CMD_PUSH) get files up to this size pushed as
+// a one-entry SYNC_PUSH instead of a "U:" notification they download after
+#define PUSH_MAX_FILE_SIZE (256 * 1024)
+
+// Entries per bundle, and how full frames are packed
+#define BUNDLE_MAX_FILES 1024
+#define BUNDLE_FRAME_SIZE (256 * 1024)
+
+// Per-file status in bundle replies
+#define BUNDLE_STORED 0     // uploads: stored (a version follows); downloads: in the bundle
+#define BUNDLE_FAILED 1     // checksum mismatch, or the server could not store it
+#define BUNDLE_MISSING 2    // downloads: no such file
+#define BUNDLE_TOO_LARGE 3  // downloads: fetch it on its own
+
+struct BundleEntry {
+    std::string name;
+    uint64_t version = 0;
+    const char* data = nullptr;     // points into the frame
+    uint64_t size = 0;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    bool intact = false;            // data matches digest
+};
+
+// Encoded size of an entry
+size_t bundle_entry_size(size_t nameLength, uint64_t size);
+
+// Append an entry to a frame; digest is computed when not given
+void append_bundle_entry(std::string& frame, const std::string& name, uint64_t version,
+                         const char* data, size_t size, const uint8_t* digest = nullptr);
+
+// Split a frame into its entries. False if it does not end on an entry
+// boundary; a damaged entry is only marked (intact = false).
+bool parse_bundle_frame(const char* data, size_t length, std::vector<BundleEntry>& entries);
+
+#endif
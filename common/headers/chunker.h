@@ -0,0 +1,32 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Content-defined chunking (FastCDC with normalized chunking). A cut point
+// depends only on the bytes since the previous cut, so identical content
+// produces identical chunks wherever it sits in a file, and an edit only
+// changes the chunks around it. Client and server must agree on all of this.
+
+#define CDC_MIN_CHUNK (16 * 1024)
+#define CDC_AVG_CHUNK (64 * 1024)
+#define CDC_MAX_CHUNK (256 * 1024)
+
+// Finds cut points in a stream that arrives in arbitrary pieces
+class CdcChunker {
+public:
+    // Scans data for the end of the current chunk. Returns how many bytes
+    // of data belong to it; cut is set when the chunk ends right there.
+    // Otherwise all of data was consumed and the chunk continues.
+    size_t scan(const uint8_t* data, size_t length, bool& cut);
+
+    // Bytes of the current chunk seen so far (0 right after a cut)
+    size_t current() const { return chunkLength; }
+
+private:
+    uint64_t hash = 0;
+    size_t chunkLength = 0;
+};
+
+#endif
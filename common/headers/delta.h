@@ -0,0 +1,62 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// rsync-style delta transfer. The receiver describes the copy it already
+// has as a list of per-block signatures; the sender rolls a weak checksum
+// over its new version and emits either "copy this range of your file" or
+// literal bytes.
+
+// Block size bounds for signatures
+#define DELTA_MIN_BLOCK (2 * 1024)
+#define DELTA_MAX_BLOCK (1024 * 1024)
+
+// Upper bound on blocks per signature, so the encoded form fits in one frame
+#define DELTA_MAX_BLOCKS (128 * 1024)
+
+// Bytes of SHA-256 kept per block (128 bits is plenty to confirm a weak match)
+#define DELTA_STRONG_SIZE 16
+
+struct BlockSignature {
+    uint32_t weak;
+    uint8_t strong[DELTA_STRONG_SIZE];
+};
+
+struct FileSignature {
+    uint64_t baseVersion = 0;   // identifies the exact copy the signature describes
+    uint64_t fileSize = 0;
+    uint32_t blockSize = 0;
+    std::vector<BlockSignature> blocks; // full blocks only; a short tail is sent as literal
+};
+
+// Receives the delta in file order
+class DeltaSink {
+public:
+    virtual ~DeltaSink() {}
+    virtual bool literal(const uint8_t* data, size_t length) = 0;
+    virtual bool copy(uint64_t offset, uint64_t length) = 0;
+};
+
+uint32_t delta_block_size(uint64_t fileSize);
+uint32_t delta_weak_checksum(const uint8_t* data, size_t length);
+
+// Reads [offset, offset+length) of the file being described
+typedef std::function<bool(uint64_t offset, void* buffer, size_t length)> BlockReader;
+
+// Signature of the first fileSize bytes of a file
+bool compute_signature(const BlockReader& read, uint64_t fileSize, FileSignature& sig);
+
+std::string encode_signature(const FileSignature& sig);
+bool decode_signature(const char* data, size_t length, FileSignature& sig);
+
+// Express data (the new version) in terms of the base described by sig.
+// Literal runs are handed out in pieces of at most maxLiteral bytes.
+bool compute_delta(const uint8_t* data, uint64_t size, const FileSignature& sig,
+                   size_t maxLiteral, DeltaSink& sink);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef LISTING_H
+#define LISTING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+// CMD_LIST_SERVER lists a user's files a page at a time. The request is an
+// encoded ListQuery (empty: the first page by name); the reply is "OK", a
+// u8 set when more pages follow, and the page's entries:
+//   varint bytes of name shared with the previous entry, varint suffix
+//   length, suffix, varint size, varint mtime (ns since the epoch), atime
+//   and ctime as zigzag varints relative to mtime
+// The next page is asked for after the sort key and name of the last entry
+// received, so neither side ever holds the whole listing.
+
+// Entries per page at most; a page also ends once its entries take
+// LIST_PAGE_BYTES
+#define LIST_PAGE_FILES 1000
+#define LIST_PAGE_BYTES (256 * 1024)
+
+// Sort orders; ties are broken by name
+enum ListSort {
+    LIST_BY_NAME = 0,
+    LIST_BY_MTIME = 1,
+    LIST_BY_SIZE = 2
+};
+
+struct ListQuery {
+    uint8_t sort = LIST_BY_NAME;
+    bool descending = false;
+    uint32_t limit = LIST_PAGE_FILES;
+    bool resume = false;            // list only what comes after afterKey/afterName
+    uint64_t afterKey = 0;          // sort key of the last entry received (unused by name)
+    std::string afterName;
+    uint64_t modifiedSince = 0;     // ns; files modified before are left out
+    uint64_t minSize = 0;
+    uint64_t maxSize = UINT64_MAX;
+};
+
+struct ListEntry {
+    std::string name;
+    uint64_t size = 0;
+    uint64_t mtime = 0;     // ns since the epoch
+    uint64_t atime = 0;
+    uint64_t ctime = 0;
+};
+
+inline uint64_t list_time(const struct timespec& ts) {
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void encode_list_query(std::string& out, const ListQuery& query);
+bool decode_list_query(const std::string& in, ListQuery& query);
+
+// Whether a file passes the query's filters, and its sort key
+bool list_matches(const ListQuery& query, uint64_t size, uint64_t mtime);
+uint64_t list_sort_key(const ListQuery& query, uint64_t size, uint64_t mtime);
+
+// Whether (keyA, nameA) comes before (keyB, nameB) in the query's order
+bool list_before(const ListQuery& query, uint64_t keyA, const std::string& nameA,
+                 uint64_t keyB, const std::string& nameB);
+
+// Append an entry to a page; previous is the name of the entry before it
+// in the page (empty for the first)
+void append_list_entry(std::string& page, const std::string& previous, const ListEntry& entry);
+bool parse_list_page(const char* data, size_t length, std::vector<ListEntry>& entries);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include "sha256.h"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Fingerprint of a user's namespace (file names and server versions) that
+// client and server keep side by side. Files are placed by the leading
+// nibbles of SHA-256(name); every node holds the number of files under it
+// and the XOR of their leaf hashes, SHA-256(name, version). Equal nodes
+// mean equal subtrees, so comparing the two trees top-down finds what
+// differs in a few round trips however many files there are.
+
+#define MERKLE_FANOUT 16
+#define MERKLE_DEPTH 4      // node levels below the root; deeper, files are listed
+
+// Wire sizes: a prefix is depth (u8) + nibbles (u32), a node count (u32) + hash
+#define MERKLE_PREFIX_SIZE 5
+#define MERKLE_NODE_SIZE (4 + SHA256_DIGEST_SIZE)
+
+// Prefixes per CMD_MERKLE request; keeps a reply to a few MB
+#define MERKLE_MAX_PREFIXES 4096
+
+// A node: the first depth nibbles of the name hash, as an integer
+struct MerklePrefix {
+    uint8_t depth = 0;
+    uint32_t bits = 0;
+
+    MerklePrefix child(int i) const { return {(uint8_t)(depth + 1), bits * MERKLE_FANOUT + i}; }
+    bool contains(const std::string& name) const;
+};
+
+struct MerkleNode {
+    uint32_t count = 0;
+    uint8_t hash[SHA256_DIGEST_SIZE] = {};
+
+    bool operator==(const MerkleNode& other) const;
+    bool operator!=(const MerkleNode& other) const { return !(*this == other); }
+};
+
+// Not thread-safe; owners lock around it
+class MerkleTree {
+public:
+    // Add a file or change its version
+    void set(const std::string& name, uint64_t version);
+    void remove(const std::string& name);
+
+    MerkleNode node(const MerklePrefix& prefix) const;
+
+    // Files under a prefix (name, version)
+    std::vector<std::pair<std::string, uint64_t>> files(const MerklePrefix& prefix) const;
+
+private:
+    void toggle(uint32_t key, const std::string& name, uint64_t version, int delta);
+
+    std::unordered_map<uint64_t, MerkleNode> nodes;
+    std::map<std::pair<uint32_t, std::string>, uint64_t> leaves;  // (name key, name) -> version
+};
+
+void encode_merkle_prefix(std::string& out, const MerklePrefix& prefix);
+bool decode_merkle_prefix(const uint8_t* in, MerklePrefix& prefix);
+void encode_merkle_node(std::string& out, const MerkleNode& node);
+void decode_merkle_node(const uint8_t* in, MerkleNode& node);
+
+#endif
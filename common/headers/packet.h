@@ -2,13 +2,64 @@
 #define PACKET_H
 
 #include <cstdint>
+#include <cstddef>
+#include <string>
 
-typedef struct packet {
+// Versão do protocolo de enquadramento (frame) usado no fio
+// (2: frames de comandos diferentes podem se intercalar, ver seqn abaixo)
+#define PROTOCOL_VERSION 2
+
+// Tamanho do cabeçalho codificado (ver encode_packet_header)
+#define PACKET_HEADER_SIZE 20
+
+// Maior payload aceito em um único frame
+#define PACKET_MAX_PAYLOAD (8u * 1024 * 1024)
+
+// Tamanho dos blocos usados para transferir conteúdo de arquivos
+#define FILE_CHUNK_SIZE (1024 * 1024)
+
+// Frame header as it travels on the wire (big-endian):
+//   0  uint8   version
+//   1  uint8   flags
+//   2  uint16  type
+//   4  uint32  seqn
+//   8  uint64  total_size
+//  16  uint32  length (payload bytes that follow the header)
+//
+// seqn names a stream: every frame of an exchange (the command, its data,
+// the reply, the reply's data and listing entries) carries the seqn the
+// client gave the command, so frames of different exchanges may be
+// interleaved on one connection. Client seqns start at 1; 0 marks
+// notifications nobody asked for.
+typedef struct packet_header {
+    uint8_t  version;       // Versão do protocolo
+    uint8_t  flags;         // Reservado para extensões
     uint16_t type;          // Tipo do pacote (DATA | CMD)
-    uint16_t seqn;          // Número de sequência
-    uint32_t total_size;    // Número total de fragmentos
-    uint16_t length;        // Comprimento do payload
-    char payload[1024];     // Dados do pacote
+    uint32_t seqn;          // Número de sequência
+    uint64_t total_size;    // Tamanho total da transferência
+    uint32_t length;        // Comprimento do payload
+} packet_header;
+
+typedef struct packet {
+    uint16_t type = 0;          // Tipo do pacote (DATA | CMD)
+    uint32_t seqn = 0;          // Número de sequência
+    uint64_t total_size = 0;    // Tamanho total da transferência
+    std::string payload;        // Dados do pacote (comprimento variável)
 } packet;
 
+// Header encoding
+void encode_packet_header(const packet_header& hdr, uint8_t* out);
+bool decode_packet_header(const uint8_t* in, packet_header& hdr);
+
+// Full frame (header + payload) as a contiguous byte string
+std::string encode_packet(const packet& pkt);
+
+// Frame I/O on a blocking socket. The header and payload go out in a
+// single sendmsg() so small control messages cost one syscall.
+bool send_packet(int sockfd, const packet& pkt);
+bool send_packet_data(int sockfd, uint16_t type, uint32_t seqn, uint64_t total_size,
+                      const void* data, size_t length);
+bool recv_packet_header(int sockfd, packet_header& hdr);
+bool recv_packet(int sockfd, packet& pkt);
+
 #endif
@@ -0,0 +1,36 @@
+#ifndef PACKET_TYPES_H
+#define PACKET_TYPES_H
+
+// Packet types shared by client and server
+enum PacketType {
+    CMD_LOGIN = 1,
+    CMD_UPLOAD = 2,
+    CMD_DOWNLOAD = 3,
+    CMD_DELETE = 4,
+    CMD_LIST_SERVER = 5,
+    CMD_LIST_CLIENT = 6,
+    CMD_GET_SYNC_DIR = 7,
+    DATA_PACKET = 8,
+    SYNC_NOTIFICATION = 9,  // "U:<file>" (total_size = server version), "D:<file>"
+    CMD_EXIT = 10,
+    CMD_SIGNATURE = 11,     // ask for the block signature of a file (delta upload)
+    CMD_UPLOAD_DELTA = 12,  // upload expressed against the server's copy
+    DELTA_COPY = 13,        // delta op: copy a range of the server's copy
+    CMD_QUERY_CHUNKS = 14,  // which of these chunk hashes does the server store?
+    CHUNK_REF = 15,         // upload op: append a chunk the server already stores
+    CMD_GET_CHANGES = 16,   // changes since a journal cursor (reconnect catch-up)
+    CMD_MERKLE = 17,        // compare Merkle trees: child nodes, or the files under prefixes
+    STREAM_WINDOW = 18,     // credit (u32 bytes) for the download stream with this seqn
+    CMD_ATTACH = 19,        // first frame of an auxiliary data connection: session token (u64)
+    CMD_DOWNLOAD_RANGE = 20,    // offset, length, version (u64s) + filename
+    CMD_STRIPED_BEGIN = 21,     // start an upload whose ranges arrive on any connection
+    CMD_UPLOAD_RANGE = 22,      // upload id, offset (u64s) + data
+    CMD_STRIPED_COMMIT = 23,    // upload id (u64): all ranges are in, store the file
+    CMD_UPLOAD_BUNDLE = 24,     // many small files in one stream (see bundle.h)
+    CMD_DOWNLOAD_BUNDLE = 25,
+    CMD_PUSH = 26,              // have small files pushed with their notifications
+    SYNC_PUSH = 27,             // "U:" notification carrying the file: one bundle entry
+    STREAM_CANCEL = 28          // the client abandoned the download stream with this seqn
+};
+
+#endif
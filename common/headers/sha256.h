@@ -0,0 +1,31 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#define SHA256_DIGEST_SIZE 32
+
+// Self-contained SHA-256 (FIPS 180-4); the build images ship no crypto library
+class Sha256 {
+public:
+    Sha256();
+
+    void update(const void* data, size_t length);
+    void final(uint8_t digest[SHA256_DIGEST_SIZE]);
+
+private:
+    void transform(const uint8_t block[64]);
+
+    uint32_t state[8];
+    uint64_t bitLength;
+    uint8_t buffer[64];
+    size_t bufferLength;
+};
+
+// One-shot helpers
+void sha256(const void* data, size_t length, uint8_t digest[SHA256_DIGEST_SIZE]);
+std::string sha256_hex(const uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif
@@ -4,6 +4,11 @@
 #include <cstddef> // For size_t
 
 int create_socket();
+
+// Like create_socket, but the buffers are left to the kernel's autotuning,
+// which grows them to the bandwidth-delay product of the path. Sockets
+// accepted from a listening socket inherit its buffer sizes.
+int create_bulk_socket();
 int connect_socket(int sockfd, const char* ip, int port);
 int bind_socket(int sockfd, int port);
 int listen_socket(int sockfd);
@@ -13,4 +18,7 @@ int accept_connection(int sockfd);
 size_t write_all(int sockfd, const void* buf, size_t len);
 size_t read_all(int sockfd, void* buf, size_t len);
 
+// Blocks (up to SO_RCVTIMEO) until len bytes arrive; returns bytes read
+size_t recv_exact(int sockfd, void* buf, size_t len);
+
 #endif
@@ -0,0 +1,78 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <cstdint>
+#include <string>
+
+// Big-endian integer encoding shared by everything that goes on the wire
+
+inline void put_u16(uint8_t* p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+inline void put_u32(uint8_t* p, uint32_t v) {
+    put_u16(p, v >> 16);
+    put_u16(p + 2, v & 0xffff);
+}
+
+inline void put_u64(uint8_t* p, uint64_t v) {
+    put_u32(p, v >> 32);
+    put_u32(p + 4, v & 0xffffffff);
+}
+
+inline uint16_t get_u16(const uint8_t* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+inline uint32_t get_u32(const uint8_t* p) {
+    return ((uint32_t)get_u16(p) << 16) | get_u16(p + 2);
+}
+
+inline uint64_t get_u64(const uint8_t* p) {
+    return ((uint64_t)get_u32(p) << 32) | get_u32(p + 4);
+}
+
+// Append to a payload being built
+inline void append_u16(std::string& out, uint16_t v) {
+    uint8_t buf[2];
+    put_u16(buf, v);
+    out.append((const char*)buf, sizeof(buf));
+}
+
+inline void append_u32(std::string& out, uint32_t v) {
+    uint8_t buf[4];
+    put_u32(buf, v);
+    out.append((const char*)buf, sizeof(buf));
+}
+
+inline void append_u64(std::string& out, uint64_t v) {
+    uint8_t buf[8];
+    put_u64(buf, v);
+    out.append((const char*)buf, sizeof(buf));
+}
+
+// LEB128 varints (7 bits per byte, low first), for payloads where most
+// numbers are small
+inline void append_varint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out += (char)(v | 0x80);
+        v >>= 7;
+    }
+    out += (char)v;
+}
+
+// Reads a varint at p, advancing it; false if it runs past end
+inline bool get_varint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t byte = *p++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
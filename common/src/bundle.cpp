@@ -0,0 +1,63 @@
+#include "bundle.h"
+#include "wire.h"
+#include <cstring>
+
+// name length u16 + size u64 + version u64, then the name, data and digest
+#define BUNDLE_ENTRY_OVERHEAD (2 + 8 + 8 + SHA256_DIGEST_SIZE)
+
+size_t bundle_entry_size(size_t nameLength, uint64_t size) {
+    return BUNDLE_ENTRY_OVERHEAD + nameLength + size;
+}
+
+void append_bundle_entry(std::string& frame, const std::string& name, uint64_t version,
+                         const char* data, size_t size, const uint8_t* digest) {
+    uint8_t computed[SHA256_DIGEST_SIZE];
+    if (digest == nullptr) {
+        sha256(data, size, computed);
+        digest = computed;
+    }
+
+    frame.reserve(frame.size() + bundle_entry_size(name.size(), size));
+    append_u16(frame, name.size());
+    frame += name;
+    append_u64(frame, size);
+    append_u64(frame, version);
+    frame.append(data, size);
+    frame.append((const char*)digest, SHA256_DIGEST_SIZE);
+}
+
+bool parse_bundle_frame(const char* data, size_t length, std::vector<BundleEntry>& entries) {
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + length;
+
+    while (p < end) {
+        if ((size_t)(end - p) < 2) {
+            return false;
+        }
+        size_t nameLength = get_u16(p);
+        p += 2;
+        if ((size_t)(end - p) < nameLength + 16) {
+            return false;
+        }
+
+        BundleEntry entry;
+        entry.name.assign((const char*)p, nameLength);
+        p += nameLength;
+        entry.size = get_u64(p);
+        entry.version = get_u64(p + 8);
+        p += 16;
+        if ((uint64_t)(end - p) < SHA256_DIGEST_SIZE || entry.size > (uint64_t)(end - p) - SHA256_DIGEST_SIZE) {
+            return false;
+        }
+        entry.data = (const char*)p;
+        p += entry.size;
+        memcpy(entry.digest, p, SHA256_DIGEST_SIZE);
+        p += SHA256_DIGEST_SIZE;
+
+        uint8_t actual[SHA256_DIGEST_SIZE];
+        sha256(entry.data, entry.size, actual);
+        entry.intact = memcmp(actual, entry.digest, SHA256_DIGEST_SIZE) == 0;
+        entries.push_back(std::move(entry));
+    }
+    return true;
+}
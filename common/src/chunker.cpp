@@ -0,0 +1,52 @@
+#include "chunker.h"
+#include <algorithm>
+
+// Below the average size a cut needs more zero bits, above it fewer, which
+// keeps chunk sizes close to CDC_AVG_CHUNK. The mask bits sit at the top of
+// the gear hash, where every bit depends on the last 64 bytes.
+#define MASK_HARD 0xffffc00000000000ull   // 18 bits
+#define MASK_EASY 0xfffc000000000000ull   // 14 bits
+
+static const uint64_t* gear_table() {
+    // Fixed pseudo-random table (splitmix64); never change it, stored
+    // chunk boundaries depend on it
+    static const struct Table {
+        uint64_t values[256];
+        Table() {
+            uint64_t state = 0x5eed5eed5eed5eedull;
+            for (int i = 0; i < 256; i++) {
+                uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+                values[i] = z ^ (z >> 31);
+            }
+        }
+    } table;
+    return table.values;
+}
+
+size_t CdcChunker::scan(const uint8_t* data, size_t length, bool& cut) {
+    const uint64_t* gear = gear_table();
+    cut = false;
+
+    // The first CDC_MIN_CHUNK bytes of a chunk can never end it
+    size_t i = 0;
+    if (chunkLength < CDC_MIN_CHUNK) {
+        i = std::min(length, (size_t)CDC_MIN_CHUNK - chunkLength);
+        chunkLength += i;
+    }
+
+    for (; i < length; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        chunkLength++;
+
+        uint64_t mask = (chunkLength < CDC_AVG_CHUNK) ? MASK_HARD : MASK_EASY;
+        if ((hash & mask) == 0 || chunkLength == CDC_MAX_CHUNK) {
+            cut = true;
+            hash = 0;
+            chunkLength = 0;
+            return i + 1;
+        }
+    }
+    return length;
+}
@@ -0,0 +1,230 @@
+#include "delta.h"
+#include "sha256.h"
+#include "wire.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+// Encoded signature: baseVersion u64, fileSize u64, blockSize u32, count u32,
+// then count * (weak u32, strong[DELTA_STRONG_SIZE])
+#define SIGNATURE_HEADER_SIZE 24
+#define SIGNATURE_ENTRY_SIZE (4 + DELTA_STRONG_SIZE)
+
+uint32_t delta_block_size(uint64_t fileSize) {
+    // ~sqrt(size) balances signature size against match granularity
+    uint64_t size = (uint64_t)std::sqrt((double)fileSize);
+    size = (size + 1023) & ~(uint64_t)1023;
+
+    // Very large files: grow the blocks rather than the signature
+    uint64_t minForCount = (fileSize + DELTA_MAX_BLOCKS - 1) / DELTA_MAX_BLOCKS;
+    size = std::max(size, minForCount);
+
+    return (uint32_t)std::min<uint64_t>(std::max<uint64_t>(size, DELTA_MIN_BLOCK), DELTA_MAX_BLOCK);
+}
+
+// rsync's rolling checksum: a = sum(x), b = sum((n - i) * x), both mod 2^16
+uint32_t delta_weak_checksum(const uint8_t* data, size_t length) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < length; i++) {
+        a += data[i];
+        b += (uint32_t)(length - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+static void strong_hash(const uint8_t* data, size_t length, uint8_t out[DELTA_STRONG_SIZE]) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(data, length, digest);
+    memcpy(out, digest, DELTA_STRONG_SIZE);
+}
+
+bool compute_signature(const BlockReader& read, uint64_t fileSize, FileSignature& sig) {
+    sig.fileSize = fileSize;
+    sig.blockSize = delta_block_size(fileSize);
+    sig.blocks.clear();
+    sig.blocks.reserve(fileSize / sig.blockSize);
+
+    std::vector<uint8_t> block(sig.blockSize);
+    for (uint64_t offset = 0; offset + sig.blockSize <= fileSize; offset += sig.blockSize) {
+        if (!read(offset, block.data(), sig.blockSize)) {
+            return false;
+        }
+
+        BlockSignature entry;
+        entry.weak = delta_weak_checksum(block.data(), sig.blockSize);
+        strong_hash(block.data(), sig.blockSize, entry.strong);
+        sig.blocks.push_back(entry);
+    }
+    return true;
+}
+
+std::string encode_signature(const FileSignature& sig) {
+    std::string out;
+    out.reserve(SIGNATURE_HEADER_SIZE + sig.blocks.size() * SIGNATURE_ENTRY_SIZE);
+    append_u64(out, sig.baseVersion);
+    append_u64(out, sig.fileSize);
+    append_u32(out, sig.blockSize);
+    append_u32(out, sig.blocks.size());
+    for (const auto& block : sig.blocks) {
+        append_u32(out, block.weak);
+        out.append((const char*)block.strong, DELTA_STRONG_SIZE);
+    }
+    return out;
+}
+
+bool decode_signature(const char* data, size_t length, FileSignature& sig) {
+    const uint8_t* p = (const uint8_t*)data;
+    if (length < SIGNATURE_HEADER_SIZE) {
+        return false;
+    }
+
+    sig.baseVersion = get_u64(p);
+    sig.fileSize = get_u64(p + 8);
+    sig.blockSize = get_u32(p + 16);
+    uint32_t count = get_u32(p + 20);
+
+    if (sig.blockSize == 0 || count > DELTA_MAX_BLOCKS ||
+        length != SIGNATURE_HEADER_SIZE + (size_t)count * SIGNATURE_ENTRY_SIZE) {
+        return false;
+    }
+
+    sig.blocks.resize(count);
+    p += SIGNATURE_HEADER_SIZE;
+    for (uint32_t i = 0; i < count; i++) {
+        sig.blocks[i].weak = get_u32(p);
+        memcpy(sig.blocks[i].strong, p + 4, DELTA_STRONG_SIZE);
+        p += SIGNATURE_ENTRY_SIZE;
+    }
+    return true;
+}
+
+namespace {
+
+// Coalesces adjacent copies and splits long literal runs
+class DeltaWriter {
+public:
+    DeltaWriter(DeltaSink& sink, size_t maxLiteral) : sink(sink), maxLiteral(maxLiteral) {}
+
+    bool copy(uint64_t offset, uint64_t length) {
+        if (copyLength > 0 && copyOffset + copyLength == offset) {
+            copyLength += length;
+            return true;
+        }
+        if (!flushCopy()) return false;
+        copyOffset = offset;
+        copyLength = length;
+        return true;
+    }
+
+    bool literal(const uint8_t* data, size_t length) {
+        if (length == 0) return true;
+        if (!flushCopy()) return false;
+        while (length > 0) {
+            size_t n = std::min(length, maxLiteral);
+            if (!sink.literal(data, n)) return false;
+            data += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    bool flushCopy() {
+        if (copyLength == 0) return true;
+        bool ok = sink.copy(copyOffset, copyLength);
+        copyLength = 0;
+        return ok;
+    }
+
+private:
+    DeltaSink& sink;
+    size_t maxLiteral;
+    uint64_t copyOffset = 0;
+    uint64_t copyLength = 0;
+};
+
+}
+
+bool compute_delta(const uint8_t* data, uint64_t size, const FileSignature& sig,
+                   size_t maxLiteral, DeltaSink& sink) {
+    DeltaWriter writer(sink, maxLiteral);
+    const uint64_t blockSize = sig.blockSize;
+
+    if (sig.blocks.empty() || size < blockSize) {
+        return writer.literal(data, size) && writer.flushCopy();
+    }
+
+    // weak checksum -> candidate blocks
+    std::unordered_map<uint32_t, std::vector<uint32_t>> index;
+    index.reserve(sig.blocks.size());
+    for (uint32_t i = 0; i < sig.blocks.size(); i++) {
+        index[sig.blocks[i].weak].push_back(i);
+    }
+
+    uint64_t pos = 0;            // start of the rolling window
+    uint64_t literalStart = 0;   // first byte not yet emitted
+    uint32_t nextBlock = 0;      // block that would extend the last copy
+    bool fresh = true;           // window sums must be recomputed
+    uint32_t a = 0, b = 0;
+
+    while (pos + blockSize <= size) {
+        if (fresh) {
+            uint32_t weak = delta_weak_checksum(data + pos, blockSize);
+            a = weak & 0xffff;
+            b = weak >> 16;
+            fresh = false;
+        }
+        uint32_t weak = (a & 0xffff) | (b << 16);
+
+        int64_t match = -1;
+        auto it = index.find(weak);
+        if (it != index.end()) {
+            uint8_t strong[DELTA_STRONG_SIZE];
+            strong_hash(data + pos, blockSize, strong);
+
+            // Prefer the block right after the previous match so copies coalesce
+            if (nextBlock < sig.blocks.size() && sig.blocks[nextBlock].weak == weak &&
+                memcmp(sig.blocks[nextBlock].strong, strong, DELTA_STRONG_SIZE) == 0) {
+                match = nextBlock;
+            } else {
+                for (uint32_t candidate : it->second) {
+                    if (memcmp(sig.blocks[candidate].strong, strong, DELTA_STRONG_SIZE) == 0) {
+                        match = candidate;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (match >= 0) {
+            if (!writer.literal(data + literalStart, pos - literalStart) ||
+                !writer.copy((uint64_t)match * blockSize, blockSize)) {
+                return false;
+            }
+            pos += blockSize;
+            literalStart = pos;
+            nextBlock = match + 1;
+            fresh = true;
+            continue;
+        }
+
+        // Slide the window one byte
+        if (pos + blockSize < size) {
+            uint8_t out = data[pos];
+            uint8_t in = data[pos + blockSize];
+            a = (a - out + in) & 0xffff;
+            b = (b - (uint32_t)(blockSize * out) + a) & 0xffff;
+        }
+        pos++;
+
+        // Don't let a long unmatched stretch pile up
+        if (pos - literalStart >= maxLiteral) {
+            if (!writer.literal(data + literalStart, pos - literalStart)) {
+                return false;
+            }
+            literalStart = pos;
+        }
+    }
+
+    return writer.literal(data + literalStart, size - literalStart) && writer.flushCopy();
+}
@@ -0,0 +1,116 @@
+#include "listing.h"
+#include "wire.h"
+#include <algorithm>
+
+#define LIST_DESCENDING 0x01
+#define LIST_RESUME 0x02
+
+// Times relative to mtime are small but may be negative
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+void encode_list_query(std::string& out, const ListQuery& query) {
+    out += (char)query.sort;
+    out += (char)((query.descending ? LIST_DESCENDING : 0) | (query.resume ? LIST_RESUME : 0));
+    append_varint(out, query.limit);
+    append_varint(out, query.afterKey);
+    append_varint(out, query.afterName.size());
+    out += query.afterName;
+    append_varint(out, query.modifiedSince);
+    append_varint(out, query.minSize);
+    append_varint(out, query.maxSize);
+}
+
+bool decode_list_query(const std::string& in, ListQuery& query) {
+    query = ListQuery();
+    if (in.empty()) {
+        return true;
+    }
+    const uint8_t* p = (const uint8_t*)in.data();
+    const uint8_t* end = p + in.size();
+    if (in.size() < 2 || p[0] > LIST_BY_SIZE) {
+        return false;
+    }
+    query.sort = p[0];
+    query.descending = p[1] & LIST_DESCENDING;
+    query.resume = p[1] & LIST_RESUME;
+    p += 2;
+
+    uint64_t limit, nameLength;
+    if (!get_varint(p, end, limit) || !get_varint(p, end, query.afterKey) ||
+        !get_varint(p, end, nameLength) || nameLength > (uint64_t)(end - p)) {
+        return false;
+    }
+    query.limit = std::min<uint64_t>(limit, LIST_PAGE_FILES);
+    query.afterName.assign((const char*)p, nameLength);
+    p += nameLength;
+    return get_varint(p, end, query.modifiedSince) && get_varint(p, end, query.minSize) &&
+           get_varint(p, end, query.maxSize) && p == end;
+}
+
+bool list_matches(const ListQuery& query, uint64_t size, uint64_t mtime) {
+    return mtime >= query.modifiedSince && size >= query.minSize && size <= query.maxSize;
+}
+
+uint64_t list_sort_key(const ListQuery& query, uint64_t size, uint64_t mtime) {
+    switch (query.sort) {
+        case LIST_BY_MTIME: return mtime;
+        case LIST_BY_SIZE: return size;
+        default: return 0;
+    }
+}
+
+bool list_before(const ListQuery& query, uint64_t keyA, const std::string& nameA,
+                 uint64_t keyB, const std::string& nameB) {
+    if (query.descending) {
+        return keyA != keyB ? keyA > keyB : nameA > nameB;
+    }
+    return keyA != keyB ? keyA < keyB : nameA < nameB;
+}
+
+void append_list_entry(std::string& page, const std::string& previous, const ListEntry& entry) {
+    size_t shared = 0;
+    size_t most = std::min(previous.size(), entry.name.size());
+    while (shared < most && previous[shared] == entry.name[shared]) {
+        shared++;
+    }
+    append_varint(page, shared);
+    append_varint(page, entry.name.size() - shared);
+    page.append(entry.name, shared, std::string::npos);
+    append_varint(page, entry.size);
+    append_varint(page, entry.mtime);
+    append_varint(page, zigzag((int64_t)(entry.atime - entry.mtime)));
+    append_varint(page, zigzag((int64_t)(entry.ctime - entry.mtime)));
+}
+
+bool parse_list_page(const char* data, size_t length, std::vector<ListEntry>& entries) {
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + length;
+    std::string previous;
+
+    while (p < end) {
+        uint64_t shared, suffix, atime, ctime;
+        ListEntry entry;
+        if (!get_varint(p, end, shared) || !get_varint(p, end, suffix) ||
+            shared > previous.size() || suffix > (uint64_t)(end - p)) {
+            return false;
+        }
+        entry.name.assign(previous, 0, shared);
+        entry.name.append((const char*)p, suffix);
+        p += suffix;
+        if (!get_varint(p, end, entry.size) || !get_varint(p, end, entry.mtime) ||
+            !get_varint(p, end, atime) || !get_varint(p, end, ctime)) {
+            return false;
+        }
+        entry.atime = entry.mtime + unzigzag(atime);
+        entry.ctime = entry.mtime + unzigzag(ctime);
+        previous = entry.name;
+        entries.push_back(std::move(entry));
+    }
+    return true;
+}
@@ -0,0 +1,113 @@
+#include "merkle.h"
+#include "wire.h"
+#include <cstring>
+
+// Position of a name in the tree: the first 32 bits of its hash
+static uint32_t name_key(const std::string& name) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(name.data(), name.size(), digest);
+    return get_u32(digest);
+}
+
+static uint32_t prefix_bits(uint32_t key, int depth) {
+    return depth == 0 ? 0 : key >> (32 - 4 * depth);
+}
+
+static uint64_t node_id(int depth, uint32_t bits) {
+    return ((uint64_t)depth << 32) | bits;
+}
+
+bool MerklePrefix::contains(const std::string& name) const {
+    return prefix_bits(name_key(name), depth) == bits;
+}
+
+bool MerkleNode::operator==(const MerkleNode& other) const {
+    return count == other.count && memcmp(hash, other.hash, sizeof(hash)) == 0;
+}
+
+void MerkleTree::toggle(uint32_t key, const std::string& name, uint64_t version, int delta) {
+    Sha256 ctx;
+    uint8_t v[8];
+    put_u64(v, version);
+    ctx.update(name.data(), name.size());
+    ctx.update(v, sizeof(v));
+    uint8_t leaf[SHA256_DIGEST_SIZE];
+    ctx.final(leaf);
+
+    // XOR adds and removes alike, so only the path to the root changes
+    for (int depth = 0; depth <= MERKLE_DEPTH; depth++) {
+        auto it = nodes.emplace(node_id(depth, prefix_bits(key, depth)), MerkleNode()).first;
+        MerkleNode& node = it->second;
+        node.count += delta;
+        for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+            node.hash[i] ^= leaf[i];
+        }
+        if (node.count == 0) {
+            nodes.erase(it);
+        }
+    }
+}
+
+void MerkleTree::set(const std::string& name, uint64_t version) {
+    uint32_t key = name_key(name);
+    auto it = leaves.find({key, name});
+    if (it != leaves.end()) {
+        if (it->second == version) {
+            return;
+        }
+        toggle(key, name, it->second, -1);
+        it->second = version;
+    } else {
+        leaves.emplace(std::make_pair(key, name), version);
+    }
+    toggle(key, name, version, 1);
+}
+
+void MerkleTree::remove(const std::string& name) {
+    uint32_t key = name_key(name);
+    auto it = leaves.find({key, name});
+    if (it != leaves.end()) {
+        toggle(key, name, it->second, -1);
+        leaves.erase(it);
+    }
+}
+
+MerkleNode MerkleTree::node(const MerklePrefix& prefix) const {
+    auto it = nodes.find(node_id(prefix.depth, prefix.bits));
+    return it != nodes.end() ? it->second : MerkleNode();
+}
+
+std::vector<std::pair<std::string, uint64_t>> MerkleTree::files(const MerklePrefix& prefix) const {
+    // Keys sharing the prefix form one contiguous range
+    int shift = 32 - 4 * prefix.depth;
+    uint64_t first = prefix.depth == 0 ? 0 : (uint64_t)prefix.bits << shift;
+    uint64_t last = prefix.depth == 0 ? UINT32_MAX : first + ((uint64_t)1 << shift) - 1;
+
+    std::vector<std::pair<std::string, uint64_t>> result;
+    for (auto it = leaves.lower_bound({(uint32_t)first, std::string()});
+         it != leaves.end() && it->first.first <= last; ++it) {
+        result.emplace_back(it->first.second, it->second);
+    }
+    return result;
+}
+
+void encode_merkle_prefix(std::string& out, const MerklePrefix& prefix) {
+    out += (char)prefix.depth;
+    append_u32(out, prefix.bits);
+}
+
+bool decode_merkle_prefix(const uint8_t* in, MerklePrefix& prefix) {
+    prefix.depth = in[0];
+    prefix.bits = get_u32(in + 1);
+    return prefix.depth <= MERKLE_DEPTH && prefix.bits < ((uint64_t)1 << (4 * prefix.depth));
+}
+
+void encode_merkle_node(std::string& out, const MerkleNode& node) {
+    append_u32(out, node.count);
+    out.append((const char*)node.hash, sizeof(node.hash));
+}
+
+void decode_merkle_node(const uint8_t* in, MerkleNode& node) {
+    node.count = get_u32(in);
+    memcpy(node.hash, in + 4, sizeof(node.hash));
+}
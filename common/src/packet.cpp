@@ -0,0 +1,136 @@
+#include "packet.h"
+#include "wire.h"
+#include "socket_utils.h"
+#include "common.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <cstring>
+#include <errno.h>
+
+void encode_packet_header(const packet_header& hdr, uint8_t* out) {
+    out[0] = hdr.version;
+    out[1] = hdr.flags;
+    put_u16(out + 2, hdr.type);
+    put_u32(out + 4, hdr.seqn);
+    put_u64(out + 8, hdr.total_size);
+    put_u32(out + 16, hdr.length);
+}
+
+bool decode_packet_header(const uint8_t* in, packet_header& hdr) {
+    hdr.version = in[0];
+    hdr.flags = in[1];
+    hdr.type = get_u16(in + 2);
+    hdr.seqn = get_u32(in + 4);
+    hdr.total_size = get_u64(in + 8);
+    hdr.length = get_u32(in + 16);
+
+    if (hdr.version != PROTOCOL_VERSION) {
+        DEBUG_PRINTF("ERROR: Unsupported protocol version %d\n", hdr.version);
+        return false;
+    }
+    if (hdr.length > PACKET_MAX_PAYLOAD) {
+        DEBUG_PRINTF("ERROR: Invalid payload length: %u (max: %u)\n", hdr.length, PACKET_MAX_PAYLOAD);
+        return false;
+    }
+    return true;
+}
+
+std::string encode_packet(const packet& pkt) {
+    packet_header hdr;
+    hdr.version = PROTOCOL_VERSION;
+    hdr.flags = 0;
+    hdr.type = pkt.type;
+    hdr.seqn = pkt.seqn;
+    hdr.total_size = pkt.total_size;
+    hdr.length = pkt.payload.size();
+
+    std::string frame(PACKET_HEADER_SIZE, '\0');
+    encode_packet_header(hdr, (uint8_t*)&frame[0]);
+    frame += pkt.payload;
+    return frame;
+}
+
+bool send_packet(int sockfd, const packet& pkt) {
+    return send_packet_data(sockfd, pkt.type, pkt.seqn, pkt.total_size,
+                            pkt.payload.data(), pkt.payload.size());
+}
+
+bool send_packet_data(int sockfd, uint16_t type, uint32_t seqn, uint64_t total_size,
+                      const void* data, size_t length) {
+    if (length > PACKET_MAX_PAYLOAD) {
+        DEBUG_PRINTF("ERROR: Payload too large for a single frame: %zu\n", length);
+        return false;
+    }
+
+    packet_header hdr;
+    hdr.version = PROTOCOL_VERSION;
+    hdr.flags = 0;
+    hdr.type = type;
+    hdr.seqn = seqn;
+    hdr.total_size = total_size;
+    hdr.length = length;
+
+    uint8_t head[PACKET_HEADER_SIZE];
+    encode_packet_header(hdr, head);
+
+    struct iovec iov[2];
+    iov[0].iov_base = head;
+    iov[0].iov_len = sizeof(head);
+    iov[1].iov_base = const_cast<void*>(data);
+    iov[1].iov_len = length;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = length > 0 ? 2 : 1;
+
+    size_t remaining = sizeof(head) + length;
+    while (remaining > 0) {
+        ssize_t sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            DEBUG_PRINTF("ERROR: Failed to send frame (type=%d): %s\n", type, strerror(errno));
+            return false;
+        }
+        remaining -= sent;
+
+        // Advance the iovec past what the kernel already accepted
+        while (sent > 0 && msg.msg_iovlen > 0) {
+            if ((size_t)sent >= msg.msg_iov[0].iov_len) {
+                sent -= msg.msg_iov[0].iov_len;
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            } else {
+                msg.msg_iov[0].iov_base = (char*)msg.msg_iov[0].iov_base + sent;
+                msg.msg_iov[0].iov_len -= sent;
+                sent = 0;
+            }
+        }
+    }
+    return true;
+}
+
+bool recv_packet_header(int sockfd, packet_header& hdr) {
+    uint8_t head[PACKET_HEADER_SIZE];
+    if (recv_exact(sockfd, head, sizeof(head)) != sizeof(head)) {
+        return false;
+    }
+    return decode_packet_header(head, hdr);
+}
+
+bool recv_packet(int sockfd, packet& pkt) {
+    packet_header hdr;
+    if (!recv_packet_header(sockfd, hdr)) {
+        return false;
+    }
+
+    pkt.type = hdr.type;
+    pkt.seqn = hdr.seqn;
+    pkt.total_size = hdr.total_size;
+    pkt.payload.resize(hdr.length);
+    if (hdr.length > 0 && recv_exact(sockfd, &pkt.payload[0], hdr.length) != hdr.length) {
+        DEBUG_PRINTF("ERROR: Truncated frame payload (type=%d, length=%u)\n", hdr.type, hdr.length);
+        return false;
+    }
+    return true;
+}
@@ -29,6 +29,19 @@ int create_socket() {
     return sockfd;
 }
 
+int create_bulk_socket() {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (sockfd >= 0) {
+        int flag = 1;
+        if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0) {
+            DEBUG_PRINTF("WARNING: Failed to set TCP_NODELAY: %s\n", strerror(errno));
+        }
+    }
+
+    return sockfd;
+}
+
 int connect_socket(int sockfd, const char* ip, int port) {
     sockaddr_in serv_addr;
     memset(&serv_addr, 0, sizeof(serv_addr));
@@ -48,7 +61,7 @@ int bind_socket(int sockfd, int port) {
 }
 
 int listen_socket(int sockfd) {
-    return listen(sockfd, 10);
+    return listen(sockfd, SOMAXCONN);
 }
 
 int accept_connection(int sockfd) {
@@ -115,3 +128,19 @@ size_t read_all(int sockfd, void* buf, size_t len) {
 
     return total_read;
 }
+
+size_t recv_exact(int sockfd, void* buf, size_t len) {
+    size_t total_read = 0;
+    while (total_read < len) {
+        ssize_t bytes_read = recv(sockfd, (char*)buf + total_read, len - total_read, 0);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read <= 0) {
+            if (bytes_read < 0) {
+                DEBUG_PRINTF("DEBUG Socket: recv error: %s\n", strerror(errno));
+            }
+            break; // Error, timeout or connection closed
+        }
+        total_read += bytes_read;
+    }
+    return total_read;
+}
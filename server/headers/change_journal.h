@@ -0,0 +1,107 @@
+#ifndef CHANGE_JOURNAL_H
+#define CHANGE_JOURNAL_H
+
+#include "file_manager.h"
+#include "group_commit.h"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct JournalChange {
+    uint64_t seq = 0;
+    char op = 0;            // 'U' (written) or 'D' (deleted)
+    std::string filename;
+    uint64_t version = 0;   // 'U': version of the file written
+};
+
+// A change written to the journal but not yet known to be on disk
+struct StagedChange {
+    uint64_t seq = 0;
+    uint64_t ticket = 0;
+};
+
+// Append-only log of the changes to each user's files, numbered from 1 in
+// commit order: files/.journal/<user>.log. A device remembers the last
+// number it has seen (its cursor) and on reconnecting asks only for what
+// came after it.
+//
+// Only the latest change of each file is kept once the log is compacted,
+// which is enough to catch up from any cursor. Deletions are dropped as
+// soon as every device that uses the journal has acknowledged them; a
+// cursor older than that (the floor) gets a full listing instead.
+class ChangeJournal {
+public:
+    explicit ChangeJournal(const std::string& root);
+    ~ChangeJournal();
+
+    // Whether load() has run for this user since the server started
+    bool loaded(const std::string& username);
+
+    // Bring the journal in line with the user's files (the directory lock
+    // held), recording whatever changed without being journaled
+    void load(const std::string& username, const std::vector<FileInfo>& files);
+
+    // Record a change to a file; called with the file locked, after the change
+    void append(const std::string& username, char op, const std::string& filename, uint64_t version);
+
+    // append() in two steps, so that many changes share one flush: stage()
+    // writes the record (file locked, as for append), commit() waits until
+    // it is on disk. Changes are handed out only once committed.
+    StagedChange stage(const std::string& username, char op, const std::string& filename, uint64_t version);
+    bool commit(const std::string& username, const StagedChange& change);
+
+    // Current journal id and head (the last committed change). A listing
+    // taken after this call covers every change up to head.
+    void position(const std::string& username, uint64_t& id, uint64_t& head);
+
+    // Changes after cursor seq, oldest first (latest per file). False when
+    // id names another journal or seq cannot be served from this one.
+    bool changesSince(const std::string& username, uint64_t id, uint64_t seq,
+                      std::vector<JournalChange>& changes, uint64_t& head);
+
+    // A device has seen everything up to seq
+    void acknowledge(const std::string& username, uint64_t device, uint64_t seq);
+
+private:
+    struct DeviceAck {
+        uint64_t seq = 0;
+        uint64_t time = 0;
+    };
+
+    struct UserJournal {
+        std::mutex mutex;
+        std::string path;
+        int fd = -1;
+        bool reconciled = false;
+        uint64_t id = 0;
+        uint64_t floor = 0;     // oldest cursor that can be served
+        uint64_t head = 0;      // number of the last change
+        uint64_t durable = 0;   // number of the last change known to be on disk
+        size_t records = 0;     // records in the log file
+        std::unordered_map<std::string, JournalChange> latest;
+        std::map<uint64_t, std::string> bySeq;
+        std::unordered_map<uint64_t, DeviceAck> devices;
+    };
+
+    UserJournal* user(const std::string& username);
+    void readLog(UserJournal& journal);
+    bool createLog(UserJournal& journal);
+    void apply(UserJournal& journal, char op, uint64_t seq, uint64_t value, uint64_t time,
+               const std::string& name);
+    bool write(UserJournal& journal, char op, uint64_t seq, uint64_t value,
+               const std::string& name);
+    StagedChange record(UserJournal& journal, char op, const std::string& filename, uint64_t version);
+    void maybeCompact(UserJournal& journal);
+    void compact(UserJournal& journal);
+
+    std::string root;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::unique_ptr<UserJournal>> users;
+    GroupCommit logSync;        // keys are log paths
+};
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Length of a chunk hash (raw SHA-256)
+#define CHUNK_HASH_SIZE 32
+
+// Memory for chunk contents kept by the store's cache, shared by all
+// sessions
+#define CHUNK_CACHE_SIZE (64 * 1024 * 1024)
+
+// Chunks of files up to this size enter the cache when written or read;
+// larger files are served from disk unless their chunks are cached already
+#define CHUNK_CACHE_MAX_FILE (16 * 1024 * 1024)
+
+// Chunks up to this size (e.g. the content of a small file, the tail of a
+// large one) are appended to pack segments instead of taking a chunk file
+// and an inode each. The manifests of small files are packed by the
+// FileManager, per user (see PACKED_FILE_MAX_SIZE). 0 stores every chunk
+// as a file of its own.
+#define CHUNK_PACK_MAX_SIZE (16 * 1024)
+
+// A pack segment takes appends until it reaches this size. Full segments
+// less than half referenced are compacted.
+#define PACK_SEGMENT_SIZE (64 * 1024 * 1024)
+
+struct ChunkRef {
+    std::string hash;       // raw SHA-256 of the chunk
+    uint32_t length = 0;
+};
+
+// Contents of one chunk, shared by the cache and its readers
+typedef std::shared_ptr<const std::string> ChunkData;
+
+// LRU of chunk contents bounded by total bytes. Chunks never change under a
+// hash, so entries need no invalidation on writes: a new version has new
+// chunks, and the store drops entries of chunks nothing references.
+class ChunkCache {
+public:
+    explicit ChunkCache(size_t capacity) : capacity(capacity) {}
+
+    // nullptr on a miss
+    ChunkData get(const std::string& hash);
+    void put(const std::string& hash, const ChunkData& data);
+    void erase(const std::string& hash);
+
+private:
+    typedef std::list<std::pair<std::string, ChunkData>> LruList;
+
+    std::mutex mutex;
+    size_t capacity;
+    size_t bytes = 0;
+    LruList lru;    // most recently used first
+    std::unordered_map<std::string, LruList::iterator> entries;
+};
+
+// Content-addressed chunk store shared by all users:
+// files/.chunks/<2 hex digits>/<sha256 hex>, or for small chunks a record
+// (hash, u32 length, content) appended to files/.chunks/packs/<id>.pack.
+// Reference counts are kept in memory; the FileManager rebuilds them from
+// the manifests at startup. A chunk is deleted as soon as nothing
+// references it; a packed one leaves a dead record until its segment is
+// empty or compacted.
+class ChunkStore {
+public:
+    ChunkStore(const std::string& root, const std::string& incomingDir);
+    ~ChunkStore();
+
+    // Take a reference on a chunk the store already has (length is set);
+    // false if it has no such chunk
+    bool acquire(const std::string& hash, uint32_t& length);
+
+    // Store data under its hash and take a reference on it. If the chunk is
+    // already present nothing is written. With cache set the content also
+    // enters the cache, for the devices that will download it next.
+    bool put(const std::string& hash, const char* data, size_t length, bool cache);
+
+    void release(const std::string& hash);
+
+    bool contains(const std::string& hash);
+
+    // Descriptor for reading a chunk the caller holds a reference on; the
+    // chunk starts at offset (within a pack segment)
+    int open(const std::string& hash, uint64_t& offset);
+
+    // Contents of a chunk the caller holds a reference on: cached() only if
+    // the cache has it, load() reading it into the cache otherwise (nullptr
+    // if that fails)
+    ChunkData cached(const std::string& hash);
+    ChunkData load(const std::string& hash, uint32_t length);
+
+    // Flush every chunk written so far to disk (before a manifest names them)
+    bool sync();
+
+    // Startup, once every manifest has acquired its chunks: delete the rest
+    void sweep();
+
+    // Move the live records of mostly dead segments into the segment taking
+    // appends, and delete them once the copies are on disk
+    void compact();
+
+private:
+    struct Entry {
+        uint32_t refs = 0;
+        uint32_t length = 0;
+        uint32_t pack = 0;      // segment holding it, 0 for a chunk file
+        uint64_t offset = 0;    // of the content in the segment
+    };
+
+    struct Segment {
+        int fd = -1;
+        uint64_t size = 0;      // end of the last valid record
+        uint64_t live = 0;      // bytes of records still referenced
+        bool compacting = false;
+    };
+
+    std::string chunkPath(const std::string& hash);
+    std::string packPath(uint32_t id);
+
+    // Index the records of every segment (constructor)
+    void loadPacks();
+
+    // With mutex held: append a record, or account for one going dead
+    bool appendPacked(const std::string& hash, const char* data, uint32_t length, Entry& chunk);
+    void dropPacked(const Entry& chunk);
+
+    std::string root;
+    std::string incomingDir;
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> chunks;
+    std::map<uint32_t, Segment> segments;   // by id
+    uint32_t activePack = 0;                // taking appends, 0 for none yet
+
+    ChunkCache cache;
+};
+
+// An opened stored file: the chunk list of its manifest. It holds a
+// reference on every chunk, so the content stays readable while the file is
+// replaced or deleted underneath it.
+class StoredFile {
+public:
+    StoredFile(ChunkStore& store, std::vector<ChunkRef> chunks, uint64_t version);
+    ~StoredFile();
+    StoredFile(const StoredFile&) = delete;
+    StoredFile& operator=(const StoredFile&) = delete;
+
+    uint64_t size() const { return fileSize; }
+    uint64_t version() const { return fileVersion; }   // changes on every commit
+    const std::vector<ChunkRef>& chunks() const { return chunkList; }
+    uint64_t chunkOffset(size_t index) const { return offsets[index]; }
+
+    // Index of the chunk holding offset (offset < size())
+    size_t chunkAt(uint64_t offset) const;
+
+    // Read [offset, offset+length) across chunk boundaries. Not thread-safe
+    // (keeps the last chunk open).
+    bool read(uint64_t offset, void* buffer, size_t length);
+
+    // Contents of one chunk from the store's cache, read into it on a miss
+    // if this file is small enough to be cached. nullptr otherwise: the
+    // chunk is then read from openChunk().
+    ChunkData chunkData(size_t index) const;
+
+    // Descriptor of one chunk, which starts at offset in it (caller closes it)
+    int openChunk(size_t index, uint64_t& offset) const;
+
+private:
+    ChunkStore& store;
+    std::vector<ChunkRef> chunkList;
+    std::vector<uint64_t> offsets;
+    uint64_t fileSize = 0;
+    uint64_t fileVersion = 0;
+
+    int cachedFd = -1;
+    size_t cachedIndex = 0;
+    uint64_t cachedBase = 0;
+};
+typedef std::shared_ptr<StoredFile> StoredFilePtr;
+
+#endif
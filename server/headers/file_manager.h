@@ -1,32 +1,154 @@
 #ifndef FILE_MANAGER_H
 #define FILE_MANAGER_H
 
+#include "chunk_store.h"
+#include "chunker.h"
+#include "group_commit.h"
+#include "listing.h"
+#include "merkle.h"
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <sys/stat.h>
+#include <cstdint>
+#include <ctime>
 
 struct FileInfo {
     std::string filename;
-    time_t mtime;  // modification time
-    time_t atime;  // access time
-    time_t ctime;  // change time
-    size_t size;
+    struct timespec mtime = {};  // modification time
+    struct timespec atime = {};  // access time
+    struct timespec ctime = {};  // change time
+    size_t size = 0;
+    uint64_t version = 0;  // changes on every commit (see StoredFile::version)
+    uint8_t contentHash[CHUNK_HASH_SIZE] = {};  // SHA-256 of the chunk list
 };
 
+// Files up to this size keep their manifest as a record in the user's pack
+// (files/.packs/<user>.pack) rather than as a file of their own, so a small
+// file costs no inode and no directory entry. 0 gives every file a
+// manifest file.
+#define PACKED_FILE_MAX_SIZE (16 * 1024)
+
+struct PackRecord;
+
+// In-flight streaming upload: data is cut into chunks as it arrives and
+// each chunk goes to the store; the commit writes the manifest that
+// atomically replaces the target (a file, or a record in the user's pack)
+struct UploadHandle {
+    bool active = false;
+    std::string username;
+    std::string filename;
+    std::string finalPath;
+    uint64_t size = 0;              // expected size
+    uint64_t written = 0;           // bytes appended so far
+    uint64_t version = 0;           // set by a successful commit
+    bool packed = false;            // manifest goes to the user's pack
+    CdcChunker chunker;
+    std::string pending;            // bytes of the chunk not cut yet
+    std::vector<ChunkRef> chunks;   // chunks so far, each holding a store reference
+
+    // Between the steps of a commit (see prepareCommit)
+    bool prepared = false;          // manifest ready, not yet in place
+    std::string manifestPath;       // written, not yet in place (manifest files)
+    struct stat manifestStat;
+    uint64_t ticket = 0;            // of the group commit step it waits on
+    bool synced = false;            // chunks and manifest are durable
+    std::vector<ChunkRef> replaced; // the previous version's, released once durable
+};
+
+// Upload whose ranges arrive in any order, possibly over several
+// connections: they are written at their offsets into a temp file, which
+// is cut into chunks once complete
+struct StripedUpload {
+    std::string username;
+    std::string filename;
+    uint64_t size = 0;
+    uint64_t owner = 0;             // session token of the uploading device
+    int fd = -1;
+    std::string tempPath;
+
+    std::mutex mutex;
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;  // [offset, end) written so far
+
+    ~StripedUpload();
+};
+typedef std::shared_ptr<StripedUpload> StripedUploadPtr;
+
 class FileManager {
 public:
     FileManager();
+    ~FileManager();
     
     // Initialize user directory
     bool initUserDirectory(const std::string& username);
     
     // List files in user's sync directory
     std::vector<FileInfo> listUserFiles(const std::string& username);
+
+    // One page of a listing: the first query.limit files matching the
+    // query, in its order. more is set if further files match.
+    std::vector<FileInfo> listPage(const std::string& username, const ListQuery& query, bool& more);
     
     // Upload a file to user's directory
     bool saveFile(const std::string& username, const std::string& filename, 
                  const char* data, size_t size);
     
+    // Streaming upload: append data, then write the manifest into the user
+    // directory (or drop the chunks taken so far)
+    bool beginUpload(const std::string& username, const std::string& filename,
+                     uint64_t size, UploadHandle& upload);
+    bool writeUpload(UploadHandle& upload, const char* data, size_t size);
+    bool commitUpload(UploadHandle& upload);
+    void abortUpload(UploadHandle& upload);
+
+    // The steps of commitUpload, for callers committing many uploads: doing
+    // each step for all of them before the next lets them share one data
+    // sync and one directory sync, as concurrent commits do. The waits block
+    // on the disk, so none of this belongs on an I/O thread.
+    //   prepareCommit   write the manifest next to the user directories
+    //   syncPrepared    wait until chunks and manifest are durable
+    //   publishUpload   move it into place, or append it to the user's pack
+    //                   (caller holds the file lock)
+    //   finishCommit    wait until the rename or the append is durable
+    bool prepareCommit(UploadHandle& upload);
+    bool syncPrepared(UploadHandle& upload);
+    bool publishUpload(UploadHandle& upload);
+    bool finishCommit(UploadHandle& upload);
+
+    // Striped uploads: begin returns the id the ranges name; finish checks
+    // every byte arrived and feeds the temp file into a streaming upload the
+    // caller commits. Uploads of a device that disconnects are dropped.
+    bool beginStripedUpload(const std::string& username, const std::string& filename,
+                            uint64_t size, uint64_t owner, uint64_t& id);
+    bool writeStripedRange(const std::string& username, uint64_t id, uint64_t offset,
+                           const char* data, size_t size);
+    bool finishStripedUpload(const std::string& username, uint64_t id, UploadHandle& upload);
+    void abortStripedUploads(uint64_t owner);
+
+    // Delta uploads: append [offset, offset+length) of the previous version.
+    // Whole chunks of the base are shared rather than copied.
+    bool copyUploadRange(UploadHandle& upload, StoredFile& base, uint64_t offset, uint64_t length);
+
+    // Append a chunk the store already holds (CHUNK_REF); false if it has no
+    // such chunk of that length
+    bool appendStoredChunk(UploadHandle& upload, const std::string& hash, uint32_t length);
+
+    // Whether an upload could reference this chunk instead of sending it
+    bool hasChunk(const std::string& hash);
+
+    // Listings, existence checks and opens are answered from an in-memory
+    // index of every user's files, kept by commits and deletes; none of
+    // them touches the user directory.
+
+    // Open a file for reading, or nullptr with errno set (ENOENT when the
+    // file does not exist)
+    StoredFilePtr openFile(const std::string& username, const std::string& filename);
+
     // Get file content
     bool getFile(const std::string& username, const std::string& filename, 
                 char* buffer, size_t& size);
@@ -40,11 +162,92 @@ public:
     // Get file info
     FileInfo getFileInfo(const std::string& username, const std::string& filename);
     
+    // The user's Merkle tree (see merkle.h), kept current by every commit
+    // and delete: the children of a node, and the files under one
+    void merkleChildren(const std::string& username, const MerklePrefix& prefix,
+                        MerkleNode children[MERKLE_FANOUT]);
+    std::vector<std::pair<std::string, uint64_t>> merkleFiles(const std::string& username,
+                                                             const MerklePrefix& prefix);
+
     // Propagate file to all connected devices
     void propagateFileChange(const std::string& username, const std::string& filename, 
                            int excludeSocketFd = -1);
 
 private:
+    // Cut data into chunks and store every completed one
+    bool feedUpload(UploadHandle& upload, const char* data, size_t size);
+    bool storeChunk(UploadHandle& upload, const char* data, size_t size);
+
+    struct IndexedFile {
+        FileInfo info;
+        std::vector<ChunkRef> chunks;   // as in the manifest (its references)
+        uint64_t packOffset = 0;        // its record in the user's pack,
+        uint32_t packLength = 0;        // 0 length for a manifest file
+    };
+
+    // A user's files, the Merkle tree over them, and whether they changed
+    // since the last snapshot (files/.index/<user>). The pack is appended
+    // to under indexMutex only.
+    struct UserIndex {
+        std::map<std::string, IndexedFile> files;   // by name
+        MerkleTree tree;
+        bool dirty = false;
+        int packFd = -1;                // opened on first use
+        uint64_t packIno = 0;
+        uint64_t packSize = 0;
+        uint64_t packLive = 0;          // bytes of the records files point at
+    };
+
+    // Startup: index every user directory from its snapshot when the
+    // directory and pack have not changed since, by reading every
+    // manifest and replaying the pack when they have. Either way the
+    // manifests' chunk references are taken.
+    void loadUserFiles();
+    bool loadSnapshot(const std::string& username, UserIndex& index);
+    void scanUserDirectory(const std::string& username, UserIndex& index);
+    bool importFile(const std::string& path);
+
+    // User packs: a log of manifest records, 'P' (the file is this) and
+    // 'D' (the file is gone or has a manifest file again). Replayed at
+    // startup when there is no valid snapshot; compacted by the snapshot
+    // thread once mostly dead.
+    bool openPack(const std::string& username, UserIndex& index);
+    bool appendPack(const std::string& username, UserIndex& index, PackRecord& record,
+                    uint64_t& offset, uint32_t& length);
+    void replayPack(const std::string& username, UserIndex& index);
+    void compactPacks();
+
+    // Snapshot thread: writes the index of users that changed and
+    // compacts the user packs and the chunk store's pack segments
+    void snapshotLoop();
+    void writeSnapshots();
+
+    ChunkStore store;
+
+    // Group commits of uploads: chunks and manifests (one syncfs), then
+    // the directories renamed into and the user packs appended to (one
+    // fsync each)
+    GroupCommit dataSync;
+    GroupCommit dirSync;
+
+    std::mutex stripedMutex;
+    std::map<uint64_t, StripedUploadPtr> striped;  // by id
+    uint64_t nextStripedId = 1;
+
+    // Renames into and out of user directories happen under indexMutex
+    // together with the index update, so the two never disagree
+    std::mutex indexMutex;
+    std::unordered_map<std::string, UserIndex> users;
+
+    std::mutex snapshotMutex;
+    std::condition_variable snapshotCv;
+    bool stopping = false;
+    std::thread snapshotThread;
+
+    std::string getIncomingDir();
+    std::string getIndexDir();
+    std::string getPackDir();
+    std::string getPackPath(const std::string& username);
     std::string getUserDir(const std::string& username);
     std::string getFilePath(const std::string& username, const std::string& filename);
 };
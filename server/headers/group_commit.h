@@ -0,0 +1,49 @@
+#ifndef GROUP_COMMIT_H
+#define GROUP_COMMIT_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+
+// Longest a flush waits for more commits to join it, and only when the
+// previous flush served more than one (concurrent uploads)
+#define GROUP_COMMIT_WINDOW_US 2000
+
+// Group commit: one flush makes the writes of every commit that asked for
+// it durable. A commit takes a ticket once its writes are issued and waits
+// on it; whoever finds no flush running leads the next one, and commits
+// arriving meanwhile are served by the flush after it. A ticket already
+// covered by a finished flush does not wait at all, so a caller committing
+// many files marks them all before waiting on the first.
+class GroupCommit {
+public:
+    // flush gets the keys (e.g. directories) marked since the last one
+    typedef std::function<bool(const std::set<std::string>&)> Flush;
+
+    explicit GroupCommit(Flush flush);
+
+    // Ticket for the writes issued so far, plus key if not empty
+    uint64_t mark(const std::string& key = std::string());
+
+    // Blocks until a flush begun after ticket was handed out has finished;
+    // false if it failed
+    bool wait(uint64_t ticket);
+
+private:
+    Flush flush;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint64_t issued = 0;            // last ticket handed out
+    uint64_t durable = 0;           // last ticket covered by a finished flush
+    uint64_t failedThrough = 0;     // tickets up to this may have been lost
+    bool flushing = false;
+    std::set<std::string> keys;     // marked since the running flush began
+    size_t waiting = 0;             // callers blocked in wait()
+    size_t lastBatch = 0;           // callers served by the last flush
+};
+
+#endif
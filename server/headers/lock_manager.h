@@ -0,0 +1,77 @@
+#ifndef LOCK_MANAGER_H
+#define LOCK_MANAGER_H
+
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+enum LockMode {
+    LOCK_READ,      // shared: any number of readers at once
+    LOCK_WRITE      // exclusive
+};
+
+// Hands out per-user reader/writer locks and per-file locks inside each
+// user directory, so different users never contend and operations on
+// different files of the same user only share the directory lock.
+//
+//   directory read   listing, initial sync
+//   directory write  whole-directory changes (blocks every file of the user)
+//   file read        download       (directory read + file read)
+//   file write       upload commit, delete (directory read + file write)
+//
+// Locks are meant to be held across short filesystem operations only,
+// never while waiting on the network.
+class LockManager {
+public:
+    LockManager();
+    ~LockManager();
+
+    struct UserEntry;
+
+private:
+    friend class DirLock;
+    friend class FileLock;
+
+    UserEntry* user(const std::string& username);
+    std::shared_mutex* acquireFile(UserEntry* entry, const std::string& filename);
+    void releaseFile(UserEntry* entry, const std::string& filename);
+
+    std::mutex usersMutex;
+    std::unordered_map<std::string, std::unique_ptr<UserEntry>> users;
+};
+
+// Scoped lock on a user's directory
+class DirLock {
+public:
+    DirLock(LockManager& manager, const std::string& username, LockMode mode);
+    ~DirLock();
+
+    DirLock(const DirLock&) = delete;
+    DirLock& operator=(const DirLock&) = delete;
+
+private:
+    LockManager::UserEntry* entry;
+    LockMode mode;
+};
+
+// Scoped lock on one file of a user (holds the directory lock shared)
+class FileLock {
+public:
+    FileLock(LockManager& manager, const std::string& username,
+             const std::string& filename, LockMode mode);
+    ~FileLock();
+
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+private:
+    LockManager& manager;
+    LockManager::UserEntry* entry;
+    std::string filename;
+    std::shared_mutex* fileMutex;
+    LockMode mode;
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "packet.h"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct IoThread;
+struct Session;
+
+// Stop reading a peer's input while this much output is waiting for it, so
+// a client that sends commands without reading the replies is throttled by
+// TCP instead of growing the server's memory
+#define OUTPUT_QUEUE_LIMIT (16 * 1024 * 1024)
+
+// Open file whose contents are sent straight from the page cache.
+// Closed once the last output segment referring to it is gone.
+struct FileBody {
+    int fd;
+    explicit FileBody(int fd) : fd(fd) {}
+    ~FileBody();
+    FileBody(const FileBody&) = delete;
+    FileBody& operator=(const FileBody&) = delete;
+};
+typedef std::shared_ptr<FileBody> FileBodyPtr;
+
+// Output classes. At every frame boundary the next frame comes from the
+// first class that has one, so replies never wait behind queued
+// notifications and neither waits behind file data.
+enum OutClass {
+    OUT_CONTROL,    // replies to commands
+    OUT_METADATA,   // notifications, listings
+    OUT_BULK,       // file contents
+    OUT_CLASSES
+};
+
+// One entry of a connection's output queue: either encoded bytes or a
+// range of a file that goes out with sendfile()
+struct OutSegment {
+    std::string bytes;
+    FileBodyPtr file;
+    uint64_t fileOffset = 0;
+    size_t fileLength = 0;
+    bool frameEnd = true;   // false for a header whose body follows
+
+    size_t size() const { return file ? fileLength : bytes.size(); }
+};
+
+// Per-connection state. Each connection is owned by exactly one I/O thread;
+// only the output buffer may be touched by other threads (under outMutex).
+struct Connection {
+    int fd = -1;
+    IoThread* owner = nullptr;
+
+    // Input side (owner thread only)
+    std::string inbuf;              // bytes received but not yet parsed
+    std::atomic<bool> readPaused{false}; // stop parsing commands (e.g. during a download)
+
+    // Output side (guarded by outMutex)
+    std::mutex outMutex;
+    std::deque<OutSegment> outq[OUT_CLASSES]; // frames waiting for the socket
+    int outClass = -1;              // class of the frame being sent; -1 between frames
+    size_t outOffset = 0;           // bytes of outq[outClass].front() already sent
+    size_t outPending = 0;          // unsent bytes across the whole queue
+    uint32_t eventMask = 0;         // interest currently registered with epoll
+    bool closeAfterFlush = false;
+    std::atomic<bool> closed{false};
+
+    // Protocol-layer state, attached by ReactorHandler::onOpen
+    std::shared_ptr<Session> session;
+};
+typedef std::shared_ptr<Connection> ConnectionPtr;
+
+// Protocol callbacks. All of them run on the I/O thread that owns the
+// connection and must never block on the socket.
+class ReactorHandler {
+public:
+    virtual ~ReactorHandler() {}
+
+    // A new connection was adopted by its I/O thread
+    virtual void onOpen(const ConnectionPtr& conn) = 0;
+
+    // A complete frame arrived. Returning false closes the connection.
+    virtual bool onPacket(const ConnectionPtr& conn, packet& pkt) = 0;
+
+    // The output buffer ran low; a streaming transfer may queue more data.
+    virtual void onWritable(const ConnectionPtr& conn) = 0;
+
+    // The connection is going away (peer closed, error or closeAfterFlush).
+    virtual void onClose(const ConnectionPtr& conn) = 0;
+};
+
+// Event-driven server core: one acceptor plus a small fixed pool of epoll
+// I/O threads that own all session sockets.
+class Reactor {
+public:
+    Reactor(ReactorHandler& handler, int numThreads);
+    ~Reactor();
+
+    // Accept connections on listenFd forever
+    void run(int listenFd);
+
+    // Queue a frame for conn. Safe to call from any thread.
+    static void queuePacket(const ConnectionPtr& conn, const packet& pkt,
+                            OutClass cls = OUT_CONTROL);
+    static void queueData(const ConnectionPtr& conn, uint16_t type, uint32_t seqn,
+                          uint64_t total_size, const void* data, size_t length,
+                          OutClass cls = OUT_BULK);
+
+    // Queue a frame whose payload is [offset, offset+length) of file. The
+    // payload is sent with sendfile() and never copied into user space.
+    static void queueFileData(const ConnectionPtr& conn, uint16_t type, uint32_t seqn,
+                              uint64_t total_size, const FileBodyPtr& file,
+                              uint64_t offset, size_t length, OutClass cls = OUT_BULK);
+
+    // Bytes still waiting in conn's output buffer
+    static size_t pendingOutput(const ConnectionPtr& conn);
+
+    // Have the owner thread call onWritable soon. Safe to call from any thread.
+    static void requestWritable(const ConnectionPtr& conn);
+
+    // Owner thread only: stop/resume dispatching incoming frames
+    static void pauseReading(const ConnectionPtr& conn);
+    static void resumeReading(const ConnectionPtr& conn);
+
+    // Close once everything queued so far has been written
+    static void closeAfterFlush(const ConnectionPtr& conn);
+
+private:
+    ReactorHandler& handler;
+    std::vector<IoThread*> threads;
+    size_t nextThread;
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "reactor.h"
+#include "file_manager.h"
+#include "packet.h"
+#include <atomic>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// States of the per-session protocol state machine. Downloads are not a
+// state: they run as streams alongside whatever the session does next.
+enum ConnState {
+    CONN_AWAIT_LOGIN,   // waiting for CMD_LOGIN
+    CONN_READY,         // idle, next frame is a command
+    CONN_UPLOADING,     // receiving the frames of an upload (commands still accepted)
+    CONN_WORKING        // a worker thread is preparing the reply
+};
+
+// A file being streamed out. Each stream is identified by the seqn of the
+// CMD_DOWNLOAD that opened it and sends only as far as the client has
+// granted credit (STREAM_WINDOW), so a device reading one stream slowly
+// cannot make the others wait.
+struct DownloadStream {
+    StoredFilePtr file;
+    uint64_t offset = 0;    // bytes queued so far
+    uint64_t end = 0;       // stop here (the file size unless a range was asked for)
+    int64_t credit = 0;     // bytes the client will still take
+
+    // CMD_DOWNLOAD_BUNDLE: these files instead of one, packed into frames
+    // of whole entries; offset and end then count bytes of the bundle
+    std::vector<std::pair<std::string, StoredFilePtr>> bundle;
+    size_t nextEntry = 0;
+};
+
+// Counters kept for the lifetime of a session
+struct SessionStats {
+    time_t connectedAt = 0;
+    std::atomic<uint64_t> commands{0};
+    std::atomic<uint64_t> bytesUploaded{0};
+    std::atomic<uint64_t> bytesDownloaded{0};
+    std::atomic<uint64_t> notifications{0};
+};
+
+struct UserSessions;
+
+// One connected device. Reached from its Connection in O(1) on every frame;
+// the socket and outbound queue live in the Connection.
+struct Session {
+    int fd = -1;
+    ConnectionPtr conn;
+    std::string username;                   // set at login
+    std::shared_ptr<UserSessions> user;     // devices of the same user (atomic_load/atomic_store)
+    uint64_t token = 0;                     // lets the device attach data connections
+    bool auxiliary = false;                 // a data connection of another session
+    SessionStats stats;
+
+    // Protocol state machine (owner I/O thread only)
+    ConnState state = CONN_AWAIT_LOGIN;
+    packet pending;                 // command that started the current upload
+    UploadHandle upload;            // chunks an upload streams into
+    StoredFilePtr deltaBase;        // previous version a delta upload copies from
+    uint64_t transferOffset = 0;    // bytes of the upload received so far
+    std::string bundleResults;      // CMD_UPLOAD_BUNDLE: status u8 + version u64 per entry
+    bool bundleBroken = false;      // a malformed frame; the rest is drained
+    std::map<uint32_t, DownloadStream> downloads;  // by seqn
+    uint32_t lastDownload = 0;      // stream served last (round robin)
+
+    // CONN_WORKING (or a login being completed): set by the worker once
+    // jobReply is ready. The session then goes to jobState. Reading is paused
+    // meanwhile, so the worker may use the upload state above until it sets
+    // jobDone.
+    std::atomic<bool> jobDone{false};
+    packet jobReply;                // sent if type is set
+    ConnState jobState = CONN_READY;
+
+    // Notifications from other devices wait here until the owner thread can
+    // put them on the wire between two of this session's own frames. Bounded;
+    // on overflow the queue is dropped and needsResync set (guarded by notifyMutex).
+    std::mutex notifyMutex;
+    std::deque<packet> notifyQueue;
+    size_t pushedBytes = 0;                 // SYNC_PUSH payloads in notifyQueue
+    bool needsResync = false;
+    std::atomic<bool> push{false};          // wants small files pushed (CMD_PUSH)
+};
+typedef std::shared_ptr<Session> SessionPtr;
+
+// Immutable snapshot of a user's connected devices. Readers never lock: a
+// login or logout publishes a new list and the old one lives on until the
+// last reader drops it.
+typedef std::vector<SessionPtr> DeviceList;
+typedef std::shared_ptr<const DeviceList> DeviceListPtr;
+
+struct UserSessions {
+    DeviceListPtr devices;  // only touched through std::atomic_load/atomic_store
+};
+
+class SessionRegistry {
+public:
+    // A new connection was accepted
+    SessionPtr open(const ConnectionPtr& conn);
+
+    // Attach session to username's device list; false if the user already
+    // has maxDevices sessions
+    bool login(const SessionPtr& session, const std::string& username, size_t maxDevices);
+
+    // Make session a data connection of the device that logged in with
+    // token: it acts for the same user but is not one of its devices
+    // (no notifications, not counted against the limit). False if no
+    // device has that token.
+    bool attach(const SessionPtr& session, uint64_t token);
+
+    // The connection is gone; detaches the session from its user
+    void close(const SessionPtr& session);
+
+    // Current devices of the session's user. Lock-free and safe from any
+    // thread, e.g. a worker finishing a job while the connection closes
+    static DeviceListPtr devices(const SessionPtr& session);
+
+    // Number of open sessions
+    size_t count();
+
+private:
+    // Writers only (open/login/close); the fan-out path never takes it
+    std::mutex mutex;
+    std::unordered_map<int, SessionPtr> byFd;
+    std::unordered_map<std::string, std::shared_ptr<UserSessions>> users;
+    std::unordered_map<uint64_t, SessionPtr> byToken;
+    std::mt19937_64 tokens{std::random_device{}()};
+};
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A few threads for work that would stall an I/O thread (hashing a whole
+// file, long disk reads). Jobs hand their results back through the reactor.
+class WorkerPool {
+public:
+    explicit WorkerPool(int numThreads);
+    ~WorkerPool();
+
+    void submit(std::function<void()> job);
+
+private:
+    void run();
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> jobs;
+    std::vector<std::thread> threads;
+    bool stopping;
+};
+
+#endif
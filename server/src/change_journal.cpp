@@ -0,0 +1,366 @@
+#include "change_journal.h"
+#include "wire.h"
+#include "common.h"
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <random>
+#include <cstring>
+#include <ctime>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+#define JOURNAL_MAGIC "SYNCJRN1"
+#define JOURNAL_HEADER_SIZE 24      // magic, journal id, floor
+#define JOURNAL_RECORD_SIZE 27      // op, seq, value, time, name length (+ name)
+
+// Compact once the log holds this many records beyond twice the live ones
+#define JOURNAL_COMPACT_SLACK 1024
+
+// A device that has not acknowledged anything for this long no longer
+// holds deletions back; if it returns it gets a full listing
+#define JOURNAL_DEVICE_EXPIRY (30 * 24 * 3600)
+
+// Flush the logs of a group commit
+static bool sync_logs(const std::set<std::string>& paths) {
+    bool ok = true;
+    for (const auto& path : paths) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fdatasync(fd) != 0) {
+            std::cerr << "ERROR: Failed to sync journal " << path << ": " << strerror(errno) << std::endl;
+            ok = false;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return ok;
+}
+
+ChangeJournal::ChangeJournal(const std::string& root) : root(root), logSync(sync_logs) {
+    std::error_code ec;
+    fs::create_directories(root, ec);
+}
+
+ChangeJournal::~ChangeJournal() {
+    for (auto& entry : users) {
+        if (entry.second->fd >= 0) {
+            close(entry.second->fd);
+        }
+    }
+}
+
+ChangeJournal::UserJournal* ChangeJournal::user(const std::string& username) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& journal = users[username];
+    if (!journal) {
+        journal.reset(new UserJournal());
+        journal->path = root + "/" + username + ".log";
+        readLog(*journal);
+    }
+    return journal.get();
+}
+
+static std::string encode_header(uint64_t id, uint64_t floor) {
+    std::string header(JOURNAL_MAGIC);
+    append_u64(header, id);
+    append_u64(header, floor);
+    return header;
+}
+
+static std::string encode_record(char op, uint64_t seq, uint64_t value, uint64_t time,
+                                 const std::string& name) {
+    std::string rec(1, op);
+    append_u64(rec, seq);
+    append_u64(rec, value);
+    append_u64(rec, time);
+    uint8_t len[2];
+    put_u16(len, name.size());
+    rec.append((const char*)len, sizeof(len));
+    rec += name;
+    return rec;
+}
+
+bool ChangeJournal::createLog(UserJournal& journal) {
+    std::random_device random;
+    journal.id = ((uint64_t)random() << 32) | random();
+    journal.floor = journal.head = journal.durable = 0;
+    journal.records = 0;
+    journal.latest.clear();
+    journal.bySeq.clear();
+    journal.devices.clear();
+
+    std::string header = encode_header(journal.id, journal.floor);
+    if (ftruncate(journal.fd, 0) != 0 ||
+        ::write(journal.fd, header.data(), header.size()) != (ssize_t)header.size()) {
+        std::cerr << "ERROR: Failed to create journal " << journal.path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void ChangeJournal::readLog(UserJournal& journal) {
+    journal.fd = open(journal.path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journal.fd < 0) {
+        std::cerr << "ERROR: Failed to open journal " << journal.path << ": " << strerror(errno) << std::endl;
+        return;
+    }
+
+    std::string data;
+    char buffer[64 * 1024];
+    ssize_t n;
+    while ((n = pread(journal.fd, buffer, sizeof(buffer), data.size())) > 0) {
+        data.append(buffer, n);
+    }
+
+    if (data.size() < JOURNAL_HEADER_SIZE || data.compare(0, 8, JOURNAL_MAGIC) != 0) {
+        // New user (or unreadable log): devices holding a cursor resync once
+        createLog(journal);
+        return;
+    }
+    const uint8_t* p = (const uint8_t*)data.data();
+    journal.id = get_u64(p + 8);
+    journal.floor = journal.head = get_u64(p + 16);
+
+    size_t offset = JOURNAL_HEADER_SIZE;
+    while (offset + JOURNAL_RECORD_SIZE <= data.size()) {
+        const uint8_t* rec = p + offset;
+        size_t nameLength = get_u16(rec + 25);
+        if (offset + JOURNAL_RECORD_SIZE + nameLength > data.size()) {
+            break;
+        }
+        std::string name((const char*)rec + JOURNAL_RECORD_SIZE, nameLength);
+        apply(journal, rec[0], get_u64(rec + 1), get_u64(rec + 9), get_u64(rec + 17), name);
+        offset += JOURNAL_RECORD_SIZE + nameLength;
+    }
+
+    if (offset != data.size()) {
+        // A record torn by a crash; its change is found again by load()
+        DEBUG_PRINTF("WARN Server: Dropping %zu bytes at the end of %s\n",
+                     data.size() - offset, journal.path.c_str());
+        if (ftruncate(journal.fd, offset) != 0) {
+            std::cerr << "ERROR: Failed to truncate journal " << journal.path << std::endl;
+        }
+    }
+    journal.durable = journal.head;
+}
+
+void ChangeJournal::apply(UserJournal& journal, char op, uint64_t seq, uint64_t value, uint64_t time,
+                          const std::string& name) {
+    journal.records++;
+    if (op == 'A') {
+        DeviceAck& ack = journal.devices[value];
+        ack.seq = seq;
+        ack.time = time;
+        return;
+    }
+
+    auto it = journal.latest.find(name);
+    if (it != journal.latest.end()) {
+        journal.bySeq.erase(it->second.seq);
+    }
+    JournalChange& change = journal.latest[name];
+    change.seq = seq;
+    change.op = op;
+    change.filename = name;
+    change.version = value;
+    journal.bySeq[seq] = name;
+    journal.head = std::max(journal.head, seq);
+}
+
+bool ChangeJournal::write(UserJournal& journal, char op, uint64_t seq, uint64_t value,
+                          const std::string& name) {
+    uint64_t now = time(nullptr);
+    std::string rec = encode_record(op, seq, value, now, name);
+    if (journal.fd < 0 || ::write(journal.fd, rec.data(), rec.size()) != (ssize_t)rec.size()) {
+        std::cerr << "ERROR: Failed to append to journal " << journal.path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    apply(journal, op, seq, value, now, name);
+    return true;
+}
+
+// Write a change; it is handed out once a flush covering its ticket is done
+StagedChange ChangeJournal::record(UserJournal& journal, char op, const std::string& filename, uint64_t version) {
+    StagedChange change;
+    if (!write(journal, op, journal.head + 1, version, filename)) {
+        return change;
+    }
+    change.seq = journal.head;
+    change.ticket = logSync.mark(journal.path);
+    maybeCompact(journal);
+    return change;
+}
+
+// Acknowledgements grow the log as much as changes do, so both check
+void ChangeJournal::maybeCompact(UserJournal& journal) {
+    if (journal.records > 2 * journal.latest.size() + journal.devices.size() + JOURNAL_COMPACT_SLACK) {
+        compact(journal);
+    }
+}
+
+bool ChangeJournal::loaded(const std::string& username) {
+    UserJournal* journal = user(username);
+    std::lock_guard<std::mutex> lock(journal->mutex);
+    return journal->reconciled;
+}
+
+void ChangeJournal::load(const std::string& username, const std::vector<FileInfo>& files) {
+    UserJournal* journal = user(username);
+    std::lock_guard<std::mutex> lock(journal->mutex);
+    if (journal->reconciled) {
+        return;
+    }
+    journal->reconciled = true;
+
+    // Files replaced or added behind the journal's back (a crash right after
+    // a commit, files from older versions)
+    std::unordered_map<std::string, uint64_t> present;
+    for (const auto& file : files) {
+        present[file.filename] = file.version;
+        auto it = journal->latest.find(file.filename);
+        if (it == journal->latest.end() || it->second.op != 'U' || it->second.version != file.version) {
+            record(*journal, 'U', file.filename, file.version);
+        }
+    }
+
+    std::vector<std::string> gone;
+    for (const auto& entry : journal->latest) {
+        if (entry.second.op == 'U' && present.count(entry.first) == 0) {
+            gone.push_back(entry.first);
+        }
+    }
+    for (const auto& filename : gone) {
+        record(*journal, 'D', filename, 0);
+    }
+    if (journal->head > journal->durable) {
+        if (fdatasync(journal->fd) != 0) {
+            std::cerr << "ERROR: Failed to sync journal " << journal->path << ": " << strerror(errno) << std::endl;
+        }
+        journal->durable = journal->head;
+    }
+
+    DEBUG_PRINTF("DEBUG Server: Journal of %s at %llu (%zu files)\n", username.c_str(),
+                 (unsigned long long)journal->head, files.size());
+}
+
+void ChangeJournal::append(const std::string& username, char op, const std::string& filename, uint64_t version) {
+    commit(username, stage(username, op, filename, version));
+}
+
+StagedChange ChangeJournal::stage(const std::string& username, char op, const std::string& filename,
+                                  uint64_t version) {
+    UserJournal* journal = user(username);
+    std::lock_guard<std::mutex> lock(journal->mutex);
+    return record(*journal, op, filename, version);
+}
+
+bool ChangeJournal::commit(const std::string& username, const StagedChange& change) {
+    if (change.seq == 0) {
+        return false;
+    }
+    // A change must not be handed out under a number a crash could reuse.
+    // Records are written in order, so the flush covers the earlier ones too.
+    bool ok = logSync.wait(change.ticket);
+    if (ok) {
+        UserJournal* journal = user(username);
+        std::lock_guard<std::mutex> lock(journal->mutex);
+        journal->durable = std::max(journal->durable, change.seq);
+    }
+    return ok;
+}
+
+void ChangeJournal::position(const std::string& username, uint64_t& id, uint64_t& head) {
+    UserJournal* journal = user(username);
+    std::lock_guard<std::mutex> lock(journal->mutex);
+    id = journal->id;
+    head = journal->durable;
+}
+
+bool ChangeJournal::changesSince(const std::string& username, uint64_t id, uint64_t seq,
+                                 std::vector<JournalChange>& changes, uint64_t& head) {
+    UserJournal* journal = user(username);
+    std::lock_guard<std::mutex> lock(journal->mutex);
+    if (id != journal->id || seq < journal->floor || seq > journal->durable) {
+        return false;
+    }
+    auto end = journal->bySeq.upper_bound(journal->durable);
+    for (auto it = journal->bySeq.upper_bound(seq); it != end; ++it) {
+        changes.push_back(journal->latest[it->second]);
+    }
+    head = journal->durable;
+    return true;
+}
+
+void ChangeJournal::acknowledge(const std::string& username, uint64_t device, uint64_t seq) {
+    UserJournal* journal = user(username);
+    std::lock_guard<std::mutex> lock(journal->mutex);
+    // Losing one of these only delays compaction; no need to sync it
+    if (write(*journal, 'A', seq, device, "")) {
+        maybeCompact(*journal);
+    }
+}
+
+void ChangeJournal::compact(UserJournal& journal) {
+    // Deletions every device has seen can go
+    uint64_t now = time(nullptr);
+    uint64_t acked = journal.head;
+    for (auto it = journal.devices.begin(); it != journal.devices.end();) {
+        if (it->second.time + JOURNAL_DEVICE_EXPIRY < now) {
+            it = journal.devices.erase(it);
+            continue;
+        }
+        acked = std::min(acked, it->second.seq);
+        ++it;
+    }
+
+    uint64_t floor = journal.floor;
+    std::string data;
+    size_t records = 0;
+    for (const auto& entry : journal.bySeq) {
+        const JournalChange& change = journal.latest[entry.second];
+        if (change.op == 'D' && change.seq <= acked) {
+            floor = std::max(floor, change.seq);
+            continue;
+        }
+        data += encode_record(change.op, change.seq, change.version, now, change.filename);
+        records++;
+    }
+    for (const auto& device : journal.devices) {
+        data += encode_record('A', device.second.seq, device.first, device.second.time, "");
+        records++;
+    }
+    data = encode_header(journal.id, floor) + data;
+
+    std::string tmpPath = journal.path + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd >= 0 && ::write(fd, data.data(), data.size()) == (ssize_t)data.size() &&
+              fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!ok || rename(tmpPath.c_str(), journal.path.c_str()) != 0) {
+        std::cerr << "ERROR: Failed to compact journal " << journal.path << ": " << strerror(errno) << std::endl;
+        unlink(tmpPath.c_str());
+        return;
+    }
+
+    close(journal.fd);
+    journal.fd = open(journal.path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+    journal.floor = floor;
+    journal.records = records;
+    journal.durable = journal.head;
+    for (auto it = journal.latest.begin(); it != journal.latest.end();) {
+        if (it->second.op == 'D' && it->second.seq <= acked) {
+            journal.bySeq.erase(it->second.seq);
+            it = journal.latest.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    DEBUG_PRINTF("DEBUG Server: Compacted %s to %zu records (floor %llu)\n",
+                 journal.path.c_str(), records, (unsigned long long)floor);
+}
@@ -0,0 +1,602 @@
+#include "chunk_store.h"
+#include "sha256.h"
+#include "common.h"
+#include "wire.h"
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+// Pack record: hash, u32 length, then the content
+#define PACK_RECORD_HEADER (CHUNK_HASH_SIZE + 4)
+
+static bool pread_all(int fd, void* buffer, size_t length, uint64_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(fd, (char*)buffer + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+static bool pwrite_all(int fd, const void* buffer, size_t length, uint64_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pwrite(fd, (const char*)buffer + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+ChunkData ChunkCache::get(const std::string& hash) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(hash);
+    if (it == entries.end()) {
+        return nullptr;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+}
+
+void ChunkCache::put(const std::string& hash, const ChunkData& data) {
+    if (data->size() > capacity) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (entries.count(hash) > 0) {
+        return;
+    }
+    lru.emplace_front(hash, data);
+    entries[hash] = lru.begin();
+    bytes += data->size();
+
+    while (bytes > capacity) {
+        // Readers still holding an evicted chunk keep it alive until done
+        bytes -= lru.back().second->size();
+        entries.erase(lru.back().first);
+        lru.pop_back();
+    }
+}
+
+void ChunkCache::erase(const std::string& hash) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(hash);
+    if (it != entries.end()) {
+        bytes -= it->second->second->size();
+        lru.erase(it->second);
+        entries.erase(it);
+    }
+}
+
+ChunkStore::ChunkStore(const std::string& root, const std::string& incomingDir)
+    : root(root), incomingDir(incomingDir), cache(CHUNK_CACHE_SIZE) {
+    std::error_code ec;
+    fs::create_directories(root, ec);
+
+    static const char hex[] = "0123456789abcdef";
+    for (int i = 0; i < 256; i++) {
+        std::string dir = root + "/" + hex[i >> 4] + hex[i & 0xf];
+        fs::create_directory(dir, ec);
+
+        // Every chunk on disk starts unreferenced until a manifest claims it
+        for (const auto& entry : fs::directory_iterator(dir, ec)) {
+            std::string name = entry.path().filename().string();
+            if (name.size() != CHUNK_HASH_SIZE * 2 || !entry.is_regular_file()) {
+                continue;
+            }
+            std::string hash(CHUNK_HASH_SIZE, '\0');
+            for (int j = 0; j < CHUNK_HASH_SIZE; j++) {
+                hash[j] = (char)std::stoi(name.substr(j * 2, 2), nullptr, 16);
+            }
+            Entry& chunk = chunks[hash];
+            chunk.length = entry.file_size(ec);
+        }
+    }
+
+    fs::create_directory(root + "/packs", ec);
+    loadPacks();
+}
+
+ChunkStore::~ChunkStore() {
+    for (auto& segment : segments) {
+        close(segment.second.fd);
+    }
+}
+
+std::string ChunkStore::chunkPath(const std::string& hash) {
+    std::string hex = sha256_hex((const uint8_t*)hash.data());
+    return root + "/" + hex.substr(0, 2) + "/" + hex;
+}
+
+std::string ChunkStore::packPath(uint32_t id) {
+    return root + "/packs/" + std::to_string(id) + ".pack";
+}
+
+// A record counts only if its content matches its hash. The first one
+// that does not ends the segment: it is an append torn by a crash, never
+// synced, so no manifest names it or anything after it.
+void ChunkStore::loadPacks() {
+    std::error_code ec;
+    std::vector<uint32_t> ids;
+    for (const auto& entry : fs::directory_iterator(root + "/packs", ec)) {
+        const fs::path& path = entry.path();
+        std::string stem = path.stem().string();
+        if (path.extension() == ".pack" && !stem.empty() &&
+            stem.find_first_not_of("0123456789") == std::string::npos) {
+            ids.push_back(std::stoul(stem));
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+
+    size_t torn = 0;
+    uint64_t fileSize = 0;
+    for (uint32_t id : ids) {
+        int fd = ::open(packPath(id).c_str(), O_RDWR | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            std::cerr << "ERROR: Failed to open pack segment " << packPath(id) << ": " << strerror(errno) << std::endl;
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+        Segment& segment = segments[id];
+        segment.fd = fd;
+        fileSize = st.st_size;
+
+        uint8_t header[PACK_RECORD_HEADER];
+        std::vector<char> content;
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        while (segment.size + PACK_RECORD_HEADER <= fileSize &&
+               pread_all(fd, header, PACK_RECORD_HEADER, segment.size)) {
+            uint32_t length = get_u32(header + CHUNK_HASH_SIZE);
+            uint64_t record = PACK_RECORD_HEADER + (uint64_t)length;
+            if (record > fileSize - segment.size) {
+                break;
+            }
+            content.resize(length);
+            if (!pread_all(fd, content.data(), length, segment.size + PACK_RECORD_HEADER)) {
+                break;
+            }
+            sha256(content.data(), length, digest);
+            if (memcmp(digest, header, CHUNK_HASH_SIZE) != 0) {
+                break;
+            }
+
+            // A record copied by a compaction that did not get to delete
+            // its segment is there twice; the first copy is used
+            std::string hash((const char*)header, CHUNK_HASH_SIZE);
+            if (chunks.count(hash) == 0) {
+                Entry& chunk = chunks[hash];
+                chunk.length = length;
+                chunk.pack = id;
+                chunk.offset = segment.size + PACK_RECORD_HEADER;
+                segment.live += record;
+            }
+            segment.size += record;
+        }
+        if (segment.size < fileSize) {
+            torn++;
+        }
+    }
+    if (torn > 0) {
+        DEBUG_PRINTF("WARN Server: %zu pack segments end in a torn record\n", torn);
+    }
+
+    // Appends go on in the last segment unless its end is torn
+    if (!segments.empty() && segments.rbegin()->second.size == fileSize &&
+        fileSize < PACK_SEGMENT_SIZE) {
+        activePack = segments.rbegin()->first;
+    }
+}
+
+bool ChunkStore::appendPacked(const std::string& hash, const char* data, uint32_t length, Entry& chunk) {
+    uint64_t record = PACK_RECORD_HEADER + (uint64_t)length;
+    if (activePack == 0 || segments[activePack].size + record > PACK_SEGMENT_SIZE) {
+        // Past any segment that failed to load, too
+        uint32_t id = segments.empty() ? 1 : segments.rbegin()->first + 1;
+        int fd;
+        while ((fd = ::open(packPath(id).c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0 &&
+               errno == EEXIST) {
+            id++;
+        }
+        if (fd < 0) {
+            std::cerr << "ERROR: Failed to create pack segment " << packPath(id) << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        segments[id].fd = fd;
+        activePack = id;
+    }
+    Segment& segment = segments[activePack];
+
+    std::string buffer(hash);
+    append_u32(buffer, length);
+    buffer.append(data, length);
+    // A partial record is overwritten by the next append
+    if (!pwrite_all(segment.fd, buffer.data(), buffer.size(), segment.size)) {
+        std::cerr << "ERROR: Failed to append to pack segment " << packPath(activePack) << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    chunk.length = length;
+    chunk.pack = activePack;
+    chunk.offset = segment.size + PACK_RECORD_HEADER;
+    segment.size += record;
+    segment.live += record;
+    return true;
+}
+
+void ChunkStore::dropPacked(const Entry& chunk) {
+    auto it = segments.find(chunk.pack);
+    if (it == segments.end()) {
+        return;
+    }
+    Segment& segment = it->second;
+    segment.live -= PACK_RECORD_HEADER + (uint64_t)chunk.length;
+    // Open readers keep their descriptor; a compaction deletes its
+    // segment itself, once its copies are on disk
+    if (segment.live == 0 && chunk.pack != activePack && !segment.compacting) {
+        close(segment.fd);
+        unlink(packPath(chunk.pack).c_str());
+        segments.erase(it);
+    }
+}
+
+bool ChunkStore::acquire(const std::string& hash, uint32_t& length) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = chunks.find(hash);
+    if (it == chunks.end()) {
+        return false;
+    }
+    it->second.refs++;
+    length = it->second.length;
+    return true;
+}
+
+bool ChunkStore::put(const std::string& hash, const char* data, size_t length, bool cache) {
+    uint32_t existing;
+    if (acquire(hash, existing)) {
+        return true;
+    }
+
+    if (length <= CHUNK_PACK_MAX_SIZE) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = chunks.find(hash);
+        if (it != chunks.end()) {
+            it->second.refs++;
+            return true;
+        }
+        Entry chunk;
+        if (!appendPacked(hash, data, length, chunk)) {
+            return false;
+        }
+        chunk.refs = 1;
+        chunks[hash] = chunk;
+        if (cache) {
+            this->cache.put(hash, std::make_shared<const std::string>(data, length));
+        }
+        return true;
+    }
+
+    // Written beside the uploads, then renamed in; readers never see a
+    // partial chunk
+    std::string tmpl = incomingDir + "/chunk.XXXXXX";
+    std::vector<char> path(tmpl.begin(), tmpl.end());
+    path.push_back('\0');
+    int fd = mkstemp(path.data());
+    if (fd < 0) {
+        std::cerr << "ERROR: Failed to create chunk file: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = write(fd, data + done, length - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            std::cerr << "ERROR: Failed to write chunk: " << strerror(errno) << std::endl;
+            close(fd);
+            unlink(path.data());
+            return false;
+        }
+        done += n;
+    }
+    close(fd);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = chunks.find(hash);
+    if (it != chunks.end()) {
+        // Another upload stored the same chunk meanwhile
+        unlink(path.data());
+        it->second.refs++;
+        return true;
+    }
+    if (rename(path.data(), chunkPath(hash).c_str()) != 0) {
+        std::cerr << "ERROR: Failed to store chunk: " << strerror(errno) << std::endl;
+        unlink(path.data());
+        return false;
+    }
+    Entry& chunk = chunks[hash];
+    chunk.refs = 1;
+    chunk.length = length;
+    if (cache) {
+        this->cache.put(hash, std::make_shared<const std::string>(data, length));
+    }
+    return true;
+}
+
+void ChunkStore::release(const std::string& hash) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = chunks.find(hash);
+    if (it == chunks.end() || it->second.refs == 0) {
+        DEBUG_PRINTF("WARN Server: Releasing unreferenced chunk %s\n",
+                     sha256_hex((const uint8_t*)hash.data()).c_str());
+        return;
+    }
+    if (--it->second.refs == 0) {
+        // Unlinked under the lock so a concurrent put() cannot resurrect it halfway
+        if (it->second.pack != 0) {
+            dropPacked(it->second);
+        } else {
+            unlink(chunkPath(hash).c_str());
+        }
+        chunks.erase(it);
+        cache.erase(hash);
+    }
+}
+
+bool ChunkStore::contains(const std::string& hash) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return chunks.count(hash) > 0;
+}
+
+int ChunkStore::open(const std::string& hash, uint64_t& offset) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = chunks.find(hash);
+        if (it != chunks.end() && it->second.pack != 0) {
+            offset = it->second.offset;
+            return fcntl(segments[it->second.pack].fd, F_DUPFD_CLOEXEC, 0);
+        }
+    }
+    offset = 0;
+    return ::open(chunkPath(hash).c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+ChunkData ChunkStore::cached(const std::string& hash) {
+    return cache.get(hash);
+}
+
+ChunkData ChunkStore::load(const std::string& hash, uint32_t length) {
+    ChunkData data = cache.get(hash);
+    if (data) {
+        return data;
+    }
+
+    uint64_t offset;
+    int fd = open(hash, offset);
+    if (fd < 0) {
+        return nullptr;
+    }
+    auto content = std::make_shared<std::string>(length, '\0');
+    bool ok = pread_all(fd, &(*content)[0], length, offset);
+    close(fd);
+    if (!ok) {
+        return nullptr;
+    }
+    cache.put(hash, content);
+    return content;
+}
+
+bool ChunkStore::sync() {
+    int fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    // One call covers every chunk written by every upload so far, instead
+    // of an fsync per (small) chunk file
+    bool ok = syncfs(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+void ChunkStore::sweep() {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t removed = 0;
+    for (auto it = chunks.begin(); it != chunks.end();) {
+        if (it->second.refs == 0) {
+            if (it->second.pack != 0) {
+                dropPacked(it->second);
+            } else {
+                unlink(chunkPath(it->first).c_str());
+            }
+            it = chunks.erase(it);
+            removed++;
+        } else {
+            ++it;
+        }
+    }
+    std::cout << "Chunk store: " << chunks.size() << " chunks";
+    if (!segments.empty()) {
+        size_t packed = 0;
+        for (const auto& chunk : chunks) {
+            packed += chunk.second.pack != 0;
+        }
+        std::cout << ", " << packed << " of them in " << segments.size() << " pack segments";
+    }
+    if (removed > 0) {
+        std::cout << " (" << removed << " unreferenced removed)";
+    }
+    std::cout << std::endl;
+}
+
+void ChunkStore::compact() {
+    // Segments to compact and their live records, as of now
+    std::map<uint32_t, std::vector<std::pair<std::string, Entry>>> victims;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& segment : segments) {
+            if (segment.second.live * 2 >= segment.second.size) {
+                continue;
+            }
+            // The segment taking appends is sealed first, unless it is
+            // still small: appends then go to a new one
+            if (segment.first == activePack) {
+                if (segment.second.size < PACK_SEGMENT_SIZE / 16) {
+                    continue;
+                }
+                activePack = 0;
+            }
+            segment.second.compacting = true;
+            victims[segment.first];
+        }
+        if (victims.empty()) {
+            return;
+        }
+        for (const auto& chunk : chunks) {
+            auto victim = victims.find(chunk.second.pack);
+            if (victim != victims.end()) {
+                victim->second.emplace_back(chunk.first, chunk.second);
+            }
+        }
+    }
+
+    // Records are read without the lock; one released meanwhile is skipped
+    size_t moved = 0;
+    std::vector<char> content;
+    for (const auto& victim : victims) {
+        for (const auto& record : victim.second) {
+            const Entry& old = record.second;
+            content.resize(old.length);
+            uint64_t offset;
+            int fd = open(record.first, offset);
+            bool ok = fd >= 0 && offset == old.offset && pread_all(fd, content.data(), old.length, offset);
+            if (fd >= 0) {
+                close(fd);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = chunks.find(record.first);
+            if (it == chunks.end() || it->second.pack != victim.first) {
+                continue;
+            }
+            Entry copy = it->second;
+            if (!ok || !appendPacked(record.first, content.data(), old.length, copy)) {
+                break;  // the segment stays; its remaining records too
+            }
+            dropPacked(it->second);
+            it->second = copy;
+            moved++;
+        }
+    }
+
+    // Only once the copies are on disk may the segments go
+    bool synced = sync();
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t removed = 0;
+    for (const auto& victim : victims) {
+        auto it = segments.find(victim.first);
+        if (it == segments.end()) {
+            continue;
+        }
+        it->second.compacting = false;
+        if (synced && it->second.live == 0) {
+            close(it->second.fd);
+            unlink(packPath(victim.first).c_str());
+            segments.erase(it);
+            removed++;
+        }
+    }
+    DEBUG_PRINTF("DEBUG Server: Compacted %zu pack segments (%zu records moved)\n", removed, moved);
+}
+
+StoredFile::StoredFile(ChunkStore& store, std::vector<ChunkRef> chunks, uint64_t version)
+    : store(store), chunkList(std::move(chunks)), fileVersion(version) {
+    offsets.reserve(chunkList.size());
+    for (const auto& chunk : chunkList) {
+        offsets.push_back(fileSize);
+        fileSize += chunk.length;
+    }
+}
+
+StoredFile::~StoredFile() {
+    if (cachedFd >= 0) {
+        close(cachedFd);
+    }
+    for (const auto& chunk : chunkList) {
+        store.release(chunk.hash);
+    }
+}
+
+size_t StoredFile::chunkAt(uint64_t offset) const {
+    return std::upper_bound(offsets.begin(), offsets.end(), offset) - offsets.begin() - 1;
+}
+
+int StoredFile::openChunk(size_t index, uint64_t& offset) const {
+    return store.open(chunkList[index].hash, offset);
+}
+
+bool StoredFile::read(uint64_t offset, void* buffer, size_t length) {
+    if (length > fileSize || offset > fileSize - length) {
+        return false;
+    }
+
+    char* out = (char*)buffer;
+    while (length > 0) {
+        size_t index = chunkAt(offset);
+        uint64_t inChunk = offset - offsets[index];
+        size_t n = std::min((uint64_t)length, chunkList[index].length - inChunk);
+
+        ChunkData data = chunkData(index);
+        if (data) {
+            memcpy(out, data->data() + inChunk, n);
+            out += n;
+            offset += n;
+            length -= n;
+            continue;
+        }
+
+        if (cachedFd < 0 || cachedIndex != index) {
+            if (cachedFd >= 0) {
+                close(cachedFd);
+            }
+            cachedFd = openChunk(index, cachedBase);
+            cachedIndex = index;
+            if (cachedFd < 0) {
+                return false;
+            }
+        }
+
+        ssize_t r = pread(cachedFd, out, n, cachedBase + inChunk);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            return false;
+        }
+        out += r;
+        offset += r;
+        length -= r;
+    }
+    return true;
+}
+
+ChunkData StoredFile::chunkData(size_t index) const {
+    const ChunkRef& chunk = chunkList[index];
+    if (fileSize <= CHUNK_CACHE_MAX_FILE) {
+        return store.load(chunk.hash, chunk.length);
+    }
+    return store.cached(chunk.hash);
+}
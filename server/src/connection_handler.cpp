@@ -1,62 +1,259 @@
 #include "connection_handler.h"
 #include "file_manager.h"
+#include "change_journal.h"
+#include "lock_manager.h"
+#include "reactor.h"
+#include "session.h"
+#include "worker_pool.h"
+#include "delta.h"
+#include "bundle.h"
+#include "merkle.h"
+#include "wire.h"
 #include "packet.h"
+#include "packet_types.h"
 #include "common.h"
 #include "socket_utils.h"
 #include <pthread.h>
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <errno.h>
 #include <unistd.h>
 #include <unordered_map>
 #include <vector>
 #include <mutex>
+#include <thread>
 #include <sys/socket.h>
-#include <netinet/tcp.h>  // For TCP_NODELAY and IPPROTO_TCP // macOS only?
-// The following two headers are needed for TCP_NODELAY and IPPROTO_TCP, required for Linux
-#include <netinet/in.h>
-// #include <linux/tcp.h>
-#include <fcntl.h>
 #include <iostream>
 
+// Upper bound for the reactor's I/O thread pool
+#define MAX_IO_THREADS 4
+
+// Keep at most this much of the downloads queued ahead of the socket
+#define DOWNLOAD_WINDOW (4 * FILE_CHUNK_SIZE)
+
+// Bytes a download stream may send before the client grants more credit,
+// and how many streams a session may have open at once
+#define STREAM_INITIAL_WINDOW (4 * FILE_CHUNK_SIZE)
+#define MAX_DOWNLOAD_STREAMS 16
+
+// Simultaneous devices allowed per user
+#define MAX_DEVICES_PER_USER 2
+
+// Notifications a device may have waiting before it is considered too slow
+// and dropped to a single resync marker
+#define NOTIFY_QUEUE_LIMIT 1024
+
+// Notifications moved to the socket per onWritable call
+#define NOTIFY_BATCH 64
+
+// File content a device may have waiting in pushed notifications; beyond
+// that its updates go out as plain "U:" notifications it downloads
+#define PUSH_QUEUE_BYTES (8 * 1024 * 1024)
+
+// Threads for jobs too slow for an I/O thread (e.g. file signatures)
+#define WORKER_THREADS 2
+
+// Threads committing uploads. They spend their time waiting for group
+// commit flushes, so there are enough for many commits to share each one.
+#define COMMIT_THREADS 32
+
 // Global FileManager instance
 static FileManager fileManager;
 
-// Mutex for protecting concurrent access to shared resources
-static pthread_mutex_t fileMutex = PTHREAD_MUTEX_INITIALIZER;
+// What changed in each user's files, for devices catching up
+static ChangeJournal journal("files/.journal");
+
+// Per-user / per-file locks around FileManager operations
+static LockManager lockManager;
+
+// Connected devices, grouped by user
+static SessionRegistry sessions;
+
+// Created by run_server
+static WorkerPool* workerPool = nullptr;
+static WorkerPool* commitPool = nullptr;
+
+void notify_devices(const SessionPtr& session, const packet& pkt, const packet* push = nullptr);
+bool push_wanted(const SessionPtr& session);
+packet push_packet(const std::string& filename, uint64_t version, const char* data, size_t size,
+                   const uint8_t* digest = nullptr);
+void flush_notifications(const SessionPtr& session);
+bool handle_login(const SessionPtr& session, packet& pkt);
+void handle_upload_data(const SessionPtr& session, packet& pkt);
+void handle_delta_copy(const SessionPtr& session, packet& pkt);
+void handle_chunk_ref(const SessionPtr& session, packet& pkt);
+void finish_upload(const SessionPtr& session);
+void handle_bundle_data(const SessionPtr& session, packet& pkt);
+void finish_bundle(const SessionPtr& session);
+packet bundle_reply(const SessionPtr& session);
+bool queue_bundle_frame(const SessionPtr& session, uint32_t seqn, DownloadStream& stream);
+void continue_download(const SessionPtr& session);
+void handle_stream_window(const SessionPtr& session, packet& pkt);
+void open_download(const SessionPtr& session, const packet& pkt, const std::string& filename,
+                   uint64_t offset, uint64_t length, uint64_t version);
+void finish_job(const SessionPtr& session);
+void process_command(const SessionPtr& session, packet& pkt);
+
+// Glue between the reactor and the per-connection protocol state machine
+class ServerHandler : public ReactorHandler {
+public:
+    void onOpen(const ConnectionPtr& conn) override {
+        conn->session = sessions.open(conn);
+    }
 
-// Keep track of connected clients
-struct ClientInfo {
-    std::string username;
-    int sockfd;
-};
+    bool onPacket(const ConnectionPtr& conn, packet& pkt) override {
+        const SessionPtr& session = conn->session;
+        session->stats.commands++;
 
-static std::unordered_map<std::string, std::vector<ClientInfo>> connectedClients;
-static pthread_mutex_t clientsMutex = PTHREAD_MUTEX_INITIALIZER;
-
-// Enum for packet types
-enum PacketType {
-    CMD_LOGIN = 1,
-    CMD_UPLOAD = 2,
-    CMD_DOWNLOAD = 3,
-    CMD_DELETE = 4,
-    CMD_LIST_SERVER = 5,
-    CMD_LIST_CLIENT = 6,
-    CMD_GET_SYNC_DIR = 7,
-    DATA_PACKET = 8,
-    SYNC_NOTIFICATION = 9,
-    CMD_EXIT = 10
-};
+        if (session->state == CONN_AWAIT_LOGIN) {
+            return handle_login(session, pkt);
+        }
+
+        // Credit for a download stream, whatever else is going on
+        if (pkt.type == STREAM_WINDOW) {
+            handle_stream_window(session, pkt);
+            return true;
+        }
+        if (pkt.type == STREAM_CANCEL) {
+            // Frames already queued still go out; the client drops them
+            session->downloads.erase(pkt.seqn);
+            return true;
+        }
+
+        // Frames of an upload carry the seqn of the command that started
+        // it. Leftovers of an upload that was cut short are dropped.
+        if (pkt.type == DATA_PACKET || pkt.type == DELTA_COPY || pkt.type == CHUNK_REF) {
+            if (session->state != CONN_UPLOADING || pkt.seqn != session->pending.seqn) {
+                DEBUG_PRINTF("DEBUG Server: Dropping type %d frame of no open upload (seq %u)\n",
+                             pkt.type, pkt.seqn);
+            } else if (pkt.type == DATA_PACKET && session->pending.type == CMD_UPLOAD_BUNDLE) {
+                handle_bundle_data(session, pkt);
+            } else if (pkt.type == DATA_PACKET) {
+                handle_upload_data(session, pkt);
+            } else if (pkt.type == DELTA_COPY && session->pending.type == CMD_UPLOAD_DELTA) {
+                handle_delta_copy(session, pkt);
+            } else if (pkt.type == CHUNK_REF &&
+                       (session->pending.type == CMD_UPLOAD || session->pending.type == CMD_UPLOAD_DELTA)) {
+                handle_chunk_ref(session, pkt);
+            } else if (session->pending.type == CMD_UPLOAD_BUNDLE) {
+                // Bundles carry whole entries only
+                DEBUG_PRINTF("DEBUG Server: Type %d frame in a bundle upload\n", pkt.type);
+                session->bundleBroken = true;
+                finish_bundle(session);
+            } else {
+                DEBUG_PRINTF("DEBUG Server: Dropping type %d frame of a type %d upload\n",
+                             pkt.type, session->pending.type);
+            }
+            return true;
+        }
+
+        if (session->state == CONN_WORKING) {
+            // Reading is paused in this state; nothing should get here
+            DEBUG_PRINTF("WARN Server: Packet type %d received in state %d\n", pkt.type, session->state);
+            return true;
+        }
+
+        // Other commands are served between the frames of an upload, but
+        // one that starts another upload aborts it
+        if (session->state == CONN_UPLOADING &&
+            (pkt.type == CMD_UPLOAD || pkt.type == CMD_UPLOAD_DELTA || pkt.type == CMD_SIGNATURE ||
+             pkt.type == CMD_UPLOAD_BUNDLE)) {
+            DEBUG_PRINTF("DEBUG Server: Upload interrupted by packet type %d\n", pkt.type);
+            packet response;
+            response.type = session->pending.type;
+            response.seqn = session->pending.seqn;
+            response.payload = "ERROR";
+            Reactor::queuePacket(session->conn, response);
+            fileManager.abortUpload(session->upload);
+            session->upload = UploadHandle();
+            session->deltaBase.reset();
+            session->transferOffset = 0;
+            session->bundleResults.clear();
+            session->state = CONN_READY;
+        }
 
-void* handle_client(void* client_sockfd);
-bool register_client(const std::string& username, int sockfd);
-void unregister_client(const std::string& username, int sockfd);
-void notify_clients(const std::string& username, const packet& pkt, int excludeSockfd);
-void process_command(int sockfd, packet& pkt);
+        // Data connections only move file ranges; everything else belongs
+        // to the device they were attached to
+        if (session->auxiliary && pkt.type != CMD_DOWNLOAD_RANGE &&
+            pkt.type != CMD_UPLOAD_RANGE && pkt.type != CMD_EXIT) {
+            DEBUG_PRINTF("DEBUG Server: Refusing packet type %d on a data connection\n", pkt.type);
+            packet response;
+            response.type = pkt.type;
+            response.seqn = pkt.seqn;
+            response.payload = "ERROR";
+            Reactor::queuePacket(session->conn, response);
+            return true;
+        }
+
+        // Validate received packet
+        if (pkt.type == 0) {
+            DEBUG_PRINTF("DEBUG Server: Received invalid packet with type=0, ignoring.\n");
+            return true;
+        }
+
+        DEBUG_PRINTF("DEBUG Server: Received command packet type: %d, seq: %u\n", pkt.type, pkt.seqn);
+
+        // Process the command in a try/catch block to prevent crashes
+        try {
+            process_command(session, pkt);
+        } catch (const std::exception& e) {
+            DEBUG_PRINTF("ERROR Server: Exception processing command: %s\n", e.what());
+            // Continue processing commands rather than disconnecting
+        }
+
+        if (pkt.type == CMD_EXIT) {
+            DEBUG_PRINTF("DEBUG Server: Received exit command, closing connection.\n");
+            Reactor::closeAfterFlush(session->conn);
+        }
+        return true;
+    }
+
+    void onWritable(const ConnectionPtr& conn) override {
+        const SessionPtr& session = conn->session;
+        if (!session->downloads.empty()) {
+            continue_download(session);
+        }
+        if (session->jobDone) {
+            finish_job(session);
+        }
+        // Frames never split, so notifications can go between any two
+        if (session->state != CONN_AWAIT_LOGIN) {
+            flush_notifications(session);
+        }
+    }
+
+    void onClose(const ConnectionPtr& conn) override {
+        SessionPtr session = conn->session;
+        conn->session.reset(); // Session and Connection point at each other
+
+        // Drop the temp file of an upload cut short by the disconnect
+        fileManager.abortUpload(session->upload);
+        if (session->token != 0) {
+            fileManager.abortStripedUploads(session->token);
+        }
+
+        // Unregister client on disconnect
+        sessions.close(session);
+        DEBUG_PRINTF("DEBUG Server: Session fd=%d closed after %lds: %llu commands, %llu bytes up, "
+                     "%llu bytes down, %llu notifications; %zu sessions left\n",
+                     session->fd, (long)(time(nullptr) - session->stats.connectedAt),
+                     (unsigned long long)session->stats.commands.load(),
+                     (unsigned long long)session->stats.bytesUploaded.load(),
+                     (unsigned long long)session->stats.bytesDownloaded.load(),
+                     (unsigned long long)session->stats.notifications.load(),
+                     sessions.count());
+        if (!session->auxiliary) {
+            printf("Cliente desconectado: %s\n", session->username.c_str());
+        }
+    }
+};
 
 void run_server(int port) {
     int err;
-    int sockfd = create_socket();
+    // Data connections of striped transfers must not be held to small buffers
+    int sockfd = create_bulk_socket();
 
     err = bind_socket(sockfd, port);
     if (err < 0) {
@@ -68,642 +265,1246 @@ void run_server(int port) {
         DEBUG_PRINTF("error at listen socket, code: %d\n", err);
     }
 
+    int ioThreads = std::thread::hardware_concurrency();
+    if (ioThreads < 1) ioThreads = 1;
+    if (ioThreads > MAX_IO_THREADS) ioThreads = MAX_IO_THREADS;
 
     printf("Servidor rodando na porta %d...\n", port);
 
-    while (true) {
-        int client_sockfd = accept_connection(sockfd);
-        pthread_t thread_id;
-        pthread_create(&thread_id, NULL, handle_client, (void*)(intptr_t)client_sockfd);
-        pthread_detach(thread_id);
-    }
+    static WorkerPool pool(WORKER_THREADS);
+    workerPool = &pool;
+    static WorkerPool commits(COMMIT_THREADS);
+    commitPool = &commits;
+
+    static ServerHandler handler;
+    Reactor reactor(handler, ioThreads);
+    reactor.run(sockfd);
 }
 
-void* handle_client(void* arg) {
-    int sockfd = (intptr_t)arg;
-    printf("Cliente conectado!\n");
+bool handle_login(const SessionPtr& session, packet& pkt) {
+    DEBUG_PRINTF("DEBUG Server: Received packet header - type: %d, seqn: %u, length: %zu\n",
+           pkt.type, pkt.seqn, pkt.payload.size());
+
+    if (pkt.type == CMD_ATTACH) {
+        packet response;
+        response.type = CMD_ATTACH;
+        response.seqn = pkt.seqn;
+        if (pkt.payload.size() != 8 ||
+            !sessions.attach(session, get_u64((const uint8_t*)pkt.payload.data()))) {
+            response.payload = "ERROR";
+            Reactor::queuePacket(session->conn, response);
+            Reactor::closeAfterFlush(session->conn);
+            return true;
+        }
+        response.payload = "OK";
+        Reactor::queuePacket(session->conn, response);
+        session->state = CONN_READY;
+        return true;
+    }
 
-    // Configure the socket for proper data reception
-    struct timeval timeout;
-    timeout.tv_sec = 30;  // Increase from 5 to 30 seconds
-    timeout.tv_usec = 0;
+    if (pkt.type != CMD_LOGIN) {
+        DEBUG_PRINTF("ERROR: Expected login packet (type 1), but received type %d\n", pkt.type);
+        return false;
+    }
 
-    // Set socket timeouts
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-        perror("Error setting receive timeout on server");
+    std::string username = pkt.payload;
+    printf("Login de usuário: %s (seq: %u)\n", username.c_str(), pkt.seqn);
+
+    // Register client and check session limit
+    if (!sessions.login(session, username, MAX_DEVICES_PER_USER)) {
+        // Error message already printed by SessionRegistry::login
+        packet error_pkt;
+        error_pkt.type = CMD_EXIT; // Use EXIT type to signal client closure
+        error_pkt.seqn = pkt.seqn; // Acknowledge the login attempt sequence
+        error_pkt.payload = "Session limit (" + std::to_string(MAX_DEVICES_PER_USER) + ") reached";
+        Reactor::queuePacket(session->conn, error_pkt);
+        Reactor::closeAfterFlush(session->conn);
+        return true;
     }
-    if (setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
-        perror("Error setting send timeout on server");
+
+    // Send login confirmation with SAME sequence number. The token lets
+    // the device open data connections (CMD_ATTACH) for striped transfers.
+    packet response;
+    response.type = CMD_LOGIN;
+    response.seqn = pkt.seqn;  // Use client's sequence number
+    append_u64(response.payload, session->token);
+
+    // The user directory is initialized (only if registration succeeded)
+    // and, on the user's first login, the journal checked against it. That
+    // syncs the disk, so a worker does it. The session stays in
+    // CONN_AWAIT_LOGIN meanwhile: nothing, notifications included, may
+    // reach the client before the reply.
+    Reactor::pauseReading(session->conn);
+    workerPool->submit([session, response]() {
+        const std::string& username = session->username;
+        {
+            DirLock dirLock(lockManager, username, LOCK_WRITE);
+            fileManager.initUserDirectory(username);
+            if (!journal.loaded(username)) {
+                journal.load(username, fileManager.listUserFiles(username));
+            }
+        }
+
+        DEBUG_PRINTF("DEBUG Server: Sending login response with seq: %u\n", response.seqn);
+        session->jobReply = response;
+        session->jobDone = true;
+        Reactor::requestWritable(session->conn);
+    });
+    return true;
+}
+
+// Fan a notification out to the user's other devices. Reads a published
+// snapshot of the device list and only appends to each device's bounded
+// queue, so the sender never blocks on a slow device. Devices that asked
+// for pushes get push instead, if given and their queue has room for it.
+void notify_devices(const SessionPtr& session, const packet& pkt, const packet* push) {
+    DeviceListPtr devices = SessionRegistry::devices(session);
+    DEBUG_PRINTF("DEBUG Server: notify_devices for user '%s': %zu devices, excluding fd=%d\n",
+                 session->username.c_str(), devices->size(), session->fd);
+
+    for (const auto& device : *devices) {
+        if (device == session) {
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(device->notifyMutex);
+            if (device->needsResync) {
+                continue; // The resync marker supersedes anything we'd add
+            }
+            if (device->notifyQueue.size() >= NOTIFY_QUEUE_LIMIT) {
+                DEBUG_PRINTF("WARN Server: Device on socket %d is not keeping up, dropping %zu notifications for a resync\n",
+                             device->fd, device->notifyQueue.size());
+                std::deque<packet>().swap(device->notifyQueue);
+                device->needsResync = true;
+                device->pushedBytes = 0;
+            } else if (push && device->push && device->pushedBytes + push->payload.size() <= PUSH_QUEUE_BYTES) {
+                DEBUG_PRINTF("DEBUG Server: Pushing file to socket %d (%zu bytes)\n", device->fd, push->payload.size());
+                device->notifyQueue.push_back(*push);
+                device->pushedBytes += push->payload.size();
+            } else {
+                DEBUG_PRINTF("DEBUG Server: Notifying client on socket %d about file: %s (packet type=%d, seqn=%u, length=%zu)\n",
+                             device->fd, pkt.payload.c_str(), pkt.type, pkt.seqn, pkt.payload.size());
+                device->notifyQueue.push_back(pkt);
+            }
+        }
+
+        // The device's I/O thread moves it to the socket at a frame boundary
+        Reactor::requestWritable(device->conn);
     }
+}
 
-    // Enable keep-alive
-    int keepalive = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive)) < 0) {
-        perror("Error setting SO_KEEPALIVE on server");
+// Owner thread: move queued notifications to the socket. A device that
+// overflowed its queue gets one "R:" marker telling it to resync in full.
+void flush_notifications(const SessionPtr& session) {
+    std::vector<packet> batch;
+    bool resync = false;
+    bool more;
+    {
+        std::lock_guard<std::mutex> lock(session->notifyMutex);
+        while (!session->notifyQueue.empty() && batch.size() < NOTIFY_BATCH) {
+            batch.push_back(std::move(session->notifyQueue.front()));
+            session->notifyQueue.pop_front();
+            if (batch.back().type == SYNC_PUSH) {
+                session->pushedBytes -= batch.back().payload.size();
+            }
+        }
+        if (session->notifyQueue.empty() && session->needsResync) {
+            session->needsResync = false;
+            resync = true;
+        }
+        more = !session->notifyQueue.empty();
     }
 
-    // Set socket to blocking mode
-    int flags = fcntl(sockfd, F_GETFL, 0);
-    fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK);
+    for (const auto& pkt : batch) {
+        Reactor::queuePacket(session->conn, pkt, OUT_METADATA);
+        session->stats.notifications++;
+    }
 
-    // Set TCP_NODELAY to disable Nagle's algorithm
-    int flag = 1;
-    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0) {
-        perror("Error setting TCP_NODELAY on server");
+    if (resync) {
+        packet marker;
+        marker.type = SYNC_NOTIFICATION;
+        marker.payload = "R:";
+        DEBUG_PRINTF("DEBUG Server: Sending resync marker to socket %d\n", session->fd);
+        Reactor::queuePacket(session->conn, marker, OUT_METADATA);
     }
 
-    packet pkt;
-    memset(&pkt, 0, sizeof(packet)); // Clear the packet before reading
-    std::string username;
+    if (more) {
+        Reactor::requestWritable(session->conn);
+    }
+}
 
-    // Read login packet using standard read to avoid potential issues with custom read_all
-    DEBUG_PRINTF("DEBUG Server: Waiting to read login packet (size=%zu bytes)...\n", sizeof(packet));
-    ssize_t direct_bytes = recv(sockfd, &pkt, sizeof(packet), MSG_WAITALL);
-    DEBUG_PRINTF("DEBUG Server: Direct read returned %zd bytes\n", direct_bytes);
+// Whether any other device of the user would take a SYNC_PUSH, so its
+// content is only gathered when it will be sent
+bool push_wanted(const SessionPtr& session) {
+    DeviceListPtr devices = SessionRegistry::devices(session);
+    for (const auto& device : *devices) {
+        if (device != session && device->push) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    if (direct_bytes > 0) {
-        DEBUG_PRINTF("DEBUG Server: Received packet header - type: %d, seqn: %d, length: %d\n",
-               pkt.type, pkt.seqn, pkt.length);
+// SYNC_PUSH of a file just stored; total_size is its version, like "U:"
+packet push_packet(const std::string& filename, uint64_t version, const char* data, size_t size,
+                   const uint8_t* digest) {
+    packet push;
+    push.type = SYNC_PUSH;
+    push.total_size = version;
+    append_bundle_entry(push.payload, filename, version, data, size, digest);
+    return push;
+}
 
-        // Validate payload length
-        if (pkt.length > sizeof(pkt.payload)) {
-            DEBUG_PRINTF("ERROR: Invalid payload length: %d (max: %zu)\n", pkt.length, sizeof(pkt.payload));
-            close(sockfd);
-            pthread_exit(NULL);
-        }
+void handle_upload_data(const SessionPtr& session, packet& pkt) {
+    uint64_t expected = session->pending.total_size;
 
-        // Continue processing even with partial read as long as we have the essential header
-        if (pkt.type == CMD_LOGIN) {
-            // Ensure the payload is null-terminated
-            pkt.payload[pkt.length < sizeof(pkt.payload) ? pkt.length : sizeof(pkt.payload) - 1] = '\0';
-            username = pkt.payload;
-            printf("Login de usuário: %s (seq: %d)\n", username.c_str(), pkt.seqn);
+    // Basic sanity-check of the packet
+    if (pkt.payload.size() > expected - session->transferOffset) {
+        DEBUG_PRINTF("DEBUG Server: Malformed data packet received (length=%zu)\n", pkt.payload.size());
+        fileManager.abortUpload(session->upload); // finish_upload reports the error
+        finish_upload(session);
+        return;
+    }
 
-            // Register client and check session limit
-            if (!register_client(username, sockfd)) {
-                // Error message already printed by register_client
-                // Optionally send error packet back to client before closing
-                packet error_pkt;
-                memset(&error_pkt, 0, sizeof(packet));
-                error_pkt.type = CMD_EXIT; // Use EXIT type to signal client closure
-                error_pkt.seqn = pkt.seqn; // Acknowledge the login attempt sequence
-                const char* errMsg = "Session limit (2) reached";
-                strncpy(error_pkt.payload, errMsg, sizeof(error_pkt.payload)-1);
-                error_pkt.length = strlen(errMsg);
-                send(sockfd, &error_pkt, sizeof(packet), 0); // Best effort send
+    // Chunks go straight to the temp file. If the upload could not be
+    // started (or a write failed) the data is drained and dropped so the
+    // stream stays in sync; finish_upload then reports the error.
+    if (session->upload.active &&
+        !fileManager.writeUpload(session->upload, pkt.payload.data(), pkt.payload.size())) {
+        fileManager.abortUpload(session->upload);
+    }
+    session->transferOffset += pkt.payload.size();
+    session->stats.bytesUploaded += pkt.payload.size();
+    DEBUG_PRINTF("DEBUG Server: Received data packet %u, progress: %zu/%llu bytes (%d%%)\n",
+           pkt.seqn, session->transferOffset, (unsigned long long)expected,
+           (int)(session->transferOffset * 100 / expected));
+
+    if (session->transferOffset == expected) {
+        finish_upload(session);
+    }
+}
 
-                close(sockfd);
-                pthread_exit(NULL); // Exit thread if registration failed
-            }
+// DELTA_COPY: 12-byte payload (offset u64, length u32) naming a range of the
+// previous version to append to the upload
+void handle_delta_copy(const SessionPtr& session, packet& pkt) {
+    uint64_t expected = session->pending.total_size;
 
-            // Initialize user directory (only if registration succeeded)
-            pthread_mutex_lock(&fileMutex);
-            fileManager.initUserDirectory(username);
-            pthread_mutex_unlock(&fileMutex);
+    if (pkt.payload.size() != 12) {
+        DEBUG_PRINTF("DEBUG Server: Malformed DELTA_COPY (length=%zu)\n", pkt.payload.size());
+        fileManager.abortUpload(session->upload); // finish_upload reports the error
+        finish_upload(session);
+        return;
+    }
+    const uint8_t* p = (const uint8_t*)pkt.payload.data();
+    uint64_t offset = get_u64(p);
+    uint64_t length = get_u32(p + 8);
+
+    if (length > expected - session->transferOffset) {
+        DEBUG_PRINTF("DEBUG Server: DELTA_COPY past the end of the upload (length=%llu)\n",
+                     (unsigned long long)length);
+        fileManager.abortUpload(session->upload);
+        finish_upload(session);
+        return;
+    }
 
-            // Send login confirmation with SAME sequence number
-            packet response;
-            memset(&response, 0, sizeof(packet)); // Clear response packet
-            response.type = CMD_LOGIN;
-            response.seqn = pkt.seqn;  // Use client's sequence number
-            response.total_size = 0;
-            response.length = 0;
-
-            DEBUG_PRINTF("DEBUG Server: Sending login response with seq: %d\n", response.seqn);
-            ssize_t bytes_sent = send(sockfd, &response, sizeof(packet), 0);
-            DEBUG_PRINTF("DEBUG Server: Direct send returned %zd bytes\n", bytes_sent);
-
-            // Process commands
-            while (true) {
-                memset(&pkt, 0, sizeof(packet)); // Clear packet before reading
-
-                // Add a basic socket check before receiving
-                int error = 0;
-                socklen_t len = sizeof(error);
-                if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
-                    DEBUG_PRINTF("DEBUG Server: Socket error check failed, closing connection.\n");
-                    break;
-                }
+    // Without a matching base the op is only counted (the upload already failed)
+    if (session->upload.active &&
+        !fileManager.copyUploadRange(session->upload, *session->deltaBase, offset, length)) {
+        fileManager.abortUpload(session->upload);
+    }
+    session->transferOffset += length;
 
-                // Use direct socket operations to read command packets
-                // DEBUG_PRINTF("DEBUG Server: Waiting for next command packet...\n");
-                errno = 0; // Clear errno before the call
+    if (session->transferOffset == expected) {
+        finish_upload(session);
+    }
+}
 
-                // Use MSG_PEEK first to check if data is available without consuming it
-                ssize_t peek_bytes = recv(sockfd, &pkt, sizeof(packet), MSG_PEEK | MSG_DONTWAIT);
-                if (peek_bytes == 0) {
-                    // Client closed connection gracefully
-                    DEBUG_PRINTF("DEBUG Server: Client closed connection (received EOF).\n");
-                    break;
-                } else if (peek_bytes < 0) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        // No data available, just timeout, continue waiting
-                        // DEBUG_PRINTF("DEBUG Server: Timeout waiting for command, retrying...\n");
-                        continue;
-                    } else {
-                        // Real error
-                        DEBUG_PRINTF("DEBUG Server: Error checking for data: %s (errno=%d)\n",
-                               strerror(errno), errno);
-                        break;
-                    }
-                }
+// CHUNK_REF: 36-byte payload (hash, length u32) naming a stored chunk to
+// append to the upload
+void handle_chunk_ref(const SessionPtr& session, packet& pkt) {
+    uint64_t expected = session->pending.total_size;
 
-                // Now do the actual read with MSG_WAITALL since we know data is available
-                ssize_t cmd_bytes = recv(sockfd, &pkt, sizeof(packet), MSG_WAITALL);
+    if (pkt.payload.size() != CHUNK_HASH_SIZE + 4) {
+        DEBUG_PRINTF("DEBUG Server: Malformed CHUNK_REF (length=%zu)\n", pkt.payload.size());
+        fileManager.abortUpload(session->upload); // finish_upload reports the error
+        finish_upload(session);
+        return;
+    }
+    std::string hash = pkt.payload.substr(0, CHUNK_HASH_SIZE);
+    uint64_t length = get_u32((const uint8_t*)pkt.payload.data() + CHUNK_HASH_SIZE);
+
+    if (length > expected - session->transferOffset) {
+        DEBUG_PRINTF("DEBUG Server: CHUNK_REF past the end of the upload (length=%llu)\n",
+                     (unsigned long long)length);
+        fileManager.abortUpload(session->upload);
+        finish_upload(session);
+        return;
+    }
 
-                if (cmd_bytes <= 0) {
-                    DEBUG_PRINTF("DEBUG Server: Failed to read command packet: %s (errno=%d)\n",
-                           strerror(errno), errno);
+    // The chunk may have been dropped since the client asked; the upload
+    // then fails and the client sends the file whole
+    if (session->upload.active &&
+        !fileManager.appendStoredChunk(session->upload, hash, length)) {
+        DEBUG_PRINTF("DEBUG Server: Referenced chunk not stored, failing upload\n");
+        fileManager.abortUpload(session->upload);
+    }
+    session->transferOffset += length;
 
-                    // Check if connection is still alive
-                    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
-                        DEBUG_PRINTF("DEBUG Server: Socket is in error state, closing connection.\n");
-                        break;
-                    }
+    if (session->transferOffset == expected) {
+        finish_upload(session);
+    }
+}
 
-                    // If it's a timeout, we can try again
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        DEBUG_PRINTF("DEBUG Server: Timeout waiting for command, retrying...\n");
-                        continue;
-                    }
+// Commit uploads of one user together: every manifest is written, one
+// flush makes them all durable, each is renamed into place under its own
+// file lock and journaled, one directory flush covers the renames and one
+// journal flush the records.
+// Blocks on the disk: worker threads only. stored[i] says whether
+// uploads[i] takes part and is left saying whether it was committed.
+static void commit_uploads(const std::string& username, std::vector<UploadHandle>& uploads,
+                           std::vector<char>& stored) {
+    for (size_t i = 0; i < uploads.size(); i++) {
+        stored[i] = stored[i] && fileManager.prepareCommit(uploads[i]);
+    }
+    // The first wait covers every manifest written above
+    for (size_t i = 0; i < uploads.size(); i++) {
+        stored[i] = stored[i] && fileManager.syncPrepared(uploads[i]);
+    }
+    std::vector<StagedChange> changes(uploads.size());
+    for (size_t i = 0; i < uploads.size(); i++) {
+        if (stored[i]) {
+            FileLock fileLock(lockManager, username, uploads[i].filename, LOCK_WRITE);
+            stored[i] = fileManager.publishUpload(uploads[i]);
+            if (stored[i]) {
+                changes[i] = journal.stage(username, 'U', uploads[i].filename, uploads[i].version);
+            }
+        }
+    }
+    for (size_t i = 0; i < uploads.size(); i++) {
+        stored[i] = stored[i] && fileManager.finishCommit(uploads[i]);
+        fileManager.abortUpload(uploads[i]); // no-op unless the commit failed
+    }
+    // The file is in place either way, so its record is committed regardless
+    for (size_t i = 0; i < uploads.size(); i++) {
+        journal.commit(username, changes[i]);
+    }
+}
 
-                    break;
+void finish_upload(const SessionPtr& session) {
+    DEBUG_PRINTF("DEBUG Server: Finished receiving file data, committing file\n");
+
+    // The commit waits for the disk, so a commit worker does it; further
+    // commands of this session wait until it is done
+    auto uploads = std::make_shared<std::vector<UploadHandle>>(1);
+    (*uploads)[0] = std::move(session->upload);
+    packet pending = session->pending;
+    session->upload = UploadHandle();
+    session->deltaBase.reset();
+    session->transferOffset = 0;
+    session->state = CONN_WORKING;
+    Reactor::pauseReading(session->conn);
+
+    commitPool->submit([session, uploads, pending]() {
+        const std::string& username = session->username;
+        UploadHandle& upload = (*uploads)[0];
+        const std::string& filename = pending.payload;
+        std::vector<char> stored(1, upload.active);
+        commit_uploads(username, *uploads, stored);
+        bool success = stored[0];
+        uint64_t version = upload.version;
+
+        DEBUG_PRINTF("DEBUG Server: File save %s\n", success ? "successful" : "failed");
+
+        packet response;
+        response.type = pending.type;
+        response.seqn = pending.seqn;
+
+        if (success) {
+            // Notify other clients about this file
+            packet notifyPkt;
+            notifyPkt.type = SYNC_NOTIFICATION;
+            notifyPkt.total_size = version;
+            notifyPkt.payload = "U:" + filename;
+
+            // Small files go along with the notification to devices that want
+            // them. The chunks were just stored, so they come from the cache.
+            packet push;
+            if (pending.total_size <= PUSH_MAX_FILE_SIZE && push_wanted(session)) {
+                StoredFilePtr file;
+                {
+                    FileLock fileLock(lockManager, username, filename, LOCK_READ);
+                    file = fileManager.openFile(username, filename);
                 }
-
-                if (cmd_bytes < sizeof(packet)) {
-                    DEBUG_PRINTF("DEBUG Server: Read incomplete packet (%zd of %zu bytes)\n",
-                           cmd_bytes, sizeof(packet));
-                    break;
+                std::vector<char> content(file ? file->size() : 0);
+                if (file && file->version() == version && file->read(0, content.data(), content.size())) {
+                    push = push_packet(filename, version, content.data(), content.size());
                 }
+            }
 
-                // Validate received packet
-                if (pkt.type == 0) {
-                    DEBUG_PRINTF("DEBUG Server: Received invalid packet with type=0, ignoring.\n");
-                    continue;
-                }
+            DEBUG_PRINTF("DEBUG Server: Notifying other clients about file: %s\n", filename.c_str());
+            notify_devices(session, notifyPkt, push.type != 0 ? &push : nullptr);
+
+            // Send success response; the client records the version it now has
+            response.total_size = version;
+            response.payload = "OK";
+        } else {
+            response.payload = "ERROR";
+        }
+        DEBUG_PRINTF("DEBUG Server: Upload response: %s with seq: %u\n", response.payload.c_str(), response.seqn);
+        session->jobReply = response;
+        session->jobDone = true;
+        Reactor::requestWritable(session->conn);
+    });
+}
 
-                DEBUG_PRINTF("DEBUG Server: Received command packet type: %d, seq: %d\n", pkt.type, pkt.seqn);
+// Store the entries of one bundle frame, each as a file of its own,
+// committed together. Results are collected for the reply. Commit worker.
+static void store_bundle_frame(const SessionPtr& session, const std::string& frame) {
+    const std::string& username = session->username;
 
-                // Process the command in a try/catch block to prevent crashes
-                try {
-                    process_command(sockfd, pkt);
-                } catch (const std::exception& e) {
-                    DEBUG_PRINTF("ERROR Server: Exception processing command: %s\n", e.what());
-                    // Continue processing commands rather than disconnecting
-                }
+    std::vector<BundleEntry> entries;
+    if (!parse_bundle_frame(frame.data(), frame.size(), entries)) {
+        DEBUG_PRINTF("DEBUG Server: Malformed bundle frame (length=%zu)\n", frame.size());
+        session->bundleBroken = true;
+        return;
+    }
 
-                if (pkt.type == CMD_EXIT) {
-                    DEBUG_PRINTF("DEBUG Server: Received exit command, closing connection.\n");
-                    break;
-                }
+    std::vector<UploadHandle> uploads(entries.size());
+    std::vector<char> stored(entries.size(), 0);
+    for (size_t i = 0; i < entries.size(); i++) {
+        const BundleEntry& entry = entries[i];
+        stored[i] = entry.intact && entry.size <= BUNDLE_MAX_FILE_SIZE &&
+                    fileManager.beginUpload(username, entry.name, entry.size, uploads[i]) &&
+                    fileManager.writeUpload(uploads[i], entry.data, entry.size);
+    }
+    commit_uploads(username, uploads, stored);
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        const BundleEntry& entry = entries[i];
+        const UploadHandle& upload = uploads[i];
+        bool success = stored[i];
+
+        session->bundleResults += (char)(success ? BUNDLE_STORED : BUNDLE_FAILED);
+        append_u64(session->bundleResults, success ? upload.version : 0);
+
+        if (success) {
+            packet notifyPkt;
+            notifyPkt.type = SYNC_NOTIFICATION;
+            notifyPkt.total_size = upload.version;
+            notifyPkt.payload = "U:" + entry.name;
+            packet push;
+            if (entry.size <= PUSH_MAX_FILE_SIZE && push_wanted(session)) {
+                push = push_packet(entry.name, upload.version, entry.data, entry.size, entry.digest);
             }
+            notify_devices(session, notifyPkt, push.type != 0 ? &push : nullptr);
         } else {
-            DEBUG_PRINTF("ERROR: Expected login packet (type 1), but received type %d\n", pkt.type);
+            DEBUG_PRINTF("DEBUG Server: Bundle entry %s not stored%s\n", entry.name.c_str(),
+                         entry.intact ? "" : " (checksum mismatch)");
         }
-    } else {
-        DEBUG_PRINTF("ERROR: Failed to read login packet: %s\n", strerror(errno));
     }
+}
 
-    // Unregister client on disconnect
-    if (!username.empty()) {
-        unregister_client(username, sockfd);
+// DATA_PACKET of a CMD_UPLOAD_BUNDLE: whole entries. Storing them waits for
+// the disk, so a commit worker does it while the session's further frames
+// wait; the bundle state is the worker's until it hands the session back.
+void handle_bundle_data(const SessionPtr& session, packet& pkt) {
+    if (pkt.payload.size() > session->pending.total_size - session->transferOffset) {
+        DEBUG_PRINTF("DEBUG Server: Bundle frame past the end (length=%zu)\n", pkt.payload.size());
+        session->bundleBroken = true;
+        finish_bundle(session);
+        return;
     }
 
-    close(sockfd);
-    printf("Cliente desconectado: %s\n", username.c_str());
-    pthread_exit(NULL);
-}
+    auto frame = std::make_shared<std::string>(std::move(pkt.payload));
+    session->state = CONN_WORKING;
+    Reactor::pauseReading(session->conn);
 
-bool register_client(const std::string& username, int sockfd) {
-    pthread_mutex_lock(&clientsMutex);
+    commitPool->submit([session, frame]() {
+        store_bundle_frame(session, *frame);
+        session->transferOffset += frame->size();
+        session->stats.bytesUploaded += frame->size();
+        if (session->bundleBroken || session->transferOffset == session->pending.total_size) {
+            session->jobReply = bundle_reply(session);
+        } else {
+            session->jobState = CONN_UPLOADING;
+        }
+        session->jobDone = true;
+        Reactor::requestWritable(session->conn);
+    });
+}
 
-    // Check session limit
-    if (connectedClients.count(username) && connectedClients[username].size() >= 2) {
-        DEBUG_PRINTF("SERVER: Session limit (2) reached for user '%s'. Denying connection %d.\n", username.c_str(), sockfd);
-        pthread_mutex_unlock(&clientsMutex);
-        return false;
-    }
+// Reply to a CMD_UPLOAD_BUNDLE: "OK" + status u8 and version u64 per entry,
+// in bundle order, or "ERROR" if the bundle was malformed (entries before
+// the bad frame are stored all the same). Resets the bundle state.
+packet bundle_reply(const SessionPtr& session) {
+    packet response;
+    response.type = session->pending.type;
+    response.seqn = session->pending.seqn;
+    response.payload = session->bundleBroken ? std::string("ERROR") : "OK" + session->bundleResults;
+    DEBUG_PRINTF("DEBUG Server: Bundle of %zu files done\n", session->bundleResults.size() / 9);
+
+    // A broken bundle's remaining frames are dropped as leftovers
+    session->bundleResults.clear();
+    session->bundleBroken = false;
+    session->transferOffset = 0;
+    return response;
+}
 
-    ClientInfo clientInfo;
-    clientInfo.username = username;
-    clientInfo.sockfd = sockfd;
-    connectedClients[username].push_back(clientInfo);
+void finish_bundle(const SessionPtr& session) {
+    Reactor::queuePacket(session->conn, bundle_reply(session));
+    session->state = CONN_READY;
+}
 
-    DEBUG_PRINTF("SERVER: Registered client %s on socket %d. Total sessions for user: %zu\n",
-           username.c_str(), sockfd, connectedClients[username].size());
+// Queue the next frame of a bundle download: as many whole entries as fit
+// BUNDLE_FRAME_SIZE (at least one). Bundled files are small, so they are
+// read here rather than sent from their chunks. False if a read failed.
+bool queue_bundle_frame(const SessionPtr& session, uint32_t seqn, DownloadStream& stream) {
+    std::string frame;
+    std::vector<char> buffer;
+    while (stream.nextEntry < stream.bundle.size()) {
+        const std::string& name = stream.bundle[stream.nextEntry].first;
+        StoredFile& file = *stream.bundle[stream.nextEntry].second;
+        if (!frame.empty() && frame.size() + bundle_entry_size(name.size(), file.size()) > BUNDLE_FRAME_SIZE) {
+            break;
+        }
+        buffer.resize(file.size());
+        if (!file.read(0, buffer.data(), buffer.size())) {
+            return false;
+        }
+        append_bundle_entry(frame, name, file.version(), buffer.data(), buffer.size());
+        stream.bundle[stream.nextEntry].second.reset(); // unpin it
+        stream.nextEntry++;
+    }
 
-    pthread_mutex_unlock(&clientsMutex);
+    Reactor::queueData(session->conn, DATA_PACKET, seqn, stream.end, frame.data(), frame.size());
+    stream.offset += frame.size();
+    stream.credit -= frame.size();
+    session->stats.bytesDownloaded += frame.size();
     return true;
 }
 
-void unregister_client(const std::string& username, int sockfd) {
-    pthread_mutex_lock(&clientsMutex);
+// Queue more of the open downloads without running far ahead of the
+// socket. Streams with credit take turns one stored chunk at a time, so a
+// big file does not hold up the small ones opened after it. Chunks in the
+// store's cache are sent from memory; the others go out with sendfile().
+void continue_download(const SessionPtr& session) {
+    auto& downloads = session->downloads;
+
+    while (!downloads.empty() && Reactor::pendingOutput(session->conn) < DOWNLOAD_WINDOW) {
+        // The next stream after the one served last that may send
+        auto it = downloads.upper_bound(session->lastDownload);
+        for (size_t tried = 0; tried < downloads.size(); tried++) {
+            if (it == downloads.end()) {
+                it = downloads.begin();
+            }
+            if (it->second.credit > 0) {
+                break;
+            }
+            ++it;
+        }
+        if (it == downloads.end() || it->second.credit <= 0) {
+            break; // all waiting for the client
+        }
+        uint32_t seqn = it->first;
+        DownloadStream& stream = it->second;
+        session->lastDownload = seqn;
+
+        if (!stream.bundle.empty()) {
+            if (stream.offset < stream.end && !queue_bundle_frame(session, seqn, stream)) {
+                std::cerr << "ERROR: Failed to read file of bundle download: " << strerror(errno) << std::endl;
+                Reactor::closeAfterFlush(session->conn);
+                downloads.clear();
+                return;
+            }
+            if (stream.offset == stream.end) {
+                downloads.erase(it);
+            }
+            continue;
+        }
+
+        uint64_t fileSize = stream.file->size();
+        if (stream.offset < stream.end) {
+            // A range may start and end inside a chunk
+            size_t index = stream.file->chunkAt(stream.offset);
+            uint64_t skip = stream.offset - stream.file->chunkOffset(index);
+            size_t bytesToSend = std::min<uint64_t>(stream.file->chunks()[index].length - skip,
+                                                    stream.end - stream.offset);
+
+            // Every frame of the stream carries the seqn of its CMD_DOWNLOAD
+            ChunkData data = stream.file->chunkData(index);
+            if (data) {
+                Reactor::queueData(session->conn, DATA_PACKET, seqn, fileSize,
+                                   data->data() + skip, bytesToSend);
+            } else {
+                // Opened only once it is due, so a big file never holds many descriptors
+                uint64_t base;
+                int fd = stream.file->openChunk(index, base);
+                if (fd < 0) {
+                    // Pinned chunks do not vanish; this is a broken store. The client
+                    // sees the connection drop rather than a short file.
+                    std::cerr << "ERROR: Failed to open chunk of download: " << strerror(errno) << std::endl;
+                    Reactor::closeAfterFlush(session->conn);
+                    downloads.clear();
+                    return;
+                }
+                Reactor::queueFileData(session->conn, DATA_PACKET, seqn, fileSize,
+                                       std::make_shared<FileBody>(fd), base + skip, bytesToSend);
+            }
+            stream.offset += bytesToSend;
+            stream.credit -= bytesToSend;
+            session->stats.bytesDownloaded += bytesToSend;
+        }
 
-    // Remove from connected clients
-    auto& clients = connectedClients[username];
-    for (auto it = clients.begin(); it != clients.end(); ++it) {
-        if (it->sockfd == sockfd) {
-            clients.erase(it);
-            break;
+        if (stream.offset == stream.end) {
+            downloads.erase(it); // queued segments keep the file open until sent
         }
     }
+}
 
-    if (clients.empty()) {
-        connectedClients.erase(username);
+// STREAM_WINDOW: the client consumed this many (u32) more bytes of the
+// download stream seqn
+void handle_stream_window(const SessionPtr& session, packet& pkt) {
+    auto it = session->downloads.find(pkt.seqn);
+    if (it == session->downloads.end() || pkt.payload.size() != 4) {
+        return; // already complete
     }
-
-    pthread_mutex_unlock(&clientsMutex);
+    it->second.credit += get_u32((const uint8_t*)pkt.payload.data());
+    continue_download(session);
 }
 
-void notify_clients(const std::string& username, const packet& pkt, int excludeSockfd) {
-    DEBUG_PRINTF("DEBUG Server: notify_clients called for user '%s', excludeSockfd=%d\n", username.c_str(), excludeSockfd);
+// Reply to CMD_DOWNLOAD / CMD_DOWNLOAD_RANGE with "OK" + version (total_size
+// is the file size) and open a stream for [offset, offset+length) of the
+// file, clamped to its size. A range of a version other than the one asked
+// for is refused with "CHANGED", as its bytes would not fit the others.
+void open_download(const SessionPtr& session, const packet& pkt, const std::string& filename,
+                   uint64_t offset, uint64_t length, uint64_t version) {
+    const std::string& username = session->username;
+    packet response;
+    response.type = pkt.type;
+    response.seqn = pkt.seqn;
+
+    if (session->downloads.size() >= MAX_DOWNLOAD_STREAMS) {
+        response.payload = "BUSY";
+        Reactor::queuePacket(session->conn, response);
+        return;
+    }
 
-    std::vector<int> sockets_to_notify;
+    // Opening pins the chunks of the current version, so a concurrent
+    // upload or delete cannot change what this download sends
+    StoredFilePtr file;
+    int err;
+    {
+        FileLock fileLock(lockManager, username, filename, LOCK_READ);
+        file = fileManager.openFile(username, filename);
+        err = errno;
+    }
 
-    // Copy the list of sockets while holding the mutex for the minimum time
-    pthread_mutex_lock(&clientsMutex);
-    auto it = connectedClients.find(username);
-    if (it != connectedClients.end()) {
-        DEBUG_PRINTF("DEBUG Server: Found %zu connected clients for user '%s'\n", it->second.size(), username.c_str());
-        for (const auto& client : it->second) {
-            DEBUG_PRINTF("DEBUG Server: Considering client sockfd=%d (excludeSockfd=%d)\n", client.sockfd, excludeSockfd);
-            if (client.sockfd != excludeSockfd) {
-                sockets_to_notify.push_back(client.sockfd);
-            }
-        }
-    } else {
-        DEBUG_PRINTF("DEBUG Server: No connected clients found for user '%s'\n", username.c_str());
+    if (!file) {
+        response.payload = (err == ENOENT) ? "NOT_FOUND" : "ERROR";
+        DEBUG_PRINTF("DEBUG Server: Sending download response: %s with seq: %u\n", response.payload.c_str(), response.seqn);
+        Reactor::queuePacket(session->conn, response);
+        return;
+    }
+    if (version != 0 && file->version() != version) {
+        response.payload = "CHANGED";
+        Reactor::queuePacket(session->conn, response);
+        return;
     }
-    pthread_mutex_unlock(&clientsMutex);
 
-    // Now send outside the critical section so a slow / blocked socket does
-    // not freeze the whole server.
-    for (int fd : sockets_to_notify) {
-        DEBUG_PRINTF("DEBUG Server: Notifying client on socket %d about file: %s (packet type=%d, seqn=%d, length=%d)\n",
-                     fd, pkt.payload, pkt.type, pkt.seqn, pkt.length);
-        // Use non-blocking send with MSG_DONTWAIT so we never block indefinitely.
-        ssize_t s = send(fd, &pkt, sizeof(packet), MSG_DONTWAIT | MSG_NOSIGNAL);
-        if (s < 0) {
-            DEBUG_PRINTF("WARN: Failed to notify socket %d: %s\n", fd, strerror(errno));
-        } else {
-            DEBUG_PRINTF("DEBUG Server: Successfully notified socket %d (%zd bytes sent)\n", fd, s);
-        }
+    uint64_t fileSize = file->size();
+    offset = std::min(offset, fileSize);
+    length = std::min(length, fileSize - offset);
+
+    // Send response header
+    response.total_size = fileSize;
+    response.payload = "OK";
+    append_u64(response.payload, file->version());
+    DEBUG_PRINTF("DEBUG Server: Sending download response: OK with seq: %u\n", response.seqn);
+    Reactor::queuePacket(session->conn, response);
+
+    // File data is streamed as the socket drains and the client
+    // grants credit; further commands are served meanwhile
+    DownloadStream& stream = session->downloads[pkt.seqn];
+    stream.file = file;
+    stream.offset = offset;
+    stream.end = offset + length;
+    stream.credit = STREAM_INITIAL_WINDOW;
+    continue_download(session);
+}
+
+// Owner thread: a worker finished preparing this session's reply
+void finish_job(const SessionPtr& session) {
+    session->jobDone = false;
+    session->state = session->jobState;
+    session->jobState = CONN_READY;
+    if (session->jobReply.type != 0) {
+        Reactor::queuePacket(session->conn, session->jobReply);
+        session->jobReply = packet();
     }
-    DEBUG_PRINTF("DEBUG Server: notify_clients finished for user '%s'\n", username.c_str());
+    Reactor::resumeReading(session->conn);
 }
 
-void process_command(int sockfd, packet& pkt) {
-    // Create a fresh response packet for each command to avoid reusing memory
+void process_command(const SessionPtr& session, packet& pkt) {
+    // Create a fresh response packet for each command
     packet response;
-    memset(&response, 0, sizeof(packet)); // Clear the response packet
 
     // Basic setup - all commands need these
     response.type = pkt.type;
     response.seqn = pkt.seqn;  // Important: Use the same sequence number from the request
-    response.total_size = 0;
-    response.length = 0;
-
-    std::string username;
-    // Get username from connected clients
-    pthread_mutex_lock(&clientsMutex);
-    for (const auto& entry : connectedClients) {
-        for (const auto& client : entry.second) {
-            if (client.sockfd == sockfd) {
-                username = client.username;
-                break;
-            }
-        }
-        if (!username.empty()) break;
-    }
-    pthread_mutex_unlock(&clientsMutex);
 
-    if (username.empty()) {
-        DEBUG_PRINTF("ERROR: No username found for socket %d\n", sockfd);
-        return;
-    }
+    const std::string& username = session->username;
 
-    DEBUG_PRINTF("DEBUG Server: Processing command type %d from user: %s, seq: %d\n",
+    DEBUG_PRINTF("DEBUG Server: Processing command type %d from user: %s, seq: %u\n",
            pkt.type, username.c_str(), pkt.seqn);
 
     // Process based on command type
     switch (pkt.type) {
         case CMD_UPLOAD: {
             // Extract filename from the payload
-            std::string filename(pkt.payload);
-            DEBUG_PRINTF("DEBUG Server: Received upload command for file: %s, size: %u bytes\n",
-                   filename.c_str(), pkt.total_size);
-
-            // Receive file data
-            char* fileData = new char[pkt.total_size];
-            size_t bytesRead = 0;
-
-            // Loop to receive all file data packets
-            while (bytesRead < pkt.total_size) {
-                packet dataPkt;
-                // Reliably read an entire packet. Using read_all protects against partial
-                // TCP deliveries that occur when multiple sessions are active.
-                size_t got = read_all(sockfd, &dataPkt, sizeof(packet));
-
-                if (got != sizeof(packet)) {
-                    DEBUG_PRINTF("DEBUG Server: Error reading data packet (read %zu of %zu bytes)\n", got, sizeof(packet));
-                    break;
-                }
-
-                // Basic sanity-check of the packet
-                if (dataPkt.type != DATA_PACKET || dataPkt.length > sizeof(dataPkt.payload)) {
-                    DEBUG_PRINTF("DEBUG Server: Malformed data packet received (type=%d, length=%d)\n", dataPkt.type, dataPkt.length);
-                    break;
-                }
-
-                memcpy(fileData + bytesRead, dataPkt.payload, dataPkt.length);
-                bytesRead += dataPkt.length;
-                DEBUG_PRINTF("DEBUG Server: Received data packet %d, progress: %zu/%u bytes (%d%%)\n",
-                       dataPkt.seqn, bytesRead, pkt.total_size, (int)(bytesRead * 100 / pkt.total_size));
+            std::string filename = pkt.payload;
+            DEBUG_PRINTF("DEBUG Server: Received upload command for file: %s, size: %llu bytes\n",
+                   filename.c_str(), (unsigned long long)pkt.total_size);
+
+            // File data follows as DATA_PACKETs; the state machine streams
+            // them into a preallocated temp file
+            session->pending = pkt;
+            session->transferOffset = 0;
+            if (!fileManager.beginUpload(username, filename, pkt.total_size, session->upload)) {
+                DEBUG_PRINTF("DEBUG Server: Could not start upload of %s, discarding its data\n",
+                       filename.c_str());
             }
+            session->state = CONN_UPLOADING;
 
-            DEBUG_PRINTF("DEBUG Server: Finished receiving file data, saving file\n");
-
-            // Save file
-            pthread_mutex_lock(&fileMutex);
-            bool success = fileManager.saveFile(username, filename, fileData, bytesRead);
-            pthread_mutex_unlock(&fileMutex);
-
-            DEBUG_PRINTF("DEBUG Server: File save %s\n", success ? "successful" : "failed");
-
-            delete[] fileData;
-
-            if (success) {
-                // Notify other clients about this file
-                packet notifyPkt;
-                notifyPkt.type = SYNC_NOTIFICATION;
-                notifyPkt.seqn = 0;
-                notifyPkt.total_size = 0;
-                std::string payload = std::string("U:") + filename;
-                strncpy(notifyPkt.payload, payload.c_str(), sizeof(notifyPkt.payload) - 1);
-                notifyPkt.payload[sizeof(notifyPkt.payload)-1] = '\0';
-                notifyPkt.length = strlen(notifyPkt.payload);
-
-                DEBUG_PRINTF("DEBUG Server: Notifying other clients about file: %s\n", filename.c_str());
-                notify_clients(username, notifyPkt, sockfd);
-
-                // Send success response
-                strcpy(response.payload, "OK");
-                response.length = 2;
-            } else {
-                strcpy(response.payload, "ERROR");
-                response.length = 5;
+            if (pkt.total_size == 0) {
+                finish_upload(session);
             }
-            DEBUG_PRINTF("DEBUG Server: Sending upload response: %s with seq: %d\n", response.payload, response.seqn);
-            send(sockfd, &response, sizeof(packet), 0);
             break;
         }
 
         case CMD_DOWNLOAD: {
-            std::string filename(pkt.payload);
-
-            // Check if file exists
-            pthread_mutex_lock(&fileMutex);
-            bool exists = fileManager.fileExists(username, filename);
-
-            if (exists) {
-                // Get file size first
-                size_t fileSize = 0;
-                fileManager.getFile(username, filename, nullptr, fileSize);
-
-                // Allocate buffer for file
-                char* fileData = new char[fileSize];
-                bool success = fileManager.getFile(username, filename, fileData, fileSize);
-                pthread_mutex_unlock(&fileMutex);
-
-                if (success) {
-                    // Send response header
-                    response.total_size = fileSize;
-                    strcpy(response.payload, "OK");
-                    response.length = 2;
-                    DEBUG_PRINTF("DEBUG Server: Sending download response: %s with seq: %d\n", response.payload, response.seqn);
-                    send(sockfd, &response, sizeof(packet), 0);
-
-                    // Send file data in chunks
-                    size_t bytesSent = 0;
-                    while (bytesSent < fileSize) {
-                        packet dataPkt;
-                        dataPkt.type = DATA_PACKET;
-                        // Include the original command's sequence number to help client thread identify these packets
-                        dataPkt.seqn = response.seqn;
-
-                        size_t bytesToSend = std::min(sizeof(dataPkt.payload), fileSize - bytesSent);
-                        memcpy(dataPkt.payload, fileData + bytesSent, bytesToSend);
-                        dataPkt.length = bytesToSend;
-
-                        send(sockfd, &dataPkt, sizeof(packet), 0);
-                        bytesSent += bytesToSend;
-                    }
+            open_download(session, pkt, pkt.payload, 0, UINT64_MAX, 0);
+            break;
+        }
 
-                    delete[] fileData;
-                } else {
-                    strcpy(response.payload, "ERROR");
-                    response.length = 5;
-                    DEBUG_PRINTF("DEBUG Server: Sending download response: %s with seq: %d\n", response.payload, response.seqn);
-                    send(sockfd, &response, sizeof(packet), 0);
-                }
-            } else {
-                pthread_mutex_unlock(&fileMutex);
-                strcpy(response.payload, "NOT_FOUND");
-                response.length = 9;
-                DEBUG_PRINTF("DEBUG Server: Sending download response: %s with seq: %d\n", response.payload, response.seqn);
-                send(sockfd, &response, sizeof(packet), 0);
+        case CMD_DOWNLOAD_RANGE: {
+            // Payload: offset, length, version (0 = any) as u64s, then the filename
+            if (pkt.payload.size() <= 24) {
+                response.payload = "ERROR";
+                Reactor::queuePacket(session->conn, response);
+                break;
             }
+            const uint8_t* p = (const uint8_t*)pkt.payload.data();
+            open_download(session, pkt, pkt.payload.substr(24), get_u64(p), get_u64(p + 8), get_u64(p + 16));
             break;
         }
 
         case CMD_DELETE: {
-            std::string filename(pkt.payload);
+            std::string filename = pkt.payload;
 
             // CRITICAL: Use command-specific variables to avoid shared memory issues
-            int delete_client_fd = sockfd;
-            uint16_t delete_seq = pkt.seqn;
+            uint32_t delete_seq = pkt.seqn;
 
-            DEBUG_PRINTF("DEBUG Server: [DELETE] Command received for file: %s (seq: %d)\n",
+            DEBUG_PRINTF("DEBUG Server: [DELETE] Command received for file: %s (seq: %u)\n",
                   filename.c_str(), delete_seq);
 
             // Prepare an isolated response packet
             packet delete_response;
-            memset(&delete_response, 0, sizeof(packet));
             delete_response.type = CMD_DELETE;  // CRITICAL: set correct type
             delete_response.seqn = delete_seq;  // CRITICAL: preserve sequence number
 
-            // Process delete operation with exclusive lock
-            pthread_mutex_lock(&fileMutex);
-            bool exists = fileManager.fileExists(username, filename);
-            bool success = false;
-
-            if (exists) {
-                DEBUG_PRINTF("DEBUG Server: [DELETE] File %s exists, attempting deletion\n", filename.c_str());
-                success = fileManager.deleteFile(username, filename);
-            } else {
-                DEBUG_PRINTF("DEBUG Server: [DELETE] File %s not found\n", filename.c_str());
+            // Process delete operation with exclusive lock on this file only
+            bool exists, success = false;
+            {
+                FileLock fileLock(lockManager, username, filename, LOCK_WRITE);
+                exists = fileManager.fileExists(username, filename);
+
+                if (exists) {
+                    DEBUG_PRINTF("DEBUG Server: [DELETE] File %s exists, attempting deletion\n", filename.c_str());
+                    success = fileManager.deleteFile(username, filename);
+                    if (success) {
+                        journal.append(username, 'D', filename, 0);
+                    }
+                } else {
+                    DEBUG_PRINTF("DEBUG Server: [DELETE] File %s not found\n", filename.c_str());
+                }
             }
-            pthread_mutex_unlock(&fileMutex);
 
             // Set response based on operation result
             if (!exists) {
-                strcpy(delete_response.payload, "NOT_FOUND");
-                delete_response.length = 9;
+                delete_response.payload = "NOT_FOUND";
             } else if (success) {
-                strcpy(delete_response.payload, "OK");
-                delete_response.length = 2;
+                delete_response.payload = "OK";
 
                 // Only notify if deletion was successful
                 packet notifyPkt;
-                memset(&notifyPkt, 0, sizeof(packet));
                 notifyPkt.type = SYNC_NOTIFICATION;
-                notifyPkt.seqn = 0;
-                std::string payload = std::string("D:") + filename;
-                strncpy(notifyPkt.payload, payload.c_str(), sizeof(notifyPkt.payload) - 1);
-                notifyPkt.payload[sizeof(notifyPkt.payload)-1] = '\0';
-                notifyPkt.length = strlen(notifyPkt.payload);
+                notifyPkt.payload = "D:" + filename;
 
                 DEBUG_PRINTF("DEBUG Server: [DELETE] Notifying other clients about deletion\n");
-                notify_clients(username, notifyPkt, delete_client_fd);
+                notify_devices(session, notifyPkt);
             } else {
-                strcpy(delete_response.payload, "ERROR");
-                delete_response.length = 5;
+                delete_response.payload = "ERROR";
             }
 
             // Verify the response packet is correct
-            DEBUG_PRINTF("DEBUG Server: [DELETE] Prepared response packet: type=%d, seq=%d, payload='%s'\n",
-                  delete_response.type, delete_response.seqn, delete_response.payload);
+            DEBUG_PRINTF("DEBUG Server: [DELETE] Prepared response packet: type=%d, seq=%u, payload='%s'\n",
+                  delete_response.type, delete_response.seqn, delete_response.payload.c_str());
 
-            // CRITICAL: Send response directly with exclusive lock
-            pthread_mutex_lock(&fileMutex);  // Use file mutex to ensure exclusive socket access
-            ssize_t bytes_sent = send(delete_client_fd, &delete_response, sizeof(packet), 0);
-            pthread_mutex_unlock(&fileMutex);
-
-            if (bytes_sent == sizeof(packet)) {
-                DEBUG_PRINTF("DEBUG Server: [DELETE] Response sent successfully (%zd bytes)\n", bytes_sent);
-            } else {
-                DEBUG_PRINTF("ERROR Server: [DELETE] Failed to send response (%zd bytes): %s\n",
-                       bytes_sent, strerror(errno));
-            }
+            Reactor::queuePacket(session->conn, delete_response);
 
             break;
         }
 
         case CMD_LIST_SERVER: {
-            // Create local variables for this command
+            // Payload: a ListQuery (empty: first page by name). Reply: "OK",
+            // more flag, then the page's entries (see listing.h).
             packet list_response;
-            memset(&list_response, 0, sizeof(packet));
             list_response.type = CMD_LIST_SERVER;
             list_response.seqn = pkt.seqn;
 
-            DEBUG_PRINTF("DEBUG Server: Processing list_server command for user %s\n", username.c_str());
-
-            // Force filesystem refresh by ensuring the user directory exists
-            pthread_mutex_lock(&fileMutex);
-            fileManager.initUserDirectory(username); // This refreshes directory access
-            pthread_mutex_unlock(&fileMutex);
-
-            // Get files with mutex protection
-            pthread_mutex_lock(&fileMutex);
-            auto files = fileManager.listUserFiles(username);
-            pthread_mutex_unlock(&fileMutex);
+            ListQuery query;
+            if (!decode_list_query(pkt.payload, query)) {
+                list_response.payload = "ERROR";
+                Reactor::queuePacket(session->conn, list_response);
+                break;
+            }
 
-            DEBUG_PRINTF("DEBUG Server: Found %zu files for user %s\n", files.size(), username.c_str());
+            bool more;
+            std::vector<FileInfo> files = fileManager.listPage(username, query, more);
 
-            // Format file list
-            std::string fileList;
+            // Entries are encoded straight into the reply until it reaches
+            // LIST_PAGE_BYTES; the client resumes after the last one sent
+            std::string& payload = list_response.payload;
+            payload = "OK";
+            payload += (char)0;
+            const std::string* previous = nullptr;
+            size_t sent = 0;
             for (const auto& file : files) {
-                std::string entry = file.filename + "," +
-                           std::to_string(file.size) + "," +
-                           std::to_string(file.mtime) + "," +
-                           std::to_string(file.atime) + "," +
-                           std::to_string(file.ctime) + "\n";
-                fileList += entry;
-                DEBUG_PRINTF("DEBUG Server: Adding file to list: %s (size: %zu)\n",
-                       file.filename.c_str(), file.size);
-            }
-
-            // Set response metadata
-            list_response.total_size = fileList.size();
-
-            // Copy data to payload (up to the limit)
-            if (fileList.empty()) {
-                strcpy(list_response.payload, "");
-                list_response.length = 0;
-                DEBUG_PRINTF("DEBUG Server: No files found, sending empty list\n");
-            } else {
-                // Only copy up to the payload size limit
-                size_t bytes_to_copy = std::min(sizeof(list_response.payload) - 1, fileList.size());
-                strncpy(list_response.payload, fileList.c_str(), bytes_to_copy);
-                list_response.payload[bytes_to_copy] = '\0'; // Ensure null termination
-                list_response.length = bytes_to_copy;
-                DEBUG_PRINTF("DEBUG Server: File list prepared (%zu bytes, %zu files)\n",
-                       fileList.size(), files.size());
-            }
-
-            DEBUG_PRINTF("DEBUG Server: Sending list_server response with seq: %d, total_size: %u\n",
-                   list_response.seqn, list_response.total_size);
-            ssize_t bytes_sent = send(sockfd, &list_response, sizeof(packet), 0);
-            DEBUG_PRINTF("DEBUG Server: Sent list_server response header (%zd bytes)\n", bytes_sent);
-
-            // If list is longer than payload, send the rest in DATA packets
-            if (fileList.size() > sizeof(list_response.payload) - 1) {
-                size_t bytesSent = sizeof(list_response.payload) - 1;
-
-                while (bytesSent < fileList.size()) {
-                    packet dataPkt;
-                    memset(&dataPkt, 0, sizeof(packet));
-                    dataPkt.type = DATA_PACKET;
-                    dataPkt.seqn = list_response.seqn;
-
-                    size_t bytesToSend = std::min(sizeof(dataPkt.payload) - 1, fileList.size() - bytesSent);
-                    strncpy(dataPkt.payload, fileList.c_str() + bytesSent, bytesToSend);
-                    dataPkt.payload[bytesToSend] = '\0'; // Ensure null termination
-                    dataPkt.length = bytesToSend;
-
-                    DEBUG_PRINTF("DEBUG Server: Sending list_server data packet: %zu bytes\n", bytesToSend);
-                    send(sockfd, &dataPkt, sizeof(packet), 0);
-                    bytesSent += bytesToSend;
+                if (sent > 0 && payload.size() >= LIST_PAGE_BYTES) {
+                    more = true;
+                    break;
                 }
+                ListEntry entry;
+                entry.name = file.filename;
+                entry.size = file.size;
+                entry.mtime = list_time(file.mtime);
+                entry.atime = list_time(file.atime);
+                entry.ctime = list_time(file.ctime);
+                append_list_entry(payload, previous ? *previous : std::string(), entry);
+                previous = &file.filename;
+                sent++;
             }
+            payload[2] = more ? 1 : 0;
+
+            DEBUG_PRINTF("DEBUG Server: Listing page for user %s: %zu files, %zu bytes%s\n",
+                   username.c_str(), sent, payload.size(), more ? ", more follow" : "");
+            Reactor::queuePacket(session->conn, list_response);
             break;
         }
 
         case CMD_GET_SYNC_DIR: {
-            pthread_mutex_lock(&fileMutex);
-            fileManager.initUserDirectory(username);
-            auto files = fileManager.listUserFiles(username);
-            pthread_mutex_unlock(&fileMutex);
+            // Payload: optional device id. The journal position is taken
+            // first: a change racing the listing is then sent again later
+            // rather than missed.
+            std::vector<FileInfo> files;
+            uint64_t journalId, head;
+            {
+                DirLock dirLock(lockManager, username, LOCK_READ);
+                journal.position(username, journalId, head);
+                fileManager.initUserDirectory(username);
+                files = fileManager.listUserFiles(username);
+            }
+            if (pkt.payload.size() == sizeof(uint64_t)) {
+                journal.acknowledge(username, get_u64((const uint8_t*)pkt.payload.data()), head);
+            }
 
-            // Send number of files
+            // Send number of files, and the cursor the listing brings the device to
             response.total_size = files.size();
-            strcpy(response.payload, "OK");
-            response.length = 2;
-            DEBUG_PRINTF("DEBUG Server: Sending get_sync_dir response: %s with seq: %d, total_size: %u\n",
-                   response.payload, response.seqn, response.total_size);
-            send(sockfd, &response, sizeof(packet), 0);
+            response.payload = "OK";
+            append_u64(response.payload, journalId);
+            append_u64(response.payload, head);
+            DEBUG_PRINTF("DEBUG Server: Sending get_sync_dir response: OK with seq: %u, total_size: %llu\n",
+                   response.seqn, (unsigned long long)response.total_size);
+            Reactor::queuePacket(session->conn, response);
 
             // Send each file info
             for (const auto& file : files) {
                 packet infoPkt;
                 infoPkt.type = SYNC_NOTIFICATION;
-                infoPkt.seqn = 0;
-                infoPkt.total_size = file.size;
-                std::string payload = std::string("U:") + file.filename;
-                strncpy(infoPkt.payload, payload.c_str(), sizeof(infoPkt.payload) - 1);
-                infoPkt.payload[sizeof(infoPkt.payload)-1] = '\0';
-                infoPkt.length = strlen(infoPkt.payload);
+                infoPkt.total_size = file.version;
+                infoPkt.seqn = pkt.seqn;
+                infoPkt.payload = "U:" + file.filename;
+
+                Reactor::queuePacket(session->conn, infoPkt, OUT_METADATA);
+            }
+            break;
+        }
+
+        case CMD_GET_CHANGES: {
+            // Payload: device id, journal id, cursor. Reply "OK" + journal id
+            // + new cursor and one notification per changed file, or "RESYNC"
+            // when the cursor cannot be served (the device then lists everything).
+            std::vector<JournalChange> changes;
+            uint64_t head;
+            const uint8_t* p = (const uint8_t*)pkt.payload.data();
+            if (pkt.payload.size() != 3 * sizeof(uint64_t) ||
+                !journal.changesSince(username, get_u64(p + 8), get_u64(p + 16), changes, head)) {
+                response.payload = "RESYNC";
+                Reactor::queuePacket(session->conn, response);
+                break;
+            }
+            journal.acknowledge(username, get_u64(p), get_u64(p + 16));
+
+            DEBUG_PRINTF("DEBUG Server: %zu changes for %s since %llu\n", changes.size(),
+                         username.c_str(), (unsigned long long)get_u64(p + 16));
+            response.total_size = changes.size();
+            response.payload = "OK";
+            append_u64(response.payload, get_u64(p + 8));
+            append_u64(response.payload, head);
+            Reactor::queuePacket(session->conn, response);
+
+            for (const auto& change : changes) {
+                packet infoPkt;
+                infoPkt.type = SYNC_NOTIFICATION;
+                infoPkt.total_size = change.version;
+                infoPkt.seqn = pkt.seqn;
+                infoPkt.payload = std::string(1, change.op) + ":" + change.filename;
+                Reactor::queuePacket(session->conn, infoPkt, OUT_METADATA);
+            }
+            break;
+        }
 
-                send(sockfd, &infoPkt, sizeof(packet), 0);
+        case CMD_MERKLE: {
+            // Payload: 'N' or 'F', then prefixes. 'N' replies "OK" + journal
+            // id + head + the MERKLE_FANOUT children of each prefix; 'F'
+            // replies the same header and a "U:" notification for every file
+            // under the prefixes. The journal position is taken before the
+            // tree is read, so the device's cursor never gets ahead of it.
+            size_t count = pkt.payload.empty() ? 0 : (pkt.payload.size() - 1) / MERKLE_PREFIX_SIZE;
+            std::vector<MerklePrefix> prefixes(count);
+            bool valid = !pkt.payload.empty() && (pkt.payload[0] == 'N' || pkt.payload[0] == 'F') &&
+                         (pkt.payload.size() - 1) % MERKLE_PREFIX_SIZE == 0 &&
+                         count <= MERKLE_MAX_PREFIXES;
+            for (size_t i = 0; valid && i < count; i++) {
+                valid = decode_merkle_prefix((const uint8_t*)pkt.payload.data() + 1 + i * MERKLE_PREFIX_SIZE,
+                                             prefixes[i]) &&
+                        (pkt.payload[0] == 'F' || prefixes[i].depth < MERKLE_DEPTH);
             }
+            if (!valid) {
+                response.payload = "ERROR";
+                Reactor::queuePacket(session->conn, response);
+                break;
+            }
+
+            uint64_t journalId, head;
+            journal.position(username, journalId, head);
+            response.payload = "OK";
+            append_u64(response.payload, journalId);
+            append_u64(response.payload, head);
+
+            if (pkt.payload[0] == 'N') {
+                for (const auto& prefix : prefixes) {
+                    MerkleNode children[MERKLE_FANOUT];
+                    fileManager.merkleChildren(username, prefix, children);
+                    for (const auto& child : children) {
+                        encode_merkle_node(response.payload, child);
+                    }
+                }
+                Reactor::queuePacket(session->conn, response);
+                break;
+            }
+
+            std::vector<std::pair<std::string, uint64_t>> files;
+            for (const auto& prefix : prefixes) {
+                auto under = fileManager.merkleFiles(username, prefix);
+                files.insert(files.end(), under.begin(), under.end());
+            }
+            DEBUG_PRINTF("DEBUG Server: Listing %zu files under %zu Merkle prefixes for %s\n",
+                         files.size(), prefixes.size(), username.c_str());
+            response.total_size = files.size();
+            Reactor::queuePacket(session->conn, response);
+            for (const auto& file : files) {
+                packet infoPkt;
+                infoPkt.type = SYNC_NOTIFICATION;
+                infoPkt.total_size = file.second;
+                infoPkt.seqn = pkt.seqn;
+                infoPkt.payload = "U:" + file.first;
+                Reactor::queuePacket(session->conn, infoPkt, OUT_METADATA);
+            }
+            break;
+        }
+
+        case CMD_SIGNATURE: {
+            std::string filename = pkt.payload;
+
+            StoredFilePtr file;
+            int err;
+            {
+                FileLock fileLock(lockManager, username, filename, LOCK_READ);
+                file = fileManager.openFile(username, filename);
+                err = errno;
+            }
+
+            if (!file) {
+                response.payload = (err == ENOENT) ? "NOT_FOUND" : "ERROR";
+                Reactor::queuePacket(session->conn, response);
+                break;
+            }
+
+            // Hashing the whole file would stall every connection on this
+            // I/O thread; hold further commands until the worker is done
+            session->state = CONN_WORKING;
+            Reactor::pauseReading(session->conn);
+
+            workerPool->submit([session, file, response]() mutable {
+                FileSignature sig;
+                sig.baseVersion = file->version();
+                auto reader = [&file](uint64_t offset, void* buffer, size_t length) {
+                    return file->read(offset, buffer, length);
+                };
+                if (compute_signature(reader, file->size(), sig)) {
+                    response.total_size = file->size();
+                    response.payload = "OK" + encode_signature(sig);
+                    DEBUG_PRINTF("DEBUG Server: Signature ready: %zu blocks of %u bytes\n",
+                                 sig.blocks.size(), sig.blockSize);
+                } else {
+                    response.payload = "ERROR";
+                }
+                session->jobReply = response;
+                session->jobDone = true;
+                Reactor::requestWritable(session->conn);
+            });
+            break;
+        }
+
+        case CMD_UPLOAD_DELTA: {
+            // Payload: base version (u64) the delta was computed against, then the filename
+            if (pkt.payload.size() <= 8) {
+                response.payload = "ERROR";
+                Reactor::queuePacket(session->conn, response);
+                break;
+            }
+            uint64_t baseVersion = get_u64((const uint8_t*)pkt.payload.data());
+            std::string filename = pkt.payload.substr(8);
+            DEBUG_PRINTF("DEBUG Server: Received delta upload for file: %s, size: %llu bytes\n",
+                   filename.c_str(), (unsigned long long)pkt.total_size);
+
+            StoredFilePtr base;
+            {
+                FileLock fileLock(lockManager, username, filename, LOCK_READ);
+                base = fileManager.openFile(username, filename);
+            }
+
+            session->pending = pkt;
+            session->pending.payload = filename;
+            session->transferOffset = 0;
+            session->state = CONN_UPLOADING;
+
+            // The copy ranges only make sense against the exact version the
+            // client saw. Otherwise the ops are drained and the upload fails;
+            // the client then falls back to a full upload.
+            if (base && base->version() == baseVersion) {
+                session->deltaBase = base;
+                if (!fileManager.beginUpload(username, filename, pkt.total_size, session->upload)) {
+                    DEBUG_PRINTF("DEBUG Server: Could not start delta upload of %s\n", filename.c_str());
+                }
+            } else {
+                DEBUG_PRINTF("DEBUG Server: Base of %s changed since its signature, rejecting delta\n",
+                             filename.c_str());
+            }
+
+            if (pkt.total_size == 0) {
+                finish_upload(session);
+            }
+            break;
+        }
+
+        case CMD_QUERY_CHUNKS: {
+            // Payload: chunk hashes; reply "OK" followed by one byte per hash (1 = stored)
+            if (pkt.payload.size() % CHUNK_HASH_SIZE != 0) {
+                response.payload = "ERROR";
+                Reactor::queuePacket(session->conn, response);
+                break;
+            }
+
+            size_t count = pkt.payload.size() / CHUNK_HASH_SIZE;
+            size_t found = 0;
+            response.payload = "OK";
+            response.payload.reserve(2 + count);
+            for (size_t i = 0; i < count; i++) {
+                bool stored = fileManager.hasChunk(pkt.payload.substr(i * CHUNK_HASH_SIZE, CHUNK_HASH_SIZE));
+                response.payload += stored ? '\1' : '\0';
+                found += stored;
+            }
+            DEBUG_PRINTF("DEBUG Server: %zu of %zu queried chunks already stored\n", found, count);
+            Reactor::queuePacket(session->conn, response);
+            break;
+        }
+
+        case CMD_UPLOAD_BUNDLE: {
+            // total_size is the size of the bundle; its frames follow on this stream
+            DEBUG_PRINTF("DEBUG Server: Receiving bundle of %llu bytes\n", (unsigned long long)pkt.total_size);
+            session->pending = pkt;
+            session->transferOffset = 0;
+            session->bundleResults.clear();
+            session->bundleBroken = false;
+            session->state = CONN_UPLOADING;
+            if (pkt.total_size == 0) {
+                finish_bundle(session);
+            }
+            break;
+        }
+
+        case CMD_DOWNLOAD_BUNDLE: {
+            // Payload: name length u16 + name per file. Reply "OK" + one status
+            // per name (BUNDLE_*); total_size is the size of the bundle that follows.
+            if (session->downloads.size() >= MAX_DOWNLOAD_STREAMS) {
+                response.payload = "BUSY";
+                Reactor::queuePacket(session->conn, response);
+                break;
+            }
+
+            std::vector<std::pair<std::string, StoredFilePtr>> bundle;
+            std::string statuses;
+            uint64_t bundleSize = 0;
+            const uint8_t* p = (const uint8_t*)pkt.payload.data();
+            const uint8_t* end = p + pkt.payload.size();
+            bool valid = true;
+            while (p < end) {
+                size_t length = (end - p >= 2) ? get_u16(p) : SIZE_MAX;
+                if (length > (size_t)(end - p) - 2 || statuses.size() >= BUNDLE_MAX_FILES) {
+                    valid = false;
+                    break;
+                }
+                std::string filename((const char*)p + 2, length);
+                p += 2 + length;
+
+                StoredFilePtr file;
+                {
+                    FileLock fileLock(lockManager, username, filename, LOCK_READ);
+                    file = fileManager.openFile(username, filename);
+                }
+                if (!file) {
+                    statuses += (char)BUNDLE_MISSING;
+                } else if (file->size() > BUNDLE_MAX_FILE_SIZE) {
+                    statuses += (char)BUNDLE_TOO_LARGE;
+                } else {
+                    statuses += (char)BUNDLE_STORED;
+                    bundleSize += bundle_entry_size(filename.size(), file->size());
+                    bundle.emplace_back(filename, file);
+                }
+            }
+            if (!valid) {
+                response.payload = "ERROR";
+                Reactor::queuePacket(session->conn, response);
+                break;
+            }
+
+            response.total_size = bundleSize;
+            response.payload = "OK" + statuses;
+            DEBUG_PRINTF("DEBUG Server: Sending bundle of %zu files (%llu bytes)\n",
+                         bundle.size(), (unsigned long long)bundleSize);
+            Reactor::queuePacket(session->conn, response);
+
+            if (!bundle.empty()) {
+                DownloadStream& stream = session->downloads[pkt.seqn];
+                stream.bundle = std::move(bundle);
+                stream.nextEntry = 0;
+                stream.offset = 0;
+                stream.end = bundleSize;
+                stream.credit = STREAM_INITIAL_WINDOW;
+                continue_download(session);
+            }
+            break;
+        }
+
+        case CMD_PUSH: {
+            // From now on small files come with their notifications. Reply
+            // "OK" + the largest size pushed (u64).
+            session->push = true;
+            response.payload = "OK";
+            append_u64(response.payload, PUSH_MAX_FILE_SIZE);
+            Reactor::queuePacket(session->conn, response);
+            break;
+        }
+
+        case CMD_STRIPED_BEGIN: {
+            // Payload: filename; total_size is the file size. Reply "OK" + upload id (u64).
+            uint64_t id;
+            if (fileManager.beginStripedUpload(username, pkt.payload, pkt.total_size, session->token, id)) {
+                response.payload = "OK";
+                append_u64(response.payload, id);
+            } else {
+                response.payload = "ERROR";
+            }
+            Reactor::queuePacket(session->conn, response);
+            break;
+        }
+
+        case CMD_UPLOAD_RANGE: {
+            // Payload: upload id, offset (u64s), then the data to write there
+            if (pkt.payload.size() < 16) {
+                response.payload = "ERROR";
+                Reactor::queuePacket(session->conn, response);
+                break;
+            }
+            const uint8_t* p = (const uint8_t*)pkt.payload.data();
+            size_t length = pkt.payload.size() - 16;
+            bool written = fileManager.writeStripedRange(username, get_u64(p), get_u64(p + 8),
+                                                         pkt.payload.data() + 16, length);
+            session->stats.bytesUploaded += length;
+            response.payload = written ? "OK" : "ERROR";
+            Reactor::queuePacket(session->conn, response);
+            break;
+        }
+
+        case CMD_STRIPED_COMMIT: {
+            // Payload: upload id (u64). Reply "OK" with total_size = the new version.
+            if (pkt.payload.size() != 8) {
+                response.payload = "ERROR";
+                Reactor::queuePacket(session->conn, response);
+                break;
+            }
+            uint64_t id = get_u64((const uint8_t*)pkt.payload.data());
+
+            // Cutting the whole file into chunks takes as long as hashing
+            // it; like signatures it runs on a worker
+            session->state = CONN_WORKING;
+            Reactor::pauseReading(session->conn);
+
+            workerPool->submit([session, id, response]() mutable {
+                const std::string& username = session->username;
+                std::vector<UploadHandle> uploads(1);
+                UploadHandle& upload = uploads[0];
+                std::vector<char> stored(1, fileManager.finishStripedUpload(username, id, upload));
+                commit_uploads(username, uploads, stored);
+                bool success = stored[0];
+                DEBUG_PRINTF("DEBUG Server: Striped upload %llu %s\n",
+                             (unsigned long long)id, success ? "committed" : "failed");
+
+                if (success) {
+                    packet notifyPkt;
+                    notifyPkt.type = SYNC_NOTIFICATION;
+                    notifyPkt.total_size = upload.version;
+                    notifyPkt.payload = "U:" + upload.filename;
+                    notify_devices(session, notifyPkt);
+                    response.total_size = upload.version;
+                    response.payload = "OK";
+                } else {
+                    response.payload = "ERROR";
+                }
+                session->jobReply = response;
+                session->jobDone = true;
+                Reactor::requestWritable(session->conn);
+            });
             break;
         }
 
         case CMD_EXIT: {
-            strcpy(response.payload, "OK");
-            response.length = 2;
-            DEBUG_PRINTF("DEBUG Server: Sending exit response: %s with seq: %d\n", response.payload, response.seqn);
-            send(sockfd, &response, sizeof(packet), 0);
+            response.payload = "OK";
+            DEBUG_PRINTF("DEBUG Server: Sending exit response: %s with seq: %u\n", response.payload.c_str(), response.seqn);
+            Reactor::queuePacket(session->conn, response);
             break;
         }
 
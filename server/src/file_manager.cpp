@@ -1,20 +1,797 @@
 #include "file_manager.h"
+#include "sha256.h"
+#include "wire.h"
+#include "common.h"
 #include <iostream>
 #include <fstream>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <filesystem>
-#include <dirent.h>
 #include <fcntl.h>
+#include <cstring>
+#include <errno.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
 
 namespace fs = std::filesystem;
 
-FileManager::FileManager() {
+// A file in a user directory is a manifest naming its chunks:
+// magic, size u64, count u32, then count * (hash, length u32)
+#define MANIFEST_MAGIC "SYNCMAN1"
+#define MANIFEST_MAGIC_SIZE 8
+#define MANIFEST_HEADER_SIZE (MANIFEST_MAGIC_SIZE + 12)
+#define MANIFEST_ENTRY_SIZE (CHUNK_HASH_SIZE + 4)
+
+// A record of a user pack (files/.packs/<user>.pack): body length u32,
+// body, SHA-256 of the body. The body is op u8 and name (length u16 +
+// name); a 'P' record goes on with version u64, mtime, chunk count u32
+// and the chunks (hash, length u32). A record that does not check out is
+// the tail of an append torn by a crash.
+#define PACK_RECORD_OVERHEAD (4 + SHA256_DIGEST_SIZE)
+
+// Compact a user pack once its dead records outweigh the live ones by
+// this many bytes
+#define USER_PACK_SLACK (64 * 1024)
+
+// Index snapshot of one user (files/.index/<user>):
+//   magic, directory inode u64, directory mtime, pack inode u64, pack size
+//   u64, file count u32, then per file: name length u16, name, mtime,
+//   atime, ctime, version u64, pack offset u64, pack record length u32,
+//   chunk count u32, chunks (hash, length u32); times are seconds u64 +
+//   ns u32. A SHA-256 of everything before it ends the file.
+#define INDEX_MAGIC "SYNCIDX2"
+#define INDEX_MAGIC_SIZE 8
+
+// Seconds between snapshot rounds. A user directory changed less than
+// INDEX_QUIET_TIME seconds ago waits for the next round: its mtime, which
+// validates the snapshot at startup, has a coarse clock and a change
+// right after the snapshot could otherwise leave it unchanged.
+#define INDEX_SNAPSHOT_INTERVAL 10
+#define INDEX_QUIET_TIME 1
+
+static bool read_all(int fd, void* buffer, size_t length, uint64_t offset) {
+    char* out = (char*)buffer;
+    while (length > 0) {
+        ssize_t n = pread(fd, out, length, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        out += n;
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool read_manifest_header(int fd, uint64_t& size, uint32_t& count) {
+    uint8_t header[MANIFEST_HEADER_SIZE];
+    if (!read_all(fd, header, sizeof(header), 0) ||
+        memcmp(header, MANIFEST_MAGIC, MANIFEST_MAGIC_SIZE) != 0) {
+        return false;
+    }
+    size = get_u64(header + MANIFEST_MAGIC_SIZE);
+    count = get_u32(header + MANIFEST_MAGIC_SIZE + 8);
+    return true;
+}
+
+static bool read_manifest(int fd, std::vector<ChunkRef>& chunks) {
+    uint64_t size;
+    uint32_t count;
+    if (!read_manifest_header(fd, size, count)) {
+        return false;
+    }
+
+    std::vector<uint8_t> entries((size_t)count * MANIFEST_ENTRY_SIZE);
+    if (!read_all(fd, entries.data(), entries.size(), MANIFEST_HEADER_SIZE)) {
+        return false;
+    }
+
+    chunks.resize(count);
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* entry = entries.data() + (size_t)i * MANIFEST_ENTRY_SIZE;
+        chunks[i].hash.assign((const char*)entry, CHUNK_HASH_SIZE);
+        chunks[i].length = get_u32(entry + CHUNK_HASH_SIZE);
+        total += chunks[i].length;
+    }
+    return total == size;
+}
+
+static bool read_manifest(const std::string& path, std::vector<ChunkRef>& chunks) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = read_manifest(fd, chunks);
+    close(fd);
+    return ok;
+}
+
+// Identifies the exact version of a manifest. Commits rename a new inode
+// into place, so any replacement changes this; the rename itself does not.
+static uint64_t stat_version(const struct stat& st) {
+    uint64_t mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+    return ((uint64_t)st.st_ino * 0x9e3779b97f4a7c15ull) ^ (mtime * 31) ^ (uint64_t)st.st_size;
+}
+
+// Version of a pack record: where it was appended and when. Compaction
+// moves records but keeps their versions.
+static uint64_t pack_version(uint64_t ino, uint64_t offset, const struct timespec& mtime) {
+    uint64_t ns = (uint64_t)mtime.tv_sec * 1000000000ull + mtime.tv_nsec;
+    return (ino * 0x9e3779b97f4a7c15ull) ^ (ns * 31) ^ (offset * 0xc2b2ae3d27d4eb4full);
+}
+
+static bool later(const struct timespec& a, const struct timespec& b) {
+    return a.tv_sec != b.tv_sec ? a.tv_sec > b.tv_sec : a.tv_nsec > b.tv_nsec;
+}
+
+static void add_chunks(FileInfo& info, const std::vector<ChunkRef>& chunks) {
+    Sha256 hash;
+    for (const auto& chunk : chunks) {
+        info.size += chunk.length;
+        hash.update(chunk.hash.data(), chunk.hash.size());
+    }
+    hash.final(info.contentHash);
+}
+
+// Index entry of a manifest with this stat and chunk list
+static FileInfo file_info(const std::string& name, const struct stat& st,
+                          const std::vector<ChunkRef>& chunks) {
+    FileInfo info;
+    info.filename = name;
+    info.mtime = st.st_mtim;
+    info.atime = st.st_atim;
+    info.ctime = st.st_ctim;
+    info.version = stat_version(st);
+    add_chunks(info, chunks);
+    return info;
+}
+
+struct PackRecord {
+    char op = 'P';
+    std::string name;
+    uint64_t version = 0;
+    struct timespec mtime = {};
+    std::vector<ChunkRef> chunks;
+};
+
+// Index entry of a file whose manifest is a pack record
+static FileInfo packed_info(const PackRecord& record) {
+    FileInfo info;
+    info.filename = record.name;
+    info.mtime = info.atime = info.ctime = record.mtime;
+    info.version = record.version;
+    add_chunks(info, record.chunks);
+    return info;
+}
+
+static void append_timespec(std::string& out, const struct timespec& ts) {
+    append_u64(out, ts.tv_sec);
+    append_u32(out, ts.tv_nsec);
+}
+
+// Bounds-checked reads from a snapshot or a pack record; ok turns false
+// past the end
+struct SnapshotReader {
+    const uint8_t* p;
+    const uint8_t* end;
+    bool ok = true;
+
+    const uint8_t* take(size_t n) {
+        if (!ok || (size_t)(end - p) < n) {
+            ok = false;
+            return nullptr;
+        }
+        p += n;
+        return p - n;
+    }
+    uint16_t u16() { const uint8_t* q = take(2); return q ? get_u16(q) : 0; }
+    uint32_t u32() { const uint8_t* q = take(4); return q ? get_u32(q) : 0; }
+    uint64_t u64() { const uint8_t* q = take(8); return q ? get_u64(q) : 0; }
+    struct timespec time() {
+        struct timespec ts;
+        ts.tv_sec = u64();
+        ts.tv_nsec = u32();
+        return ts;
+    }
+    std::string bytes(size_t n) {
+        const uint8_t* q = take(n);
+        return q ? std::string((const char*)q, n) : std::string();
+    }
+};
+
+static std::string encode_pack_record(const PackRecord& record) {
+    std::string body(1, record.op);
+    append_u16(body, record.name.size());
+    body += record.name;
+    if (record.op == 'P') {
+        append_u64(body, record.version);
+        append_timespec(body, record.mtime);
+        append_u32(body, record.chunks.size());
+        for (const auto& chunk : record.chunks) {
+            body += chunk.hash;
+            append_u32(body, chunk.length);
+        }
+    }
+
+    std::string out;
+    append_u32(out, body.size());
+    out += body;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(body.data(), body.size(), digest);
+    out.append((const char*)digest, sizeof(digest));
+    return out;
+}
+
+// The record at offset of a pack read whole; false past its last intact one
+static bool parse_pack_record(const std::string& data, size_t offset, PackRecord& record, size_t& length) {
+    if (data.size() - offset < PACK_RECORD_OVERHEAD) {
+        return false;
+    }
+    size_t bodySize = get_u32((const uint8_t*)data.data() + offset);
+    if (data.size() - offset - PACK_RECORD_OVERHEAD < bodySize) {
+        return false;
+    }
+    const uint8_t* body = (const uint8_t*)data.data() + offset + 4;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(body, bodySize, digest);
+    if (memcmp(digest, body + bodySize, SHA256_DIGEST_SIZE) != 0) {
+        return false;
+    }
+
+    SnapshotReader reader{body, body + bodySize};
+    record = PackRecord();
+    const uint8_t* op = reader.take(1);
+    record.op = op ? (char)*op : 0;
+    record.name = reader.bytes(reader.u16());
+    if (record.op == 'P') {
+        record.version = reader.u64();
+        record.mtime = reader.time();
+        uint32_t count = reader.u32();
+        for (uint32_t i = 0; i < count && reader.ok; i++) {
+            ChunkRef chunk;
+            chunk.hash = reader.bytes(CHUNK_HASH_SIZE);
+            chunk.length = reader.u32();
+            record.chunks.push_back(std::move(chunk));
+        }
+    }
+    length = PACK_RECORD_OVERHEAD + bodySize;
+    return reader.ok && reader.p == reader.end && (record.op == 'P' || record.op == 'D');
+}
+
+// Flush of a group commit: directories renamed into and packs appended to
+static bool sync_paths(const std::set<std::string>& paths) {
+    bool ok = true;
+    for (const auto& path : paths) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fsync(fd) != 0) {
+            std::cerr << "ERROR: Failed to sync " << path << ": " << strerror(errno) << std::endl;
+            ok = false;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return ok;
+}
+
+FileManager::FileManager()
+    : store("files/.chunks", getIncomingDir()),
+      dataSync([this](const std::set<std::string>&) { return store.sync(); }),
+      dirSync(sync_paths) {
     // Create main server directory if it doesn't exist
 
     if (!fs::exists("files")) {
         fs::create_directory("files");
     }
+
+    // Temp files of uploads interrupted by a crash are never committed
+    std::error_code ec;
+    fs::remove_all(getIncomingDir(), ec);
+    fs::create_directory(getIncomingDir(), ec);
+
+    fs::create_directory(getIndexDir(), ec);
+    fs::create_directory(getPackDir(), ec);
+    loadUserFiles();
+    store.sweep();
+
+    snapshotThread = std::thread(&FileManager::snapshotLoop, this);
+}
+
+FileManager::~FileManager() {
+    {
+        std::lock_guard<std::mutex> lock(snapshotMutex);
+        stopping = true;
+    }
+    snapshotCv.notify_all();
+    snapshotThread.join();
+
+    for (auto& user : users) {
+        if (user.second.packFd >= 0) {
+            close(user.second.packFd);
+        }
+    }
+}
+
+void FileManager::loadUserFiles() {
+    std::error_code ec;
+    size_t files = 0, snapshots = 0;
+    for (const auto& userDir : fs::directory_iterator("files", ec)) {
+        if (!userDir.is_directory() ||
+            userDir.path().filename().string().compare(0, 9, "sync_dir_") != 0) {
+            continue;
+        }
+        std::string username = userDir.path().filename().string().substr(9);
+        UserIndex& index = users[username];
+
+        if (loadSnapshot(username, index)) {
+            snapshots++;
+        } else {
+            scanUserDirectory(username, index);
+            index.dirty = true;
+        }
+        files += index.files.size();
+    }
+    std::cout << "Index: " << files << " files of " << users.size() << " users ("
+              << snapshots << " from snapshots)" << std::endl;
+}
+
+bool FileManager::loadSnapshot(const std::string& username, UserIndex& index) {
+    std::ifstream in(getIndexDir() + "/" + username, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.size() < INDEX_MAGIC_SIZE + SHA256_DIGEST_SIZE ||
+        data.compare(0, INDEX_MAGIC_SIZE, INDEX_MAGIC) != 0) {
+        return false;
+    }
+    size_t bodySize = data.size() - SHA256_DIGEST_SIZE;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(data.data(), bodySize, digest);
+    if (memcmp(digest, data.data() + bodySize, SHA256_DIGEST_SIZE) != 0) {
+        return false;
+    }
+
+    // Any rename into or out of the directory since moved its mtime
+    SnapshotReader reader{(const uint8_t*)data.data() + INDEX_MAGIC_SIZE,
+                               (const uint8_t*)data.data() + bodySize};
+    struct stat dirSt;
+    uint64_t dirIno = reader.u64();
+    struct timespec dirMtime = reader.time();
+    if (stat(getUserDir(username).c_str(), &dirSt) != 0 || dirSt.st_ino != dirIno ||
+        dirSt.st_mtim.tv_sec != dirMtime.tv_sec || dirSt.st_mtim.tv_nsec != dirMtime.tv_nsec) {
+        DEBUG_PRINTF("DEBUG FileManager: Index snapshot of %s is out of date\n", username.c_str());
+        return false;
+    }
+
+    // Every append to the pack grew it, and compaction replaced it
+    struct stat packSt;
+    uint64_t packIno = reader.u64();
+    uint64_t packSize = reader.u64();
+    bool hasPack = stat(getPackPath(username).c_str(), &packSt) == 0;
+    if (hasPack ? (packSt.st_ino != packIno || (uint64_t)packSt.st_size != packSize)
+                : (packIno != 0 || packSize != 0)) {
+        DEBUG_PRINTF("DEBUG FileManager: Index snapshot of %s is behind its pack\n", username.c_str());
+        return false;
+    }
+
+    std::map<std::string, IndexedFile> files;
+    uint64_t packLive = 0;
+    uint32_t count = reader.u32();
+    for (uint32_t i = 0; i < count && reader.ok; i++) {
+        std::string name = reader.bytes(reader.u16());
+        IndexedFile& file = files[name];
+        file.info.filename = name;
+        file.info.mtime = reader.time();
+        file.info.atime = reader.time();
+        file.info.ctime = reader.time();
+        file.info.version = reader.u64();
+        file.packOffset = reader.u64();
+        file.packLength = reader.u32();
+        packLive += file.packLength;
+        uint32_t chunks = reader.u32();
+        Sha256 hash;
+        for (uint32_t j = 0; j < chunks && reader.ok; j++) {
+            ChunkRef chunk;
+            chunk.hash = reader.bytes(CHUNK_HASH_SIZE);
+            chunk.length = reader.u32();
+            file.info.size += chunk.length;
+            hash.update(chunk.hash.data(), chunk.hash.size());
+            file.chunks.push_back(std::move(chunk));
+        }
+        hash.final(file.info.contentHash);
+    }
+    if (!reader.ok || reader.p != reader.end) {
+        return false;
+    }
+
+    // The manifests' references, as a scan would take them
+    std::vector<std::string> acquired;
+    for (const auto& entry : files) {
+        for (const auto& chunk : entry.second.chunks) {
+            uint32_t length;
+            if (!store.acquire(chunk.hash, length)) {
+                DEBUG_PRINTF("DEBUG FileManager: Index snapshot of %s names a missing chunk\n", username.c_str());
+                for (const auto& hash : acquired) {
+                    store.release(hash);
+                }
+                return false;
+            }
+            acquired.push_back(chunk.hash);
+        }
+    }
+
+    index.files.swap(files);
+    for (const auto& entry : index.files) {
+        index.tree.set(entry.first, entry.second.info.version);
+    }
+    index.packLive = packLive;
+    if (hasPack) {
+        openPack(username, index);
+    }
+    return true;
+}
+
+void FileManager::scanUserDirectory(const std::string& username, UserIndex& index) {
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(getUserDir(username), ec)) {
+        if (!entry.is_regular_file()) {
+            continue;
+        }
+        std::string path = entry.path().string();
+        std::string name = entry.path().filename().string();
+
+        struct stat st;
+        std::vector<ChunkRef> chunks;
+        if (!read_manifest(path, chunks)) {
+            // The import's commit takes the references itself
+            std::cout << "Converting " << path << " to chunked storage" << std::endl;
+            if (!importFile(path) || !read_manifest(path, chunks) || stat(path.c_str(), &st) != 0) {
+                std::cerr << "ERROR: Failed to convert " << path << std::endl;
+                continue;
+            }
+        } else {
+            if (stat(path.c_str(), &st) != 0) {
+                continue;
+            }
+            for (const auto& chunk : chunks) {
+                uint32_t length;
+                if (!store.acquire(chunk.hash, length)) {
+                    std::cerr << "ERROR: " << path << " references a missing chunk "
+                              << sha256_hex((const uint8_t*)chunk.hash.data()) << std::endl;
+                }
+            }
+        }
+
+        IndexedFile& file = index.files[name];
+        file.info = file_info(name, st, chunks);
+        file.chunks = std::move(chunks);
+        index.tree.set(name, file.info.version);
+    }
+
+    replayPack(username, index);
+}
+
+bool FileManager::openPack(const std::string& username, UserIndex& index) {
+    if (index.packFd >= 0) {
+        return true;
+    }
+    std::string path = getPackPath(username);
+    bool created = access(path.c_str(), F_OK) != 0;
+    index.packFd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (index.packFd < 0 || fstat(index.packFd, &st) != 0) {
+        std::cerr << "ERROR: Failed to open pack " << path << ": " << strerror(errno) << std::endl;
+        if (index.packFd >= 0) {
+            close(index.packFd);
+            index.packFd = -1;
+        }
+        return false;
+    }
+    // Records synced into a pack whose name a crash could lose would be lost too
+    if (created && !sync_paths({getPackDir()})) {
+        close(index.packFd);
+        index.packFd = -1;
+        return false;
+    }
+    index.packIno = st.st_ino;
+    index.packSize = st.st_size;
+    return true;
+}
+
+bool FileManager::appendPack(const std::string& username, UserIndex& index, PackRecord& record,
+                             uint64_t& offset, uint32_t& length) {
+    if (!openPack(username, index)) {
+        return false;
+    }
+    offset = index.packSize;
+    if (record.op == 'P') {
+        record.version = pack_version(index.packIno, offset, record.mtime);
+    }
+    std::string data = encode_pack_record(record);
+    ssize_t n = write(index.packFd, data.data(), data.size());
+    if (n != (ssize_t)data.size()) {
+        std::cerr << "ERROR: Failed to append to pack " << getPackPath(username) << ": " << strerror(errno) << std::endl;
+        // A partial record would read as a torn tail and hide the ones after it
+        if (n > 0 && ftruncate(index.packFd, offset) != 0) {
+            std::cerr << "ERROR: Failed to truncate pack " << getPackPath(username) << std::endl;
+        }
+        return false;
+    }
+    index.packSize += data.size();
+    length = data.size();
+    return true;
+}
+
+void FileManager::replayPack(const std::string& username, UserIndex& index) {
+    if (access(getPackPath(username).c_str(), F_OK) != 0 || !openPack(username, index)) {
+        return;
+    }
+
+    std::string data;
+    char buffer[64 * 1024];
+    ssize_t n;
+    while ((n = pread(index.packFd, buffer, sizeof(buffer), data.size())) > 0) {
+        data.append(buffer, n);
+    }
+
+    struct Latest {
+        PackRecord record;
+        uint64_t offset;
+        uint32_t length;
+    };
+    std::map<std::string, Latest> latest;
+    size_t offset = 0;
+    size_t length;
+    PackRecord record;
+    while (parse_pack_record(data, offset, record, length)) {
+        if (record.op == 'P') {
+            std::string name = record.name;
+            latest[name] = Latest{std::move(record), offset, (uint32_t)length};
+        } else {
+            latest.erase(record.name);
+        }
+        offset += length;
+    }
+    if (offset != data.size()) {
+        // Never synced, so no commit was reported for it
+        DEBUG_PRINTF("WARN FileManager: Dropping %zu bytes at the end of the pack of %s\n",
+                     data.size() - offset, username.c_str());
+        if (ftruncate(index.packFd, offset) != 0) {
+            std::cerr << "ERROR: Failed to truncate pack " << getPackPath(username) << std::endl;
+        }
+        index.packSize = offset;
+    }
+
+    for (auto& entry : latest) {
+        PackRecord& live = entry.second.record;
+        auto existing = index.files.find(live.name);
+        if (existing != index.files.end()) {
+            // A crash between the two steps of a switch between manifest
+            // file and pack record left both: the later one is the file
+            if (!later(live.mtime, existing->second.info.mtime)) {
+                PackRecord gone;
+                gone.op = 'D';
+                gone.name = live.name;
+                uint64_t goneOffset;
+                uint32_t goneLength;
+                appendPack(username, index, gone, goneOffset, goneLength);
+                continue;
+            }
+            for (const auto& chunk : existing->second.chunks) {
+                store.release(chunk.hash);
+            }
+            unlink(getFilePath(username, live.name).c_str());
+        }
+
+        for (const auto& chunk : live.chunks) {
+            uint32_t stored;
+            if (!store.acquire(chunk.hash, stored)) {
+                std::cerr << "ERROR: Pack record of " << live.name << " references a missing chunk "
+                          << sha256_hex((const uint8_t*)chunk.hash.data()) << std::endl;
+            }
+        }
+        IndexedFile& file = index.files[live.name];
+        file.info = packed_info(live);
+        file.chunks = std::move(live.chunks);
+        file.packOffset = entry.second.offset;
+        file.packLength = entry.second.length;
+        index.packLive += file.packLength;
+        index.tree.set(live.name, file.info.version);
+    }
+}
+
+void FileManager::compactPacks() {
+    std::vector<std::string> due;
+    {
+        std::lock_guard<std::mutex> lock(indexMutex);
+        for (const auto& user : users) {
+            const UserIndex& index = user.second;
+            if (index.packFd >= 0 && index.packSize - index.packLive > index.packLive + USER_PACK_SLACK) {
+                due.push_back(user.first);
+            }
+        }
+    }
+
+    for (const auto& username : due) {
+        // The live records, rewritten from the index
+        std::string data;
+        uint64_t size;
+        std::vector<std::pair<std::string, uint64_t>> offsets;
+        {
+            std::lock_guard<std::mutex> lock(indexMutex);
+            const UserIndex& index = users[username];
+            size = index.packSize;
+            for (const auto& entry : index.files) {
+                const IndexedFile& file = entry.second;
+                if (file.packLength == 0) {
+                    continue;
+                }
+                PackRecord record;
+                record.name = entry.first;
+                record.version = file.info.version;
+                record.mtime = file.info.mtime;
+                record.chunks = file.chunks;
+                offsets.emplace_back(entry.first, data.size());
+                data += encode_pack_record(record);
+            }
+        }
+
+        std::string path = getPackPath(username);
+        std::string tmpPath = path + ".tmp";
+        int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0 && write(fd, data.data(), data.size()) == (ssize_t)data.size() &&
+                  fsync(fd) == 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!ok) {
+            std::cerr << "ERROR: Failed to compact pack " << path << ": " << strerror(errno) << std::endl;
+            unlink(tmpPath.c_str());
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(indexMutex);
+        UserIndex& index = users[username];
+        if (index.packSize != size) {
+            // Appended to meanwhile; the next round tries again
+            unlink(tmpPath.c_str());
+            continue;
+        }
+        // The name must be durable before anything is appended to the new pack
+        if (rename(tmpPath.c_str(), path.c_str()) != 0 || !sync_paths({getPackDir()})) {
+            std::cerr << "ERROR: Failed to replace pack " << path << ": " << strerror(errno) << std::endl;
+            unlink(tmpPath.c_str());
+            continue;
+        }
+        close(index.packFd);
+        index.packFd = -1;
+        openPack(username, index);
+        for (const auto& entry : offsets) {
+            index.files[entry.first].packOffset = entry.second;
+        }
+        index.packLive = data.size();
+        index.dirty = true;
+        DEBUG_PRINTF("DEBUG FileManager: Compacted pack of %s from %llu to %zu bytes\n",
+                     username.c_str(), (unsigned long long)size, data.size());
+    }
+}
+
+void FileManager::snapshotLoop() {
+    std::unique_lock<std::mutex> lock(snapshotMutex);
+    while (!stopping) {
+        snapshotCv.wait_for(lock, std::chrono::seconds(INDEX_SNAPSHOT_INTERVAL));
+        if (stopping) {
+            break;
+        }
+        lock.unlock();
+        writeSnapshots();
+        compactPacks();
+        store.compact();
+        lock.lock();
+    }
+}
+
+void FileManager::writeSnapshots() {
+    std::vector<std::string> dirty;
+    {
+        std::lock_guard<std::mutex> lock(indexMutex);
+        for (const auto& user : users) {
+            if (user.second.dirty) {
+                dirty.push_back(user.first);
+            }
+        }
+    }
+
+    for (const auto& username : dirty) {
+        // The directory is stat'ed before the index is read: a change the
+        // index misses renames into it later, which moves its mtime
+        struct stat dirSt;
+        if (stat(getUserDir(username).c_str(), &dirSt) != 0 ||
+            time(nullptr) - dirSt.st_mtim.tv_sec <= INDEX_QUIET_TIME) {
+            continue;
+        }
+
+        std::string data(INDEX_MAGIC, INDEX_MAGIC_SIZE);
+        append_u64(data, dirSt.st_ino);
+        append_timespec(data, dirSt.st_mtim);
+        {
+            std::lock_guard<std::mutex> lock(indexMutex);
+            UserIndex& index = users[username];
+            index.dirty = false;
+            struct stat packSt;
+            bool hasPack = stat(getPackPath(username).c_str(), &packSt) == 0;
+            append_u64(data, hasPack ? packSt.st_ino : 0);
+            append_u64(data, hasPack ? packSt.st_size : 0);
+            append_u32(data, index.files.size());
+            for (const auto& entry : index.files) {
+                const IndexedFile& file = entry.second;
+                append_u16(data, entry.first.size());
+                data += entry.first;
+                append_timespec(data, file.info.mtime);
+                append_timespec(data, file.info.atime);
+                append_timespec(data, file.info.ctime);
+                append_u64(data, file.info.version);
+                append_u64(data, file.packOffset);
+                append_u32(data, file.packLength);
+                append_u32(data, file.chunks.size());
+                for (const auto& chunk : file.chunks) {
+                    data += chunk.hash;
+                    append_u32(data, chunk.length);
+                }
+            }
+        }
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        sha256(data.data(), data.size(), digest);
+        data.append((const char*)digest, sizeof(digest));
+
+        std::string path = getIndexDir() + "/" + username;
+        std::string tmpPath = path + ".tmp";
+        int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0 && write(fd, data.data(), data.size()) == (ssize_t)data.size() &&
+                  fsync(fd) == 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+            std::cerr << "ERROR: Failed to write index snapshot " << path << ": " << strerror(errno) << std::endl;
+            unlink(tmpPath.c_str());
+            std::lock_guard<std::mutex> lock(indexMutex);
+            users[username].dirty = true;
+            continue;
+        }
+        DEBUG_PRINTF("DEBUG FileManager: Index snapshot of %s written (%zu bytes)\n",
+                     username.c_str(), data.size());
+    }
+}
+
+bool FileManager::importFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    UploadHandle upload;
+    upload.active = true;
+    upload.finalPath = path;
+    upload.size = st.st_size;
+
+    std::vector<char> buffer(1024 * 1024);
+    bool ok = true;
+    while (ok && upload.written < upload.size) {
+        size_t n = std::min((uint64_t)buffer.size(), upload.size - upload.written);
+        ok = read_all(fd, buffer.data(), n, upload.written) && writeUpload(upload, buffer.data(), n);
+    }
+    close(fd);
+
+    if (!ok) {
+        abortUpload(upload);
+        return false;
+    }
+    return commitUpload(upload);
 }
 
 bool FileManager::initUserDirectory(const std::string& username) {
@@ -30,161 +807,734 @@ bool FileManager::initUserDirectory(const std::string& username) {
 
 std::vector<FileInfo> FileManager::listUserFiles(const std::string& username) {
     std::vector<FileInfo> files;
-    std::string userDir = getUserDir(username);
-
-    // Ensure directory exists
-    if (!fs::exists(userDir)) {
+    std::lock_guard<std::mutex> lock(indexMutex);
+    auto user = users.find(username);
+    if (user == users.end()) {
         return files;
     }
-
-    // Force cache refresh by doing a directory read with a system call first
-    DIR* dir = opendir(userDir.c_str());
-    if (dir) {
-        // Just open and close to refresh the directory information
-        closedir(dir);
+    files.reserve(user->second.files.size());
+    for (const auto& entry : user->second.files) {
+        files.push_back(entry.second.info);
     }
+    return files;
+}
 
-    // Clear any filesystem cache to force a fresh read
-    fs::directory_iterator end;
-    fs::directory_iterator it(userDir);
-
-    // Reset the iterator to force a fresh directory read
-    it = fs::directory_iterator(userDir);
+std::vector<FileInfo> FileManager::listPage(const std::string& username, const ListQuery& query,
+                                            bool& more) {
+    std::vector<FileInfo> page;
+    size_t limit = std::max<size_t>(1, std::min<size_t>(query.limit, LIST_PAGE_FILES));
+    more = false;
 
-    // Now collect files with the refreshed view
-    for (const auto& entry : fs::directory_iterator(userDir)) {
-        if (entry.is_regular_file()) {
-            struct stat fileStat;
-            std::string filepath = entry.path().string();
+    std::lock_guard<std::mutex> lock(indexMutex);
+    auto user = users.find(username);
+    if (user == users.end()) {
+        return page;
+    }
+    const auto& files = user->second.files;
+    auto matches = [&](const FileInfo& info) {
+        return list_matches(query, info.size, list_time(info.mtime));
+    };
 
-            if (stat(filepath.c_str(), &fileStat) == 0) {
-                FileInfo info;
-                info.filename = entry.path().filename().string();
-                info.mtime = fileStat.st_mtime;
-                info.atime = fileStat.st_atime;
-                info.ctime = fileStat.st_ctime;
-                info.size = fileStat.st_size;
-                files.push_back(info);
+    // The index is kept in name order: walk it from the resume point
+    if (query.sort == LIST_BY_NAME) {
+        auto take = [&](const FileInfo& info) {
+            if (!matches(info)) {
+                return true;
+            }
+            if (page.size() == limit) {
+                more = true;
+                return false;
+            }
+            page.push_back(info);
+            return true;
+        };
+        if (!query.descending) {
+            auto it = query.resume ? files.upper_bound(query.afterName) : files.begin();
+            for (; it != files.end() && take(it->second.info); ++it) {
+            }
+        } else {
+            auto it = query.resume ? files.lower_bound(query.afterName) : files.end();
+            while (it != files.begin() && take((--it)->second.info)) {
             }
         }
+        return page;
     }
 
-    return files;
+    // Other orders: keep the first limit + 1 files past the resume point
+    // in a heap whose top is the last of them
+    auto key = [&](const FileInfo* info) {
+        return list_sort_key(query, info->size, list_time(info->mtime));
+    };
+    auto before = [&](const FileInfo* a, const FileInfo* b) {
+        return list_before(query, key(a), a->filename, key(b), b->filename);
+    };
+    std::vector<const FileInfo*> heap;
+    heap.reserve(limit + 1);
+    for (const auto& entry : files) {
+        const FileInfo* info = &entry.second.info;
+        if (!matches(*info) ||
+            (query.resume && !list_before(query, query.afterKey, query.afterName, key(info), info->filename))) {
+            continue;
+        }
+        if (heap.size() <= limit) {
+            heap.push_back(info);
+            std::push_heap(heap.begin(), heap.end(), before);
+        } else if (before(info, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), before);
+            heap.back() = info;
+            std::push_heap(heap.begin(), heap.end(), before);
+        }
+    }
+    std::sort_heap(heap.begin(), heap.end(), before);
+    if (heap.size() > limit) {
+        heap.pop_back();
+        more = true;
+    }
+    page.reserve(heap.size());
+    for (const FileInfo* info : heap) {
+        page.push_back(*info);
+    }
+    return page;
 }
 
 bool FileManager::saveFile(const std::string& username, const std::string& filename,
                          const char* data, size_t size) {
+    UploadHandle upload;
+    if (!beginUpload(username, filename, size, upload)) {
+        return false;
+    }
+    if (!writeUpload(upload, data, size)) {
+        abortUpload(upload);
+        return false;
+    }
+    return commitUpload(upload);
+}
+
+bool FileManager::beginUpload(const std::string& username, const std::string& filename,
+                            uint64_t size, UploadHandle& upload) {
     // Ensure user directory exists
     if (!initUserDirectory(username)) {
         return false;
     }
 
-    std::string filepath = getFilePath(username, filename);
-    std::ofstream file(filepath, std::ios::binary);
+    upload = UploadHandle();
+    upload.active = true;
+    upload.username = username;
+    upload.filename = filename;
+    upload.finalPath = getFilePath(username, filename);
+    upload.size = size;
+    upload.packed = PACKED_FILE_MAX_SIZE > 0 && size <= PACKED_FILE_MAX_SIZE;
+    upload.pending.reserve(std::min((uint64_t)CDC_MAX_CHUNK, size));
+    return true;
+}
+
+bool FileManager::storeChunk(UploadHandle& upload, const char* data, size_t size) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(data, size, digest);
 
-    if (!file) {
-        std::cerr << "ERROR: Failed to open file for writing: " << filepath << std::endl;
+    ChunkRef chunk;
+    chunk.hash.assign((const char*)digest, CHUNK_HASH_SIZE);
+    chunk.length = size;
+    if (!store.put(chunk.hash, data, size, upload.size <= CHUNK_CACHE_MAX_FILE)) {
         return false;
     }
+    upload.chunks.push_back(std::move(chunk));
+    return true;
+}
+
+bool FileManager::feedUpload(UploadHandle& upload, const char* data, size_t size) {
+    while (size > 0) {
+        bool cut;
+        size_t n = upload.chunker.scan((const uint8_t*)data, size, cut);
+
+        if (cut && upload.pending.empty()) {
+            // The whole chunk is in the caller's buffer; no need to copy it
+            if (!storeChunk(upload, data, n)) {
+                return false;
+            }
+        } else {
+            upload.pending.append(data, n);
+            if (cut) {
+                if (!storeChunk(upload, upload.pending.data(), upload.pending.size())) {
+                    return false;
+                }
+                upload.pending.clear();
+            }
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
 
-    // Write file data
-    file.write(data, size);
+bool FileManager::writeUpload(UploadHandle& upload, const char* data, size_t size) {
+    if (!upload.active || size > upload.size - upload.written) {
+        return false;
+    }
+    if (!feedUpload(upload, data, size)) {
+        std::cerr << "ERROR: Error storing data of " << upload.finalPath << std::endl;
+        return false;
+    }
+    upload.written += size;
+    return true;
+}
 
-    // Check for errors and flush to ensure data is written
-    if (!file.good()) {
-        std::cerr << "ERROR: Error writing to file: " << filepath << std::endl;
-        file.close();
+bool FileManager::copyUploadRange(UploadHandle& upload, StoredFile& base, uint64_t offset, uint64_t length) {
+    if (!upload.active || length > upload.size - upload.written ||
+        offset > base.size() || length > base.size() - offset) {
         return false;
     }
 
-    // Explicitly flush to disk
-    file.flush();
+    std::vector<char> buffer;
+    uint64_t end = offset + length;
+    while (offset < end) {
+        size_t index = base.chunkAt(offset);
+        const ChunkRef& chunk = base.chunks()[index];
+        uint64_t chunkStart = base.chunkOffset(index);
+        uint64_t chunkEnd = chunkStart + chunk.length;
 
-    // Close the file
-    file.close();
+        // Both streams sit on a cut point and the whole chunk is wanted: the
+        // chunker would cut the same chunk again, so just share it
+        if (upload.chunker.current() == 0 && offset == chunkStart && chunkEnd <= end) {
+            uint32_t stored;
+            if (!store.acquire(chunk.hash, stored)) {
+                return false;
+            }
+            upload.chunks.push_back(chunk);
+            upload.written += chunk.length;
+            offset = chunkEnd;
+            continue;
+        }
 
-    // Sync the parent directory to update directory entry (important!)
-    std::string userDir = getUserDir(username);
-    int dirfd = open(userDir.c_str(), O_RDONLY);
-    if (dirfd >= 0) {
-        fsync(dirfd);  // Force directory entry update
-        close(dirfd);
+        size_t n = std::min(chunkEnd, end) - offset;
+        buffer.resize(n);
+        if (!base.read(offset, buffer.data(), n) || !feedUpload(upload, buffer.data(), n)) {
+            std::cerr << "ERROR: Failed to copy base range into " << upload.finalPath << std::endl;
+            return false;
+        }
+        upload.written += n;
+        offset += n;
     }
+    return true;
+}
 
-    // Double check the file exists and has the right size
-    struct stat st;
-    if (stat(filepath.c_str(), &st) != 0 || st.st_size != size) {
-        std::cerr << "ERROR: File verification failed after save: " << filepath << std::endl;
+bool FileManager::appendStoredChunk(UploadHandle& upload, const std::string& hash, uint32_t length) {
+    if (!upload.active || length > upload.size - upload.written) {
         return false;
     }
 
-    std::cout << "File saved successfully: " << filepath
-              << " (size: " << size << " bytes)" << std::endl;
+    uint32_t stored;
+    if (!store.acquire(hash, stored)) {
+        return false;
+    }
+    if (stored != length) {
+        store.release(hash);
+        return false;
+    }
+
+    if (upload.chunker.current() == 0) {
+        ChunkRef chunk;
+        chunk.hash = hash;
+        chunk.length = length;
+        upload.chunks.push_back(std::move(chunk));
+        upload.written += length;
+        return true;
+    }
+
+    // Not on a cut point here; the content has to go through the chunker
+    std::vector<char> buffer(length);
+    uint64_t offset;
+    int fd = store.open(hash, offset);
+    bool ok = fd >= 0 && read_all(fd, buffer.data(), length, offset);
+    if (fd >= 0) {
+        close(fd);
+    }
+    store.release(hash);
+    return ok && writeUpload(upload, buffer.data(), length);
+}
+
+bool FileManager::hasChunk(const std::string& hash) {
+    return store.contains(hash);
+}
+
+bool FileManager::commitUpload(UploadHandle& upload) {
+    return prepareCommit(upload) && syncPrepared(upload) && publishUpload(upload) &&
+           finishCommit(upload);
+}
+
+bool FileManager::prepareCommit(UploadHandle& upload) {
+    if (!upload.active) {
+        return false;
+    }
+    if (upload.written != upload.size) {
+        std::cerr << "ERROR: Incomplete upload for " << upload.finalPath << " ("
+                  << upload.written << " of " << upload.size << " bytes)" << std::endl;
+        abortUpload(upload);
+        return false;
+    }
+    if (!upload.pending.empty()) {
+        if (!storeChunk(upload, upload.pending.data(), upload.pending.size())) {
+            abortUpload(upload);
+            return false;
+        }
+        upload.pending.clear();
+    }
+
+    // A packed file's manifest is appended at publish; the sync below
+    // still covers its chunks
+    if (upload.packed) {
+        upload.prepared = true;
+        upload.ticket = dataSync.mark();
+        return true;
+    }
+
+    std::string manifest(MANIFEST_MAGIC, MANIFEST_MAGIC_SIZE);
+    manifest.reserve(MANIFEST_HEADER_SIZE + upload.chunks.size() * MANIFEST_ENTRY_SIZE);
+    append_u64(manifest, upload.size);
+    append_u32(manifest, upload.chunks.size());
+    for (const auto& chunk : upload.chunks) {
+        manifest += chunk.hash;
+        append_u32(manifest, chunk.length);
+    }
+
+    // The temp file lives next to the user directories so the final
+    // rename() never crosses a filesystem
+    std::string tmpl = getIncomingDir() + "/manifest.XXXXXX";
+    std::vector<char> tempPath(tmpl.begin(), tmpl.end());
+    tempPath.push_back('\0');
+    int fd = mkstemp(tempPath.data());
+    if (fd < 0) {
+        std::cerr << "ERROR: Failed to create temp file for upload: " << strerror(errno) << std::endl;
+        abortUpload(upload);
+        return false;
+    }
+    fchmod(fd, 0644);
+    upload.manifestPath = tempPath.data();
+    upload.prepared = true;
+
+    bool written = write(fd, manifest.data(), manifest.size()) == (ssize_t)manifest.size() &&
+                   fstat(fd, &upload.manifestStat) == 0;
+    close(fd);
+    if (!written) {
+        std::cerr << "ERROR: Failed to write manifest for " << upload.finalPath << ": " << strerror(errno) << std::endl;
+        abortUpload(upload);
+        return false;
+    }
+
+    // Chunks and manifest are on the same filesystem: the store's sync
+    // makes both durable, for every commit that got this far meanwhile
+    upload.ticket = dataSync.mark();
     return true;
 }
 
-bool FileManager::getFile(const std::string& username, const std::string& filename,
-                        char* buffer, size_t& size) {
-    std::string filepath = getFilePath(username, filename);
+bool FileManager::syncPrepared(UploadHandle& upload) {
+    if (!upload.active || !upload.prepared) {
+        return false;
+    }
+    if (!dataSync.wait(upload.ticket)) {
+        std::cerr << "ERROR: Failed to sync upload of " << upload.finalPath << std::endl;
+        abortUpload(upload);
+        return false;
+    }
+    upload.synced = true;
+    return true;
+}
 
-    if (!fs::exists(filepath)) {
+bool FileManager::publishUpload(UploadHandle& upload) {
+    // Chunks and manifest must be on disk before the rename makes them visible
+    if (!upload.active || !upload.prepared || !upload.synced) {
         return false;
     }
 
-    std::ifstream file(filepath, std::ios::binary | std::ios::ate);
-    if (!file) {
+    // The version being replaced gives up its chunks once the new one is
+    // durably in place. An import at startup has no user set; the scan
+    // indexes it.
+    std::string userDir = fs::path(upload.finalPath).parent_path().string();
+    std::set<std::string> paths;
+    bool published;
+    if (upload.username.empty()) {
+        published = rename(upload.manifestPath.c_str(), upload.finalPath.c_str()) == 0;
+        paths.insert(userDir);
+    } else {
+        std::lock_guard<std::mutex> lock(indexMutex);
+        UserIndex& index = users[upload.username];
+        auto previous = index.files.find(upload.filename);
+        bool hadManifest = previous != index.files.end() && previous->second.packLength == 0;
+        uint32_t replacedLength = previous != index.files.end() ? previous->second.packLength : 0;
+
+        FileInfo info;
+        uint64_t offset = 0;
+        uint32_t length = 0;
+        if (upload.packed) {
+            PackRecord record;
+            record.name = upload.filename;
+            record.chunks = upload.chunks;
+            clock_gettime(CLOCK_REALTIME, &record.mtime);
+            published = appendPack(upload.username, index, record, offset, length);
+            if (published) {
+                info = packed_info(record);
+                paths.insert(getPackPath(upload.username));
+                // Until this unlink is durable a restart sees both; the
+                // record is the later of the two
+                if (hadManifest && unlink(upload.finalPath.c_str()) == 0) {
+                    paths.insert(userDir);
+                }
+            }
+        } else {
+            // Timestamped now, so a restart finds it later than the record
+            // it replaces
+            bool stamped = replacedLength == 0 ||
+                           (utimensat(AT_FDCWD, upload.manifestPath.c_str(), nullptr, 0) == 0 &&
+                            stat(upload.manifestPath.c_str(), &upload.manifestStat) == 0);
+            published = stamped && rename(upload.manifestPath.c_str(), upload.finalPath.c_str()) == 0;
+            if (published) {
+                info = file_info(upload.filename, upload.manifestStat, upload.chunks);
+                paths.insert(userDir);
+                if (replacedLength > 0) {
+                    PackRecord gone;
+                    gone.op = 'D';
+                    gone.name = upload.filename;
+                    uint64_t goneOffset;
+                    uint32_t goneLength;
+                    appendPack(upload.username, index, gone, goneOffset, goneLength);
+                }
+            }
+        }
+
+        if (published) {
+            IndexedFile& file = index.files[upload.filename];
+            upload.replaced.swap(file.chunks);
+            file.info = info;
+            file.chunks = std::move(upload.chunks);
+            file.packOffset = offset;
+            file.packLength = length;
+            index.packLive += length;
+            index.packLive -= replacedLength;
+            index.tree.set(upload.filename, info.version);
+            index.dirty = true;
+            upload.version = info.version;
+        }
+    }
+    if (!published) {
+        std::cerr << "ERROR: Failed to move upload into place: " << upload.finalPath
+                  << ": " << strerror(errno) << std::endl;
+        abortUpload(upload);
         return false;
     }
+    upload.manifestPath.clear();
+    upload.prepared = false;
 
-    size_t fileSize = file.tellg();
-    file.seekg(0, std::ios::beg);
+    // The references now belong to the manifest
+    upload.chunks.clear();
+    if (upload.username.empty()) {
+        upload.version = stat_version(upload.manifestStat);
+    }
+    for (const auto& path : paths) {
+        upload.ticket = dirSync.mark(path);
+    }
+    return true;
+}
+
+bool FileManager::finishCommit(UploadHandle& upload) {
+    if (!upload.active || upload.prepared) {
+        return false;
+    }
+    // The file is in place either way; a failed sync only means it may not
+    // survive a crash, which the caller reports as a failed upload
+    bool ok = dirSync.wait(upload.ticket);
+    for (const auto& chunk : upload.replaced) {
+        store.release(chunk.hash);
+    }
+    upload.replaced.clear();
+    upload.active = false;
+
+    if (ok) {
+        std::cout << "File saved successfully: " << upload.finalPath
+                  << " (size: " << upload.size << " bytes)" << std::endl;
+    }
+    return ok;
+}
+
+StripedUpload::~StripedUpload() {
+    if (fd >= 0) {
+        close(fd);
+        unlink(tempPath.c_str());
+    }
+}
+
+bool FileManager::beginStripedUpload(const std::string& username, const std::string& filename,
+                                     uint64_t size, uint64_t owner, uint64_t& id) {
+    if (!initUserDirectory(username)) {
+        return false;
+    }
+
+    auto upload = std::make_shared<StripedUpload>();
+    upload->username = username;
+    upload->filename = filename;
+    upload->size = size;
+    upload->owner = owner;
+
+    std::string tmpl = getIncomingDir() + "/striped.XXXXXX";
+    std::vector<char> tempPath(tmpl.begin(), tmpl.end());
+    tempPath.push_back('\0');
+    upload->fd = mkstemp(tempPath.data());
+    if (upload->fd < 0) {
+        std::cerr << "ERROR: Failed to create temp file for striped upload: " << strerror(errno) << std::endl;
+        return false;
+    }
+    upload->tempPath = tempPath.data();
+
+    // Reserve the space up front so a full disk fails here, not halfway
+    int err = posix_fallocate(upload->fd, 0, size);
+    if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+        std::cerr << "ERROR: Failed to allocate " << size << " bytes for striped upload: "
+                  << strerror(err) << std::endl;
+        return false;
+    }
+    if (err != 0 && ftruncate(upload->fd, size) != 0) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(stripedMutex);
+    id = nextStripedId++;
+    striped[id] = upload;
+    return true;
+}
+
+bool FileManager::writeStripedRange(const std::string& username, uint64_t id, uint64_t offset,
+                                    const char* data, size_t size) {
+    StripedUploadPtr upload;
+    {
+        std::lock_guard<std::mutex> lock(stripedMutex);
+        auto it = striped.find(id);
+        if (it == striped.end()) {
+            return false;
+        }
+        upload = it->second;
+    }
+    if (upload->username != username || offset > upload->size || size > upload->size - offset) {
+        return false;
+    }
+
+    while (size > 0) {
+        ssize_t n = pwrite(upload->fd, data, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            std::cerr << "ERROR: Failed to write striped range: " << strerror(errno) << std::endl;
+            return false;
+        }
+        data += n;
+        offset += n;
+        size -= n;
+        std::lock_guard<std::mutex> lock(upload->mutex);
+        upload->ranges.emplace_back(offset - n, offset);
+    }
+    return true;
+}
+
+bool FileManager::finishStripedUpload(const std::string& username, uint64_t id, UploadHandle& upload) {
+    StripedUploadPtr striped_upload;
+    {
+        std::lock_guard<std::mutex> lock(stripedMutex);
+        auto it = striped.find(id);
+        if (it == striped.end() || it->second->username != username) {
+            return false;
+        }
+        striped_upload = it->second;
+        striped.erase(it); // late ranges now fail instead of racing the read below
+    }
+
+    // Every byte must have been written by some range
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    {
+        std::lock_guard<std::mutex> lock(striped_upload->mutex);
+        ranges.swap(striped_upload->ranges);
+    }
+    std::sort(ranges.begin(), ranges.end());
+    uint64_t covered = 0;
+    for (const auto& range : ranges) {
+        if (range.first > covered) {
+            break;
+        }
+        covered = std::max(covered, range.second);
+    }
+    if (covered != striped_upload->size) {
+        DEBUG_PRINTF("DEBUG FileManager: Striped upload %llu incomplete (%llu of %llu bytes)\n",
+                     (unsigned long long)id, (unsigned long long)covered,
+                     (unsigned long long)striped_upload->size);
+        return false;
+    }
+
+    if (!beginUpload(username, striped_upload->filename, striped_upload->size, upload)) {
+        return false;
+    }
+    std::vector<char> buffer(std::min((uint64_t)CDC_MAX_CHUNK, striped_upload->size));
+    for (uint64_t offset = 0; offset < striped_upload->size; ) {
+        size_t length = std::min((uint64_t)buffer.size(), striped_upload->size - offset);
+        if (!read_all(striped_upload->fd, buffer.data(), length, offset) ||
+            !writeUpload(upload, buffer.data(), length)) {
+            abortUpload(upload);
+            return false;
+        }
+        offset += length;
+    }
+    return true;
+}
+
+void FileManager::abortStripedUploads(uint64_t owner) {
+    std::lock_guard<std::mutex> lock(stripedMutex);
+    for (auto it = striped.begin(); it != striped.end(); ) {
+        if (it->second->owner == owner) {
+            it = striped.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void FileManager::abortUpload(UploadHandle& upload) {
+    for (const auto& chunk : upload.chunks) {
+        store.release(chunk.hash);
+    }
+    upload.chunks.clear();
+    for (const auto& chunk : upload.replaced) {
+        store.release(chunk.hash);
+    }
+    upload.replaced.clear();
+    if (!upload.manifestPath.empty()) {
+        unlink(upload.manifestPath.c_str());
+        upload.manifestPath.clear();
+    }
+    upload.prepared = false;
+    upload.pending.clear();
+    upload.active = false;
+}
+
+StoredFilePtr FileManager::openFile(const std::string& username, const std::string& filename) {
+    std::lock_guard<std::mutex> lock(indexMutex);
+    auto user = users.find(username);
+    if (user == users.end() || user->second.files.count(filename) == 0) {
+        errno = ENOENT;
+        return nullptr;
+    }
+    const IndexedFile& file = user->second.files[filename];
+    std::vector<ChunkRef> chunks = file.chunks;
+    uint64_t version = file.info.version;
+
+    // Pin every chunk before handing the file out; under the lock, so a
+    // commit cannot release them first
+    for (size_t i = 0; i < chunks.size(); i++) {
+        uint32_t length;
+        if (!store.acquire(chunks[i].hash, length)) {
+            for (size_t j = 0; j < i; j++) {
+                store.release(chunks[j].hash);
+            }
+            errno = EIO;
+            return nullptr;
+        }
+    }
+    return std::make_shared<StoredFile>(store, std::move(chunks), version);
+}
+
+bool FileManager::getFile(const std::string& username, const std::string& filename,
+                        char* buffer, size_t& size) {
+    StoredFilePtr file = openFile(username, filename);
+    if (!file) {
+        return false;
+    }
 
     if (buffer == nullptr) {
         // Just return the size
-        size = fileSize;
+        size = file->size();
         return true;
     }
 
-    if (size < fileSize) {
+    if (size < file->size()) {
         // Buffer too small
         return false;
     }
 
-    file.read(buffer, fileSize);
-    size = fileSize;
-
-    return file.good();
+    size = file->size();
+    return file->read(0, buffer, size);
 }
 
 bool FileManager::deleteFile(const std::string& username, const std::string& filename) {
-    std::string filepath = getFilePath(username, filename);
+    std::vector<ChunkRef> chunks;
+    {
+        std::lock_guard<std::mutex> lock(indexMutex);
+        auto user = users.find(username);
+        if (user == users.end()) {
+            return false;
+        }
+        UserIndex& index = user->second;
+        auto it = index.files.find(filename);
+        if (it == index.files.end()) {
+            return false;
+        }
+        if (it->second.packLength > 0) {
+            PackRecord gone;
+            gone.op = 'D';
+            gone.name = filename;
+            uint64_t offset;
+            uint32_t length;
+            if (!appendPack(username, index, gone, offset, length)) {
+                return false;
+            }
+            index.packLive -= it->second.packLength;
+        } else {
+            std::error_code ec;
+            if (!fs::remove(getFilePath(username, filename), ec)) {
+                return false;
+            }
+        }
+        chunks.swap(it->second.chunks);
+        index.files.erase(it);
+        index.tree.remove(filename);
+        index.dirty = true;
+    }
 
-    if (!fs::exists(filepath)) {
-        return false;
+    for (const auto& chunk : chunks) {
+        store.release(chunk.hash);
     }
+    return true;
+}
 
-    return fs::remove(filepath);
+void FileManager::merkleChildren(const std::string& username, const MerklePrefix& prefix,
+                                 MerkleNode children[MERKLE_FANOUT]) {
+    std::lock_guard<std::mutex> lock(indexMutex);
+    auto user = users.find(username);
+    for (int i = 0; i < MERKLE_FANOUT; i++) {
+        children[i] = user != users.end() ? user->second.tree.node(prefix.child(i)) : MerkleNode();
+    }
+}
+
+std::vector<std::pair<std::string, uint64_t>> FileManager::merkleFiles(const std::string& username,
+                                                                       const MerklePrefix& prefix) {
+    std::lock_guard<std::mutex> lock(indexMutex);
+    auto user = users.find(username);
+    if (user == users.end()) {
+        return {};
+    }
+    return user->second.tree.files(prefix);
 }
 
 bool FileManager::fileExists(const std::string& username, const std::string& filename) {
-    std::string filepath = getFilePath(username, filename);
-    return fs::exists(filepath);
+    std::lock_guard<std::mutex> lock(indexMutex);
+    auto user = users.find(username);
+    return user != users.end() && user->second.files.count(filename) > 0;
 }
 
 FileInfo FileManager::getFileInfo(const std::string& username, const std::string& filename) {
+    std::lock_guard<std::mutex> lock(indexMutex);
+    auto user = users.find(username);
+    if (user != users.end()) {
+        auto it = user->second.files.find(filename);
+        if (it != user->second.files.end()) {
+            return it->second.info;
+        }
+    }
     FileInfo info;
     info.filename = filename;
-
-    std::string filepath = getFilePath(username, filename);
-    struct stat fileStat;
-
-    if (stat(filepath.c_str(), &fileStat) == 0) {
-        info.mtime = fileStat.st_mtime;
-        info.atime = fileStat.st_atime;
-        info.ctime = fileStat.st_ctime;
-        info.size = fileStat.st_size;
-    }
-
     return info;
 }
 
@@ -195,6 +1545,22 @@ void FileManager::propagateFileChange(const std::string& username, const std::st
     // It should send updates to all connected sessions except the one that made the change
 }
 
+std::string FileManager::getIncomingDir() {
+    return "files/.incoming";
+}
+
+std::string FileManager::getIndexDir() {
+    return "files/.index";
+}
+
+std::string FileManager::getPackDir() {
+    return "files/.packs";
+}
+
+std::string FileManager::getPackPath(const std::string& username) {
+    return getPackDir() + "/" + username + ".pack";
+}
+
 std::string FileManager::getUserDir(const std::string& username) {
     return "files/sync_dir_" + username;
 }
@@ -0,0 +1,62 @@
+#include "group_commit.h"
+#include "common.h"
+#include <chrono>
+
+GroupCommit::GroupCommit(Flush flush) : flush(std::move(flush)) {}
+
+uint64_t GroupCommit::mark(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!key.empty()) {
+        keys.insert(key);
+    }
+    return ++issued;
+}
+
+bool GroupCommit::wait(uint64_t ticket) {
+    std::unique_lock<std::mutex> lock(mutex);
+    waiting++;
+    if (flushing) {
+        cv.notify_all();    // a leader may be waiting for company
+    }
+    while (durable < ticket) {
+        if (flushing) {
+            cv.wait(lock);
+            continue;
+        }
+
+        // Lead the next flush. Under concurrent load, give the other
+        // commits a moment to reach it too.
+        flushing = true;
+        if (lastBatch > 1) {
+            auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(GROUP_COMMIT_WINDOW_US);
+            while (waiting < lastBatch && cv.wait_until(lock, until) != std::cv_status::timeout) {
+            }
+        }
+        uint64_t target = issued;
+        size_t batch = waiting;
+        std::set<std::string> batchKeys;
+        batchKeys.swap(keys);
+
+        lock.unlock();
+        bool ok = flush(batchKeys);
+        lock.lock();
+
+        if (!ok) {
+            // Whatever the failed flush covered may be gone for good: a later
+            // flush succeeding says nothing about it
+            DEBUG_PRINTF("ERROR: Group commit flush failed, failing commits through %llu\n",
+                         (unsigned long long)target);
+            failedThrough = target;
+        }
+        if (target - durable > 1) {
+            DEBUG_PRINTF("DEBUG: Group commit: %llu commits in one flush (%zu waiting)\n",
+                         (unsigned long long)(target - durable), batch);
+        }
+        durable = target;
+        lastBatch = batch;
+        flushing = false;
+        cv.notify_all();
+    }
+    waiting--;
+    return ticket > failedThrough;
+}
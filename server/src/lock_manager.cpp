@@ -0,0 +1,87 @@
+#include "lock_manager.h"
+
+// A file lock lives only while someone holds or waits for it, so the table
+// stays as small as the number of files currently being touched.
+struct FileEntry {
+    std::shared_mutex lock;
+    int refs = 0;
+};
+
+struct LockManager::UserEntry {
+    std::shared_mutex dirLock;
+
+    std::mutex filesMutex;
+    std::unordered_map<std::string, std::unique_ptr<FileEntry>> files;
+};
+
+LockManager::LockManager() {}
+
+LockManager::~LockManager() {}
+
+// Entries are never freed: their number is bounded by the number of users
+LockManager::UserEntry* LockManager::user(const std::string& username) {
+    std::lock_guard<std::mutex> lock(usersMutex);
+    std::unique_ptr<UserEntry>& entry = users[username];
+    if (!entry) {
+        entry.reset(new UserEntry());
+    }
+    return entry.get();
+}
+
+std::shared_mutex* LockManager::acquireFile(UserEntry* entry, const std::string& filename) {
+    std::lock_guard<std::mutex> lock(entry->filesMutex);
+    std::unique_ptr<FileEntry>& file = entry->files[filename];
+    if (!file) {
+        file.reset(new FileEntry());
+    }
+    file->refs++;
+    return &file->lock;
+}
+
+void LockManager::releaseFile(UserEntry* entry, const std::string& filename) {
+    std::lock_guard<std::mutex> lock(entry->filesMutex);
+    auto it = entry->files.find(filename);
+    if (it != entry->files.end() && --it->second->refs == 0) {
+        entry->files.erase(it);
+    }
+}
+
+DirLock::DirLock(LockManager& manager, const std::string& username, LockMode mode)
+    : entry(manager.user(username)), mode(mode) {
+    if (mode == LOCK_WRITE) {
+        entry->dirLock.lock();
+    } else {
+        entry->dirLock.lock_shared();
+    }
+}
+
+DirLock::~DirLock() {
+    if (mode == LOCK_WRITE) {
+        entry->dirLock.unlock();
+    } else {
+        entry->dirLock.unlock_shared();
+    }
+}
+
+FileLock::FileLock(LockManager& manager, const std::string& username,
+                   const std::string& filename, LockMode mode)
+    : manager(manager), entry(manager.user(username)), filename(filename), mode(mode) {
+    // Always directory first, then file, so lock order is the same everywhere
+    entry->dirLock.lock_shared();
+    fileMutex = manager.acquireFile(entry, filename);
+    if (mode == LOCK_WRITE) {
+        fileMutex->lock();
+    } else {
+        fileMutex->lock_shared();
+    }
+}
+
+FileLock::~FileLock() {
+    if (mode == LOCK_WRITE) {
+        fileMutex->unlock();
+    } else {
+        fileMutex->unlock_shared();
+    }
+    manager.releaseFile(entry, filename);
+    entry->dirLock.unlock_shared();
+}
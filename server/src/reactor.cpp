@@ -0,0 +1,521 @@
+#include "reactor.h"
+#include "common.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <errno.h>
+#include <thread>
+#include <unordered_map>
+
+// Read at most this much from one socket per wakeup so a single fast
+// uploader cannot starve the other connections of its I/O thread.
+#define READ_BUDGET (4 * 1024 * 1024)
+#define READ_CHUNK (64 * 1024)
+
+// Ask the protocol layer for more data once the output buffer drops below this
+#define OUTPUT_LOW_WATER (FILE_CHUNK_SIZE)
+
+#define MAX_EVENTS 256
+
+struct IoThread {
+    int epfd = -1;
+    int wakefd = -1;
+    ReactorHandler* handler = nullptr;
+
+    // Connections handed over by the acceptor, adopted on the next wakeup,
+    // and connections other threads asked to run onWritable for
+    std::mutex pendingMutex;
+    std::vector<ConnectionPtr> pending;
+    std::vector<ConnectionPtr> writable;
+
+    // Connections owned by this thread (owner thread only)
+    std::unordered_map<int, ConnectionPtr> conns;
+
+    // Connections that got output queued by this thread's own callbacks
+    std::vector<ConnectionPtr> dirty;
+    std::thread thread;
+};
+
+static thread_local IoThread* current_thread = nullptr;
+
+// Register the interest conn needs right now. Caller holds conn->outMutex.
+static void update_interest(Connection& conn) {
+    uint32_t mask = EPOLLRDHUP;
+    if (!conn.readPaused && conn.outPending < OUTPUT_QUEUE_LIMIT) mask |= EPOLLIN;
+    if (conn.outPending > 0) mask |= EPOLLOUT;
+
+    if (mask == conn.eventMask || conn.closed.load()) {
+        return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = mask;
+    ev.data.fd = conn.fd;
+    if (epoll_ctl(conn.owner->epfd, EPOLL_CTL_MOD, conn.fd, &ev) == 0) {
+        conn.eventMask = mask;
+    } else {
+        DEBUG_PRINTF("WARN Reactor: epoll_ctl MOD failed for fd %d: %s\n", conn.fd, strerror(errno));
+    }
+}
+
+FileBody::~FileBody() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Append a segment to one of conn's output queues and make sure it gets
+// flushed. Caller holds conn->outMutex.
+static void queue_segment_locked(const ConnectionPtr& conn, OutSegment&& seg, OutClass cls) {
+    conn->outPending += seg.size();
+
+    // Small frames are coalesced so a burst of replies costs one send()
+    std::deque<OutSegment>& q = conn->outq[cls];
+    if (!seg.file && seg.frameEnd && !q.empty() && !q.back().file && q.back().frameEnd &&
+        q.back().bytes.size() < FILE_CHUNK_SIZE) {
+        q.back().bytes += seg.bytes;
+    } else {
+        q.push_back(std::move(seg));
+    }
+
+    // The owner thread flushes once its current batch of events is handled;
+    // other threads have to wake it up through EPOLLOUT.
+    if (current_thread == conn->owner) {
+        current_thread->dirty.push_back(conn);
+    } else {
+        update_interest(*conn);
+    }
+}
+
+static void queue_bytes(const ConnectionPtr& conn, std::string&& bytes, OutClass cls) {
+    std::lock_guard<std::mutex> lock(conn->outMutex);
+    if (conn->closed.load()) {
+        return;
+    }
+    OutSegment seg;
+    seg.bytes = std::move(bytes);
+    queue_segment_locked(conn, std::move(seg), cls);
+}
+
+void Reactor::queuePacket(const ConnectionPtr& conn, const packet& pkt, OutClass cls) {
+    queue_bytes(conn, encode_packet(pkt), cls);
+}
+
+void Reactor::queueData(const ConnectionPtr& conn, uint16_t type, uint32_t seqn,
+                        uint64_t total_size, const void* data, size_t length, OutClass cls) {
+    packet_header hdr;
+    hdr.version = PROTOCOL_VERSION;
+    hdr.flags = 0;
+    hdr.type = type;
+    hdr.seqn = seqn;
+    hdr.total_size = total_size;
+    hdr.length = length;
+
+    std::string frame(PACKET_HEADER_SIZE, '\0');
+    encode_packet_header(hdr, (uint8_t*)&frame[0]);
+    frame.append((const char*)data, length);
+    queue_bytes(conn, std::move(frame), cls);
+}
+
+void Reactor::queueFileData(const ConnectionPtr& conn, uint16_t type, uint32_t seqn,
+                            uint64_t total_size, const FileBodyPtr& file,
+                            uint64_t offset, size_t length, OutClass cls) {
+    packet_header hdr;
+    hdr.version = PROTOCOL_VERSION;
+    hdr.flags = 0;
+    hdr.type = type;
+    hdr.seqn = seqn;
+    hdr.total_size = total_size;
+    hdr.length = length;
+
+    OutSegment header;
+    header.bytes.assign(PACKET_HEADER_SIZE, '\0');
+    header.frameEnd = length == 0;
+    encode_packet_header(hdr, (uint8_t*)&header.bytes[0]);
+
+    OutSegment body;
+    body.file = file;
+    body.fileOffset = offset;
+    body.fileLength = length;
+
+    // Header and body go in under one lock so no other frame of the class
+    // lands between them; other classes only get a turn after the body
+    std::lock_guard<std::mutex> lock(conn->outMutex);
+    if (conn->closed.load()) {
+        return;
+    }
+    queue_segment_locked(conn, std::move(header), cls);
+    if (length > 0) {
+        queue_segment_locked(conn, std::move(body), cls);
+    }
+}
+
+size_t Reactor::pendingOutput(const ConnectionPtr& conn) {
+    std::lock_guard<std::mutex> lock(conn->outMutex);
+    return conn->outPending;
+}
+
+void Reactor::requestWritable(const ConnectionPtr& conn) {
+    IoThread* t = conn->owner;
+    if (current_thread == t) {
+        t->dirty.push_back(conn);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(t->pendingMutex);
+        t->writable.push_back(conn);
+    }
+    uint64_t one = 1;
+    if (write(t->wakefd, &one, sizeof(one)) < 0) {
+        DEBUG_PRINTF("WARN Reactor: eventfd write failed: %s\n", strerror(errno));
+    }
+}
+
+void Reactor::pauseReading(const ConnectionPtr& conn) {
+    conn->readPaused = true;
+}
+
+void Reactor::resumeReading(const ConnectionPtr& conn) {
+    conn->readPaused = false;
+}
+
+void Reactor::closeAfterFlush(const ConnectionPtr& conn) {
+    std::lock_guard<std::mutex> lock(conn->outMutex);
+    conn->closeAfterFlush = true;
+    conn->readPaused = true;
+}
+
+static void close_connection(IoThread* t, const ConnectionPtr& conn) {
+    {
+        std::lock_guard<std::mutex> lock(conn->outMutex);
+        if (conn->closed.exchange(true)) {
+            return;
+        }
+    }
+
+    t->handler->onClose(conn);
+    epoll_ctl(t->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    t->conns.erase(conn->fd);
+}
+
+// Backpressure: the peer is not reading what we already owe it
+static bool output_full(const ConnectionPtr& conn) {
+    std::lock_guard<std::mutex> lock(conn->outMutex);
+    return conn->outPending >= OUTPUT_QUEUE_LIMIT;
+}
+
+// Parse and dispatch every complete frame sitting in the input buffer
+static bool process_input(IoThread* t, const ConnectionPtr& conn) {
+    size_t pos = 0;
+    bool ok = true;
+
+    while (!conn->readPaused && conn->inbuf.size() - pos >= PACKET_HEADER_SIZE &&
+           !output_full(conn)) {
+        packet_header hdr;
+        if (!decode_packet_header((const uint8_t*)conn->inbuf.data() + pos, hdr)) {
+            DEBUG_PRINTF("ERROR Reactor: Malformed frame on fd %d, closing\n", conn->fd);
+            ok = false;
+            break;
+        }
+        if (conn->inbuf.size() - pos < PACKET_HEADER_SIZE + hdr.length) {
+            break; // Wait for the rest of the payload
+        }
+
+        packet pkt;
+        pkt.type = hdr.type;
+        pkt.seqn = hdr.seqn;
+        pkt.total_size = hdr.total_size;
+        pkt.payload.assign(conn->inbuf, pos + PACKET_HEADER_SIZE, hdr.length);
+        pos += PACKET_HEADER_SIZE + hdr.length;
+
+        if (!t->handler->onPacket(conn, pkt)) {
+            ok = false;
+            break;
+        }
+    }
+
+    conn->inbuf.erase(0, pos);
+    return ok;
+}
+
+// Returns false when the peer is gone
+static bool handle_read(IoThread* t, const ConnectionPtr& conn) {
+    size_t budget = READ_BUDGET;
+    bool eof = false;
+
+    while (budget > 0) {
+        size_t old_size = conn->inbuf.size();
+        conn->inbuf.resize(old_size + READ_CHUNK);
+        ssize_t n = recv(conn->fd, &conn->inbuf[old_size], READ_CHUNK, 0);
+        conn->inbuf.resize(old_size + (n > 0 ? n : 0));
+
+        if (n > 0) {
+            budget -= std::min(budget, (size_t)n);
+            continue;
+        }
+        if (n == 0) {
+            DEBUG_PRINTF("DEBUG Reactor: Peer closed fd %d\n", conn->fd);
+            eof = true;
+            break;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+        DEBUG_PRINTF("DEBUG Reactor: recv error on fd %d: %s\n", conn->fd, strerror(errno));
+        return false;
+    }
+
+    if (!process_input(t, conn)) {
+        return false;
+    }
+    return !eof;
+}
+
+// Write as much queued output as the socket takes, refilling streaming
+// transfers as the buffer drains. Returns false when the connection must close.
+static bool flush_output(IoThread* t, const ConnectionPtr& conn) {
+    for (int round = 0; round < 16; round++) {
+        size_t remaining;
+        {
+            std::lock_guard<std::mutex> lock(conn->outMutex);
+            while (true) {
+                // Between frames, the most urgent class goes next
+                if (conn->outClass < 0) {
+                    for (int cls = 0; cls < OUT_CLASSES && conn->outClass < 0; cls++) {
+                        if (!conn->outq[cls].empty()) {
+                            conn->outClass = cls;
+                        }
+                    }
+                    if (conn->outClass < 0) {
+                        break;
+                    }
+                }
+                std::deque<OutSegment>& q = conn->outq[conn->outClass];
+                OutSegment& seg = q.front();
+                size_t left = seg.size() - conn->outOffset;
+                ssize_t n;
+
+                if (seg.file) {
+                    // File bodies go from the page cache to the socket directly
+                    off_t off = seg.fileOffset + conn->outOffset;
+                    n = sendfile(conn->fd, seg.file->fd, &off, left);
+                    if (n == 0) {
+                        // The file shrank under us; the frame can't be completed
+                        DEBUG_PRINTF("ERROR Reactor: Short file body on fd %d\n", conn->fd);
+                        return false;
+                    }
+                } else {
+                    n = send(conn->fd, seg.bytes.data() + conn->outOffset, left,
+                             MSG_NOSIGNAL | MSG_DONTWAIT);
+                }
+
+                if (n > 0) {
+                    conn->outOffset += n;
+                    conn->outPending -= n;
+                    if (conn->outOffset == seg.size()) {
+                        if (seg.frameEnd) {
+                            conn->outClass = -1;
+                        }
+                        q.pop_front();
+                        conn->outOffset = 0;
+                    }
+                    continue;
+                }
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+                DEBUG_PRINTF("DEBUG Reactor: send error on fd %d: %s\n", conn->fd, strerror(errno));
+                return false;
+            }
+            remaining = conn->outPending;
+
+            if (remaining == 0 && conn->closeAfterFlush) {
+                return false;
+            }
+        }
+
+        if (remaining >= OUTPUT_LOW_WATER) {
+            break; // Socket is full; EPOLLOUT will bring us back
+        }
+
+        size_t before = Reactor::pendingOutput(conn);
+        t->handler->onWritable(conn);
+        if (Reactor::pendingOutput(conn) == before) {
+            break; // Nothing new to send
+        }
+    }
+
+    // A finished transfer may have resumed reading with commands already buffered
+    if (!conn->readPaused && conn->inbuf.size() >= PACKET_HEADER_SIZE) {
+        if (!process_input(t, conn)) {
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(conn->outMutex);
+    update_interest(*conn);
+    return true;
+}
+
+static void adopt_pending(IoThread* t) {
+    uint64_t counter;
+    if (read(t->wakefd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+        DEBUG_PRINTF("WARN Reactor: eventfd read failed: %s\n", strerror(errno));
+    }
+
+    std::vector<ConnectionPtr> adopted;
+    std::vector<ConnectionPtr> writable;
+    {
+        std::lock_guard<std::mutex> lock(t->pendingMutex);
+        adopted.swap(t->pending);
+        writable.swap(t->writable);
+    }
+
+    // Flushed together with the other dirty connections of this wakeup
+    t->dirty.insert(t->dirty.end(), writable.begin(), writable.end());
+
+    for (const auto& conn : adopted) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = conn->fd;
+        if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+            DEBUG_PRINTF("ERROR Reactor: epoll_ctl ADD failed for fd %d: %s\n", conn->fd, strerror(errno));
+            close(conn->fd);
+            continue;
+        }
+        conn->eventMask = ev.events;
+        t->conns[conn->fd] = conn;
+        t->handler->onOpen(conn);
+    }
+}
+
+static void io_loop(IoThread* t) {
+    current_thread = t;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        // Don't sleep while connections are still waiting to be flushed
+        int n = epoll_wait(t->epfd, events, MAX_EVENTS, t->dirty.empty() ? -1 : 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            DEBUG_PRINTF("ERROR Reactor: epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == t->wakefd) {
+                adopt_pending(t);
+                continue;
+            }
+
+            auto it = t->conns.find(fd);
+            if (it == t->conns.end()) {
+                continue;
+            }
+            ConnectionPtr conn = it->second;
+            uint32_t ev = events[i].events;
+
+            bool alive = !(ev & EPOLLERR);
+            if (alive && (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+                alive = handle_read(t, conn);
+            }
+            if (alive) {
+                alive = flush_output(t, conn);
+            }
+            if (!alive) {
+                close_connection(t, conn);
+            }
+        }
+
+        // Fan-out from one of our connections to another one we own
+        std::vector<ConnectionPtr> dirty;
+        dirty.swap(t->dirty);
+        for (const auto& conn : dirty) {
+            if (!conn->closed.load() && !flush_output(t, conn)) {
+                close_connection(t, conn);
+            }
+        }
+    }
+}
+
+Reactor::Reactor(ReactorHandler& handler, int numThreads)
+    : handler(handler), nextThread(0) {
+    if (numThreads < 1) numThreads = 1;
+
+    for (int i = 0; i < numThreads; i++) {
+        IoThread* t = new IoThread();
+        t->handler = &handler;
+        t->epfd = epoll_create1(EPOLL_CLOEXEC);
+        t->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (t->epfd < 0 || t->wakefd < 0) {
+            DEBUG_PRINTF("ERROR Reactor: Failed to create epoll/eventfd: %s\n", strerror(errno));
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = t->wakefd;
+        epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->wakefd, &ev);
+
+        t->thread = std::thread(io_loop, t);
+        threads.push_back(t);
+    }
+}
+
+Reactor::~Reactor() {
+    // I/O threads run for the lifetime of the process
+    for (IoThread* t : threads) {
+        t->thread.detach();
+    }
+}
+
+void Reactor::run(int listenFd) {
+    while (true) {
+        int fd = accept_connection(listenFd);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            DEBUG_PRINTF("ERROR Reactor: accept failed: %s\n", strerror(errno));
+            if (errno == EMFILE || errno == ENFILE) {
+                // Out of descriptors: back off instead of spinning
+                usleep(100 * 1000);
+            }
+            continue;
+        }
+
+        int flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(flag));
+
+        ConnectionPtr conn = std::make_shared<Connection>();
+        conn->fd = fd;
+
+        IoThread* t = threads[nextThread];
+        nextThread = (nextThread + 1) % threads.size();
+        conn->owner = t;
+
+        printf("Cliente conectado!\n");
+
+        {
+            std::lock_guard<std::mutex> lock(t->pendingMutex);
+            t->pending.push_back(conn);
+        }
+        uint64_t one = 1;
+        if (write(t->wakefd, &one, sizeof(one)) < 0) {
+            DEBUG_PRINTF("WARN Reactor: eventfd write failed: %s\n", strerror(errno));
+        }
+    }
+}
@@ -0,0 +1,102 @@
+#include "session.h"
+#include "common.h"
+#include <algorithm>
+
+SessionPtr SessionRegistry::open(const ConnectionPtr& conn) {
+    SessionPtr session = std::make_shared<Session>();
+    session->fd = conn->fd;
+    session->conn = conn;
+    session->stats.connectedAt = time(nullptr);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    byFd[conn->fd] = session;
+    return session;
+}
+
+bool SessionRegistry::login(const SessionPtr& session, const std::string& username, size_t maxDevices) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::shared_ptr<UserSessions>& user = users[username];
+    if (!user) {
+        user = std::make_shared<UserSessions>();
+        std::atomic_store(&user->devices, std::make_shared<const DeviceList>());
+    }
+
+    DeviceListPtr current = std::atomic_load(&user->devices);
+    if (current->size() >= maxDevices) {
+        DEBUG_PRINTF("SERVER: Session limit (%zu) reached for user '%s'. Denying connection %d.\n",
+                     maxDevices, username.c_str(), session->fd);
+        return false;
+    }
+
+    // Copy, modify, publish
+    auto next = std::make_shared<DeviceList>(*current);
+    next->push_back(session);
+    std::atomic_store(&user->devices, DeviceListPtr(next));
+
+    session->username = username;
+    std::atomic_store(&session->user, user);
+    do {
+        session->token = tokens();
+    } while (session->token == 0 || byToken.count(session->token));
+    byToken[session->token] = session;
+
+    DEBUG_PRINTF("SERVER: Registered client %s on socket %d. Total sessions for user: %zu\n",
+                 username.c_str(), session->fd, next->size());
+    return true;
+}
+
+bool SessionRegistry::attach(const SessionPtr& session, uint64_t token) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = byToken.find(token);
+    if (token == 0 || it == byToken.end()) {
+        return false;
+    }
+    session->username = it->second->username;
+    session->auxiliary = true;
+
+    DEBUG_PRINTF("SERVER: Socket %d attached as a data connection of socket %d (user %s)\n",
+                 session->fd, it->second->fd, session->username.c_str());
+    return true;
+}
+
+void SessionRegistry::close(const SessionPtr& session) {
+    std::lock_guard<std::mutex> lock(mutex);
+    byFd.erase(session->fd);
+    if (session->token != 0) {
+        byToken.erase(session->token);
+    }
+
+    std::shared_ptr<UserSessions> user = std::atomic_load(&session->user);
+    if (!user) {
+        return;
+    }
+
+    DeviceListPtr current = std::atomic_load(&user->devices);
+    auto next = std::make_shared<DeviceList>();
+    next->reserve(current->size());
+    for (const auto& device : *current) {
+        if (device != session) {
+            next->push_back(device);
+        }
+    }
+
+    if (next->empty()) {
+        users.erase(session->username);
+    }
+    std::atomic_store(&user->devices, DeviceListPtr(next));
+    std::atomic_store(&session->user, std::shared_ptr<UserSessions>());
+}
+
+DeviceListPtr SessionRegistry::devices(const SessionPtr& session) {
+    std::shared_ptr<UserSessions> user = std::atomic_load(&session->user);
+    if (!user) {
+        return std::make_shared<const DeviceList>();
+    }
+    return std::atomic_load(&user->devices);
+}
+
+size_t SessionRegistry::count() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return byFd.size();
+}
@@ -0,0 +1,50 @@
+#include "worker_pool.h"
+#include "common.h"
+#include <exception>
+
+WorkerPool::WorkerPool(int numThreads) : stopping(false) {
+    if (numThreads < 1) numThreads = 1;
+    for (int i = 0; i < numThreads; i++) {
+        threads.emplace_back(&WorkerPool::run, this);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+void WorkerPool::submit(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    cv.notify_one();
+}
+
+void WorkerPool::run() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) {
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        try {
+            job();
+        } catch (const std::exception& e) {
+            DEBUG_PRINTF("ERROR WorkerPool: Job threw: %s\n", e.what());
+        }
+    }
+}